@@ -0,0 +1,344 @@
+/*
+ * v4l2_mmal - benchmark suite.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Micro-benchmarks of the hot helpers and the output writer, run in
+ * process, and macro-benchmarks that run v4l2_mmal itself against the
+ * replay source. Results go to stdout as one JSON document, for
+ * comparison between releases.
+ *
+ * Usage: bench [path to v4l2_mmal]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include "interface/mmal/mmal.h"
+#include "interface/mmal/util/mmal_util.h"
+
+#include "../formats.h"
+#include "../writer.h"
+
+/* Each micro-benchmark runs for at least this long */
+#define BENCH_MIN_NS		200000000ULL
+
+#define WRITER_BYTES		(64 << 20)
+#define WRITER_CHUNK		(32 << 10)
+
+#define MACRO_FRAMES		300
+#define MACRO_FORMAT		"-f UYVY -s 1280x720"
+
+static volatile unsigned long bench_sink;
+static bool first_result;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void json_begin_section(const char *name)
+{
+	printf(",\n  \"%s\": [", name);
+	first_result = true;
+}
+
+static void json_end_section(void)
+{
+	printf("\n  ]");
+}
+
+static void json_begin_result(void)
+{
+	printf("%s\n    {", first_result ? "" : ",");
+	first_result = false;
+}
+
+/* Micro-benchmarks */
+
+static void bench_format_by_fourcc(unsigned long n)
+{
+	const struct v4l2_format_info *info;
+	unsigned long i;
+	unsigned int j;
+
+	for (i = 0; i < n; ) {
+		for (j = 0; (info = v4l2_format_by_index(j)) && i < n; j++, i++)
+			bench_sink += (unsigned long)v4l2_format_by_fourcc(info->fourcc);
+	}
+}
+
+static void bench_format_by_name(unsigned long n)
+{
+	const struct v4l2_format_info *info;
+	unsigned long i;
+	unsigned int j;
+
+	for (i = 0; i < n; ) {
+		for (j = 0; (info = v4l2_format_by_index(j)) && i < n; j++, i++)
+			bench_sink += (unsigned long)v4l2_format_by_name(info->name);
+	}
+}
+
+static void bench_width_to_stride(unsigned long n)
+{
+	const struct v4l2_format_info *info;
+	unsigned long i;
+	unsigned int j, width = 64;
+
+	for (i = 0; i < n; ) {
+		for (j = 0; (info = v4l2_format_by_index(j)) && i < n; j++) {
+			if (info->mmal_encoding == MMAL_ENCODING_UNUSED)
+				continue;
+			bench_sink += mmal_encoding_width_to_stride(info->mmal_encoding, width);
+			i++;
+		}
+		width = width >= 4096 ? 64 : width + 32;
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(unsigned long n);
+} micro_benchmarks[] = {
+	{ "format_by_fourcc", bench_format_by_fourcc },
+	{ "format_by_name", bench_format_by_name },
+	{ "width_to_stride", bench_width_to_stride },
+};
+
+static void run_micro(void)
+{
+	unsigned long n;
+	unsigned int i;
+	uint64_t ns;
+
+	json_begin_section("micro");
+
+	for (i = 0; i < sizeof(micro_benchmarks) / sizeof(micro_benchmarks[0]); i++) {
+		/* Double the iterations until the run is long enough to time */
+		for (n = 1024; ; n *= 2) {
+			ns = now_ns();
+			micro_benchmarks[i].run(n);
+			ns = now_ns() - ns;
+			if (ns >= BENCH_MIN_NS)
+				break;
+		}
+
+		json_begin_result();
+		printf("\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.2f}",
+		       micro_benchmarks[i].name, n, (double)ns / n);
+	}
+
+	json_end_section();
+}
+
+/* Output writer, as driven by the save threads */
+
+static unsigned int writer_released;
+
+static void bench_writer_release(void *priv)
+{
+	(void)priv;
+	__atomic_add_fetch(&writer_released, 1, __ATOMIC_RELAXED);
+}
+
+static int run_writer_one(const char *dir, enum writer_backend backend,
+			  size_t flush_bytes)
+{
+	static uint8_t chunk[WRITER_CHUNK];
+	struct writer_config cfg;
+	struct writer_stats stats;
+	struct writer w;
+	char path[PATH_MAX];
+	uint64_t ns;
+	size_t done;
+	int fd, ret;
+
+	snprintf(path, sizeof path, "%s/writer.bin", dir);
+	fd = open(path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	memset(&cfg, 0, sizeof cfg);
+	cfg.flush_bytes = flush_bytes;
+	cfg.flush_ms = 0;
+	cfg.max_held = 4;
+	cfg.backend = backend;
+
+	memset(chunk, 0x5a, sizeof chunk);
+	writer_released = 0;
+
+	ret = writer_init(&w, fd, &cfg);
+	if (ret < 0) {
+		close(fd);
+		return ret;
+	}
+
+	ns = now_ns();
+	for (done = 0; done < WRITER_BYTES; done += sizeof chunk)
+		writer_add(&w, chunk, sizeof chunk, bench_writer_release, NULL);
+	writer_flush(&w);
+	writer_sync(&w);
+	ns = now_ns() - ns;
+
+	writer_get_stats(&w, &stats);
+
+	json_begin_result();
+	printf("\"backend\": \"%s\", \"flush_bytes\": %zu, \"chunk_bytes\": %u, "
+	       "\"bytes\": %llu, \"writes\": %llu, \"mb_per_s\": %.1f, "
+	       "\"avg_write_latency_us\": %llu, \"max_write_latency_us\": %llu, "
+	       "\"errors\": %llu}",
+	       writer_backend_name(w.backend), flush_bytes, WRITER_CHUNK,
+	       (unsigned long long)stats.bytes, (unsigned long long)stats.writes,
+	       stats.bytes / (ns / 1000000000.0) / (1 << 20),
+	       stats.flushes ? (unsigned long long)(stats.latency_total_ns / stats.flushes / 1000) : 0ULL,
+	       (unsigned long long)(stats.latency_max_ns / 1000),
+	       (unsigned long long)stats.errors);
+
+	writer_cleanup(&w);
+	close(fd);
+	unlink(path);
+
+	return 0;
+}
+
+static void run_writer(const char *dir)
+{
+	static const size_t flush_sizes[] = { 0, 512 << 10 };
+	static const enum writer_backend backends[] = {
+		WRITER_BACKEND_SYNC, WRITER_BACKEND_URING,
+	};
+	unsigned int i, j;
+
+	json_begin_section("writer");
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		for (j = 0; j < sizeof(flush_sizes) / sizeof(flush_sizes[0]); j++) {
+			if (run_writer_one(dir, backends[i], flush_sizes[j]) < 0)
+				fprintf(stderr, "writer benchmark failed\n");
+		}
+	}
+
+	json_end_section();
+}
+
+/* Whole pipeline, replay source to encoder output and null render */
+
+static const struct {
+	const char *name;
+	const char *args;
+} macro_benchmarks[] = {
+	{ "end_to_end", "-E out.h264" },
+	{ "end_to_end_mp4", "-E out.mp4 --container mp4" },
+	{ "raw_save_writev", "-E out.h264 -Fraw.bin" },
+	{ "raw_save_io_uring", "-E out.h264 -Fraw.bin --io-uring" },
+};
+
+static int run_macro_one(const char *app, const char *dir, unsigned int index)
+{
+	unsigned long long send_avg = 0, send_max = 0;
+	unsigned int frames = 0;
+	double secs = 0, fps = 0, bps = 0;
+	char cmd[PATH_MAX + 256];
+	char line[512];
+	int status;
+	FILE *fp;
+
+	snprintf(cmd, sizeof cmd,
+		 "cd '%s' && { '%s' --replay=pattern --unthrottled " MACRO_FORMAT
+		 " -c%u %s 2>&1; ret=$?; rm -f *out.* raw.bin; exit $ret; }",
+		 dir, app, MACRO_FRAMES, macro_benchmarks[index].args);
+
+	fp = popen(cmd, "r");
+	if (!fp)
+		return -errno;
+
+	while (fgets(line, sizeof line, fp)) {
+		sscanf(line, "Captured %u frames in %lf seconds (%lf fps, %lf B/s)",
+		       &frames, &secs, &fps, &bps);
+		sscanf(line, "DQBUF to isp send latency avg %llu ns, max %llu ns",
+		       &send_avg, &send_max);
+	}
+
+	status = pclose(fp);
+
+	json_begin_result();
+	printf("\"name\": \"%s\", \"args\": \"%s\", \"frames\": %u, \"seconds\": %.3f, "
+	       "\"fps\": %.2f, \"bytes_per_s\": %.0f, "
+	       "\"dqbuf_to_send_avg_ns\": %llu, \"dqbuf_to_send_max_ns\": %llu, "
+	       "\"ok\": %s}",
+	       macro_benchmarks[index].name, macro_benchmarks[index].args,
+	       frames, secs, fps, bps, send_avg, send_max,
+	       status == 0 && frames == MACRO_FRAMES ? "true" : "false");
+
+	return 0;
+}
+
+static void run_macro(const char *app, const char *dir)
+{
+	unsigned int i;
+
+	json_begin_section("macro");
+
+	for (i = 0; i < sizeof(macro_benchmarks) / sizeof(macro_benchmarks[0]); i++) {
+		if (run_macro_one(app, dir, i) < 0)
+			fprintf(stderr, "macro benchmark %s failed\n",
+				macro_benchmarks[i].name);
+	}
+
+	json_end_section();
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/v4l2_mmal_bench.XXXXXX";
+	char app[PATH_MAX];
+	struct utsname uts;
+	time_t now;
+
+	if (!realpath(argc > 1 ? argv[1] : "./v4l2_mmal", app)) {
+		fprintf(stderr, "Can't find v4l2_mmal: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Can't create %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	uname(&uts);
+	now = time(NULL);
+
+	printf("{\n  \"version\": 1,\n  \"time\": %lld,\n  \"machine\": \"%s\",\n  \"kernel\": \"%s\"",
+	       (long long)now, uts.machine, uts.release);
+
+	run_micro();
+	run_writer(dir);
+	run_macro(app, dir);
+
+	printf("\n}\n");
+
+	rmdir(dir);
+	return 0;
+}
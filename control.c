@@ -0,0 +1,144 @@
+/*
+ * v4l2_mmal - control socket for daemon mode.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A line based protocol on a Unix domain socket: every line a client sends
+ * is a command, answered with one line. Clients stay connected for as many
+ * commands as they like, as long as they don't go quiet for too long. The
+ * sockets themselves are handled by the server in server.c.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "control.h"
+
+static void control_client_reset(struct server *s, unsigned int i, void *priv)
+{
+	struct control_server *c = priv;
+
+	(void)s;
+	c->clients[i].len = 0;
+}
+
+int control_open(struct control_server *c, const char *path)
+{
+	memset(c, 0, sizeof *c);
+	return server_open(&c->server, path, control_client_reset, c);
+}
+
+/*
+ * Replies are short and the client is waiting for them, one that doesn't
+ * read its replies isn't worth holding up the event loop for.
+ */
+static bool control_reply(int fd, const char *reply)
+{
+	char line[CONTROL_LINE_MAX + 1];
+	ssize_t ret;
+	int len;
+
+	len = snprintf(line, sizeof line, "%.*s\n", CONTROL_LINE_MAX - 1, reply);
+
+	do {
+		ret = send(fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret == len;
+}
+
+static void control_receive(struct control_server *c, unsigned int i,
+			    control_command_t command, void *priv)
+{
+	struct control_client *client = &c->clients[i];
+	int fd = c->server.clients[i].fd;
+	char reply[CONTROL_LINE_MAX];
+	char *end;
+	size_t len;
+	ssize_t ret;
+
+	for (;;) {
+		ret = recv(fd, client->line + client->len,
+			   sizeof client->line - client->len, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			break;
+		}
+		if (!ret)
+			break;
+
+		client->len += ret;
+
+		/* Every complete line is a command */
+		while ((end = memchr(client->line, '\n', client->len))) {
+			*end = '\0';
+			if (end > client->line && end[-1] == '\r')
+				end[-1] = '\0';
+
+			reply[0] = '\0';
+			command(client->line, reply, sizeof reply, priv);
+			if (!control_reply(fd, reply))
+				goto close;
+
+			len = end + 1 - client->line;
+			memmove(client->line, end + 1, client->len - len);
+			client->len -= len;
+		}
+
+		if (client->len == sizeof client->line) {
+			control_reply(fd, "error line too long");
+			break;
+		}
+	}
+
+close:
+	server_client_close(&c->server, i);
+}
+
+struct control_dispatch {
+	struct control_server *c;
+	control_command_t command;
+	void *priv;
+};
+
+static void control_ready(struct server *s, unsigned int i, void *priv)
+{
+	struct control_dispatch *d = priv;
+
+	(void)s;
+	control_receive(d->c, i, d->command, d->priv);
+}
+
+void control_dispatch(struct control_server *c, control_command_t command, void *priv)
+{
+	struct control_dispatch d = { c, command, priv };
+
+	server_dispatch(&c->server, control_ready, &d);
+}
+
+void control_expire(struct control_server *c)
+{
+	server_expire(&c->server, CONTROL_CLIENT_TIMEOUT_MS);
+}
+
+void control_close(struct control_server *c)
+{
+	server_close(&c->server);
+}
@@ -0,0 +1,54 @@
+/*
+ * v4l2_mmal - control socket for daemon mode.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#include <stddef.h>
+
+#include "server.h"
+
+#define CONTROL_LINE_MAX	256
+/*
+ * Clients that haven't sent a command for this long are dropped, so idle
+ * connections can't use up every slot.
+ */
+#define CONTROL_CLIENT_TIMEOUT_MS	30000
+
+/* Per connection state, indexed like the server's clients */
+struct control_client {
+	char line[CONTROL_LINE_MAX];
+	size_t len;
+};
+
+/*
+ * Runs one command, a line without its newline. The reply is a single
+ * line too, "ok ..." or "error ...", written to reply without a newline.
+ */
+typedef void (*control_command_t)(char *command, char *reply, size_t size,
+				  void *priv);
+
+struct control_server {
+	struct server server;
+	struct control_client clients[SERVER_MAX_CLIENTS];
+};
+
+int control_open(struct control_server *c, const char *path);
+void control_dispatch(struct control_server *c, control_command_t command, void *priv);
+/* Drop clients that have been idle too long, call periodically */
+void control_expire(struct control_server *c);
+void control_close(struct control_server *c);
+
+#endif
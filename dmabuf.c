@@ -0,0 +1,252 @@
+/*
+ * v4l2_mmal - dmabuf providers for V4L2_MEMORY_DMABUF capture.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Capture buffers allocated here rather than by the driver, and handed to
+ * it with V4L2_MEMORY_DMABUF, so drivers that can't export their buffers
+ * still capture straight into memory the VPU can import. The CMA heap
+ * gives the contiguous memory both the Pi drivers and vc-sm-cma need, the
+ * system heap and udmabuf serve other platforms, and memfd stands in for
+ * all of them with the replay source.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/types.h>
+
+#if __has_include(<linux/dma-heap.h>)
+#include <linux/dma-heap.h>
+#else
+struct dma_heap_allocation_data {
+	__u64 len;
+	__u32 fd;
+	__u32 fd_flags;
+	__u64 heap_flags;
+};
+#define DMA_HEAP_IOCTL_ALLOC	_IOWR('H', 0x0, struct dma_heap_allocation_data)
+#endif
+
+#if __has_include(<linux/udmabuf.h>)
+#include <linux/udmabuf.h>
+#else
+struct udmabuf_create {
+	__u32 memfd;
+	__u32 flags;
+	__u64 offset;
+	__u64 size;
+};
+#define UDMABUF_FLAGS_CLOEXEC	0x01
+#define UDMABUF_CREATE		_IOW('u', 0x42, struct udmabuf_create)
+#endif
+
+#include "dmabuf.h"
+
+#define ARRAY_SIZE(a)	(sizeof(a)/sizeof((a)[0]))
+
+static size_t dmabuf_page_align(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (size + page - 1) & ~(page - 1);
+}
+
+static void dmabuf_close_fd(struct dmabuf_provider *p)
+{
+	if (p->fd >= 0)
+		close(p->fd);
+	p->fd = -1;
+}
+
+/* -----------------------------------------------------------------------------
+ * dma-buf heaps
+ */
+
+static int heap_open(struct dmabuf_provider *p, const char *path)
+{
+	p->fd = open(path, O_RDWR | O_CLOEXEC);
+	return p->fd < 0 ? -errno : 0;
+}
+
+static int cma_open(struct dmabuf_provider *p)
+{
+	return heap_open(p, "/dev/dma_heap/linux,cma");
+}
+
+static int system_open(struct dmabuf_provider *p)
+{
+	return heap_open(p, "/dev/dma_heap/system");
+}
+
+static int heap_alloc(struct dmabuf_provider *p, size_t size)
+{
+	struct dma_heap_allocation_data data;
+
+	memset(&data, 0, sizeof data);
+	data.len = dmabuf_page_align(size);
+	data.fd_flags = O_RDWR | O_CLOEXEC;
+
+	if (ioctl(p->fd, DMA_HEAP_IOCTL_ALLOC, &data) < 0)
+		return -errno;
+
+	return data.fd;
+}
+
+static const struct dmabuf_ops dmabuf_cma = {
+	.name = "cma",
+	.open = cma_open,
+	.alloc = heap_alloc,
+	.close = dmabuf_close_fd,
+};
+
+static const struct dmabuf_ops dmabuf_system = {
+	.name = "system",
+	.open = system_open,
+	.alloc = heap_alloc,
+	.close = dmabuf_close_fd,
+};
+
+/* -----------------------------------------------------------------------------
+ * udmabuf, a dmabuf wrapped around sealed memfd pages
+ */
+
+static int udmabuf_open(struct dmabuf_provider *p)
+{
+	return heap_open(p, "/dev/udmabuf");
+}
+
+static int memfd_buffer(size_t size, unsigned int seals)
+{
+	int fd;
+
+	fd = memfd_create("v4l2_mmal", MFD_CLOEXEC | (seals ? MFD_ALLOW_SEALING : 0));
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, dmabuf_page_align(size)) < 0 ||
+	    (seals && fcntl(fd, F_ADD_SEALS, seals) < 0)) {
+		int ret = -errno;
+
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+static int udmabuf_alloc(struct dmabuf_provider *p, size_t size)
+{
+	struct udmabuf_create create;
+	int memfd, fd;
+
+	/* udmabuf insists the memfd can't shrink under it */
+	memfd = memfd_buffer(size, F_SEAL_SHRINK);
+	if (memfd < 0)
+		return memfd;
+
+	memset(&create, 0, sizeof create);
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.size = dmabuf_page_align(size);
+
+	/* The dmabuf keeps the pages, the memfd isn't needed any more */
+	fd = ioctl(p->fd, UDMABUF_CREATE, &create);
+	if (fd < 0)
+		fd = -errno;
+	close(memfd);
+
+	return fd;
+}
+
+static const struct dmabuf_ops dmabuf_udmabuf = {
+	.name = "udmabuf",
+	.open = udmabuf_open,
+	.alloc = udmabuf_alloc,
+	.close = dmabuf_close_fd,
+};
+
+/* -----------------------------------------------------------------------------
+ * memfd, mappable like a dmabuf but not one
+ */
+
+static int memfd_open(struct dmabuf_provider *p)
+{
+	p->fd = -1;
+	return 0;
+}
+
+static int memfd_alloc(struct dmabuf_provider *p, size_t size)
+{
+	(void)p;
+
+	return memfd_buffer(size, 0);
+}
+
+static const struct dmabuf_ops dmabuf_memfd = {
+	.name = "memfd",
+	.open = memfd_open,
+	.alloc = memfd_alloc,
+	.close = dmabuf_close_fd,
+};
+
+static const struct dmabuf_ops *dmabuf_providers[] = {
+	&dmabuf_cma,
+	&dmabuf_system,
+	&dmabuf_udmabuf,
+	&dmabuf_memfd,
+};
+
+int dmabuf_open(struct dmabuf_provider *p, const char *name, bool with_memfd)
+{
+	bool any = !name || !strcmp(name, "auto");
+	unsigned int i;
+	int ret = -ENOENT;
+
+	p->ops = NULL;
+	p->fd = -1;
+
+	for (i = 0; i < ARRAY_SIZE(dmabuf_providers); i++) {
+		if (!any && strcmp(name, dmabuf_providers[i]->name))
+			continue;
+		/* Always there, but never what a real device wants */
+		if (any && dmabuf_providers[i] == &dmabuf_memfd && !with_memfd)
+			continue;
+
+		ret = dmabuf_providers[i]->open(p);
+		if (!ret) {
+			p->ops = dmabuf_providers[i];
+			return 0;
+		}
+	}
+
+	return ret;
+}
+
+int dmabuf_alloc(struct dmabuf_provider *p, size_t size)
+{
+	return p->ops->alloc(p, size);
+}
+
+void dmabuf_close(struct dmabuf_provider *p)
+{
+	if (p->ops)
+		p->ops->close(p);
+	p->ops = NULL;
+}
@@ -0,0 +1,48 @@
+/*
+ * v4l2_mmal - dmabuf providers for V4L2_MEMORY_DMABUF capture.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __DMABUF_H__
+#define __DMABUF_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct dmabuf_provider;
+
+struct dmabuf_ops {
+	const char *name;
+	/* Fails with -errno when the provider isn't available here */
+	int (*open)(struct dmabuf_provider *p);
+	/* A new buffer of size bytes, as an fd, or -errno */
+	int (*alloc)(struct dmabuf_provider *p, size_t size);
+	void (*close)(struct dmabuf_provider *p);
+};
+
+struct dmabuf_provider {
+	const struct dmabuf_ops *ops;
+	/* Heap or udmabuf device */
+	int fd;
+};
+
+/*
+ * Open the named provider, or with NULL or "auto" the first one available
+ * of the CMA heap, the system heap and udmabuf, then memfd if with_memfd.
+ * memfd buffers aren't dmabufs, only the replay source takes them.
+ */
+int dmabuf_open(struct dmabuf_provider *p, const char *name, bool with_memfd);
+int dmabuf_alloc(struct dmabuf_provider *p, size_t size);
+void dmabuf_close(struct dmabuf_provider *p);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * v4l2_mmal - pre-event ring buffer for encoded video.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Encoded buffers are copied into a fixed size byte ring, with a second
+ * ring of entries describing them. A buffer never wraps around the end of
+ * the byte ring, so every entry can be handed on as one contiguous block.
+ * The oldest entries are dropped as their bytes are overwritten, so memory
+ * use is fixed at start up.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dvr.h"
+
+int dvr_init(struct dvr *d, size_t size)
+{
+	memset(d, 0, sizeof *d);
+
+	d->data = malloc(size);
+	d->entries = calloc(DVR_MAX_ENTRIES, sizeof *d->entries);
+	if (!d->data || !d->entries) {
+		dvr_cleanup(d);
+		return -ENOMEM;
+	}
+
+	d->size = size;
+	d->max_entries = DVR_MAX_ENTRIES;
+	d->frame_start = true;
+	return 0;
+}
+
+static void dvr_store_config(struct dvr *d, const uint8_t *data, size_t len)
+{
+	uint8_t *config;
+
+	config = realloc(d->config, len);
+	if (!config)
+		return;
+
+	memcpy(config, data, len);
+	d->config = config;
+	d->config_len = len;
+}
+
+void dvr_append(struct dvr *d, const uint8_t *data, size_t len, int64_t pts,
+		unsigned int flags)
+{
+	struct dvr_entry *e;
+	uint64_t start;
+	bool frame_start = d->frame_start;
+
+	if (flags & MUX_FLAG_CONFIG) {
+		dvr_store_config(d, data, len);
+		d->frame_start = true;
+		return;
+	}
+
+	/* A frame too big for one encoder buffer arrives in several pieces */
+	d->frame_start = !!(flags & MUX_FLAG_FRAME_END);
+
+	if (!len || len > d->size)
+		return;
+
+	/* Skip to the start of the ring rather than wrap */
+	start = d->head;
+	if (start % d->size + len > d->size)
+		start += d->size - start % d->size;
+	d->head = start + len;
+
+	/* Drop whatever has been overwritten, and make room for the entry */
+	while (d->count &&
+	       (d->entries[d->first].start + d->size < d->head ||
+		d->count == d->max_entries)) {
+		d->first = (d->first + 1) % d->max_entries;
+		d->count--;
+	}
+
+	e = &d->entries[(d->first + d->count) % d->max_entries];
+	e->start = start;
+	e->len = len;
+	e->flags = flags;
+	e->frame_start = frame_start;
+	e->pts = pts;
+	d->count++;
+
+	memcpy(d->data + start % d->size, data, len);
+}
+
+/*
+ * Index of the entry to start a replay from: the latest keyframe at least
+ * pre_usec before the newest buffer, or the oldest keyframe still held if
+ * the ring doesn't go back that far. Every piece of a split IDR carries the
+ * keyframe flag, only the first one can start a replay. Returns -1 if there
+ * is no keyframe.
+ */
+int dvr_find_start(struct dvr *d, int64_t pre_usec)
+{
+	const struct dvr_entry *e;
+	int64_t newest = MUX_TIME_UNKNOWN;
+	int oldest_key = -1;
+	int best = -1;
+	unsigned int i;
+
+	for (i = d->count; i-- > 0; ) {
+		e = dvr_entry(d, i);
+		if (e->pts != MUX_TIME_UNKNOWN) {
+			newest = e->pts;
+			break;
+		}
+	}
+
+	for (i = 0; i < d->count; i++) {
+		e = dvr_entry(d, i);
+		if (!(e->flags & MUX_FLAG_KEYFRAME) || !e->frame_start)
+			continue;
+		if (oldest_key < 0)
+			oldest_key = i;
+		if (newest != MUX_TIME_UNKNOWN && e->pts != MUX_TIME_UNKNOWN &&
+		    e->pts <= newest - pre_usec)
+			best = i;
+	}
+
+	return best >= 0 ? best : oldest_key;
+}
+
+const struct dvr_entry *dvr_entry(struct dvr *d, unsigned int i)
+{
+	return &d->entries[(d->first + i) % d->max_entries];
+}
+
+const uint8_t *dvr_data(struct dvr *d, const struct dvr_entry *e)
+{
+	return d->data + e->start % d->size;
+}
+
+void dvr_cleanup(struct dvr *d)
+{
+	free(d->data);
+	free(d->entries);
+	free(d->config);
+	d->data = NULL;
+	d->entries = NULL;
+	d->config = NULL;
+}
@@ -0,0 +1,64 @@
+/*
+ * v4l2_mmal - pre-event ring buffer for encoded video.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __DVR_H__
+#define __DVR_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mux.h"
+
+#define DVR_DEFAULT_SIZE	(32 << 20)
+#define DVR_DEFAULT_POST	10	/* seconds */
+#define DVR_MAX_ENTRIES		16384
+
+/* One encoder buffer, flags are MUX_FLAG_* */
+struct dvr_entry {
+	uint64_t start;		/* position in the data ring, never wraps */
+	uint32_t len;
+	uint32_t flags;
+	bool frame_start;	/* first piece of a frame */
+	int64_t pts;
+};
+
+struct dvr {
+	uint8_t *data;
+	size_t size;
+	/* Total bytes ever stored, data lives at (position % size) */
+	uint64_t head;
+
+	struct dvr_entry *entries;
+	unsigned int max_entries;
+	unsigned int first;
+	unsigned int count;
+	/* The next buffer appended begins a new frame */
+	bool frame_start;
+
+	/* Latest SPS/PPS, needed at the start of every replay */
+	uint8_t *config;
+	size_t config_len;
+};
+
+int dvr_init(struct dvr *d, size_t size);
+void dvr_append(struct dvr *d, const uint8_t *data, size_t len, int64_t pts,
+		unsigned int flags);
+int dvr_find_start(struct dvr *d, int64_t pre_usec);
+const struct dvr_entry *dvr_entry(struct dvr *d, unsigned int i);
+const uint8_t *dvr_data(struct dvr *d, const struct dvr_entry *e);
+void dvr_cleanup(struct dvr *d);
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * v4l2_mmal - V4L2 pixel formats and field orders.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __FORMATS_H__
+#define __FORMATS_H__
+
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#include "interface/mmal/mmal.h"
+
+/* No MMAL equivalent */
+#define MMAL_ENCODING_UNUSED 0
+
+struct v4l2_format_info {
+	const char *name;
+	unsigned int fourcc;
+	unsigned char n_planes;
+	MMAL_FOURCC_T mmal_encoding;
+};
+
+const struct v4l2_format_info *v4l2_format_by_index(unsigned int index);
+const struct v4l2_format_info *v4l2_format_by_fourcc(unsigned int fourcc);
+const struct v4l2_format_info *v4l2_format_by_name(const char *name);
+const struct v4l2_format_info *v4l2_format_by_mmal_encoding(MMAL_FOURCC_T encoding);
+const char *v4l2_format_name(unsigned int fourcc);
+enum v4l2_field v4l2_field_from_string(const char *name);
+const char *v4l2_field_name(enum v4l2_field field);
+void v4l2_timestamp_names(uint32_t flags, const char **ts_type, const char **ts_source);
+
+#endif
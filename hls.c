@@ -0,0 +1,222 @@
+/*
+ * v4l2_mmal - HLS playlist generation.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Maintains a rolling media playlist for the segments written by the
+ * segmented recording code. With partial segments enabled (LL-HLS), parts
+ * are byte ranges of the segment file that is still being written, listed
+ * as soon as they are on disk. The playlist is rewritten to a temporary
+ * file and renamed over the old one, so a web server never sees it half
+ * written. Segments that drop out of the window are deleted once the
+ * playlist no longer lists them, parts and all.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hls.h"
+
+int hls_init(struct hls *h, const char *path, bool fmp4, unsigned int window,
+	     unsigned int target_duration, unsigned int part_target)
+{
+	memset(h, 0, sizeof *h);
+
+	h->path = strdup(path);
+	h->tmp_path = malloc(strlen(path) + 5);
+	h->segments = calloc(window, sizeof *h->segments);
+	if (!h->path || !h->tmp_path || !h->segments) {
+		hls_cleanup(h);
+		return -ENOMEM;
+	}
+	sprintf(h->tmp_path, "%s.tmp", path);
+
+	h->fmp4 = fmp4;
+	h->window = window;
+	h->target_duration = target_duration;
+	h->part_target = part_target;
+
+	return 0;
+}
+
+static void hls_write_parts(FILE *f, const struct hls_segment *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->num_parts; i++) {
+		const struct hls_part *p = &s->parts[i];
+
+		fprintf(f, "#EXT-X-PART:DURATION=%.3f,URI=\"%s\",BYTERANGE=\"%llu@%llu\"%s\n",
+			p->duration / 1000000.0, s->uri,
+			(unsigned long long)p->length, (unsigned long long)p->offset,
+			p->independent ? ",INDEPENDENT=YES" : "");
+	}
+}
+
+static void hls_write_map(FILE *f, const struct hls *h,
+			  const struct hls_segment *s)
+{
+	/* Every file carries its own init section */
+	if (h->fmp4)
+		fprintf(f, "#EXT-X-MAP:URI=\"%s\",BYTERANGE=\"%llu@0\"\n",
+			s->uri, (unsigned long long)s->init_len);
+}
+
+static int hls_write(struct hls *h)
+{
+	unsigned int target = h->target_duration;
+	unsigned int version;
+	unsigned int i;
+	FILE *f;
+
+	for (i = 0; i < h->num_segments; i++) {
+		unsigned int secs = (h->segments[i].duration + 999999) / 1000000;
+
+		if (secs > target)
+			target = secs;
+	}
+
+	version = h->part_target ? 9 : h->fmp4 ? 7 : 3;
+
+	f = fopen(h->tmp_path, "w");
+	if (!f)
+		return -errno;
+
+	fprintf(f, "#EXTM3U\n");
+	fprintf(f, "#EXT-X-VERSION:%u\n", version);
+	fprintf(f, "#EXT-X-TARGETDURATION:%u\n", target);
+	if (h->part_target) {
+		fprintf(f, "#EXT-X-PART-INF:PART-TARGET=%.3f\n",
+			h->part_target / 1000.0);
+		fprintf(f, "#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n",
+			3 * h->part_target / 1000.0);
+	}
+	fprintf(f, "#EXT-X-MEDIA-SEQUENCE:%llu\n", (unsigned long long)h->sequence);
+
+	for (i = 0; i < h->num_segments; i++) {
+		const struct hls_segment *s = &h->segments[i];
+
+		hls_write_map(f, h, s);
+		if (i + HLS_PART_SEGMENTS >= h->num_segments)
+			hls_write_parts(f, s);
+		fprintf(f, "#EXTINF:%.3f,\n", s->duration / 1000000.0);
+		if (h->fmp4)
+			fprintf(f, "#EXT-X-BYTERANGE:%llu@%llu\n",
+				(unsigned long long)(s->length - s->init_len),
+				(unsigned long long)s->init_len);
+		fprintf(f, "%s\n", s->uri);
+	}
+
+	if (h->in_segment && h->current.num_parts) {
+		hls_write_map(f, h, &h->current);
+		hls_write_parts(f, &h->current);
+	}
+
+	if (h->ended)
+		fprintf(f, "#EXT-X-ENDLIST\n");
+
+	if (fclose(f) != 0)
+		return -errno;
+
+	if (rename(h->tmp_path, h->path) < 0)
+		return -errno;
+
+	return 0;
+}
+
+void hls_segment_start(struct hls *h, const char *name)
+{
+	const char *base;
+
+	/* Segments live next to the playlist, so refer to them by name */
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+
+	memset(&h->current, 0, sizeof h->current);
+	snprintf(h->current.uri, sizeof h->current.uri, "%s", base);
+	snprintf(h->current.file, sizeof h->current.file, "%s", name);
+	h->in_segment = true;
+}
+
+void hls_set_init(struct hls *h, uint64_t init_len)
+{
+	h->current.init_len = init_len;
+}
+
+int hls_part_add(struct hls *h, uint64_t offset, uint64_t length,
+		 int64_t duration, bool independent)
+{
+	struct hls_part *p;
+
+	if (!h->in_segment || !length)
+		return 0;
+
+	if (h->current.num_parts == HLS_MAX_PARTS)
+		return -ENOSPC;
+
+	p = &h->current.parts[h->current.num_parts++];
+	p->offset = offset;
+	p->length = length;
+	p->duration = duration;
+	p->independent = independent;
+
+	return hls_write(h);
+}
+
+int hls_segment_end(struct hls *h, uint64_t length, int64_t duration)
+{
+	char expired[sizeof h->current.file] = "";
+	int ret;
+
+	if (!h->in_segment)
+		return 0;
+
+	h->current.length = length;
+	h->current.duration = duration;
+	h->in_segment = false;
+
+	if (h->num_segments == h->window) {
+		strcpy(expired, h->segments[0].file);
+		memmove(&h->segments[0], &h->segments[1],
+			(h->window - 1) * sizeof *h->segments);
+		h->num_segments--;
+		h->sequence++;
+	}
+	h->segments[h->num_segments++] = h->current;
+
+	ret = hls_write(h);
+
+	/* Only once players can no longer find it in the playlist */
+	if (!ret && expired[0] && unlink(expired) < 0 && errno != ENOENT)
+		ret = -errno;
+
+	return ret;
+}
+
+int hls_finish(struct hls *h)
+{
+	h->ended = true;
+	return hls_write(h);
+}
+
+void hls_cleanup(struct hls *h)
+{
+	free(h->path);
+	free(h->tmp_path);
+	free(h->segments);
+	h->path = NULL;
+	h->tmp_path = NULL;
+	h->segments = NULL;
+}
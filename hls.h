@@ -0,0 +1,79 @@
+/*
+ * v4l2_mmal - HLS playlist generation.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __HLS_H__
+#define __HLS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HLS_DEFAULT_SEGMENT_TIME	6	/* seconds */
+#define HLS_DEFAULT_WINDOW		6
+
+/* Partial segments kept per segment, enough for 1s segments of 50ms parts */
+#define HLS_MAX_PARTS		64
+/* Completed segments keep their parts listed for this many segments */
+#define HLS_PART_SEGMENTS	2
+
+struct hls_part {
+	uint64_t offset;
+	uint64_t length;
+	int64_t duration;	/* microseconds */
+	bool independent;
+};
+
+struct hls_segment {
+	char uri[128];
+	/* As it was opened, to remove it once it has left the playlist */
+	char file[128];
+	/* fMP4 only: length of the init section at the start of the file */
+	uint64_t init_len;
+	uint64_t length;
+	int64_t duration;	/* microseconds */
+
+	struct hls_part parts[HLS_MAX_PARTS];
+	unsigned int num_parts;
+};
+
+struct hls {
+	char *path;
+	char *tmp_path;
+	bool fmp4;
+	/* Segments listed in the playlist */
+	unsigned int window;
+	unsigned int target_duration;	/* seconds */
+	unsigned int part_target;	/* milliseconds, 0 = no partial segments */
+
+	/* Completed segments, oldest first */
+	struct hls_segment *segments;
+	unsigned int num_segments;
+	uint64_t sequence;
+
+	struct hls_segment current;
+	bool in_segment;
+	bool ended;
+};
+
+int hls_init(struct hls *h, const char *path, bool fmp4, unsigned int window,
+	     unsigned int target_duration, unsigned int part_target);
+void hls_segment_start(struct hls *h, const char *name);
+void hls_set_init(struct hls *h, uint64_t init_len);
+int hls_part_add(struct hls *h, uint64_t offset, uint64_t length,
+		 int64_t duration, bool independent);
+int hls_segment_end(struct hls *h, uint64_t length, int64_t duration);
+int hls_finish(struct hls *h);
+void hls_cleanup(struct hls *h);
+
+#endif
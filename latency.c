@@ -0,0 +1,198 @@
+/*
+ * v4l2_mmal - lock-free latency histograms.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Histograms are updated with relaxed atomics from whichever thread sees
+ * the event (capture loop, MMAL callbacks, save threads, writer completion)
+ * and read without stopping them, so a report taken mid-run may be off by
+ * the few samples in flight.
+ *
+ * Frames are matched across stages by pts. The capture thread notes when
+ * each pts was dequeued in a small ring, which later stages search from
+ * the newest entry back.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+uint64_t latency_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int latency_bucket(uint64_t ns)
+{
+	unsigned int exp;
+
+	if (ns < (1 << LATENCY_SUB_BITS))
+		return ns;
+	if (ns >= 1ULL << LATENCY_MAX_BITS)
+		return LATENCY_BUCKETS - 1;
+
+	exp = 63 - __builtin_clzll(ns);
+	return ((exp - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+	       ((ns >> (exp - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+/* Largest value that falls in a bucket */
+static uint64_t latency_bucket_max(unsigned int bucket)
+{
+	unsigned int exp, sub;
+
+	if (bucket < (1 << LATENCY_SUB_BITS))
+		return bucket;
+
+	exp = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+	sub = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+
+	return (((uint64_t)(1 << LATENCY_SUB_BITS) + sub + 1) << (exp - LATENCY_SUB_BITS)) - 1;
+}
+
+void latency_record(struct latency_hist *h, uint64_t ns)
+{
+	uint64_t max;
+
+	__atomic_add_fetch(&h->counts[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->total_ns, ns, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&h->max_ns, &max, ns, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+uint64_t latency_percentile(const struct latency_hist *h, double percentile)
+{
+	uint64_t count, target, seen = 0, max;
+	unsigned int i;
+
+	count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+	if (!count)
+		return 0;
+
+	target = (uint64_t)(count * percentile / 100.0 + 0.5);
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+		if (seen >= target)
+			return latency_bucket_max(i) < max ? latency_bucket_max(i) : max;
+	}
+
+	return max;
+}
+
+void latency_frames_init(struct latency_frames *f)
+{
+	unsigned int i;
+
+	memset(f, 0, sizeof *f);
+	for (i = 0; i < LATENCY_FRAMES; i++)
+		f->frames[i].pts = INT64_MIN;
+}
+
+void latency_frame_start(struct latency_frames *f, int64_t pts, uint64_t ns)
+{
+	struct latency_frame *frame = &f->frames[f->next % LATENCY_FRAMES];
+
+	unsigned int i;
+
+	/* Invalidate the slot while it is rewritten */
+	__atomic_store_n(&frame->pts, INT64_MIN, __ATOMIC_RELAXED);
+	for (i = 0; i < LATENCY_STAGES; i++)
+		__atomic_store_n(&frame->stage_us[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&frame->start_ns, ns, __ATOMIC_RELEASE);
+	__atomic_store_n(&frame->pts, pts, __ATOMIC_RELEASE);
+	__atomic_store_n(&f->next, f->next + 1, __ATOMIC_RELEASE);
+}
+
+static struct latency_frame *latency_frame_lookup(struct latency_frames *f,
+						  int64_t pts, uint64_t *start_ns)
+{
+	unsigned int next = __atomic_load_n(&f->next, __ATOMIC_ACQUIRE);
+	struct latency_frame *frame;
+	unsigned int i;
+	uint64_t ns;
+
+	for (i = 1; i <= LATENCY_FRAMES && i <= next; i++) {
+		frame = &f->frames[(next - i) % LATENCY_FRAMES];
+		if (__atomic_load_n(&frame->pts, __ATOMIC_ACQUIRE) != pts)
+			continue;
+
+		ns = __atomic_load_n(&frame->start_ns, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&frame->pts, __ATOMIC_ACQUIRE) != pts)
+			return NULL;
+
+		*start_ns = ns;
+		return frame;
+	}
+
+	return NULL;
+}
+
+bool latency_frame_find(struct latency_frames *f, int64_t pts, uint64_t *start_ns)
+{
+	return latency_frame_lookup(f, pts, start_ns) != NULL;
+}
+
+bool latency_frame_stages(struct latency_frames *f, int64_t pts,
+			  uint32_t stage_us[LATENCY_STAGES])
+{
+	struct latency_frame *frame;
+	uint64_t start;
+	unsigned int i;
+
+	frame = latency_frame_lookup(f, pts, &start);
+	if (!frame)
+		return false;
+
+	for (i = 0; i < LATENCY_STAGES; i++)
+		stage_us[i] = __atomic_load_n(&frame->stage_us[i], __ATOMIC_RELAXED);
+
+	/* Reused while being read */
+	return __atomic_load_n(&frame->pts, __ATOMIC_ACQUIRE) == pts;
+}
+
+/*
+ * A stamp racing with the slot being reused could land on the new frame,
+ * but only once the pipeline is LATENCY_FRAMES frames behind.
+ */
+void latency_stamp(struct latency_hist *h, struct latency_frames *f, int64_t pts,
+		   unsigned int stage)
+{
+	struct latency_frame *frame;
+	uint64_t start, now, us;
+
+	frame = latency_frame_lookup(f, pts, &start);
+	if (!frame)
+		return;
+
+	now = latency_now_ns();
+	latency_record(h, now > start ? now - start : 0);
+
+	/* 0 means not reached, so round up */
+	us = now > start ? (now - start + 999) / 1000 : 0;
+	if (!us)
+		us = 1;
+	__atomic_store_n(&frame->stage_us[stage], us > UINT32_MAX ? UINT32_MAX : us,
+			 __ATOMIC_RELAXED);
+}
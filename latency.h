@@ -0,0 +1,79 @@
+/*
+ * v4l2_mmal - lock-free latency histograms.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Log-linear buckets in ns: 16 per power of two, so values are recorded
+ * to within 1/16, up to 2^36 ns (about 68 s).
+ */
+#define LATENCY_SUB_BITS	4
+#define LATENCY_MAX_BITS	36
+#define LATENCY_BUCKETS		((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+/* Frames remembered for matching later stages back to their DQBUF */
+#define LATENCY_FRAMES		256
+
+/*
+ * Stages whose times are also kept per frame, for the frame trace: the isp,
+ * then each sink returning its input, encoding and writing the output.
+ */
+#define LATENCY_STAGE_ISP_SEND		0
+#define LATENCY_STAGE_ISP_OUTPUT	1
+#define LATENCY_MAX_SINKS		4
+#define LATENCY_STAGE_SINK_RETURN(i)	(2 + 3 * (i))
+#define LATENCY_STAGE_ENCODED(i)	(3 + 3 * (i))
+#define LATENCY_STAGE_WRITTEN(i)	(4 + 3 * (i))
+#define LATENCY_STAGES			(2 + 3 * LATENCY_MAX_SINKS)
+
+struct latency_hist {
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+struct latency_frame {
+	int64_t pts;
+	uint64_t start_ns;
+	/* us after start each stage was reached, 0 if not (yet) */
+	uint32_t stage_us[LATENCY_STAGES];
+};
+
+/* Written by the capture thread only, read from any thread */
+struct latency_frames {
+	struct latency_frame frames[LATENCY_FRAMES];
+	unsigned int next;
+};
+
+uint64_t latency_now_ns(void);
+void latency_record(struct latency_hist *h, uint64_t ns);
+uint64_t latency_percentile(const struct latency_hist *h, double percentile);
+
+void latency_frames_init(struct latency_frames *f);
+void latency_frame_start(struct latency_frames *f, int64_t pts, uint64_t ns);
+bool latency_frame_find(struct latency_frames *f, int64_t pts, uint64_t *start_ns);
+/* Copy out the stage times of a frame, false if it is no longer known */
+bool latency_frame_stages(struct latency_frames *f, int64_t pts,
+			  uint32_t stage_us[LATENCY_STAGES]);
+/* Record the time since the frame with this pts was dequeued, if known */
+void latency_stamp(struct latency_hist *h, struct latency_frames *f, int64_t pts,
+		   unsigned int stage);
+
+#endif
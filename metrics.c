@@ -0,0 +1,257 @@
+/*
+ * v4l2_mmal - Prometheus metrics over a Unix domain socket.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Serves the text exposition format to anything that connects. An HTTP
+ * request (curl --unix-socket, or a scraper behind a proxy) gets an HTTP
+ * reply, anything else gets the bare text once it sends a line or shuts
+ * down its side. Each connection gets one reply. The sockets themselves
+ * are handled by the server in server.c.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+void metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *data;
+	int len;
+
+	if (b->failed)
+		return;
+
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(b->data ? b->data + b->len : NULL,
+				b->size - b->len, fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			b->failed = true;
+			return;
+		}
+		if (b->len + len < b->size)
+			break;
+
+		size = b->size ? b->size * 2 : 4096;
+		while (size <= b->len + len)
+			size *= 2;
+		data = realloc(b->data, size);
+		if (!data) {
+			b->failed = true;
+			return;
+		}
+		b->data = data;
+		b->size = size;
+	}
+
+	b->len += len;
+}
+
+void metrics_family(struct metrics_buf *b, const char *name, const char *type,
+		    const char *help)
+{
+	metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_value(struct metrics_buf *b, const char *name, const char *labels,
+		   uint64_t value)
+{
+	metrics_printf(b, "%s%s%s%s %llu\n", name, labels ? "{" : "",
+		       labels ? labels : "", labels ? "}" : "",
+		       (unsigned long long)value);
+}
+
+void metrics_seconds(struct metrics_buf *b, const char *name, const char *labels,
+		     uint64_t ns)
+{
+	metrics_printf(b, "%s%s%s%s %llu.%09llu\n", name, labels ? "{" : "",
+		       labels ? labels : "", labels ? "}" : "",
+		       (unsigned long long)(ns / 1000000000ULL),
+		       (unsigned long long)(ns % 1000000000ULL));
+}
+
+static void metrics_buf_free(struct metrics_buf *b)
+{
+	free(b->data);
+	memset(b, 0, sizeof *b);
+}
+
+static void metrics_client_reset(struct server *s, unsigned int i, void *priv)
+{
+	struct metrics_server *m = priv;
+	struct metrics_client *client = &m->clients[i];
+
+	(void)s;
+	metrics_buf_free(&client->reply);
+	memset(client, 0, sizeof *client);
+}
+
+int metrics_open(struct metrics_server *m, const char *path)
+{
+	memset(m, 0, sizeof *m);
+	return server_open(&m->server, path, metrics_client_reset, m);
+}
+
+static bool metrics_request_http(const struct metrics_client *client)
+{
+	return (client->request_len >= 4 && !memcmp(client->request, "GET ", 4)) ||
+	       (client->request_len >= 5 && !memcmp(client->request, "HEAD ", 5));
+}
+
+/* Whole request received, the headers for HTTP or a line otherwise */
+static bool metrics_request_done(const struct metrics_client *client)
+{
+	if (!metrics_request_http(client))
+		return memchr(client->request, '\n', client->request_len) != NULL;
+
+	return memmem(client->request, client->request_len, "\r\n\r\n", 4) ||
+	       memmem(client->request, client->request_len, "\n\n", 2);
+}
+
+static void metrics_send(struct metrics_server *m, unsigned int i)
+{
+	struct metrics_client *client = &m->clients[i];
+	int fd = m->server.clients[i].fd;
+	ssize_t ret;
+
+	while (client->sent < client->reply.len) {
+		ret = send(fd, client->reply.data + client->sent,
+			   client->reply.len - client->sent, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				break;
+
+			/* Finish when the client has read some more */
+			server_wait_writable(&m->server, i);
+			return;
+		}
+		client->sent += ret;
+	}
+
+	server_client_close(&m->server, i);
+}
+
+static void metrics_reply(struct metrics_server *m, unsigned int i,
+			  metrics_render_t render, void *priv)
+{
+	struct metrics_client *client = &m->clients[i];
+	struct metrics_buf body;
+	bool http = metrics_request_http(client);
+
+	memset(&body, 0, sizeof body);
+	render(&body, priv);
+
+	if (body.failed) {
+		if (http)
+			metrics_printf(&client->reply,
+				       "HTTP/1.0 500 Internal Server Error\r\n"
+				       "Content-Length: 0\r\nConnection: close\r\n\r\n");
+	} else if (http) {
+		metrics_printf(&client->reply,
+			       "HTTP/1.0 200 OK\r\n"
+			       "Content-Type: text/plain; version=0.0.4\r\n"
+			       "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+			       body.len);
+		if (client->request[0] == 'G')
+			metrics_printf(&client->reply, "%.*s", (int)body.len, body.data);
+	} else {
+		client->reply = body;
+		memset(&body, 0, sizeof body);
+	}
+
+	metrics_buf_free(&body);
+
+	if (client->reply.failed) {
+		server_client_close(&m->server, i);
+		return;
+	}
+
+	metrics_send(m, i);
+}
+
+static void metrics_receive(struct metrics_server *m, unsigned int i,
+			    metrics_render_t render, void *priv)
+{
+	struct metrics_client *client = &m->clients[i];
+	int fd = m->server.clients[i].fd;
+	ssize_t ret;
+
+	for (;;) {
+		ret = recv(fd, client->request + client->request_len,
+			   sizeof client->request - client->request_len, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			server_client_close(&m->server, i);
+			return;
+		}
+
+		client->request_len += ret;
+
+		/* End of the request, or as much as we'll look at */
+		if (!ret || metrics_request_done(client) ||
+		    client->request_len == sizeof client->request)
+			break;
+	}
+
+	metrics_reply(m, i, render, priv);
+}
+
+struct metrics_scrape {
+	struct metrics_server *m;
+	metrics_render_t render;
+	void *priv;
+};
+
+static void metrics_ready(struct server *s, unsigned int i, void *priv)
+{
+	struct metrics_scrape *scrape = priv;
+	struct metrics_server *m = scrape->m;
+
+	(void)s;
+	if (m->clients[i].reply.data)
+		metrics_send(m, i);
+	else
+		metrics_receive(m, i, scrape->render, scrape->priv);
+}
+
+void metrics_dispatch(struct metrics_server *m, metrics_render_t render, void *priv)
+{
+	struct metrics_scrape scrape = { m, render, priv };
+
+	server_dispatch(&m->server, metrics_ready, &scrape);
+}
+
+void metrics_expire(struct metrics_server *m)
+{
+	server_expire(&m->server, METRICS_CLIENT_TIMEOUT_MS);
+}
+
+void metrics_close(struct metrics_server *m)
+{
+	server_close(&m->server);
+}
@@ -0,0 +1,72 @@
+/*
+ * v4l2_mmal - Prometheus metrics over a Unix domain socket.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+
+#define METRICS_REQUEST_MAX	1024
+/* Clients that go this long without sending or reading anything are dropped */
+#define METRICS_CLIENT_TIMEOUT_MS	5000
+
+/* Text exposition being built, grown as needed */
+struct metrics_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	bool failed;
+};
+
+/* Per connection state, indexed like the server's clients */
+struct metrics_client {
+	char request[METRICS_REQUEST_MAX];
+	size_t request_len;
+
+	/* Reply, sent as the socket accepts it */
+	struct metrics_buf reply;
+	size_t sent;
+};
+
+/* Fills in the metrics for one scrape */
+typedef void (*metrics_render_t)(struct metrics_buf *b, void *priv);
+
+struct metrics_server {
+	struct server server;
+	struct metrics_client clients[SERVER_MAX_CLIENTS];
+};
+
+int metrics_open(struct metrics_server *m, const char *path);
+void metrics_dispatch(struct metrics_server *m, metrics_render_t render, void *priv);
+/* Drop clients that have been connected too long, call periodically */
+void metrics_expire(struct metrics_server *m);
+void metrics_close(struct metrics_server *m);
+
+/* Prometheus text format helpers */
+void metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void metrics_family(struct metrics_buf *b, const char *name, const char *type,
+		    const char *help);
+/* labels is the inside of the braces, eg. "stage=\"isp\"", or NULL */
+void metrics_value(struct metrics_buf *b, const char *name, const char *labels,
+		   uint64_t value);
+void metrics_seconds(struct metrics_buf *b, const char *name, const char *labels,
+		     uint64_t ns);
+
+#endif
@@ -0,0 +1,477 @@
+/*
+ * v4l2_mmal - container muxers for the encoded H.264 stream.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Common code for the muxers: reassembles access units that the encoder
+ * split over several buffers, keeps the SPS/PPS from the CONFIG buffer,
+ * and provides byte buffer and H.264 bitstream helpers.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mux.h"
+
+#define H264_NAL_SLICE_IDR	5
+#define H264_NAL_SPS		7
+#define H264_NAL_PPS		8
+
+static const struct mux_ops *muxers[] = {
+	&mux_mp4_ops,
+	&mux_mkv_ops,
+	&mux_ts_ops,
+};
+
+const struct mux_ops *mux_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(muxers) / sizeof(muxers[0]); i++) {
+		if (!strcmp(muxers[i]->name, name))
+			return muxers[i];
+	}
+
+	return NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ * Byte buffers
+ */
+
+void mbuf_reset(struct mux_buf *b)
+{
+	b->len = 0;
+	b->error = false;
+}
+
+void mbuf_free(struct mux_buf *b)
+{
+	free(b->data);
+	memset(b, 0, sizeof *b);
+}
+
+uint8_t *mbuf_reserve(struct mux_buf *b, size_t len)
+{
+	uint8_t *p;
+	size_t size;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 4096;
+		while (size < b->len + len)
+			size *= 2;
+
+		p = realloc(b->data, size);
+		if (!p) {
+			b->error = true;
+			return NULL;
+		}
+		b->data = p;
+		b->size = size;
+	}
+
+	p = b->data + b->len;
+	b->len += len;
+	return p;
+}
+
+void mbuf_put(struct mux_buf *b, const void *data, size_t len)
+{
+	uint8_t *p = mbuf_reserve(b, len);
+
+	if (p)
+		memcpy(p, data, len);
+}
+
+void mbuf_put8(struct mux_buf *b, uint8_t v)
+{
+	mbuf_put(b, &v, 1);
+}
+
+void mbuf_put16(struct mux_buf *b, uint16_t v)
+{
+	uint8_t p[2] = { v >> 8, v };
+
+	mbuf_put(b, p, sizeof p);
+}
+
+void mbuf_put24(struct mux_buf *b, uint32_t v)
+{
+	uint8_t p[3] = { v >> 16, v >> 8, v };
+
+	mbuf_put(b, p, sizeof p);
+}
+
+void mbuf_put32(struct mux_buf *b, uint32_t v)
+{
+	uint8_t p[4] = { v >> 24, v >> 16, v >> 8, v };
+
+	mbuf_put(b, p, sizeof p);
+}
+
+void mbuf_put64(struct mux_buf *b, uint64_t v)
+{
+	mbuf_put32(b, v >> 32);
+	mbuf_put32(b, v);
+}
+
+void mbuf_patch32(struct mux_buf *b, size_t pos, uint32_t v)
+{
+	if (b->error || pos + 4 > b->len)
+		return;
+
+	b->data[pos] = v >> 24;
+	b->data[pos + 1] = v >> 16;
+	b->data[pos + 2] = v >> 8;
+	b->data[pos + 3] = v;
+}
+
+/* -----------------------------------------------------------------------------
+ * H.264 helpers
+ */
+
+static bool is_start_code(const uint8_t *p)
+{
+	return p[0] == 0 && p[1] == 0 && p[2] == 1;
+}
+
+/*
+ * Find the next NAL unit at or after *pos. Returns a pointer to the NAL
+ * header byte and its length excluding the start code, and advances *pos
+ * to the end of the NAL.
+ */
+const uint8_t *h264_next_nal(const uint8_t *data, size_t len, size_t *pos,
+			     size_t *nal_len, size_t *sc_len)
+{
+	size_t i = *pos;
+	size_t start, end;
+
+	while (i + 3 <= len && !is_start_code(&data[i]))
+		i++;
+	if (i + 3 > len)
+		return NULL;
+
+	*sc_len = (i > 0 && data[i - 1] == 0 && i - 1 >= *pos) ? 4 : 3;
+	start = i + 3;
+
+	for (i = start; i + 3 <= len && !is_start_code(&data[i]); i++)
+		;
+
+	if (i + 3 > len) {
+		end = len;
+	} else {
+		end = i;
+		/* The zero belongs to the next NAL's 4 byte start code */
+		if (end > start && data[end - 1] == 0)
+			end--;
+	}
+
+	*nal_len = end - start;
+	*pos = end;
+	return &data[start];
+}
+
+bool h264_is_idr(const uint8_t *data, size_t len)
+{
+	const uint8_t *nal;
+	size_t pos = 0, nal_len, sc_len;
+
+	while ((nal = h264_next_nal(data, len, &pos, &nal_len, &sc_len))) {
+		if (nal_len && (nal[0] & 0x1f) == H264_NAL_SLICE_IDR)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Convert an Annex-B access unit to 4 byte length prefixed NAL units. This
+ * is done in place when every start code is 4 bytes long (which is what the
+ * VideoCore encoder produces), otherwise into the scratch buffer.
+ */
+uint8_t *h264_to_avcc(struct mux *m, uint8_t *data, size_t *len)
+{
+	const uint8_t *nal;
+	size_t pos = 0, nal_len, sc_len;
+	bool in_place = true;
+
+	while ((nal = h264_next_nal(data, *len, &pos, &nal_len, &sc_len))) {
+		if (sc_len != 4) {
+			in_place = false;
+			break;
+		}
+	}
+
+	/* Any leading garbage before the first start code also rules it out */
+	pos = 0;
+	nal = h264_next_nal(data, *len, &pos, &nal_len, &sc_len);
+	if (!nal || nal != data + 4)
+		in_place = false;
+
+	pos = 0;
+	if (in_place) {
+		size_t out = 0;
+
+		while ((nal = h264_next_nal(data, *len, &pos, &nal_len, &sc_len))) {
+			data[out] = nal_len >> 24;
+			data[out + 1] = nal_len >> 16;
+			data[out + 2] = nal_len >> 8;
+			data[out + 3] = nal_len;
+			out += 4 + nal_len;
+		}
+		*len = out;
+		return data;
+	}
+
+	mbuf_reset(&m->scratch);
+	while ((nal = h264_next_nal(data, *len, &pos, &nal_len, &sc_len))) {
+		mbuf_put32(&m->scratch, nal_len);
+		mbuf_put(&m->scratch, nal, nal_len);
+	}
+	if (m->scratch.error)
+		return NULL;
+
+	*len = m->scratch.len;
+	return m->scratch.data;
+}
+
+/* AVCDecoderConfigurationRecord, as used by MP4 avcC and Matroska CodecPrivate */
+void h264_write_avcc_config(struct mux *m, struct mux_buf *b)
+{
+	uint8_t profile = m->sps_len > 3 ? m->sps[1] : 100;
+
+	mbuf_put8(b, 1);
+	mbuf_put8(b, profile);
+	mbuf_put8(b, m->sps_len > 3 ? m->sps[2] : 0);
+	mbuf_put8(b, m->sps_len > 3 ? m->sps[3] : 40);
+	mbuf_put8(b, 0xfc | 3);		/* 4 byte NAL lengths */
+	mbuf_put8(b, 0xe0 | 1);		/* 1 SPS */
+	mbuf_put16(b, m->sps_len);
+	mbuf_put(b, m->sps, m->sps_len);
+	mbuf_put8(b, 1);		/* 1 PPS */
+	mbuf_put16(b, m->pps_len);
+	mbuf_put(b, m->pps, m->pps_len);
+
+	if (profile == 100 || profile == 110 || profile == 122 || profile == 144) {
+		mbuf_put8(b, 0xfc | 1);	/* 4:2:0 */
+		mbuf_put8(b, 0xf8 | 0);	/* 8 bit luma */
+		mbuf_put8(b, 0xf8 | 0);	/* 8 bit chroma */
+		mbuf_put8(b, 0);	/* no SPS extensions */
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Muxer core
+ */
+
+int mux_init(struct mux *m, const struct mux_ops *ops, struct writer *w,
+	     const struct mux_params *params)
+{
+	memset(m, 0, sizeof *m);
+	m->ops = ops;
+	m->w = w;
+	m->params = *params;
+	m->last_pts = MUX_TIME_UNKNOWN;
+	m->first_pts = MUX_TIME_UNKNOWN;
+
+	return 0;
+}
+
+void mux_frame_done(struct mux_frame *f)
+{
+	if (f->release)
+		f->release(f->priv);
+	f->release = NULL;
+}
+
+/* Nominal frame duration in microseconds */
+int64_t mux_frame_duration(struct mux *m)
+{
+	if (!m->params.fps_num || !m->params.fps_den)
+		return 1000000 / 30;
+
+	return (int64_t)1000000 * m->params.fps_den / m->params.fps_num;
+}
+
+static void mux_store_config(struct mux *m, const uint8_t *data, size_t len)
+{
+	const uint8_t *nal;
+	size_t pos = 0, nal_len, sc_len;
+
+	while ((nal = h264_next_nal(data, len, &pos, &nal_len, &sc_len))) {
+		uint8_t **dst;
+		size_t *dst_len;
+
+		if (!nal_len)
+			continue;
+
+		switch (nal[0] & 0x1f) {
+		case H264_NAL_SPS:
+			dst = &m->sps;
+			dst_len = &m->sps_len;
+			break;
+		case H264_NAL_PPS:
+			dst = &m->pps;
+			dst_len = &m->pps_len;
+			break;
+		default:
+			continue;
+		}
+
+		free(*dst);
+		*dst = malloc(nal_len);
+		*dst_len = *dst ? nal_len : 0;
+		if (*dst)
+			memcpy(*dst, nal, nal_len);
+	}
+}
+
+static int mux_dispatch(struct mux *m, struct mux_frame *f)
+{
+	int ret;
+
+	if (!m->opened) {
+		if (!m->sps || !m->pps) {
+			/* Can't describe the stream yet, so drop the frame */
+			mux_frame_done(f);
+			return -EAGAIN;
+		}
+
+		ret = m->ops->open(m);
+		if (ret < 0) {
+			mux_frame_done(f);
+			return ret;
+		}
+		m->opened = true;
+		m->header_len = writer_position(m->w);
+	}
+
+	if (f->pts == MUX_TIME_UNKNOWN)
+		f->pts = m->last_pts == MUX_TIME_UNKNOWN ? 0 :
+			 m->last_pts + mux_frame_duration(m);
+	m->last_pts = f->pts;
+	m->frames++;
+
+	return m->ops->frame(m, f);
+}
+
+/*
+ * Feed one encoder output buffer to the muxer. The data is owned by the
+ * muxer from here on and released through 'release' once it is no longer
+ * needed.
+ */
+int mux_buffer(struct mux *m, uint8_t *data, size_t len, int64_t pts,
+	       unsigned int flags, writer_release_t release, void *priv)
+{
+	struct mux_frame f;
+	int ret;
+
+	if (flags & MUX_FLAG_CONFIG) {
+		mux_store_config(m, data, len);
+		if (release)
+			release(priv);
+		return 0;
+	}
+
+	if (m->au.len || !(flags & MUX_FLAG_FRAME_END)) {
+		/* Part of a frame, collect it until the end arrives */
+		if (!m->au.len) {
+			m->au_pts = pts;
+			m->au_keyframe = false;
+		}
+		mbuf_put(&m->au, data, len);
+		m->au_keyframe |= !!(flags & MUX_FLAG_KEYFRAME);
+		if (release)
+			release(priv);
+
+		if (!(flags & MUX_FLAG_FRAME_END))
+			return 0;
+
+		f.data = m->au.data;
+		f.len = m->au.len;
+		f.pts = m->au_pts;
+		f.keyframe = m->au_keyframe || h264_is_idr(f.data, f.len);
+		f.release = NULL;
+		f.priv = NULL;
+
+		ret = mux_dispatch(m, &f);
+		mbuf_reset(&m->au);
+		return ret;
+	}
+
+	f.data = data;
+	f.len = len;
+	f.pts = pts;
+	f.keyframe = (flags & MUX_FLAG_KEYFRAME) || h264_is_idr(data, len);
+	f.release = release;
+	f.priv = priv;
+
+	return mux_dispatch(m, &f);
+}
+
+/*
+ * Write the payload of a frame. Data still in the producer's buffer is
+ * passed to the writer by reference, anything else (reassembled frames,
+ * the scratch buffer) is copied as it is about to be reused.
+ */
+int mux_frame_write(struct mux *m, struct mux_frame *f, const uint8_t *data,
+		    size_t len)
+{
+	int ret;
+
+	if (f->release && data >= f->data && data + len <= f->data + f->len) {
+		ret = writer_add(m->w, data, len, f->release, f->priv);
+		f->release = NULL;
+		return ret;
+	}
+
+	ret = writer_copy(m->w, data, len);
+	mux_frame_done(f);
+	return ret;
+}
+
+/* Push out any frames the container is holding back */
+int mux_flush(struct mux *m)
+{
+	if (!m->opened || !m->ops->flush)
+		return 0;
+
+	return m->ops->flush(m);
+}
+
+/*
+ * Finish the current container, e.g. when output moves to a new file. The
+ * next frame starts a new one with the parameter sets already received.
+ */
+int mux_reset(struct mux *m)
+{
+	int ret = 0;
+
+	if (m->opened && m->ops->close)
+		ret = m->ops->close(m);
+	m->opened = false;
+
+	return ret;
+}
+
+void mux_cleanup(struct mux *m)
+{
+	mux_reset(m);
+
+	mbuf_free(&m->au);
+	mbuf_free(&m->scratch);
+	free(m->sps);
+	free(m->pps);
+	m->sps = NULL;
+	m->pps = NULL;
+}
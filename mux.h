@@ -0,0 +1,145 @@
+/*
+ * v4l2_mmal - container muxers for the encoded H.264 stream.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __MUX_H__
+#define __MUX_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "writer.h"
+
+#define MUX_TIME_UNKNOWN	INT64_MIN
+
+/* Buffer flags, mapped from the MMAL buffer header flags by the caller */
+#define MUX_FLAG_CONFIG		(1 << 0)
+#define MUX_FLAG_KEYFRAME	(1 << 1)
+#define MUX_FLAG_FRAME_END	(1 << 2)
+
+/* Growable byte buffer used to build container headers */
+struct mux_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	bool error;
+};
+
+/* One complete H.264 access unit in Annex-B format */
+struct mux_frame {
+	uint8_t *data;
+	size_t len;
+	int64_t pts;		/* microseconds */
+	bool keyframe;
+
+	/*
+	 * Ownership of data. Muxers must either pass it on to the writer with
+	 * writer_add() or call mux_frame_done() once they have copied it.
+	 */
+	writer_release_t release;
+	void *priv;
+};
+
+struct mux;
+
+struct mux_ops {
+	const char *name;
+	int (*open)(struct mux *m);
+	int (*frame)(struct mux *m, struct mux_frame *f);
+	/* Optional, write out anything held back, e.g. a partial fragment */
+	int (*flush)(struct mux *m);
+	int (*close)(struct mux *m);
+};
+
+struct mux_params {
+	unsigned int width;
+	unsigned int height;
+	/* Nominal frame rate, used for the last frame's duration */
+	unsigned int fps_num;
+	unsigned int fps_den;
+};
+
+struct mux {
+	const struct mux_ops *ops;
+	struct writer *w;
+	struct mux_params params;
+	void *priv;
+
+	/* Parameter sets from the encoder's CONFIG buffer */
+	uint8_t *sps;
+	size_t sps_len;
+	uint8_t *pps;
+	size_t pps_len;
+	bool opened;
+	/* Bytes of container header written when the muxer was opened */
+	uint64_t header_len;
+
+	/* Access unit reassembly for frames split over several buffers */
+	struct mux_buf au;
+	int64_t au_pts;
+	bool au_keyframe;
+
+	/* Scratch space for Annex-B to length-prefixed conversion */
+	struct mux_buf scratch;
+
+	int64_t last_pts;
+	uint64_t frames;
+
+	/*
+	 * Origin of the media timeline. It survives mux_reset() so the files
+	 * of a segmented recording carry on from each other rather than all
+	 * starting again at 0.
+	 */
+	int64_t first_pts;
+};
+
+const struct mux_ops *mux_find(const char *name);
+int mux_init(struct mux *m, const struct mux_ops *ops, struct writer *w,
+	     const struct mux_params *params);
+int mux_buffer(struct mux *m, uint8_t *data, size_t len, int64_t pts,
+	       unsigned int flags, writer_release_t release, void *priv);
+int mux_flush(struct mux *m);
+int mux_reset(struct mux *m);
+void mux_cleanup(struct mux *m);
+
+void mux_frame_done(struct mux_frame *f);
+int mux_frame_write(struct mux *m, struct mux_frame *f, const uint8_t *data,
+		    size_t len);
+int64_t mux_frame_duration(struct mux *m);
+
+/* Byte buffer helpers */
+void mbuf_reset(struct mux_buf *b);
+void mbuf_free(struct mux_buf *b);
+uint8_t *mbuf_reserve(struct mux_buf *b, size_t len);
+void mbuf_put(struct mux_buf *b, const void *data, size_t len);
+void mbuf_put8(struct mux_buf *b, uint8_t v);
+void mbuf_put16(struct mux_buf *b, uint16_t v);
+void mbuf_put24(struct mux_buf *b, uint32_t v);
+void mbuf_put32(struct mux_buf *b, uint32_t v);
+void mbuf_put64(struct mux_buf *b, uint64_t v);
+void mbuf_patch32(struct mux_buf *b, size_t pos, uint32_t v);
+
+/* H.264 bitstream helpers */
+const uint8_t *h264_next_nal(const uint8_t *data, size_t len, size_t *pos,
+			     size_t *nal_len, size_t *sc_len);
+bool h264_is_idr(const uint8_t *data, size_t len);
+uint8_t *h264_to_avcc(struct mux *m, uint8_t *data, size_t *len);
+void h264_write_avcc_config(struct mux *m, struct mux_buf *b);
+
+extern const struct mux_ops mux_mp4_ops;
+extern const struct mux_ops mux_mkv_ops;
+extern const struct mux_ops mux_ts_ops;
+
+#endif
@@ -0,0 +1,467 @@
+/*
+ * v4l2_mmal - streaming Matroska muxer.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The Segment and Clusters are written with unknown sizes, so frames go
+ * straight out as SimpleBlocks and nothing is ever buffered or seeked
+ * during capture. A new Cluster starts at every keyframe. Cues are
+ * appended at close; if the output is a regular file, the Segment size
+ * and a SeekHead pointing at the Cues are then patched into space
+ * reserved at the start of the file.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mux.h"
+
+#define MKV_ID_EBML			0x1a45dfa3
+#define MKV_ID_EBML_VERSION		0x4286
+#define MKV_ID_EBML_READ_VERSION	0x42f7
+#define MKV_ID_EBML_MAX_ID_LENGTH	0x42f2
+#define MKV_ID_EBML_MAX_SIZE_LENGTH	0x42f3
+#define MKV_ID_DOCTYPE			0x4282
+#define MKV_ID_DOCTYPE_VERSION		0x4287
+#define MKV_ID_DOCTYPE_READ_VERSION	0x4285
+#define MKV_ID_VOID			0xec
+#define MKV_ID_SEGMENT			0x18538067
+#define MKV_ID_SEEKHEAD			0x114d9b74
+#define MKV_ID_SEEK			0x4dbb
+#define MKV_ID_SEEK_ID			0x53ab
+#define MKV_ID_SEEK_POSITION		0x53ac
+#define MKV_ID_INFO			0x1549a966
+#define MKV_ID_TIMESTAMP_SCALE		0x2ad7b1
+#define MKV_ID_MUXING_APP		0x4d80
+#define MKV_ID_WRITING_APP		0x5741
+#define MKV_ID_TRACKS			0x1654ae6b
+#define MKV_ID_TRACK_ENTRY		0xae
+#define MKV_ID_TRACK_NUMBER		0xd7
+#define MKV_ID_TRACK_UID		0x73c5
+#define MKV_ID_TRACK_TYPE		0x83
+#define MKV_ID_FLAG_LACING		0x9c
+#define MKV_ID_DEFAULT_DURATION		0x23e383
+#define MKV_ID_CODEC_ID			0x86
+#define MKV_ID_CODEC_PRIVATE		0x63a2
+#define MKV_ID_VIDEO			0xe0
+#define MKV_ID_PIXEL_WIDTH		0xb0
+#define MKV_ID_PIXEL_HEIGHT		0xba
+#define MKV_ID_CLUSTER			0x1f43b675
+#define MKV_ID_CLUSTER_TIMESTAMP	0xe7
+#define MKV_ID_SIMPLE_BLOCK		0xa3
+#define MKV_ID_CUES			0x1c53bb6b
+#define MKV_ID_CUE_POINT		0xbb
+#define MKV_ID_CUE_TIME			0xb3
+#define MKV_ID_CUE_TRACK_POSITIONS	0xb7
+#define MKV_ID_CUE_TRACK		0xf7
+#define MKV_ID_CUE_CLUSTER_POSITION	0xf1
+
+#define MKV_TRACK_NUMBER		1
+#define MKV_TIMESTAMP_SCALE		1000000	/* ns, so timestamps are in ms */
+#define MKV_SIZE_UNKNOWN		0x01ffffffffffffffULL
+
+/* Room kept at the start of the Segment for the final SeekHead */
+#define MKV_SEEKHEAD_SPACE		128
+
+struct mkv_cue {
+	uint64_t time;
+	uint64_t pos;
+};
+
+struct mkv {
+	struct mux_buf hdr;
+
+	int64_t first_pts;
+	bool in_cluster;
+	int64_t cluster_time;
+
+	/* Bytes written since the start of the Segment's data */
+	uint64_t pos;
+	/* File offset of the Segment's data */
+	uint64_t segment_start;
+	uint64_t info_pos;
+	uint64_t tracks_pos;
+
+	struct mkv_cue *cues;
+	unsigned int num_cues;
+	unsigned int max_cues;
+};
+
+static void ebml_id(struct mux_buf *b, uint32_t id)
+{
+	if (id > 0xffffff)
+		mbuf_put32(b, id);
+	else if (id > 0xffff)
+		mbuf_put24(b, id);
+	else if (id > 0xff)
+		mbuf_put16(b, id);
+	else
+		mbuf_put8(b, id);
+}
+
+static void ebml_size(struct mux_buf *b, uint64_t size)
+{
+	unsigned int len = 1;
+	int i;
+
+	/* All ones is reserved for "unknown" at every length */
+	while (len < 8 && size >= (1ULL << (7 * len)) - 1)
+		len++;
+
+	size |= 1ULL << (7 * len);
+	for (i = len - 1; i >= 0; i--)
+		mbuf_put8(b, size >> (8 * i));
+}
+
+/* Fixed 8 byte size field, used for elements whose size is patched later */
+static void ebml_size8(uint8_t *p, uint64_t size)
+{
+	int i;
+
+	size |= 1ULL << 56;
+	for (i = 7; i >= 0; i--)
+		*p++ = size >> (8 * i);
+}
+
+static size_t ebml_master_start(struct mux_buf *b, uint32_t id)
+{
+	size_t pos;
+
+	ebml_id(b, id);
+	pos = b->len;
+	mbuf_reserve(b, 8);
+	return pos;
+}
+
+static void ebml_master_end(struct mux_buf *b, size_t pos)
+{
+	if (!b->error)
+		ebml_size8(b->data + pos, b->len - pos - 8);
+}
+
+static void ebml_uint(struct mux_buf *b, uint32_t id, uint64_t v)
+{
+	unsigned int len = 1;
+	int i;
+
+	while (len < 8 && v >> (8 * len))
+		len++;
+
+	ebml_id(b, id);
+	ebml_size(b, len);
+	for (i = len - 1; i >= 0; i--)
+		mbuf_put8(b, v >> (8 * i));
+}
+
+static void ebml_binary(struct mux_buf *b, uint32_t id, const void *data,
+			size_t len)
+{
+	ebml_id(b, id);
+	ebml_size(b, len);
+	mbuf_put(b, data, len);
+}
+
+static void ebml_string(struct mux_buf *b, uint32_t id, const char *s)
+{
+	ebml_binary(b, id, s, strlen(s));
+}
+
+static void ebml_void(struct mux_buf *b, size_t len)
+{
+	uint8_t *p;
+
+	/* len includes the ID and a one byte size, so must be 2..128 */
+	ebml_id(b, MKV_ID_VOID);
+	ebml_size(b, len - 2);
+	p = mbuf_reserve(b, len - 2);
+	if (p)
+		memset(p, 0, len - 2);
+}
+
+static void mkv_seek_entry(struct mux_buf *b, uint32_t id, uint64_t pos)
+{
+	struct mux_buf idb = { 0 };
+	size_t seek;
+
+	ebml_id(&idb, id);
+
+	seek = ebml_master_start(b, MKV_ID_SEEK);
+	ebml_binary(b, MKV_ID_SEEK_ID, idb.data, idb.len);
+	/* Always 8 bytes, so the SeekHead size doesn't depend on the file */
+	ebml_id(b, MKV_ID_SEEK_POSITION);
+	ebml_size(b, 8);
+	mbuf_put64(b, pos);
+	ebml_master_end(b, seek);
+
+	mbuf_free(&idb);
+}
+
+/* SeekHead padded with a Void element to exactly MKV_SEEKHEAD_SPACE */
+static void mkv_write_seekhead(struct mkv *mkv, struct mux_buf *b,
+			       uint64_t cues_pos)
+{
+	size_t start = b->len;
+	size_t head;
+
+	head = ebml_master_start(b, MKV_ID_SEEKHEAD);
+	mkv_seek_entry(b, MKV_ID_INFO, mkv->info_pos);
+	mkv_seek_entry(b, MKV_ID_TRACKS, mkv->tracks_pos);
+	if (cues_pos)
+		mkv_seek_entry(b, MKV_ID_CUES, cues_pos);
+	ebml_master_end(b, head);
+
+	ebml_void(b, MKV_SEEKHEAD_SPACE - (b->len - start));
+}
+
+static int mkv_write(struct mux *m, struct mux_buf *b)
+{
+	struct mkv *mkv = m->priv;
+
+	if (b->error)
+		return -ENOMEM;
+
+	mkv->pos += b->len;
+	return writer_copy(m->w, b->data, b->len);
+}
+
+static int mkv_open(struct mux *m)
+{
+	struct mkv *mkv;
+	struct mux_buf *b;
+	struct mux_buf avcc = { 0 };
+	size_t ebml, info, tracks, track, video;
+	int ret;
+
+	mkv = calloc(1, sizeof *mkv);
+	if (!mkv)
+		return -ENOMEM;
+	m->priv = mkv;
+	mkv->first_pts = MUX_TIME_UNKNOWN;
+	b = &mkv->hdr;
+
+	ebml = ebml_master_start(b, MKV_ID_EBML);
+	ebml_uint(b, MKV_ID_EBML_VERSION, 1);
+	ebml_uint(b, MKV_ID_EBML_READ_VERSION, 1);
+	ebml_uint(b, MKV_ID_EBML_MAX_ID_LENGTH, 4);
+	ebml_uint(b, MKV_ID_EBML_MAX_SIZE_LENGTH, 8);
+	ebml_string(b, MKV_ID_DOCTYPE, "matroska");
+	ebml_uint(b, MKV_ID_DOCTYPE_VERSION, 4);
+	ebml_uint(b, MKV_ID_DOCTYPE_READ_VERSION, 2);
+	ebml_master_end(b, ebml);
+
+	ebml_id(b, MKV_ID_SEGMENT);
+	mbuf_put64(b, MKV_SIZE_UNKNOWN);
+	mkv->segment_start = b->len;
+
+	/* Positions below are relative to the Segment's data */
+	mkv->info_pos = MKV_SEEKHEAD_SPACE;
+	mkv_write_seekhead(mkv, b, 0);
+
+	info = ebml_master_start(b, MKV_ID_INFO);
+	ebml_uint(b, MKV_ID_TIMESTAMP_SCALE, MKV_TIMESTAMP_SCALE);
+	ebml_string(b, MKV_ID_MUXING_APP, "v4l2_mmal");
+	ebml_string(b, MKV_ID_WRITING_APP, "v4l2_mmal");
+	ebml_master_end(b, info);
+
+	mkv->tracks_pos = b->len - mkv->segment_start;
+	tracks = ebml_master_start(b, MKV_ID_TRACKS);
+	track = ebml_master_start(b, MKV_ID_TRACK_ENTRY);
+	ebml_uint(b, MKV_ID_TRACK_NUMBER, MKV_TRACK_NUMBER);
+	ebml_uint(b, MKV_ID_TRACK_UID, MKV_TRACK_NUMBER);
+	ebml_uint(b, MKV_ID_TRACK_TYPE, 1);	/* video */
+	ebml_uint(b, MKV_ID_FLAG_LACING, 0);
+	ebml_uint(b, MKV_ID_DEFAULT_DURATION, mux_frame_duration(m) * 1000);
+	ebml_string(b, MKV_ID_CODEC_ID, "V_MPEG4/ISO/AVC");
+	h264_write_avcc_config(m, &avcc);
+	ebml_binary(b, MKV_ID_CODEC_PRIVATE, avcc.data, avcc.len);
+	mbuf_free(&avcc);
+	video = ebml_master_start(b, MKV_ID_VIDEO);
+	ebml_uint(b, MKV_ID_PIXEL_WIDTH, m->params.width);
+	ebml_uint(b, MKV_ID_PIXEL_HEIGHT, m->params.height);
+	ebml_master_end(b, video);
+	ebml_master_end(b, track);
+	ebml_master_end(b, tracks);
+
+	ret = mkv_write(m, b);
+	/* Only count what follows the Segment header */
+	mkv->pos -= mkv->segment_start;
+	return ret;
+}
+
+static int mkv_start_cluster(struct mux *m, int64_t time, bool keyframe)
+{
+	struct mkv *mkv = m->priv;
+	struct mux_buf *b = &mkv->hdr;
+
+	if (keyframe) {
+		if (mkv->num_cues == mkv->max_cues) {
+			unsigned int max = mkv->max_cues ? mkv->max_cues * 2 : 64;
+			struct mkv_cue *cues;
+
+			cues = realloc(mkv->cues, max * sizeof *cues);
+			if (cues) {
+				mkv->cues = cues;
+				mkv->max_cues = max;
+			}
+		}
+		if (mkv->num_cues < mkv->max_cues) {
+			mkv->cues[mkv->num_cues].time = time;
+			mkv->cues[mkv->num_cues].pos = mkv->pos;
+			mkv->num_cues++;
+		}
+	}
+
+	mbuf_reset(b);
+	ebml_id(b, MKV_ID_CLUSTER);
+	mbuf_put64(b, MKV_SIZE_UNKNOWN);
+	ebml_uint(b, MKV_ID_CLUSTER_TIMESTAMP, time);
+
+	mkv->in_cluster = true;
+	mkv->cluster_time = time;
+
+	return mkv_write(m, b);
+}
+
+static int mkv_frame(struct mux *m, struct mux_frame *f)
+{
+	struct mkv *mkv = m->priv;
+	struct mux_buf *b = &mkv->hdr;
+	int64_t time, rel;
+	uint8_t *data;
+	size_t len = f->len;
+	int ret;
+
+	if (mkv->first_pts == MUX_TIME_UNKNOWN)
+		mkv->first_pts = f->pts;
+	time = f->pts > mkv->first_pts ? (f->pts - mkv->first_pts) / 1000 : 0;
+
+	/* Block timestamps are 16 bit signed offsets from the Cluster's */
+	rel = time - mkv->cluster_time;
+	if (!mkv->in_cluster || f->keyframe || rel < INT16_MIN || rel > INT16_MAX) {
+		ret = mkv_start_cluster(m, time, f->keyframe);
+		if (ret < 0) {
+			mux_frame_done(f);
+			return ret;
+		}
+		rel = 0;
+	}
+
+	data = h264_to_avcc(m, f->data, &len);
+	if (!data) {
+		mux_frame_done(f);
+		return -ENOMEM;
+	}
+
+	mbuf_reset(b);
+	ebml_id(b, MKV_ID_SIMPLE_BLOCK);
+	ebml_size(b, 4 + len);
+	ebml_size(b, MKV_TRACK_NUMBER);
+	mbuf_put16(b, (uint16_t)(int16_t)rel);
+	mbuf_put8(b, f->keyframe ? 0x80 : 0x00);
+
+	ret = mkv_write(m, b);
+	if (ret < 0) {
+		mux_frame_done(f);
+		return ret;
+	}
+
+	mkv->pos += len;
+	return mux_frame_write(m, f, data, len);
+}
+
+static int mkv_write_cues(struct mux *m)
+{
+	struct mkv *mkv = m->priv;
+	struct mux_buf *b = &mkv->hdr;
+	size_t cues, point, track;
+	unsigned int i;
+
+	mbuf_reset(b);
+	cues = ebml_master_start(b, MKV_ID_CUES);
+	for (i = 0; i < mkv->num_cues; i++) {
+		point = ebml_master_start(b, MKV_ID_CUE_POINT);
+		ebml_uint(b, MKV_ID_CUE_TIME, mkv->cues[i].time);
+		track = ebml_master_start(b, MKV_ID_CUE_TRACK_POSITIONS);
+		ebml_uint(b, MKV_ID_CUE_TRACK, MKV_TRACK_NUMBER);
+		ebml_uint(b, MKV_ID_CUE_CLUSTER_POSITION, mkv->cues[i].pos);
+		ebml_master_end(b, track);
+		ebml_master_end(b, point);
+	}
+	ebml_master_end(b, cues);
+
+	return mkv_write(m, b);
+}
+
+/*
+ * Fill in the Segment size and the SeekHead now that the Cues have been
+ * written. Only possible when the output is a regular file.
+ */
+static int mkv_patch_header(struct mux *m, uint64_t cues_pos)
+{
+	struct mkv *mkv = m->priv;
+	struct mux_buf *b = &mkv->hdr;
+	uint8_t size[8];
+	struct stat st;
+	int ret;
+
+	if (fstat(m->w->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	ret = writer_sync(m->w);
+	if (ret < 0)
+		return ret;
+
+	ebml_size8(size, mkv->pos);
+	if (pwrite(m->w->fd, size, sizeof size, mkv->segment_start - 8) != sizeof size)
+		return -errno;
+
+	mbuf_reset(b);
+	mkv_write_seekhead(mkv, b, cues_pos);
+	if (b->error)
+		return -ENOMEM;
+	if (pwrite(m->w->fd, b->data, b->len, mkv->segment_start) != (ssize_t)b->len)
+		return -errno;
+
+	return 0;
+}
+
+static int mkv_close(struct mux *m)
+{
+	struct mkv *mkv = m->priv;
+	uint64_t cues_pos;
+	int ret;
+
+	if (!mkv)
+		return 0;
+
+	cues_pos = mkv->pos;
+	ret = mkv_write_cues(m);
+	if (!ret)
+		ret = mkv_patch_header(m, cues_pos);
+
+	mbuf_free(&mkv->hdr);
+	free(mkv->cues);
+	free(mkv);
+	m->priv = NULL;
+
+	return ret;
+}
+
+const struct mux_ops mux_mkv_ops = {
+	.name = "mkv",
+	.open = mkv_open,
+	.frame = mkv_frame,
+	.close = mkv_close,
+};
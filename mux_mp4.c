@@ -0,0 +1,427 @@
+/*
+ * v4l2_mmal - fragmented MP4 (ISO BMFF) muxer.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Writes an empty moov followed by a moof/mdat pair per fragment. A new
+ * fragment is started at every keyframe, so the file is playable while it
+ * is being written and never needs to be seeked. The samples of the
+ * current fragment are held in memory as the moof has to precede them.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mux.h"
+
+#define MP4_TIMESCALE		90000
+#define MP4_TRACK_ID		1
+
+/* Bound the memory used by a fragment if keyframes are far apart */
+#define MP4_MAX_FRAGMENT_SIZE	(16 << 20)
+#define MP4_MAX_SAMPLES		1024
+
+#define MP4_SAMPLE_SYNC		0x02000000	/* depends on no other sample */
+#define MP4_SAMPLE_NON_SYNC	0x01010000	/* depends on others, non-sync */
+
+struct mp4_sample {
+	uint32_t size;
+	uint32_t duration;
+	uint32_t flags;
+};
+
+struct mp4 {
+	struct mux_buf hdr;
+	struct mux_buf mdat;
+
+	struct mp4_sample samples[MP4_MAX_SAMPLES];
+	unsigned int num_samples;
+
+	uint32_t sequence;
+	uint64_t base_time;
+	uint64_t last_time;
+};
+
+static uint64_t mp4_time(struct mux *m, int64_t pts)
+{
+	if (pts < m->first_pts)
+		return 0;
+
+	return (uint64_t)(pts - m->first_pts) * MP4_TIMESCALE / 1000000;
+}
+
+static size_t box_start(struct mux_buf *b, const char *type)
+{
+	size_t pos = b->len;
+
+	mbuf_put32(b, 0);
+	mbuf_put(b, type, 4);
+	return pos;
+}
+
+static size_t fullbox_start(struct mux_buf *b, const char *type,
+			    uint8_t version, uint32_t flags)
+{
+	size_t pos = box_start(b, type);
+
+	mbuf_put8(b, version);
+	mbuf_put24(b, flags);
+	return pos;
+}
+
+static void box_end(struct mux_buf *b, size_t pos)
+{
+	mbuf_patch32(b, pos, b->len - pos);
+}
+
+static void put_matrix(struct mux_buf *b)
+{
+	static const uint32_t matrix[9] = {
+		0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000
+	};
+	unsigned int i;
+
+	for (i = 0; i < 9; i++)
+		mbuf_put32(b, matrix[i]);
+}
+
+static void mp4_write_stsd(struct mux *m, struct mux_buf *b)
+{
+	static const uint8_t compressor[32] = { 0 };
+	size_t stsd, avc1, avcc;
+
+	stsd = fullbox_start(b, "stsd", 0, 0);
+	mbuf_put32(b, 1);
+
+	avc1 = box_start(b, "avc1");
+	mbuf_put32(b, 0);			/* reserved */
+	mbuf_put16(b, 0);
+	mbuf_put16(b, 1);			/* data reference index */
+	mbuf_put16(b, 0);			/* pre_defined */
+	mbuf_put16(b, 0);			/* reserved */
+	mbuf_put32(b, 0);			/* pre_defined */
+	mbuf_put32(b, 0);
+	mbuf_put32(b, 0);
+	mbuf_put16(b, m->params.width);
+	mbuf_put16(b, m->params.height);
+	mbuf_put32(b, 0x00480000);		/* 72 dpi */
+	mbuf_put32(b, 0x00480000);
+	mbuf_put32(b, 0);			/* reserved */
+	mbuf_put16(b, 1);			/* frame count */
+	mbuf_put(b, compressor, sizeof compressor);
+	mbuf_put16(b, 0x0018);			/* depth */
+	mbuf_put16(b, 0xffff);			/* pre_defined */
+
+	avcc = box_start(b, "avcC");
+	h264_write_avcc_config(m, b);
+	box_end(b, avcc);
+
+	box_end(b, avc1);
+	box_end(b, stsd);
+}
+
+static int mp4_open(struct mux *m)
+{
+	struct mp4 *mp4;
+	struct mux_buf *b;
+	size_t ftyp, moov, mvhd, trak, tkhd, mdia, mdhd, hdlr, minf, vmhd;
+	size_t dinf, dref, url, stbl, box, mvex, trex;
+
+	mp4 = calloc(1, sizeof *mp4);
+	if (!mp4)
+		return -ENOMEM;
+	m->priv = mp4;
+	b = &mp4->hdr;
+
+	ftyp = box_start(b, "ftyp");
+	mbuf_put(b, "iso5", 4);
+	mbuf_put32(b, 0x200);
+	mbuf_put(b, "iso5", 4);
+	mbuf_put(b, "iso6", 4);
+	mbuf_put(b, "avc1", 4);
+	mbuf_put(b, "mp41", 4);
+	box_end(b, ftyp);
+
+	moov = box_start(b, "moov");
+
+	mvhd = fullbox_start(b, "mvhd", 0, 0);
+	mbuf_put32(b, 0);			/* creation time */
+	mbuf_put32(b, 0);			/* modification time */
+	mbuf_put32(b, 1000);			/* timescale */
+	mbuf_put32(b, 0);			/* duration, unknown */
+	mbuf_put32(b, 0x00010000);		/* rate 1.0 */
+	mbuf_put16(b, 0x0100);			/* volume 1.0 */
+	mbuf_put16(b, 0);
+	mbuf_put32(b, 0);
+	mbuf_put32(b, 0);
+	put_matrix(b);
+	for (box = 0; box < 6; box++)
+		mbuf_put32(b, 0);		/* pre_defined */
+	mbuf_put32(b, MP4_TRACK_ID + 1);	/* next track ID */
+	box_end(b, mvhd);
+
+	trak = box_start(b, "trak");
+
+	tkhd = fullbox_start(b, "tkhd", 0, 0x3);	/* enabled, in movie */
+	mbuf_put32(b, 0);
+	mbuf_put32(b, 0);
+	mbuf_put32(b, MP4_TRACK_ID);
+	mbuf_put32(b, 0);
+	mbuf_put32(b, 0);			/* duration */
+	mbuf_put32(b, 0);
+	mbuf_put32(b, 0);
+	mbuf_put16(b, 0);			/* layer */
+	mbuf_put16(b, 0);			/* alternate group */
+	mbuf_put16(b, 0);			/* volume */
+	mbuf_put16(b, 0);
+	put_matrix(b);
+	mbuf_put32(b, m->params.width << 16);
+	mbuf_put32(b, m->params.height << 16);
+	box_end(b, tkhd);
+
+	mdia = box_start(b, "mdia");
+
+	mdhd = fullbox_start(b, "mdhd", 0, 0);
+	mbuf_put32(b, 0);
+	mbuf_put32(b, 0);
+	mbuf_put32(b, MP4_TIMESCALE);
+	mbuf_put32(b, 0);
+	mbuf_put16(b, 0x55c4);			/* "und" */
+	mbuf_put16(b, 0);
+	box_end(b, mdhd);
+
+	hdlr = fullbox_start(b, "hdlr", 0, 0);
+	mbuf_put32(b, 0);
+	mbuf_put(b, "vide", 4);
+	mbuf_put32(b, 0);
+	mbuf_put32(b, 0);
+	mbuf_put32(b, 0);
+	mbuf_put(b, "VideoHandler", 13);
+	box_end(b, hdlr);
+
+	minf = box_start(b, "minf");
+
+	vmhd = fullbox_start(b, "vmhd", 0, 1);
+	mbuf_put16(b, 0);
+	mbuf_put16(b, 0);
+	mbuf_put16(b, 0);
+	mbuf_put16(b, 0);
+	box_end(b, vmhd);
+
+	dinf = box_start(b, "dinf");
+	dref = fullbox_start(b, "dref", 0, 0);
+	mbuf_put32(b, 1);
+	url = fullbox_start(b, "url ", 0, 1);	/* media in same file */
+	box_end(b, url);
+	box_end(b, dref);
+	box_end(b, dinf);
+
+	stbl = box_start(b, "stbl");
+	mp4_write_stsd(m, b);
+	box = fullbox_start(b, "stts", 0, 0);
+	mbuf_put32(b, 0);
+	box_end(b, box);
+	box = fullbox_start(b, "stsc", 0, 0);
+	mbuf_put32(b, 0);
+	box_end(b, box);
+	box = fullbox_start(b, "stsz", 0, 0);
+	mbuf_put32(b, 0);
+	mbuf_put32(b, 0);
+	box_end(b, box);
+	box = fullbox_start(b, "stco", 0, 0);
+	mbuf_put32(b, 0);
+	box_end(b, box);
+	box_end(b, stbl);
+
+	box_end(b, minf);
+	box_end(b, mdia);
+	box_end(b, trak);
+
+	mvex = box_start(b, "mvex");
+	trex = fullbox_start(b, "trex", 0, 0);
+	mbuf_put32(b, MP4_TRACK_ID);
+	mbuf_put32(b, 1);			/* sample description index */
+	mbuf_put32(b, 0);			/* default duration */
+	mbuf_put32(b, 0);			/* default size */
+	mbuf_put32(b, 0);			/* default flags */
+	box_end(b, trex);
+	box_end(b, mvex);
+
+	box_end(b, moov);
+
+	if (b->error)
+		return -ENOMEM;
+
+	return writer_copy(m->w, b->data, b->len);
+}
+
+static int mp4_flush_fragment(struct mux *m)
+{
+	struct mp4 *mp4 = m->priv;
+	struct mux_buf *b = &mp4->hdr;
+	size_t moof, traf, box, trun, data_offset;
+	unsigned int i;
+	uint8_t *data;
+	int ret;
+
+	if (!mp4->num_samples)
+		return 0;
+
+	mbuf_reset(b);
+
+	moof = box_start(b, "moof");
+
+	box = fullbox_start(b, "mfhd", 0, 0);
+	mbuf_put32(b, ++mp4->sequence);
+	box_end(b, box);
+
+	traf = box_start(b, "traf");
+
+	box = fullbox_start(b, "tfhd", 0, 0x020000);	/* default-base-is-moof */
+	mbuf_put32(b, MP4_TRACK_ID);
+	box_end(b, box);
+
+	box = fullbox_start(b, "tfdt", 1, 0);
+	mbuf_put64(b, mp4->base_time);
+	box_end(b, box);
+
+	/* data offset, sample duration, size and flags present */
+	trun = fullbox_start(b, "trun", 0, 0x000701);
+	mbuf_put32(b, mp4->num_samples);
+	data_offset = b->len;
+	mbuf_put32(b, 0);
+	for (i = 0; i < mp4->num_samples; i++) {
+		mbuf_put32(b, mp4->samples[i].duration);
+		mbuf_put32(b, mp4->samples[i].size);
+		mbuf_put32(b, mp4->samples[i].flags);
+	}
+	box_end(b, trun);
+
+	box_end(b, traf);
+	box_end(b, moof);
+
+	/* Samples start straight after the mdat header */
+	mbuf_patch32(b, data_offset, b->len - moof + 8);
+
+	mbuf_put32(b, 8 + mp4->mdat.len);
+	mbuf_put(b, "mdat", 4);
+
+	if (b->error)
+		return -ENOMEM;
+
+	ret = writer_copy(m->w, b->data, b->len);
+	if (ret < 0)
+		return ret;
+
+	/* Hand the sample data over to the writer and start a new buffer */
+	data = mp4->mdat.data;
+	ret = writer_add(m->w, data, mp4->mdat.len, free, data);
+	memset(&mp4->mdat, 0, sizeof mp4->mdat);
+
+	mp4->num_samples = 0;
+	return ret;
+}
+
+static int mp4_frame(struct mux *m, struct mux_frame *f)
+{
+	struct mp4 *mp4 = m->priv;
+	struct mp4_sample *s;
+	uint64_t time;
+	uint8_t *data;
+	size_t len = f->len;
+	int ret = 0;
+
+	if (m->first_pts == MUX_TIME_UNKNOWN)
+		m->first_pts = f->pts;
+	time = mp4_time(m, f->pts);
+
+	/* Now the previous sample's duration is known */
+	if (mp4->num_samples) {
+		s = &mp4->samples[mp4->num_samples - 1];
+		s->duration = time > mp4->last_time ? time - mp4->last_time : 0;
+	}
+
+	if (mp4->num_samples &&
+	    (f->keyframe || mp4->num_samples == MP4_MAX_SAMPLES ||
+	     mp4->mdat.len + len > MP4_MAX_FRAGMENT_SIZE)) {
+		ret = mp4_flush_fragment(m);
+		if (ret < 0) {
+			mux_frame_done(f);
+			return ret;
+		}
+	}
+
+	if (!mp4->num_samples)
+		mp4->base_time = time;
+
+	data = h264_to_avcc(m, f->data, &len);
+	if (!data) {
+		mux_frame_done(f);
+		return -ENOMEM;
+	}
+
+	mbuf_put(&mp4->mdat, data, len);
+	mux_frame_done(f);
+	if (mp4->mdat.error)
+		return -ENOMEM;
+
+	s = &mp4->samples[mp4->num_samples++];
+	s->size = len;
+	s->duration = 0;
+	s->flags = f->keyframe ? MP4_SAMPLE_SYNC : MP4_SAMPLE_NON_SYNC;
+	mp4->last_time = time;
+
+	return 0;
+}
+
+/*
+ * Write out the current fragment before the next keyframe. The last
+ * sample's duration isn't known yet, so the nominal one is used; tfdt
+ * keeps the following fragment on the right timeline regardless.
+ */
+static int mp4_flush(struct mux *m)
+{
+	struct mp4 *mp4 = m->priv;
+
+	if (mp4->num_samples)
+		mp4->samples[mp4->num_samples - 1].duration =
+			mux_frame_duration(m) * MP4_TIMESCALE / 1000000;
+
+	return mp4_flush_fragment(m);
+}
+
+static int mp4_close(struct mux *m)
+{
+	struct mp4 *mp4 = m->priv;
+	int ret;
+
+	if (!mp4)
+		return 0;
+
+	ret = mp4_flush(m);
+
+	mbuf_free(&mp4->hdr);
+	mbuf_free(&mp4->mdat);
+	free(mp4);
+	m->priv = NULL;
+
+	return ret;
+}
+
+const struct mux_ops mux_mp4_ops = {
+	.name = "mp4",
+	.open = mp4_open,
+	.frame = mp4_frame,
+	.flush = mp4_flush,
+	.close = mp4_close,
+};
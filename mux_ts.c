@@ -0,0 +1,284 @@
+/*
+ * v4l2_mmal - MPEG transport stream muxer.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Single programme, single H.264 stream. Each access unit becomes one PES
+ * packet whose first TS packet carries the PCR. The PCR is the buffer pts
+ * (i.e. the V4L2 timestamp relative to the start of capture) on a 27MHz
+ * clock, and the PTS runs TS_PTS_DELAY ahead of it to give decoders some
+ * buffering headroom.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mux.h"
+
+#define TS_PACKET_SIZE		188
+#define TS_PAYLOAD_SIZE		(TS_PACKET_SIZE - 4)
+
+#define TS_PID_PAT		0x0000
+#define TS_PID_PMT		0x1000
+#define TS_PID_VIDEO		0x0100
+#define TS_PROGRAM_NUMBER	1
+#define TS_STREAM_TYPE_H264	0x1b
+#define TS_STREAM_ID_VIDEO	0xe0
+
+#define TS_PTS_DELAY		200000	/* us */
+/* PAT/PMT are sent before every keyframe and at least this often */
+#define TS_PSI_INTERVAL		100000	/* us */
+
+struct ts {
+	struct mux_buf out;
+	struct mux_buf psi;
+	struct mux_buf pes;
+
+	uint8_t cc_pat;
+	uint8_t cc_pmt;
+	uint8_t cc_video;
+
+	int64_t last_psi;
+};
+
+static uint32_t crc32_mpeg(const uint8_t *data, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	unsigned int i;
+
+	while (len--) {
+		crc ^= (uint32_t)*data++ << 24;
+		for (i = 0; i < 8; i++)
+			crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+
+	return crc;
+}
+
+/*
+ * Split a payload into TS packets. The first packet gets the payload unit
+ * start indicator and, if pcr >= 0, an adaptation field with the PCR. The
+ * last packet is padded with adaptation field stuffing.
+ */
+static void ts_packetize(struct mux_buf *out, uint16_t pid, uint8_t *cc,
+			 const uint8_t *data, size_t len, int64_t pcr,
+			 bool random_access)
+{
+	bool first = true;
+
+	while (len || first) {
+		uint8_t af[TS_PAYLOAD_SIZE];
+		size_t af_len = 0, room, chunk;
+		uint8_t *p;
+
+		if (first && pcr >= 0) {
+			uint64_t base = pcr / 300;
+			unsigned int ext = pcr % 300;
+
+			af[1] = 0x10 | (random_access ? 0x40 : 0);
+			af[2] = base >> 25;
+			af[3] = base >> 17;
+			af[4] = base >> 9;
+			af[5] = base >> 1;
+			af[6] = (base & 1) << 7 | 0x7e | ext >> 8;
+			af[7] = ext;
+			af_len = 8;
+		}
+
+		room = TS_PAYLOAD_SIZE - af_len;
+		chunk = len < room ? len : room;
+
+		/* Stuff the rest of a short packet inside the adaptation field */
+		if (chunk < room) {
+			size_t stuffing = room - chunk;
+
+			if (!af_len) {
+				af[1] = 0x00;
+				af_len = stuffing == 1 ? 1 : 2;
+				stuffing -= af_len;
+			}
+			memset(af + af_len, 0xff, stuffing);
+			af_len += stuffing;
+		}
+
+		p = mbuf_reserve(out, TS_PACKET_SIZE);
+		if (!p)
+			return;
+
+		p[0] = 0x47;
+		p[1] = (first ? 0x40 : 0) | pid >> 8;
+		p[2] = pid;
+		p[3] = (af_len ? 0x30 : 0x10) | (*cc & 0x0f);
+		*cc = (*cc + 1) & 0x0f;
+
+		if (af_len) {
+			af[0] = af_len - 1;
+			memcpy(p + 4, af, af_len);
+		}
+		memcpy(p + 4 + af_len, data, chunk);
+
+		data += chunk;
+		len -= chunk;
+		first = false;
+	}
+}
+
+/* Wrap a PSI section with its pointer field and CRC */
+static void ts_write_section(struct ts *ts, uint16_t pid, uint8_t *cc)
+{
+	struct mux_buf *s = &ts->psi;
+	uint32_t crc;
+
+	/*
+	 * Section length counts from after the length field and includes
+	 * the CRC, which happens to equal the length so far.
+	 */
+	s->data[2] = 0xb0 | s->len >> 8;
+	s->data[3] = s->len;
+	crc = crc32_mpeg(s->data + 1, s->len - 1);
+	mbuf_put32(s, crc);
+
+	ts_packetize(&ts->out, pid, cc, s->data, s->len, -1, false);
+}
+
+static void ts_write_psi(struct ts *ts)
+{
+	struct mux_buf *s = &ts->psi;
+
+	mbuf_reset(s);
+	mbuf_put8(s, 0);			/* pointer field */
+	mbuf_put8(s, 0x00);			/* table id: PAT */
+	mbuf_put16(s, 0);			/* section length, filled in */
+	mbuf_put16(s, 1);			/* transport stream id */
+	mbuf_put8(s, 0xc1);			/* version 0, current */
+	mbuf_put8(s, 0);			/* section number */
+	mbuf_put8(s, 0);			/* last section number */
+	mbuf_put16(s, TS_PROGRAM_NUMBER);
+	mbuf_put16(s, 0xe000 | TS_PID_PMT);
+	if (s->error)
+		return;
+	ts_write_section(ts, TS_PID_PAT, &ts->cc_pat);
+
+	mbuf_reset(s);
+	mbuf_put8(s, 0);
+	mbuf_put8(s, 0x02);			/* table id: PMT */
+	mbuf_put16(s, 0);
+	mbuf_put16(s, TS_PROGRAM_NUMBER);
+	mbuf_put8(s, 0xc1);
+	mbuf_put8(s, 0);
+	mbuf_put8(s, 0);
+	mbuf_put16(s, 0xe000 | TS_PID_VIDEO);	/* PCR PID */
+	mbuf_put16(s, 0xf000);			/* no programme info */
+	mbuf_put8(s, TS_STREAM_TYPE_H264);
+	mbuf_put16(s, 0xe000 | TS_PID_VIDEO);
+	mbuf_put16(s, 0xf000);			/* no ES info */
+	if (s->error)
+		return;
+	ts_write_section(ts, TS_PID_PMT, &ts->cc_pmt);
+}
+
+static void ts_put_timestamp(struct mux_buf *b, uint8_t prefix, uint64_t ts)
+{
+	mbuf_put8(b, prefix << 4 | (ts >> 29 & 0x0e) | 1);
+	mbuf_put16(b, (ts >> 14 & 0xfffe) | 1);
+	mbuf_put16(b, (ts << 1 & 0xfffe) | 1);
+}
+
+static int ts_open(struct mux *m)
+{
+	struct ts *ts;
+
+	ts = calloc(1, sizeof *ts);
+	if (!ts)
+		return -ENOMEM;
+	m->priv = ts;
+	ts->last_psi = MUX_TIME_UNKNOWN;
+
+	return 0;
+}
+
+static int ts_frame(struct mux *m, struct mux_frame *f)
+{
+	static const uint8_t aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+	struct ts *ts = m->priv;
+	struct mux_buf *pes = &ts->pes;
+	int64_t pts = f->pts > 0 ? f->pts : 0;
+	const uint8_t *nal;
+	size_t pos = 0, nal_len, sc_len;
+	uint64_t pts90;
+
+	mbuf_reset(&ts->out);
+
+	if (f->keyframe || ts->last_psi == MUX_TIME_UNKNOWN ||
+	    pts - ts->last_psi >= TS_PSI_INTERVAL) {
+		ts_write_psi(ts);
+		ts->last_psi = pts;
+	}
+
+	/*
+	 * The encoder doesn't produce B frames, so decode and presentation
+	 * order are the same and DTS would always equal PTS.
+	 */
+	pts90 = ((uint64_t)(pts + TS_PTS_DELAY) * 9 / 100) & ((1ULL << 33) - 1);
+
+	mbuf_reset(pes);
+	mbuf_put8(pes, 0x00);
+	mbuf_put8(pes, 0x00);
+	mbuf_put8(pes, 0x01);
+	mbuf_put8(pes, TS_STREAM_ID_VIDEO);
+	mbuf_put16(pes, 0);			/* unbounded, allowed for video */
+	mbuf_put8(pes, 0x80);
+	mbuf_put8(pes, 0x80);			/* PTS only */
+	mbuf_put8(pes, 5);
+	ts_put_timestamp(pes, 0x2, pts90);
+
+	/* Decoders expect each access unit to start with a delimiter */
+	nal = h264_next_nal(f->data, f->len, &pos, &nal_len, &sc_len);
+	if (!nal || !nal_len || (nal[0] & 0x1f) != 9)
+		mbuf_put(pes, aud, sizeof aud);
+	mbuf_put(pes, f->data, f->len);
+	mux_frame_done(f);
+
+	if (pes->error)
+		return -ENOMEM;
+
+	ts_packetize(&ts->out, TS_PID_VIDEO, &ts->cc_video, pes->data, pes->len,
+		     (pts * 27) % (300LL << 33), f->keyframe);
+	if (ts->out.error)
+		return -ENOMEM;
+
+	return writer_copy(m->w, ts->out.data, ts->out.len);
+}
+
+static int ts_close(struct mux *m)
+{
+	struct ts *ts = m->priv;
+
+	if (!ts)
+		return 0;
+
+	mbuf_free(&ts->out);
+	mbuf_free(&ts->psi);
+	mbuf_free(&ts->pes);
+	free(ts);
+	m->priv = NULL;
+
+	return 0;
+}
+
+const struct mux_ops mux_ts_ops = {
+	.name = "ts",
+	.open = ts_open,
+	.frame = ts_frame,
+	.close = ts_close,
+};
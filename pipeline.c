@@ -0,0 +1,354 @@
+/*
+ * v4l2_mmal - description of the sink branches fed from the isp.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Every branch takes the isp output and feeds one sink component, with
+ * its own output encoding, size, frame rate, bitrate and file. Branches
+ * come from --branch options or a file of the same descriptions, and
+ * anything not set falls back to what the component has always done.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+#define PIPELINE_COMPONENT_PREFIX	"vc.ril."
+
+static const struct {
+	const char *name;
+	const char *cause;
+} sink_policies[] = {
+	[SINK_DROP_NEWEST] = { "newest", "input_busy" },
+	[SINK_DROP_OLDEST] = { "oldest", "replaced" },
+	[SINK_BLOCK] = { "block", "block_timeout" },
+};
+
+/* Components a branch can end in, with their defaults */
+static const struct {
+	const char *name;
+	MMAL_FOURCC_T encoding;
+	enum sink_policy policy;
+} pipeline_components[] = {
+	/*
+	 * The video must not lose frames, the JPEG of every frame and the
+	 * preview can, rather than hold isp buffers the video needs.
+	 */
+	{ "vc.ril.video_encode", MMAL_ENCODING_H264, SINK_BLOCK },
+	{ "vc.ril.image_encode", MMAL_ENCODING_JPEG, SINK_DROP_NEWEST },
+	{ "vc.ril.video_render", MMAL_ENCODING_UNUSED, SINK_DROP_OLDEST },
+};
+
+static const struct {
+	const char *name;
+	MMAL_FOURCC_T encoding;
+} pipeline_encodings[] = {
+	{ "h264", MMAL_ENCODING_H264 },
+	{ "jpeg", MMAL_ENCODING_JPEG },
+};
+
+#define ARRAY_SIZE(a)	(sizeof(a)/sizeof((a)[0]))
+
+const char *sink_policy_cause(enum sink_policy policy)
+{
+	return sink_policies[policy].cause;
+}
+
+/* Strip leading and trailing white space in place */
+static char *pipeline_trim(char *str)
+{
+	char *end;
+
+	while (isspace((unsigned char)*str))
+		str++;
+	for (end = str + strlen(str); end > str && isspace((unsigned char)end[-1]); end--)
+		;
+	*end = '\0';
+
+	return str;
+}
+
+/* Index into pipeline_components, name with or without the vc.ril. prefix */
+static int pipeline_component(const char *name, size_t len)
+{
+	const size_t prefix = strlen(PIPELINE_COMPONENT_PREFIX);
+	unsigned int i;
+
+	if (len > prefix && !strncmp(name, PIPELINE_COMPONENT_PREFIX, prefix)) {
+		name += prefix;
+		len -= prefix;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pipeline_components); i++) {
+		const char *known = pipeline_components[i].name + prefix;
+
+		if (strlen(known) == len && !strncmp(known, name, len))
+			return i;
+	}
+
+	return -1;
+}
+
+static void pipeline_branch_defaults(struct branch *b, unsigned int index,
+				     unsigned int component)
+{
+	memset(b, 0, sizeof *b);
+	b->component = pipeline_components[component].name;
+	snprintf(b->label, sizeof b->label, "%s#%u",
+		 b->component + strlen(PIPELINE_COMPONENT_PREFIX), index);
+	b->encoding = pipeline_components[component].encoding;
+	b->decimate = 1;
+	b->policy = pipeline_components[component].policy;
+	b->block_ms = SINK_BLOCK_MS_DEFAULT;
+}
+
+void pipeline_init(struct pipeline *p)
+{
+	unsigned int i;
+
+	memset(p, 0, sizeof *p);
+	for (i = 0; i < ARRAY_SIZE(pipeline_components); i++)
+		pipeline_branch_defaults(&p->branches[p->num_branches++], i, i);
+}
+
+/* policy[:ms] */
+static int pipeline_parse_policy(struct branch *b, const char *value)
+{
+	unsigned int i;
+	size_t len;
+	char *end;
+
+	for (i = 0; i < ARRAY_SIZE(sink_policies); i++) {
+		len = strlen(sink_policies[i].name);
+		if (strncmp(value, sink_policies[i].name, len))
+			continue;
+
+		if (i == SINK_BLOCK && value[len] == ':') {
+			b->block_ms = strtoul(value + len + 1, &end, 10);
+			if (*end || end == value + len + 1 || value[len + 1] == '-' ||
+			    !b->block_ms)
+				return -1;
+		} else if (value[len])
+			continue;
+		else if (i == SINK_BLOCK)
+			b->block_ms = SINK_BLOCK_MS_DEFAULT;
+
+		b->policy = i;
+		return 0;
+	}
+
+	return -1;
+}
+
+static int pipeline_parse_option(struct branch *b, const char *key, const char *value)
+{
+	char *end;
+	unsigned int i;
+
+	if (!strcmp(key, "encoding")) {
+		if (b->encoding == MMAL_ENCODING_UNUSED)
+			return -1;
+		for (i = 0; i < ARRAY_SIZE(pipeline_encodings); i++) {
+			if (!strcmp(value, pipeline_encodings[i].name)) {
+				b->encoding = pipeline_encodings[i].encoding;
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	if (!strcmp(key, "size")) {
+		b->width = strtoul(value, &end, 10);
+		if (*end != 'x' || end == value)
+			return -1;
+		b->height = strtoul(end + 1, &end, 10);
+		/* The isp works on whole chroma samples */
+		if (*end || !b->width || !b->height || (b->width | b->height) & 1)
+			return -1;
+		return 0;
+	}
+
+	if (!strcmp(key, "decimate")) {
+		b->decimate = strtoul(value, &end, 10);
+		return *end || !b->decimate ? -1 : 0;
+	}
+
+	if (!strcmp(key, "bitrate")) {
+		b->bitrate = strtoul(value, &end, 10);
+		return *end || b->encoding == MMAL_ENCODING_UNUSED ? -1 : 0;
+	}
+
+	if (!strcmp(key, "output")) {
+		if (b->encoding == MMAL_ENCODING_UNUSED ||
+		    strlen(value) >= sizeof b->output)
+			return -1;
+		strcpy(b->output, value);
+		return 0;
+	}
+
+	if (!strcmp(key, "policy"))
+		return pipeline_parse_policy(b, value);
+
+	return -1;
+}
+
+int pipeline_add_branch(struct pipeline *p, const char *desc)
+{
+	struct branch b;
+	char *opts, *opt, *value, *save;
+	int component, ret = 0;
+	size_t len;
+
+	len = strcspn(desc, ",");
+	while (len && isspace((unsigned char)desc[len - 1]))
+		len--;
+	component = pipeline_component(desc, len);
+	if (component < 0) {
+		fprintf(stderr, "Invalid branch '%s': unknown component\n", desc);
+		return -1;
+	}
+
+	if (!p->configured) {
+		p->num_branches = 0;
+		p->configured = true;
+	}
+	if (p->num_branches == PIPELINE_MAX_BRANCHES) {
+		fprintf(stderr, "Invalid branch '%s': at most %u branches\n", desc,
+			PIPELINE_MAX_BRANCHES);
+		return -1;
+	}
+
+	pipeline_branch_defaults(&b, p->num_branches, component);
+
+	opts = strdup(desc + strcspn(desc, ","));
+	if (!opts)
+		return -1;
+
+	for (opt = strtok_r(opts, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		value = strchr(opt, '=');
+		if (value) {
+			*value++ = '\0';
+			value = pipeline_trim(value);
+		}
+		opt = pipeline_trim(opt);
+		if (!value || pipeline_parse_option(&b, opt, value) < 0) {
+			fprintf(stderr, "Invalid branch '%s': bad option '%s'\n", desc, opt);
+			ret = -1;
+			break;
+		}
+	}
+
+	free(opts);
+	if (ret < 0)
+		return ret;
+
+	p->branches[p->num_branches++] = b;
+	return 0;
+}
+
+int pipeline_load(struct pipeline *p, const char *path)
+{
+	char line[512];
+	unsigned int lineno = 0;
+	char *start;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Can't open pipeline %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/* Only the branches in the file, even if it lists none */
+	if (!p->configured) {
+		p->num_branches = 0;
+		p->configured = true;
+	}
+
+	while (fgets(line, sizeof line, f)) {
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+
+		start = pipeline_trim(line);
+		if (!*start)
+			continue;
+
+		if (pipeline_add_branch(p, start) < 0) {
+			fprintf(stderr, "%s:%u: invalid branch\n", path, lineno);
+			ret = -1;
+			break;
+		}
+	}
+
+	fclose(f);
+	return ret;
+}
+
+int pipeline_set_policy(struct pipeline *p, const char *arg)
+{
+	const char *value = strchr(arg, '=');
+	const char *component = NULL;
+	unsigned int i, found = 0;
+	size_t len;
+	int c;
+
+	if (!value)
+		return -1;
+	len = value - arg;
+
+	c = pipeline_component(arg, len);
+	if (c >= 0)
+		component = pipeline_components[c].name;
+
+	for (i = 0; i < p->num_branches; i++) {
+		if (p->branches[i].component != component &&
+		    (strlen(p->branches[i].label) != len ||
+		     strncmp(p->branches[i].label, arg, len)))
+			continue;
+		if (pipeline_parse_policy(&p->branches[i], value + 1) < 0)
+			return -1;
+		found++;
+	}
+
+	return found ? 0 : -1;
+}
+
+void pipeline_print(const struct pipeline *p)
+{
+	const struct branch *b;
+	unsigned int i;
+
+	for (i = 0; i < p->num_branches; i++) {
+		b = &p->branches[i];
+
+		printf("Branch %u: %s", i, b->component);
+		if (b->encoding != MMAL_ENCODING_UNUSED)
+			printf(" %4.4s", (const char *)&b->encoding);
+		if (b->width)
+			printf(" %ux%u", b->width, b->height);
+		if (b->decimate > 1)
+			printf(" 1/%u frames", b->decimate);
+		if (b->bitrate)
+			printf(" %u b/s", b->bitrate);
+		printf(" policy %s", sink_policies[b->policy].name);
+		if (b->policy == SINK_BLOCK)
+			printf(":%u", b->block_ms);
+		if (b->output[0])
+			printf(" to %s", b->output);
+		printf("\n");
+	}
+}
@@ -0,0 +1,95 @@
+/*
+ * v4l2_mmal - description of the sink branches fed from the isp.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "formats.h"
+
+#define PIPELINE_MAX_BRANCHES	4
+#define PIPELINE_OUTPUT_LEN	96
+#define PIPELINE_LABEL_LEN	24
+
+/*
+ * What a sink does with an isp frame when all its input buffers are busy.
+ * Frames are never waited for in the MMAL callbacks, a frame that has to
+ * wait is held with its isp buffer until the sink returns an input buffer.
+ */
+enum sink_policy {
+	SINK_DROP_NEWEST,	/* skip the new frame */
+	SINK_DROP_OLDEST,	/* hold the new frame, replacing any held one */
+	SINK_BLOCK,		/* hold every frame, up to block_ms each */
+};
+
+/* Cause label of frames a blocking sink held more of than it may */
+#define SINK_OVERFLOW_CAUSE	"queue_full"
+
+#define SINK_BLOCK_MS_DEFAULT	1000
+
+/* One sink component and what it makes of the isp frames */
+struct branch {
+	/* Full MMAL name, eg. vc.ril.video_encode */
+	const char *component;
+	/*
+	 * Unique within the pipeline, eg. video_encode#0 for branch 0, for
+	 * statistics and for picking the branch out when several use the
+	 * same component.
+	 */
+	char label[PIPELINE_LABEL_LEN];
+	/* Output port encoding, MMAL_ENCODING_UNUSED for a sink without one */
+	MMAL_FOURCC_T encoding;
+	/* Scaled to this size first, 0 for the isp output size */
+	unsigned int width;
+	unsigned int height;
+	/* Only every decimate'th frame is given to the sink */
+	unsigned int decimate;
+	/* bits/s, 0 for the component's default */
+	uint32_t bitrate;
+	/* File written, "-" for stdout, empty for <index>_<encode file name> */
+	char output[PIPELINE_OUTPUT_LEN];
+	enum sink_policy policy;
+	unsigned int block_ms;
+};
+
+struct pipeline {
+	struct branch branches[PIPELINE_MAX_BRANCHES];
+	unsigned int num_branches;
+	/* Branches given by the user, the defaults are replaced by the first */
+	bool configured;
+};
+
+/* The H.264, JPEG and render branches v4l2_mmal has always had */
+void pipeline_init(struct pipeline *p);
+/*
+ * component[,key=value...] with keys encoding, size, decimate, bitrate,
+ * output and policy. Returns 0, or -1 after printing what was wrong.
+ */
+int pipeline_add_branch(struct pipeline *p, const char *desc);
+/* One branch description per line, '#' starts a comment */
+int pipeline_load(struct pipeline *p, const char *path);
+/*
+ * sink=policy[:ms], sink being a branch label for that branch alone or a
+ * component for every branch using it.
+ */
+int pipeline_set_policy(struct pipeline *p, const char *arg);
+void pipeline_print(const struct pipeline *p);
+
+/* Cause label of a sink's drops under the policy */
+const char *sink_policy_cause(enum sink_policy policy);
+
+#endif
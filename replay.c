@@ -0,0 +1,879 @@
+/*
+ * v4l2_mmal - V4L2 capture emulation from a file or test pattern.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Implements the subset of the V4L2 capture ioctls used by v4l2_mmal,
+ * delivering frames from a raw file as written by --file (frames of
+ * sizeimage bytes back to back, replayed in a loop) or from a generated
+ * pattern. Buffers live in a memfd so they are mapped exactly like driver
+ * buffers, and the poll fd behaves like a device fd. The multi-planar API
+ * can be emulated instead, with every plane of a buffer mapped on its own.
+ * With V4L2_MEMORY_DMABUF the client's buffers are mapped when queued and
+ * filled in place, any mappable fd will do.
+ *
+ * Frames are produced on a timer at the programmed rate, and like a real
+ * sensor a frame is dropped when no buffer is queued for it. Unthrottled,
+ * every queued buffer is filled straight away. Timestamps always advance
+ * by the nominal frame interval from STREAMON, so output timing does not
+ * depend on how fast the pipeline runs.
+ *
+ * A source changing mode can be emulated, as an HDMI receiver sees it: the
+ * frames stop, V4L2_EVENT_SOURCE_CHANGE is raised, and the new size is the
+ * format once the client has freed its buffers.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "replay.h"
+
+#define REPLAY_DEFAULT_WIDTH	640
+#define REPLAY_DEFAULT_HEIGHT	480
+
+/* Line and image size of the supported formats */
+static const struct replay_format {
+	unsigned int fourcc;
+	/* Planes with the multi-planar API, 4:2:0 chroma after the first */
+	unsigned int planes;
+	/* Bytes per pixel in a line, as a fraction */
+	unsigned int line_num;
+	unsigned int line_den;
+	/* sizeimage = bytesperline * height * size_num / size_den */
+	unsigned int size_num;
+	unsigned int size_den;
+} replay_formats[] = {
+	{ V4L2_PIX_FMT_YUYV, 1, 2, 1, 1, 1 },
+	{ V4L2_PIX_FMT_YVYU, 1, 2, 1, 1, 1 },
+	{ V4L2_PIX_FMT_UYVY, 1, 2, 1, 1, 1 },
+	{ V4L2_PIX_FMT_VYUY, 1, 2, 1, 1, 1 },
+	{ V4L2_PIX_FMT_RGB565X, 1, 2, 1, 1, 1 },
+	{ V4L2_PIX_FMT_BGR24, 1, 3, 1, 1, 1 },
+	{ V4L2_PIX_FMT_RGB24, 1, 3, 1, 1, 1 },
+	{ V4L2_PIX_FMT_BGR32, 1, 4, 1, 1, 1 },
+	{ V4L2_PIX_FMT_ABGR32, 1, 4, 1, 1, 1 },
+	{ V4L2_PIX_FMT_XBGR32, 1, 4, 1, 1, 1 },
+	{ V4L2_PIX_FMT_RGB32, 1, 4, 1, 1, 1 },
+	{ V4L2_PIX_FMT_ARGB32, 1, 4, 1, 1, 1 },
+	{ V4L2_PIX_FMT_NV12, 1, 1, 1, 3, 2 },
+	{ V4L2_PIX_FMT_NV21, 1, 1, 1, 3, 2 },
+	{ V4L2_PIX_FMT_NV12M, 2, 1, 1, 3, 2 },
+	{ V4L2_PIX_FMT_NV21M, 2, 1, 1, 3, 2 },
+	{ V4L2_PIX_FMT_YUV420M, 3, 1, 1, 3, 2 },
+	{ V4L2_PIX_FMT_SBGGR8, 1, 1, 1, 1, 1 },
+	{ V4L2_PIX_FMT_SGBRG8, 1, 1, 1, 1, 1 },
+	{ V4L2_PIX_FMT_SGRBG8, 1, 1, 1, 1, 1 },
+	{ V4L2_PIX_FMT_SRGGB8, 1, 1, 1, 1, 1 },
+	{ V4L2_PIX_FMT_SBGGR10P, 1, 5, 4, 1, 1 },
+	{ V4L2_PIX_FMT_SGBRG10P, 1, 5, 4, 1, 1 },
+	{ V4L2_PIX_FMT_SGRBG10P, 1, 5, 4, 1, 1 },
+	{ V4L2_PIX_FMT_SRGGB10P, 1, 5, 4, 1, 1 },
+};
+
+static const struct replay_format *replay_format(unsigned int fourcc)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(replay_formats) / sizeof(replay_formats[0]); i++) {
+		if (replay_formats[i].fourcc == fourcc)
+			return &replay_formats[i];
+	}
+
+	return NULL;
+}
+
+/* Adjust a requested format to one we can deliver, as a driver would */
+static void replay_try_format(struct replay *r, struct v4l2_pix_format *pix)
+{
+	const struct replay_format *f;
+	unsigned int min_stride;
+
+	/* Separate planes only exist with the multi-planar API */
+	f = replay_format(pix->pixelformat);
+	if (!f || (f->planes > 1 && !r->mplane)) {
+		f = &replay_formats[0];
+		pix->pixelformat = f->fourcc;
+	}
+
+	if (!pix->width)
+		pix->width = REPLAY_DEFAULT_WIDTH;
+	if (!pix->height)
+		pix->height = REPLAY_DEFAULT_HEIGHT;
+	pix->width = (pix->width + 1) & ~1;
+	pix->height = (pix->height + 1) & ~1;
+
+	min_stride = (pix->width * f->line_num + f->line_den - 1) / f->line_den;
+	if (pix->bytesperline < min_stride)
+		pix->bytesperline = min_stride;
+	pix->sizeimage = pix->bytesperline * pix->height * f->size_num / f->size_den;
+	pix->field = V4L2_FIELD_NONE;
+	pix->colorspace = V4L2_COLORSPACE_SMPTE170M;
+}
+
+/* Split the frame into planes, each page aligned in the buffer */
+static void replay_set_format(struct replay *r, const struct v4l2_pix_format *pix)
+{
+	const struct replay_format *f = replay_format(pix->pixelformat);
+	long page = sysconf(_SC_PAGESIZE);
+	size_t offset = 0;
+	unsigned int i;
+
+	r->fmt = *pix;
+	r->num_planes = r->mplane ? f->planes : 1;
+
+	for (i = 0; i < r->num_planes; i++) {
+		if (r->num_planes == 1) {
+			r->planes[i].stride = pix->bytesperline;
+			r->planes[i].size = pix->sizeimage;
+		} else if (!i) {
+			r->planes[i].stride = pix->bytesperline;
+			r->planes[i].size = pix->bytesperline * pix->height;
+		} else {
+			/* Interleaved chroma has a full stride, separate U and V half */
+			r->planes[i].stride = pix->bytesperline / (r->num_planes - 1);
+			r->planes[i].size = r->planes[i].stride * pix->height / 2;
+		}
+
+		r->planes[i].offset = offset;
+		offset += (r->planes[i].size + page - 1) & ~(page - 1);
+	}
+
+	r->buffer_size = offset;
+}
+
+static void replay_get_format(struct replay *r, struct v4l2_format *fmt)
+{
+	struct v4l2_pix_format_mplane *mp = &fmt->fmt.pix_mp;
+	unsigned int i;
+
+	if (!r->mplane) {
+		fmt->fmt.pix = r->fmt;
+		return;
+	}
+
+	memset(mp, 0, sizeof *mp);
+	mp->width = r->fmt.width;
+	mp->height = r->fmt.height;
+	mp->pixelformat = r->fmt.pixelformat;
+	mp->field = r->fmt.field;
+	mp->colorspace = r->fmt.colorspace;
+	mp->num_planes = r->num_planes;
+	for (i = 0; i < r->num_planes; i++) {
+		mp->plane_fmt[i].bytesperline = r->planes[i].stride;
+		mp->plane_fmt[i].sizeimage = r->planes[i].size;
+	}
+}
+
+static void replay_try_fmt(struct replay *r, struct v4l2_format *fmt)
+{
+	struct v4l2_pix_format pix;
+
+	if (!r->mplane) {
+		replay_try_format(r, &fmt->fmt.pix);
+		replay_set_format(r, &fmt->fmt.pix);
+		return;
+	}
+
+	/* Only the luma stride is taken, the rest follows from it */
+	memset(&pix, 0, sizeof pix);
+	pix.width = fmt->fmt.pix_mp.width;
+	pix.height = fmt->fmt.pix_mp.height;
+	pix.pixelformat = fmt->fmt.pix_mp.pixelformat;
+	pix.bytesperline = fmt->fmt.pix_mp.plane_fmt[0].bytesperline;
+	replay_try_format(r, &pix);
+	replay_set_format(r, &pix);
+	replay_get_format(r, fmt);
+}
+
+static enum v4l2_buf_type replay_type(struct replay *r)
+{
+	return r->mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+			 : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+}
+
+static int replay_error(int err)
+{
+	errno = err;
+	return -1;
+}
+
+/* A diagonal gradient, the sequence number is stamped over it per frame */
+static int replay_render_pattern(struct replay *r)
+{
+	uint8_t *frame;
+	unsigned int x, y;
+
+	if (r->source_mapped)
+		return 0;
+
+	frame = malloc(r->fmt.sizeimage);
+	if (!frame)
+		return -ENOMEM;
+
+	for (y = 0; y < r->fmt.sizeimage / r->fmt.bytesperline; y++) {
+		for (x = 0; x < r->fmt.bytesperline; x++)
+			frame[y * r->fmt.bytesperline + x] = (x + y) & 0xff;
+	}
+
+	free((void *)r->source);
+	r->source = frame;
+	r->source_size = r->fmt.sizeimage;
+	r->source_frames = 1;
+
+	return 0;
+}
+
+static int replay_map_file(struct replay *r, const char *path)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -errno;
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	r->source = data;
+	r->source_size = st.st_size;
+	r->source_mapped = true;
+
+	return 0;
+}
+
+int replay_open(struct replay *r, const char *source, unsigned int fps,
+		bool unthrottled, bool mplane)
+{
+	struct v4l2_pix_format pix;
+	struct epoll_event ev;
+	int ret;
+
+	memset(r, 0, sizeof *r);
+	r->fd = -1;
+	r->timer_fd = -1;
+	r->ready_fd = -1;
+	r->event_fd = -1;
+	r->mem_fd = -1;
+	r->fps = fps ? fps : REPLAY_DEFAULT_FPS;
+	r->unthrottled = unthrottled;
+	r->mplane = mplane;
+	pthread_mutex_init(&r->lock, NULL);
+
+	memset(&pix, 0, sizeof pix);
+	pix.pixelformat = mplane ? V4L2_PIX_FMT_NV12M : V4L2_PIX_FMT_YUYV;
+	replay_try_format(r, &pix);
+	replay_set_format(r, &pix);
+
+	if (strcmp(source, REPLAY_PATTERN)) {
+		ret = replay_map_file(r, source);
+		if (ret < 0)
+			goto error;
+	}
+
+	r->fd = epoll_create1(EPOLL_CLOEXEC);
+	r->ready_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	r->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (r->fd < 0 || r->ready_fd < 0 || r->timer_fd < 0 || r->event_fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	if (epoll_ctl(r->fd, EPOLL_CTL_ADD, r->ready_fd, &ev) < 0 ||
+	    epoll_ctl(r->fd, EPOLL_CTL_ADD, r->timer_fd, &ev) < 0 ||
+	    epoll_ctl(r->fd, EPOLL_CTL_ADD, r->event_fd, &ev) < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	return 0;
+
+error:
+	replay_close(r);
+	return ret;
+}
+
+static void replay_free_buffers(struct replay *r)
+{
+	unsigned int i;
+
+	if (r->mem)
+		munmap(r->mem, r->buffer_size * r->nbufs);
+	if (r->mem_fd >= 0)
+		close(r->mem_fd);
+	for (i = 0; r->imports && i < r->nbufs * r->num_planes; i++) {
+		if (r->imports[i].mem)
+			munmap(r->imports[i].mem, r->imports[i].size);
+		if (r->imports[i].fd >= 0)
+			close(r->imports[i].fd);
+	}
+	free(r->imports);
+	free(r->queued);
+	free(r->ready);
+
+	r->mem = NULL;
+	r->mem_fd = -1;
+	r->imports = NULL;
+	r->queued = NULL;
+	r->ready = NULL;
+	r->nbufs = 0;
+	r->queued_count = 0;
+	r->ready_count = 0;
+}
+
+static int replay_reqbufs(struct replay *r, struct v4l2_requestbuffers *rb)
+{
+	size_t size;
+	unsigned int i;
+	int err;
+
+	if (rb->type != replay_type(r) ||
+	    (rb->memory != V4L2_MEMORY_MMAP && rb->memory != V4L2_MEMORY_DMABUF))
+		return replay_error(EINVAL);
+	if (r->streaming)
+		return replay_error(EBUSY);
+
+	replay_free_buffers(r);
+
+	/* The new mode shows once the old buffers are gone */
+	if (r->format_pending) {
+		struct v4l2_pix_format pix = r->fmt;
+
+		pix.width = r->change_width;
+		pix.height = r->change_height;
+		pix.bytesperline = 0;
+		replay_try_format(r, &pix);
+		replay_set_format(r, &pix);
+		r->format_pending = false;
+	}
+
+	if (!rb->count)
+		return 0;
+
+	if (replay_render_pattern(r) < 0)
+		return replay_error(ENOMEM);
+
+	r->source_frames = r->source_size / r->fmt.sizeimage;
+	if (!r->source_frames)
+		return replay_error(EINVAL);
+
+	r->memory = rb->memory;
+	if (r->memory == V4L2_MEMORY_DMABUF) {
+		r->imports = calloc(rb->count * r->num_planes, sizeof *r->imports);
+		if (!r->imports) {
+			errno = ENOMEM;
+			goto error;
+		}
+		for (i = 0; i < rb->count * r->num_planes; i++)
+			r->imports[i].fd = -1;
+	} else {
+		size = r->buffer_size * rb->count;
+
+		r->mem_fd = memfd_create("replay", MFD_CLOEXEC);
+		if (r->mem_fd < 0 || ftruncate(r->mem_fd, size) < 0)
+			goto error;
+
+		r->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			      r->mem_fd, 0);
+		if (r->mem == MAP_FAILED) {
+			r->mem = NULL;
+			goto error;
+		}
+	}
+
+	r->queued = calloc(rb->count, sizeof *r->queued);
+	r->ready = calloc(rb->count, sizeof *r->ready);
+	if (!r->queued || !r->ready) {
+		errno = ENOMEM;
+		goto error;
+	}
+
+	r->nbufs = rb->count;
+	return 0;
+
+error:
+	err = errno;
+	replay_free_buffers(r);
+	return replay_error(err);
+}
+
+static int replay_fill_buf(struct replay *r, struct v4l2_buffer *buf,
+			   unsigned int index)
+{
+	struct v4l2_plane *planes = buf->m.planes;
+	unsigned int i;
+
+	if (r->mplane && (!planes || buf->length < r->num_planes))
+		return replay_error(EINVAL);
+
+	memset(buf, 0, sizeof *buf);
+	buf->index = index;
+	buf->type = replay_type(r);
+	buf->memory = r->memory;
+	buf->field = V4L2_FIELD_NONE;
+	buf->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+
+	if (!r->mplane) {
+		if (r->memory == V4L2_MEMORY_DMABUF) {
+			buf->length = r->planes[0].size;
+			buf->m.fd = r->imports[index].client_fd;
+		} else {
+			buf->length = r->buffer_size;
+			buf->m.offset = index * r->buffer_size;
+		}
+		return 0;
+	}
+
+	buf->length = r->num_planes;
+	buf->m.planes = planes;
+	for (i = 0; i < r->num_planes; i++) {
+		memset(&planes[i], 0, sizeof planes[i]);
+		planes[i].length = r->planes[i].size;
+		if (r->memory == V4L2_MEMORY_DMABUF)
+			planes[i].m.fd = r->imports[index * r->num_planes + i].client_fd;
+		else
+			planes[i].m.mem_offset = index * r->buffer_size + r->planes[i].offset;
+	}
+
+	return 0;
+}
+
+/*
+ * Map a queued dmabuf, unless it's the one already mapped for the plane.
+ * Our own reference to it is kept, as the driver's would be.
+ */
+static int replay_import(struct replay_import *imp, int fd, unsigned int length,
+			 size_t size)
+{
+	struct stat st, old;
+	off_t end;
+
+	if (fstat(fd, &st) < 0)
+		return replay_error(EINVAL);
+
+	if (imp->fd >= 0 && !fstat(imp->fd, &old) &&
+	    old.st_dev == st.st_dev && old.st_ino == st.st_ino) {
+		imp->client_fd = fd;
+		return 0;
+	}
+
+	/* A length of 0 means the whole dmabuf */
+	if (!length) {
+		end = lseek(fd, 0, SEEK_END);
+		length = end > 0 ? end : 0;
+	}
+	if (length < size)
+		return replay_error(EINVAL);
+
+	if (imp->mem)
+		munmap(imp->mem, imp->size);
+	if (imp->fd >= 0)
+		close(imp->fd);
+	imp->mem = NULL;
+
+	imp->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (imp->fd < 0)
+		return -1;
+
+	imp->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, imp->fd, 0);
+	if (imp->mem == MAP_FAILED) {
+		imp->mem = NULL;
+		close(imp->fd);
+		imp->fd = -1;
+		return -1;
+	}
+
+	imp->size = size;
+	imp->client_fd = fd;
+	return 0;
+}
+
+/* Where a plane of a buffer is filled */
+static uint8_t *replay_plane_mem(struct replay *r, unsigned int index,
+				 unsigned int plane)
+{
+	if (r->memory == V4L2_MEMORY_DMABUF)
+		return r->imports[index * r->num_planes + plane].mem;
+
+	return r->mem + index * r->buffer_size + r->planes[plane].offset;
+}
+
+/* Hand the oldest queued buffer a frame, with lock held */
+static void replay_produce(struct replay *r)
+{
+	struct replay_frame *frame;
+	uint64_t one = 1;
+
+	frame = &r->ready[(r->ready_first + r->ready_count) % r->nbufs];
+	frame->index = r->queued[r->queued_first];
+	frame->sequence = r->sequence++;
+	r->queued_first = (r->queued_first + 1) % r->nbufs;
+	r->queued_count--;
+	r->ready_count++;
+
+	if (write(r->ready_fd, &one, sizeof one) != sizeof one)
+		return;
+}
+
+/*
+ * Whether the source is changing mode, with lock held. Once change_frames
+ * have gone by the event is raised, and there are no frames until the
+ * client has taken the new format.
+ */
+static bool replay_changing(struct replay *r)
+{
+	uint64_t one = 1;
+
+	if (r->format_pending)
+		return true;
+	if (!r->change_frames || r->sequence < r->change_frames)
+		return false;
+
+	/* The client finds out from the event fd, then DQEVENT */
+	r->change_frames = 0;
+	r->format_pending = true;
+	r->event_pending = write(r->event_fd, &one, sizeof one) == sizeof one;
+
+	return true;
+}
+
+/* Account for timer ticks since the last call, with lock held */
+static void replay_tick(struct replay *r)
+{
+	uint64_t expirations;
+
+	if (read(r->timer_fd, &expirations, sizeof expirations) != sizeof expirations)
+		return;
+
+	while (expirations--) {
+		if (replay_changing(r)) {
+			/* No signal, no frames */
+			break;
+		} else if (r->queued_count) {
+			replay_produce(r);
+		} else {
+			/* Nowhere to put it, the gap shows in the sequence */
+			r->sequence++;
+		}
+	}
+}
+
+static int replay_qbuf(struct replay *r, struct v4l2_buffer *buf)
+{
+	struct replay_import *imp;
+	unsigned int i;
+
+	if (buf->type != replay_type(r) || buf->memory != r->memory ||
+	    buf->index >= r->nbufs)
+		return replay_error(EINVAL);
+
+	if (r->memory == V4L2_MEMORY_DMABUF) {
+		if (r->mplane && (!buf->m.planes || buf->length < r->num_planes))
+			return replay_error(EINVAL);
+
+		for (i = 0; i < r->num_planes; i++) {
+			imp = &r->imports[buf->index * r->num_planes + i];
+			if (r->mplane) {
+				if (replay_import(imp, buf->m.planes[i].m.fd,
+						  buf->m.planes[i].length,
+						  r->planes[i].size) < 0)
+					return -1;
+			} else if (replay_import(imp, buf->m.fd, buf->length,
+						 r->planes[0].size) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&r->lock);
+	r->queued[(r->queued_first + r->queued_count) % r->nbufs] = buf->index;
+	r->queued_count++;
+	if (r->streaming && r->unthrottled && !replay_changing(r))
+		replay_produce(r);
+	pthread_mutex_unlock(&r->lock);
+
+	return 0;
+}
+
+static int replay_dqbuf(struct replay *r, struct v4l2_buffer *buf)
+{
+	struct replay_frame frame;
+	uint64_t value, usec;
+	const uint8_t *src;
+	uint8_t *mem;
+	unsigned int i;
+
+	if (buf->type != replay_type(r) ||
+	    (r->mplane && (!buf->m.planes || buf->length < r->num_planes)))
+		return replay_error(EINVAL);
+
+	pthread_mutex_lock(&r->lock);
+
+	if (!r->streaming) {
+		pthread_mutex_unlock(&r->lock);
+		return replay_error(EINVAL);
+	}
+
+	if (!r->unthrottled)
+		replay_tick(r);
+
+	if (read(r->ready_fd, &value, sizeof value) != sizeof value) {
+		pthread_mutex_unlock(&r->lock);
+		return replay_error(EAGAIN);
+	}
+
+	frame = r->ready[r->ready_first];
+	r->ready_first = (r->ready_first + 1) % r->nbufs;
+	r->ready_count--;
+
+	pthread_mutex_unlock(&r->lock);
+
+	/* The buffer belongs to us until it is returned, so fill it unlocked */
+	src = r->source + (size_t)(frame.sequence % r->source_frames) * r->fmt.sizeimage;
+	for (i = 0; i < r->num_planes; i++) {
+		mem = replay_plane_mem(r, frame.index, i);
+		memcpy(mem, src, r->planes[i].size);
+		if (!i && !r->source_mapped)
+			memcpy(mem, &frame.sequence, sizeof frame.sequence);
+		src += r->planes[i].size;
+	}
+
+	replay_fill_buf(r, buf, frame.index);
+	if (r->mplane) {
+		for (i = 0; i < r->num_planes; i++)
+			buf->m.planes[i].bytesused = r->planes[i].size;
+	} else {
+		buf->bytesused = r->fmt.sizeimage;
+	}
+	buf->sequence = frame.sequence;
+	buf->flags |= V4L2_BUF_FLAG_DONE;
+
+	usec = (uint64_t)frame.sequence * 1000000 / r->fps + r->start.tv_nsec / 1000;
+	buf->timestamp.tv_sec = r->start.tv_sec + usec / 1000000;
+	buf->timestamp.tv_usec = usec % 1000000;
+
+	return 0;
+}
+
+static int replay_streamon(struct replay *r)
+{
+	struct itimerspec its;
+
+	if (!r->nbufs)
+		return replay_error(EINVAL);
+
+	pthread_mutex_lock(&r->lock);
+	if (r->streaming) {
+		pthread_mutex_unlock(&r->lock);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &r->start);
+	r->streaming = true;
+	r->sequence = 0;
+
+	if (r->unthrottled) {
+		while (r->queued_count && !replay_changing(r))
+			replay_produce(r);
+	} else {
+		/* First frame one interval after STREAMON, as from a sensor */
+		memset(&its, 0, sizeof its);
+		its.it_interval.tv_sec = 1 / r->fps;
+		its.it_interval.tv_nsec = r->fps > 1 ? 1000000000 / r->fps : 0;
+		its.it_value = its.it_interval;
+		timerfd_settime(r->timer_fd, 0, &its, NULL);
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return 0;
+}
+
+static int replay_streamoff(struct replay *r)
+{
+	struct itimerspec its;
+	uint64_t value;
+
+	pthread_mutex_lock(&r->lock);
+	memset(&its, 0, sizeof its);
+	timerfd_settime(r->timer_fd, 0, &its, NULL);
+	while (read(r->ready_fd, &value, sizeof value) == sizeof value)
+		;
+
+	/* Everything is back with the client, as after VIDIOC_STREAMOFF */
+	r->streaming = false;
+	r->queued_count = 0;
+	r->ready_count = 0;
+	pthread_mutex_unlock(&r->lock);
+
+	return 0;
+}
+
+static int replay_dqevent(struct replay *r, struct v4l2_event *ev)
+{
+	uint64_t value;
+
+	pthread_mutex_lock(&r->lock);
+	if (!r->event_pending) {
+		pthread_mutex_unlock(&r->lock);
+		return replay_error(ENOENT);
+	}
+
+	if (read(r->event_fd, &value, sizeof value) != sizeof value)
+		value = 0;
+	r->event_pending = false;
+	pthread_mutex_unlock(&r->lock);
+
+	memset(ev, 0, sizeof *ev);
+	ev->type = V4L2_EVENT_SOURCE_CHANGE;
+	ev->u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION;
+	clock_gettime(CLOCK_MONOTONIC, &ev->timestamp);
+
+	return 0;
+}
+
+int replay_source_change(struct replay *r, unsigned int frames,
+			 unsigned int width, unsigned int height)
+{
+	if (!frames || !width || !height)
+		return replay_error(EINVAL);
+
+	r->change_frames = frames;
+	r->change_width = width;
+	r->change_height = height;
+
+	return 0;
+}
+
+int replay_ioctl(struct replay *r, unsigned long request, void *arg)
+{
+	switch (request) {
+	case VIDIOC_QUERYCAP: {
+		struct v4l2_capability *cap = arg;
+
+		memset(cap, 0, sizeof *cap);
+		strcpy((char *)cap->driver, "replay");
+		strcpy((char *)cap->card, r->source_mapped ? "File replay" : "Test pattern");
+		strcpy((char *)cap->bus_info, "platform:replay");
+		cap->device_caps = (r->mplane ? V4L2_CAP_VIDEO_CAPTURE_MPLANE
+					      : V4L2_CAP_VIDEO_CAPTURE) |
+				   V4L2_CAP_STREAMING;
+		cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+		return 0;
+	}
+	case VIDIOC_G_FMT: {
+		struct v4l2_format *fmt = arg;
+
+		if (fmt->type != replay_type(r))
+			return replay_error(EINVAL);
+		replay_get_format(r, fmt);
+		return 0;
+	}
+	case VIDIOC_S_FMT: {
+		struct v4l2_format *fmt = arg;
+
+		if (fmt->type != replay_type(r))
+			return replay_error(EINVAL);
+		if (r->nbufs)
+			return replay_error(EBUSY);
+		replay_try_fmt(r, fmt);
+		return 0;
+	}
+	case VIDIOC_G_PARM: {
+		struct v4l2_streamparm *parm = arg;
+
+		if (parm->type != replay_type(r))
+			return replay_error(EINVAL);
+		memset(&parm->parm, 0, sizeof parm->parm);
+		parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+		parm->parm.capture.timeperframe.numerator = 1;
+		parm->parm.capture.timeperframe.denominator = r->fps;
+		return 0;
+	}
+	case VIDIOC_REQBUFS:
+		return replay_reqbufs(r, arg);
+	case VIDIOC_QUERYBUF: {
+		struct v4l2_buffer *buf = arg;
+
+		if (buf->type != replay_type(r) || buf->index >= r->nbufs)
+			return replay_error(EINVAL);
+		return replay_fill_buf(r, buf, buf->index);
+	}
+	case VIDIOC_QBUF:
+		return replay_qbuf(r, arg);
+	case VIDIOC_DQBUF:
+		return replay_dqbuf(r, arg);
+	case VIDIOC_STREAMON:
+		return replay_streamon(r);
+	case VIDIOC_STREAMOFF:
+		return replay_streamoff(r);
+	case VIDIOC_LOG_STATUS:
+		return 0;
+	case VIDIOC_SUBSCRIBE_EVENT: {
+		struct v4l2_event_subscription *sub = arg;
+
+		return sub->type == V4L2_EVENT_SOURCE_CHANGE ? 0 : replay_error(EINVAL);
+	}
+	case VIDIOC_DQEVENT:
+		return replay_dqevent(r, arg);
+	default:
+		return replay_error(ENOTTY);
+	}
+}
+
+void replay_close(struct replay *r)
+{
+	replay_free_buffers(r);
+
+	if (r->source_mapped)
+		munmap((void *)r->source, r->source_size);
+	else
+		free((void *)r->source);
+	r->source = NULL;
+
+	if (r->fd >= 0)
+		close(r->fd);
+	if (r->timer_fd >= 0)
+		close(r->timer_fd);
+	if (r->ready_fd >= 0)
+		close(r->ready_fd);
+	if (r->event_fd >= 0)
+		close(r->event_fd);
+	r->fd = -1;
+	r->timer_fd = -1;
+	r->ready_fd = -1;
+	r->event_fd = -1;
+
+	pthread_mutex_destroy(&r->lock);
+}
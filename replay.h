@@ -0,0 +1,108 @@
+/*
+ * v4l2_mmal - V4L2 capture emulation from a file or test pattern.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <linux/videodev2.h>
+
+#define REPLAY_DEFAULT_FPS	30
+#define REPLAY_PATTERN		"pattern"
+
+struct replay {
+	/* Polled like a V4L2 device fd, readable when a frame can be dequeued */
+	int fd;
+	int timer_fd;
+	int ready_fd;
+	/* Readable while a V4L2 event waits for DQEVENT */
+	int event_fd;
+	/* Backs the buffers, mmap()ed by the client at the QUERYBUF offsets */
+	int mem_fd;
+	/* V4L2_MEMORY_MMAP, or _DMABUF with the client's buffers in imports */
+	enum v4l2_memory memory;
+
+	/* Source frames, a mapped file or a rendered pattern */
+	const uint8_t *source;
+	size_t source_size;
+	unsigned int source_frames;
+	bool source_mapped;
+
+	/* The whole frame, sizeimage covers every plane */
+	struct v4l2_pix_format fmt;
+	/* Emulating a V4L2_CAP_VIDEO_CAPTURE_MPLANE device */
+	bool mplane;
+	unsigned int num_planes;
+	struct replay_plane {
+		unsigned int stride;
+		size_t size;
+		/* From the start of the buffer */
+		size_t offset;
+	} planes[VIDEO_MAX_PLANES];
+	unsigned int fps;
+	/* Deliver frames as soon as buffers are queued, not at fps */
+	bool unthrottled;
+
+	pthread_mutex_t lock;
+	uint8_t *mem;
+	/* Per buffer and plane, a dup of the last fd queued and its mapping */
+	struct replay_import {
+		int fd;
+		int client_fd;
+		uint8_t *mem;
+		size_t size;
+	} *imports;
+	size_t buffer_size;
+	unsigned int nbufs;
+	/* Buffers queued by the client, then filled and waiting for DQBUF */
+	unsigned int *queued;
+	unsigned int queued_first;
+	unsigned int queued_count;
+	struct replay_frame {
+		unsigned int index;
+		unsigned int sequence;
+	} *ready;
+	unsigned int ready_first;
+	unsigned int ready_count;
+
+	bool streaming;
+	struct timespec start;
+	unsigned int sequence;
+
+	/*
+	 * Emulated mode change, after change_frames frames the source stops,
+	 * raises V4L2_EVENT_SOURCE_CHANGE and comes back at the new size once
+	 * the buffers have been freed.
+	 */
+	unsigned int change_frames;
+	unsigned int change_width;
+	unsigned int change_height;
+	bool event_pending;
+	bool format_pending;
+};
+
+int replay_open(struct replay *r, const char *source, unsigned int fps,
+		bool unthrottled, bool mplane);
+int replay_source_change(struct replay *r, unsigned int frames,
+			 unsigned int width, unsigned int height);
+int replay_ioctl(struct replay *r, unsigned long request, void *arg);
+void replay_close(struct replay *r);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * v4l2_mmal - non-blocking Unix domain socket server.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The listening socket and a handful of clients, all non-blocking and
+ * driven from the capture event loop through one epoll fd, like a device
+ * fd, so a slow client can never hold up a frame. The protocol on top is
+ * up to the user: the metrics and control servers are both built on this.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+/* epoll data for the listening socket, clients use their index */
+#define SERVER_LISTEN		SERVER_MAX_CLIENTS
+
+static uint64_t server_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int server_open(struct server *s, const char *path, server_closed_t closed,
+		void *priv)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	struct stat st;
+	unsigned int i;
+	int ret;
+
+	memset(s, 0, sizeof *s);
+	s->fd = -1;
+	s->listen_fd = -1;
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++)
+		s->clients[i].fd = -1;
+	s->closed = closed;
+	s->priv = priv;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path)
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s->listen_fd < 0)
+		return -errno;
+
+	/* A socket left behind by a previous run, but never any other file */
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			ret = -EEXIST;
+			goto error;
+		}
+		unlink(path);
+	}
+	if (bind(s->listen_fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+	    listen(s->listen_fd, SERVER_MAX_CLIENTS) < 0) {
+		ret = -errno;
+		goto error;
+	}
+	s->path = strdup(path);
+
+	s->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.u32 = SERVER_LISTEN;
+	if (epoll_ctl(s->fd, EPOLL_CTL_ADD, s->listen_fd, &ev) < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	return 0;
+
+error:
+	server_close(s);
+	return ret;
+}
+
+void server_client_close(struct server *s, unsigned int client)
+{
+	struct server_client *c = &s->clients[client];
+
+	epoll_ctl(s->fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+
+	if (s->closed)
+		s->closed(s, client, s->priv);
+}
+
+static void server_accept(struct server *s)
+{
+	struct server_client *client;
+	struct epoll_event ev;
+	unsigned int i;
+	int fd;
+
+	while ((fd = accept4(s->listen_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		client = NULL;
+		for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+			if (s->clients[i].fd == -1) {
+				client = &s->clients[i];
+				break;
+			}
+		}
+		if (!client) {
+			close(fd);
+			continue;
+		}
+
+		memset(&ev, 0, sizeof ev);
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(s->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			continue;
+		}
+
+		client->fd = fd;
+		client->active_ns = server_now_ns();
+	}
+}
+
+void server_wait_writable(struct server *s, unsigned int client)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLOUT;
+	ev.data.u32 = client;
+	epoll_ctl(s->fd, EPOLL_CTL_MOD, s->clients[client].fd, &ev);
+}
+
+void server_dispatch(struct server *s, server_ready_t ready, void *priv)
+{
+	struct epoll_event evs[SERVER_MAX_CLIENTS + 1];
+	struct server_client *client;
+	int n, i;
+
+	n = epoll_wait(s->fd, evs, SERVER_MAX_CLIENTS + 1, 0);
+
+	for (i = 0; i < n; i++) {
+		if (evs[i].data.u32 == SERVER_LISTEN) {
+			server_accept(s);
+			continue;
+		}
+
+		/* Closed by an earlier event in this batch */
+		client = &s->clients[evs[i].data.u32];
+		if (client->fd < 0)
+			continue;
+
+		client->active_ns = server_now_ns();
+		ready(s, evs[i].data.u32, priv);
+	}
+}
+
+void server_expire(struct server *s, unsigned int timeout_ms)
+{
+	uint64_t now = server_now_ns();
+	unsigned int i;
+
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+		if (s->clients[i].fd >= 0 &&
+		    now - s->clients[i].active_ns > timeout_ms * 1000000ULL)
+			server_client_close(s, i);
+	}
+}
+
+void server_close(struct server *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+		if (s->clients[i].fd >= 0)
+			server_client_close(s, i);
+	}
+
+	if (s->fd >= 0)
+		close(s->fd);
+	if (s->listen_fd >= 0)
+		close(s->listen_fd);
+	if (s->path) {
+		unlink(s->path);
+		free(s->path);
+	}
+
+	s->fd = -1;
+	s->listen_fd = -1;
+	s->path = NULL;
+}
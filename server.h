@@ -0,0 +1,59 @@
+/*
+ * v4l2_mmal - non-blocking Unix domain socket server.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <stdint.h>
+
+#define SERVER_MAX_CLIENTS	4
+
+struct server;
+
+/* A client has data to read, or room for what it is still owed */
+typedef void (*server_ready_t)(struct server *s, unsigned int client, void *priv);
+/* A client's connection has gone, whatever was kept for it can be freed */
+typedef void (*server_closed_t)(struct server *s, unsigned int client, void *priv);
+
+struct server_client {
+	int fd;
+	/* Last time it connected, sent something or read something */
+	uint64_t active_ns;
+};
+
+struct server {
+	/* Polled by the event loop, readable when a client needs attention */
+	int fd;
+	int listen_fd;
+	char *path;
+
+	struct server_client clients[SERVER_MAX_CLIENTS];
+
+	server_closed_t closed;
+	void *priv;
+};
+
+int server_open(struct server *s, const char *path, server_closed_t closed,
+		void *priv);
+/* Accept new clients and call ready for each one that needs attention */
+void server_dispatch(struct server *s, server_ready_t ready, void *priv);
+/* Wait for the client to be able to take more data, rather than send some */
+void server_wait_writable(struct server *s, unsigned int client);
+void server_client_close(struct server *s, unsigned int client);
+/* Drop clients that have been idle longer than timeout_ms, call periodically */
+void server_expire(struct server *s, unsigned int timeout_ms);
+void server_close(struct server *s);
+
+#endif
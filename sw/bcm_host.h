@@ -0,0 +1,22 @@
+/*
+ * v4l2_mmal - software MMAL stand-in, host initialisation.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BCM_HOST_H__
+#define __BCM_HOST_H__
+
+void bcm_host_init(void);
+void bcm_host_deinit(void);
+
+#endif
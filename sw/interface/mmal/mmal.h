@@ -0,0 +1,328 @@
+/*
+ * v4l2_mmal - software MMAL stand-in.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The subset of the MMAL API used by v4l2_mmal, with the same names and
+ * semantics as the VideoCore userland headers, so the application builds
+ * unchanged against either.
+ */
+
+#ifndef __MMAL_H__
+#define __MMAL_H__
+
+#include <stdint.h>
+
+#include "interface/vcos/vcos.h"
+#include "interface/mmal/mmal_common.h"
+#include "interface/mmal/mmal_buffer.h"
+
+/* Encodings */
+#define MMAL_ENCODING_H264		MMAL_FOURCC('H', '2', '6', '4')
+#define MMAL_ENCODING_JPEG		MMAL_FOURCC('J', 'P', 'E', 'G')
+#define MMAL_ENCODING_I420		MMAL_FOURCC('I', '4', '2', '0')
+#define MMAL_ENCODING_I420_SLICE	MMAL_FOURCC('S', '4', '2', '0')
+#define MMAL_ENCODING_NV12		MMAL_FOURCC('N', 'V', '1', '2')
+#define MMAL_ENCODING_NV21		MMAL_FOURCC('N', 'V', '2', '1')
+#define MMAL_ENCODING_YUYV		MMAL_FOURCC('Y', 'U', 'Y', 'V')
+#define MMAL_ENCODING_YVYU		MMAL_FOURCC('Y', 'V', 'Y', 'U')
+#define MMAL_ENCODING_UYVY		MMAL_FOURCC('U', 'Y', 'V', 'Y')
+#define MMAL_ENCODING_VYUY		MMAL_FOURCC('V', 'Y', 'U', 'Y')
+#define MMAL_ENCODING_RGB16		MMAL_FOURCC('R', 'G', 'B', '2')
+#define MMAL_ENCODING_RGB24		MMAL_FOURCC('R', 'G', 'B', '3')
+#define MMAL_ENCODING_BGR24		MMAL_FOURCC('B', 'G', 'R', '3')
+#define MMAL_ENCODING_RGB32		MMAL_FOURCC('R', 'G', 'B', '4')
+#define MMAL_ENCODING_BGR32		MMAL_FOURCC('B', 'G', 'R', '4')
+#define MMAL_ENCODING_RGBA		MMAL_FOURCC('R', 'G', 'B', 'A')
+#define MMAL_ENCODING_BGRA		MMAL_FOURCC('B', 'G', 'R', 'A')
+#define MMAL_ENCODING_ARGB		MMAL_FOURCC('A', 'R', 'G', 'B')
+#define MMAL_ENCODING_BAYER_SBGGR8	MMAL_FOURCC('B', 'A', '8', '1')
+#define MMAL_ENCODING_BAYER_SGBRG8	MMAL_FOURCC('G', 'B', 'R', 'G')
+#define MMAL_ENCODING_BAYER_SGRBG8	MMAL_FOURCC('G', 'R', 'B', 'G')
+#define MMAL_ENCODING_BAYER_SRGGB8	MMAL_FOURCC('R', 'G', 'G', 'B')
+#define MMAL_ENCODING_BAYER_SBGGR10P	MMAL_FOURCC('p', 'B', 'A', 'A')
+#define MMAL_ENCODING_BAYER_SGRBG10P	MMAL_FOURCC('p', 'g', 'A', 'A')
+#define MMAL_ENCODING_BAYER_SGBRG10P	MMAL_FOURCC('p', 'G', 'A', 'A')
+#define MMAL_ENCODING_BAYER_SRGGB10P	MMAL_FOURCC('p', 'R', 'A', 'A')
+
+/* Elementary stream formats */
+typedef enum {
+	MMAL_ES_TYPE_UNKNOWN,
+	MMAL_ES_TYPE_CONTROL,
+	MMAL_ES_TYPE_AUDIO,
+	MMAL_ES_TYPE_VIDEO,
+	MMAL_ES_TYPE_SUBPICTURE,
+} MMAL_ES_TYPE_T;
+
+#define MMAL_ES_FORMAT_FLAG_FRAMED	0x1
+
+typedef struct {
+	int32_t x, y;
+	int32_t width, height;
+} MMAL_RECT_T;
+
+typedef struct {
+	int32_t num, den;
+} MMAL_RATIONAL_T;
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	MMAL_RECT_T crop;
+	MMAL_RATIONAL_T frame_rate;
+	MMAL_RATIONAL_T par;
+	MMAL_FOURCC_T color_space;
+} MMAL_VIDEO_FORMAT_T;
+
+typedef struct {
+	uint32_t channels;
+	uint32_t sample_rate;
+	uint32_t bits_per_sample;
+	uint32_t block_align;
+} MMAL_AUDIO_FORMAT_T;
+
+typedef union {
+	MMAL_AUDIO_FORMAT_T audio;
+	MMAL_VIDEO_FORMAT_T video;
+} MMAL_ES_SPECIFIC_FORMAT_T;
+
+typedef struct MMAL_ES_FORMAT_T {
+	MMAL_ES_TYPE_T type;
+	MMAL_FOURCC_T encoding;
+	MMAL_FOURCC_T encoding_variant;
+	MMAL_ES_SPECIFIC_FORMAT_T *es;
+	uint32_t bitrate;
+	uint32_t flags;
+	uint32_t extradata_size;
+	uint8_t *extradata;
+} MMAL_ES_FORMAT_T;
+
+void mmal_format_copy(MMAL_ES_FORMAT_T *format_dest, MMAL_ES_FORMAT_T *format_src);
+MMAL_STATUS_T mmal_format_full_copy(MMAL_ES_FORMAT_T *format_dest,
+				    MMAL_ES_FORMAT_T *format_src);
+
+/* Queues and pools */
+typedef struct MMAL_QUEUE_T MMAL_QUEUE_T;
+
+MMAL_QUEUE_T *mmal_queue_create(void);
+void mmal_queue_put(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer);
+void mmal_queue_put_back(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer);
+MMAL_BUFFER_HEADER_T *mmal_queue_get(MMAL_QUEUE_T *queue);
+MMAL_BUFFER_HEADER_T *mmal_queue_wait(MMAL_QUEUE_T *queue);
+MMAL_BUFFER_HEADER_T *mmal_queue_timedwait(MMAL_QUEUE_T *queue, VCOS_UNSIGNED timeout);
+unsigned int mmal_queue_length(MMAL_QUEUE_T *queue);
+void mmal_queue_destroy(MMAL_QUEUE_T *queue);
+
+typedef struct MMAL_POOL_T {
+	MMAL_QUEUE_T *queue;
+	uint32_t headers_num;
+	MMAL_BUFFER_HEADER_T **header;
+} MMAL_POOL_T;
+
+typedef MMAL_BOOL_T (*MMAL_POOL_BH_CB_T)(MMAL_POOL_T *pool,
+					 MMAL_BUFFER_HEADER_T *buffer,
+					 void *userdata);
+
+MMAL_POOL_T *mmal_pool_create(unsigned int headers, uint32_t payload_size);
+void mmal_pool_destroy(MMAL_POOL_T *pool);
+void mmal_pool_callback_set(MMAL_POOL_T *pool, MMAL_POOL_BH_CB_T cb, void *userdata);
+
+/* Ports and components */
+typedef enum {
+	MMAL_PORT_TYPE_UNKNOWN,
+	MMAL_PORT_TYPE_CONTROL,
+	MMAL_PORT_TYPE_INPUT,
+	MMAL_PORT_TYPE_OUTPUT,
+	MMAL_PORT_TYPE_CLOCK,
+} MMAL_PORT_TYPE_T;
+
+struct MMAL_PORT_PRIVATE_T;
+struct MMAL_PORT_USERDATA_T;
+struct MMAL_COMPONENT_T;
+
+typedef struct MMAL_PORT_T {
+	struct MMAL_PORT_PRIVATE_T *priv;
+	const char *name;
+	MMAL_PORT_TYPE_T type;
+	uint16_t index;
+	uint16_t index_all;
+	uint32_t is_enabled;
+	MMAL_ES_FORMAT_T *format;
+
+	uint32_t buffer_num_min;
+	uint32_t buffer_size_min;
+	uint32_t buffer_alignment_min;
+	uint32_t buffer_num_recommended;
+	uint32_t buffer_size_recommended;
+	uint32_t buffer_num;
+	uint32_t buffer_size;
+
+	struct MMAL_COMPONENT_T *component;
+	struct MMAL_PORT_USERDATA_T *userdata;
+	uint32_t capabilities;
+} MMAL_PORT_T;
+
+typedef void (*MMAL_PORT_BH_CB_T)(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+
+struct MMAL_COMPONENT_PRIVATE_T;
+struct MMAL_COMPONENT_USERDATA_T;
+
+typedef struct MMAL_COMPONENT_T {
+	struct MMAL_COMPONENT_PRIVATE_T *priv;
+	struct MMAL_COMPONENT_USERDATA_T *userdata;
+	const char *name;
+	uint32_t is_enabled;
+
+	MMAL_PORT_T *control;
+	uint32_t input_num;
+	MMAL_PORT_T **input;
+	uint32_t output_num;
+	MMAL_PORT_T **output;
+	uint32_t clock_num;
+	MMAL_PORT_T **clock;
+	uint32_t port_num;
+	MMAL_PORT_T **port;
+
+	uint32_t id;
+} MMAL_COMPONENT_T;
+
+MMAL_STATUS_T mmal_component_create(const char *name, MMAL_COMPONENT_T **component);
+MMAL_STATUS_T mmal_component_destroy(MMAL_COMPONENT_T *component);
+MMAL_STATUS_T mmal_component_enable(MMAL_COMPONENT_T *component);
+MMAL_STATUS_T mmal_component_disable(MMAL_COMPONENT_T *component);
+
+/* Parameters */
+typedef struct MMAL_PARAMETER_HEADER_T {
+	uint32_t id;
+	uint32_t size;
+} MMAL_PARAMETER_HEADER_T;
+
+#define MMAL_PARAMETER_GROUP_COMMON	(0 << 16)
+#define MMAL_PARAMETER_GROUP_VIDEO	(2 << 16)
+
+enum {
+	MMAL_PARAMETER_UNUSED = MMAL_PARAMETER_GROUP_COMMON,
+	MMAL_PARAMETER_SUPPORTED_ENCODINGS,
+	MMAL_PARAMETER_URI,
+	MMAL_PARAMETER_CHANGE_EVENT_REQUEST,
+	MMAL_PARAMETER_ZERO_COPY,
+	MMAL_PARAMETER_BUFFER_REQUIREMENTS,
+	MMAL_PARAMETER_STATISTICS,
+};
+
+enum {
+	MMAL_PARAMETER_DISPLAYREGION = MMAL_PARAMETER_GROUP_VIDEO,
+	MMAL_PARAMETER_SUPPORTED_PROFILES,
+	MMAL_PARAMETER_PROFILE,
+	MMAL_PARAMETER_INTRAPERIOD,
+	MMAL_PARAMETER_RATECONTROL,
+	MMAL_PARAMETER_NALUNITFORMAT,
+	MMAL_PARAMETER_MINIMISE_FRAGMENTATION,
+	MMAL_PARAMETER_MB_ROWS_PER_SLICE,
+	MMAL_PARAMETER_VIDEO_LEVEL_EXTENSION,
+	MMAL_PARAMETER_VIDEO_EEDE_ENABLE,
+	MMAL_PARAMETER_VIDEO_EEDE_LOSSRATE,
+	MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME,
+	MMAL_PARAMETER_VIDEO_INTRA_REFRESH,
+	MMAL_PARAMETER_VIDEO_IMMUTABLE_INPUT,
+	MMAL_PARAMETER_VIDEO_BIT_RATE,
+	MMAL_PARAMETER_VIDEO_FRAME_RATE,
+	MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT,
+	MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT,
+	MMAL_PARAMETER_VIDEO_ENCODE_RC_MODEL,
+	MMAL_PARAMETER_EXTRA_BUFFERS,
+	MMAL_PARAMETER_VIDEO_ALIGN_HORIZ,
+	MMAL_PARAMETER_VIDEO_ALIGN_VERT,
+	MMAL_PARAMETER_VIDEO_DROPPABLE_PFRAMES,
+	MMAL_PARAMETER_VIDEO_ENCODE_INITIAL_QUANT,
+	MMAL_PARAMETER_VIDEO_ENCODE_QP_P,
+	MMAL_PARAMETER_VIDEO_ENCODE_RC_SLICE_DQUANT,
+	MMAL_PARAMETER_VIDEO_ENCODE_FRAME_LIMIT_BITS,
+	MMAL_PARAMETER_VIDEO_ENCODE_PEAK_RATE,
+	MMAL_PARAMETER_VIDEO_ENCODE_H264_DISABLE_CABAC,
+	MMAL_PARAMETER_VIDEO_ENCODE_H264_LOW_LATENCY,
+	MMAL_PARAMETER_VIDEO_ENCODE_H264_AU_DELIMITERS,
+	MMAL_PARAMETER_VIDEO_ENCODE_H264_DEBLOCK_IDC,
+	MMAL_PARAMETER_VIDEO_ENCODE_H264_MB_INTRA_MODE,
+	MMAL_PARAMETER_VIDEO_ENCODE_HEADER_ON_OPEN,
+	MMAL_PARAMETER_VIDEO_ENCODE_PRECODE_FOR_QP,
+	MMAL_PARAMETER_VIDEO_DRM_INIT_INFO,
+	MMAL_PARAMETER_VIDEO_TIMESTAMP_FIFO,
+	MMAL_PARAMETER_VIDEO_DECODE_ERROR_CONCEALMENT,
+	MMAL_PARAMETER_VIDEO_DRM_PROTECT_BUFFER,
+	MMAL_PARAMETER_VIDEO_DECODE_CONFIG_VD3,
+	MMAL_PARAMETER_VIDEO_ENCODE_H264_VCL_HRD_PARAMETERS,
+	MMAL_PARAMETER_VIDEO_ENCODE_H264_LOW_DELAY_HRD_FLAG,
+	MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER,
+};
+
+typedef struct MMAL_PARAMETER_BOOLEAN_T {
+	MMAL_PARAMETER_HEADER_T hdr;
+	MMAL_BOOL_T enable;
+} MMAL_PARAMETER_BOOLEAN_T;
+
+typedef struct MMAL_PARAMETER_UINT32_T {
+	MMAL_PARAMETER_HEADER_T hdr;
+	uint32_t value;
+} MMAL_PARAMETER_UINT32_T;
+
+typedef enum {
+	MMAL_VIDEO_PROFILE_H264_BASELINE = 0x19,
+	MMAL_VIDEO_PROFILE_H264_MAIN,
+	MMAL_VIDEO_PROFILE_H264_EXTENDED,
+	MMAL_VIDEO_PROFILE_H264_HIGH,
+} MMAL_VIDEO_PROFILE_T;
+
+typedef enum {
+	MMAL_VIDEO_LEVEL_H264_1 = 0x1c,
+	MMAL_VIDEO_LEVEL_H264_1b,
+	MMAL_VIDEO_LEVEL_H264_11,
+	MMAL_VIDEO_LEVEL_H264_12,
+	MMAL_VIDEO_LEVEL_H264_13,
+	MMAL_VIDEO_LEVEL_H264_2,
+	MMAL_VIDEO_LEVEL_H264_21,
+	MMAL_VIDEO_LEVEL_H264_22,
+	MMAL_VIDEO_LEVEL_H264_3,
+	MMAL_VIDEO_LEVEL_H264_31,
+	MMAL_VIDEO_LEVEL_H264_32,
+	MMAL_VIDEO_LEVEL_H264_4,
+	MMAL_VIDEO_LEVEL_H264_41,
+	MMAL_VIDEO_LEVEL_H264_42,
+} MMAL_VIDEO_LEVEL_T;
+
+typedef struct MMAL_PARAMETER_VIDEO_PROFILE_S {
+	MMAL_VIDEO_PROFILE_T profile;
+	MMAL_VIDEO_LEVEL_T level;
+} MMAL_PARAMETER_VIDEO_PROFILE_S;
+
+typedef struct MMAL_PARAMETER_VIDEO_PROFILE_T {
+	MMAL_PARAMETER_HEADER_T hdr;
+	MMAL_PARAMETER_VIDEO_PROFILE_S profile[1];
+} MMAL_PARAMETER_VIDEO_PROFILE_T;
+
+MMAL_STATUS_T mmal_port_format_commit(MMAL_PORT_T *port);
+MMAL_STATUS_T mmal_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb);
+MMAL_STATUS_T mmal_port_disable(MMAL_PORT_T *port);
+MMAL_STATUS_T mmal_port_flush(MMAL_PORT_T *port);
+MMAL_STATUS_T mmal_port_parameter_set(MMAL_PORT_T *port,
+				      const MMAL_PARAMETER_HEADER_T *param);
+MMAL_STATUS_T mmal_port_parameter_get(MMAL_PORT_T *port,
+				      MMAL_PARAMETER_HEADER_T *param);
+MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+
+/* Events sent on control ports */
+#define MMAL_EVENT_ERROR		MMAL_FOURCC('E', 'R', 'R', 'O')
+#define MMAL_EVENT_EOS			MMAL_FOURCC('E', 'E', 'O', 'S')
+#define MMAL_EVENT_FORMAT_CHANGED	MMAL_FOURCC('E', 'F', 'C', 'H')
+#define MMAL_EVENT_PARAMETER_CHANGED	MMAL_FOURCC('E', 'P', 'C', 'H')
+
+#endif
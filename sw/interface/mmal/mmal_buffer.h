@@ -0,0 +1,75 @@
+/*
+ * v4l2_mmal - software MMAL stand-in, buffer headers.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __MMAL_BUFFER_H__
+#define __MMAL_BUFFER_H__
+
+#include <stdint.h>
+
+#include "interface/mmal/mmal_common.h"
+
+#define MMAL_BUFFER_HEADER_FLAG_EOS			(1 << 0)
+#define MMAL_BUFFER_HEADER_FLAG_FRAME_START		(1 << 1)
+#define MMAL_BUFFER_HEADER_FLAG_FRAME_END		(1 << 2)
+#define MMAL_BUFFER_HEADER_FLAG_FRAME			(MMAL_BUFFER_HEADER_FLAG_FRAME_START | \
+							 MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+#define MMAL_BUFFER_HEADER_FLAG_KEYFRAME		(1 << 3)
+#define MMAL_BUFFER_HEADER_FLAG_DISCONTINUITY		(1 << 4)
+#define MMAL_BUFFER_HEADER_FLAG_CONFIG			(1 << 5)
+#define MMAL_BUFFER_HEADER_FLAG_ENCRYPTED		(1 << 6)
+#define MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO		(1 << 7)
+#define MMAL_BUFFER_HEADER_FLAG_SNAPSHOT		(1 << 8)
+#define MMAL_BUFFER_HEADER_FLAG_CORRUPTED		(1 << 9)
+#define MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED	(1 << 10)
+
+struct MMAL_BUFFER_HEADER_PRIVATE_T;
+
+/* Where the planes of a video frame are, relative to data */
+typedef struct {
+	uint32_t planes;
+	uint32_t offset[4];
+	uint32_t pitch[4];
+	uint32_t flags;
+} MMAL_BUFFER_HEADER_VIDEO_SPECIFIC_T;
+
+typedef union {
+	MMAL_BUFFER_HEADER_VIDEO_SPECIFIC_T video;
+} MMAL_BUFFER_HEADER_TYPE_SPECIFIC_T;
+
+typedef struct MMAL_BUFFER_HEADER_T {
+	struct MMAL_BUFFER_HEADER_T *next;
+	struct MMAL_BUFFER_HEADER_PRIVATE_T *priv;
+
+	uint32_t cmd;
+
+	uint8_t *data;
+	uint32_t alloc_size;
+	uint32_t length;
+	uint32_t offset;
+	uint32_t flags;
+	int64_t pts;
+	int64_t dts;
+
+	MMAL_BUFFER_HEADER_TYPE_SPECIFIC_T *type;
+	void *user_data;
+} MMAL_BUFFER_HEADER_T;
+
+void mmal_buffer_header_acquire(MMAL_BUFFER_HEADER_T *header);
+void mmal_buffer_header_reset(MMAL_BUFFER_HEADER_T *header);
+void mmal_buffer_header_release(MMAL_BUFFER_HEADER_T *header);
+MMAL_STATUS_T mmal_buffer_header_replicate(MMAL_BUFFER_HEADER_T *dest,
+				 MMAL_BUFFER_HEADER_T *src);
+
+#endif
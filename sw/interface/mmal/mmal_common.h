@@ -0,0 +1,50 @@
+/*
+ * v4l2_mmal - software MMAL stand-in, common types.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __MMAL_COMMON_H__
+#define __MMAL_COMMON_H__
+
+#include <stdint.h>
+
+typedef uint32_t MMAL_FOURCC_T;
+typedef int32_t MMAL_BOOL_T;
+#define MMAL_FALSE	0
+#define MMAL_TRUE	1
+
+#define MMAL_FOURCC(a, b, c, d) \
+	((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+#define MMAL_TIME_UNKNOWN	(INT64_C(1) << 63)
+
+typedef enum {
+	MMAL_SUCCESS = 0,
+	MMAL_ENOMEM,
+	MMAL_ENOSPC,
+	MMAL_EINVAL,
+	MMAL_ENOSYS,
+	MMAL_ENOENT,
+	MMAL_ENXIO,
+	MMAL_EIO,
+	MMAL_ESPIPE,
+	MMAL_ECORRUPT,
+	MMAL_ENOTREADY,
+	MMAL_ECONFIG,
+	MMAL_EISCONN,
+	MMAL_ENOTCONN,
+	MMAL_EAGAIN,
+	MMAL_EFAULT,
+} MMAL_STATUS_T;
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * v4l2_mmal - software MMAL stand-in, connections.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * v4l2_mmal moves buffers between components itself, so connections are
+ * not implemented; the header only exists so the includes resolve.
+ */
+
+#ifndef __MMAL_CONNECTION_H__
+#define __MMAL_CONNECTION_H__
+
+#include "interface/mmal/mmal.h"
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * v4l2_mmal - software MMAL stand-in, utilities.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __MMAL_UTIL_H__
+#define __MMAL_UTIL_H__
+
+#include "interface/mmal/mmal.h"
+
+uint32_t mmal_encoding_width_to_stride(uint32_t encoding, uint32_t width);
+uint32_t mmal_encoding_stride_to_width(uint32_t encoding, uint32_t stride);
+MMAL_POOL_T *mmal_port_pool_create(MMAL_PORT_T *port, unsigned int headers,
+				   uint32_t payload_size);
+void mmal_port_pool_destroy(MMAL_PORT_T *port, MMAL_POOL_T *pool);
+const char *mmal_status_to_string(MMAL_STATUS_T status);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * v4l2_mmal - software MMAL stand-in, VCOS subset.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __VCOS_H__
+#define __VCOS_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef uint32_t VCOS_UNSIGNED;
+
+typedef enum {
+	VCOS_SUCCESS,
+	VCOS_EAGAIN,
+	VCOS_ENOENT,
+	VCOS_ENOSPC,
+	VCOS_EINVAL,
+	VCOS_EACCESS,
+	VCOS_ENOMEM,
+	VCOS_ENOSYS,
+} VCOS_STATUS_T;
+
+typedef struct VCOS_THREAD_T {
+	pthread_t thread;
+} VCOS_THREAD_T;
+
+typedef struct VCOS_THREAD_ATTR_T VCOS_THREAD_ATTR_T;
+
+VCOS_STATUS_T vcos_thread_create(VCOS_THREAD_T *thread, const char *name,
+				 VCOS_THREAD_ATTR_T *attrs,
+				 void *(*entry)(void *), void *arg);
+void vcos_thread_join(VCOS_THREAD_T *thread, void **pData);
+
+#define vcos_log_error(...)	(fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+
+#endif
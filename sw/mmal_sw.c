@@ -0,0 +1,1022 @@
+/*
+ * v4l2_mmal - software MMAL stand-in.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Buffer headers, queues, pools, ports and components implemented on top
+ * of pthreads, plus the handful of VCOS, bcm_host and VCSM calls the
+ * application makes. Built instead of the VideoCore libraries with
+ * "make MMAL=sw", so the whole capture pipeline runs on any Linux box.
+ *
+ * MMAL_SW_LATENCY_<COMPONENT> (e.g. MMAL_SW_LATENCY_VIDEO_ENCODE) sets the
+ * time in microseconds each component spends on a buffer.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bcm_host.h"
+#include "interface/mmal/util/mmal_util.h"
+#include "interface/mmal/util/mmal_util_params.h"
+#include "user-vcsm.h"
+
+#include "mmal_sw.h"
+
+#define SW_COMPONENT_PREFIX	"vc.ril."
+#define SW_EVENT_BUFFERS	2
+
+static const struct sw_component_type *sw_components[] = {
+	&sw_isp,
+	&sw_video_splitter,
+	&sw_video_render,
+	&sw_video_encode,
+	&sw_image_encode,
+};
+
+/* -----------------------------------------------------------------------------
+ * Buffer headers and pools
+ */
+
+struct sw_pool;
+
+struct MMAL_BUFFER_HEADER_PRIVATE_T {
+	int refcount;
+	struct sw_pool *pool;
+	/* Replicated from this header, released along with us */
+	MMAL_BUFFER_HEADER_T *reference;
+	uint8_t *payload;
+	uint32_t payload_size;
+	MMAL_BUFFER_HEADER_TYPE_SPECIFIC_T type;
+};
+
+struct sw_pool {
+	MMAL_POOL_T pool;
+	MMAL_POOL_BH_CB_T cb;
+	void *userdata;
+
+	MMAL_BUFFER_HEADER_T *headers;
+	struct MMAL_BUFFER_HEADER_PRIVATE_T *privs;
+	uint8_t *payload;
+};
+
+void mmal_buffer_header_acquire(MMAL_BUFFER_HEADER_T *header)
+{
+	__atomic_add_fetch(&header->priv->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+void mmal_buffer_header_reset(MMAL_BUFFER_HEADER_T *header)
+{
+	header->length = 0;
+	header->offset = 0;
+	header->flags = 0;
+	header->pts = MMAL_TIME_UNKNOWN;
+	header->dts = MMAL_TIME_UNKNOWN;
+}
+
+void mmal_buffer_header_release(MMAL_BUFFER_HEADER_T *header)
+{
+	struct MMAL_BUFFER_HEADER_PRIVATE_T *priv = header->priv;
+	MMAL_BUFFER_HEADER_T *reference;
+	struct sw_pool *pool;
+
+	if (__atomic_sub_fetch(&priv->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	reference = priv->reference;
+	if (reference) {
+		priv->reference = NULL;
+		header->data = priv->payload;
+		header->alloc_size = priv->payload_size;
+		mmal_buffer_header_release(reference);
+	}
+
+	mmal_buffer_header_reset(header);
+	header->cmd = 0;
+	priv->refcount = 1;
+
+	pool = priv->pool;
+	if (!pool)
+		return;
+	if (!pool->cb || pool->cb(&pool->pool, header, pool->userdata))
+		mmal_queue_put(pool->pool.queue, header);
+}
+
+MMAL_STATUS_T mmal_buffer_header_replicate(MMAL_BUFFER_HEADER_T *dest,
+					   MMAL_BUFFER_HEADER_T *src)
+{
+	if (!dest || !src || dest->priv->reference)
+		return MMAL_EINVAL;
+
+	mmal_buffer_header_acquire(src);
+	dest->priv->reference = src;
+
+	dest->cmd = src->cmd;
+	dest->data = src->data;
+	dest->alloc_size = src->alloc_size;
+	dest->length = src->length;
+	dest->offset = src->offset;
+	dest->flags = src->flags;
+	dest->pts = src->pts;
+	dest->dts = src->dts;
+	*dest->type = *src->type;
+
+	return MMAL_SUCCESS;
+}
+
+MMAL_POOL_T *mmal_pool_create(unsigned int headers, uint32_t payload_size)
+{
+	struct sw_pool *pool;
+	unsigned int i;
+
+	pool = calloc(1, sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->headers = calloc(headers, sizeof *pool->headers);
+	pool->privs = calloc(headers, sizeof *pool->privs);
+	pool->pool.header = calloc(headers, sizeof *pool->pool.header);
+	pool->pool.queue = mmal_queue_create();
+	if (payload_size && headers)
+		pool->payload = aligned_alloc(64, ((size_t)payload_size + 63) / 64 * 64 * headers);
+	if ((headers && (!pool->headers || !pool->privs || !pool->pool.header)) ||
+	    !pool->pool.queue || (payload_size && headers && !pool->payload)) {
+		mmal_pool_destroy(&pool->pool);
+		return NULL;
+	}
+
+	pool->pool.headers_num = headers;
+	for (i = 0; i < headers; i++) {
+		MMAL_BUFFER_HEADER_T *header = &pool->headers[i];
+		struct MMAL_BUFFER_HEADER_PRIVATE_T *priv = &pool->privs[i];
+
+		priv->refcount = 1;
+		priv->pool = pool;
+		if (payload_size) {
+			priv->payload = pool->payload + ((size_t)payload_size + 63) / 64 * 64 * i;
+			priv->payload_size = payload_size;
+		}
+
+		header->priv = priv;
+		header->type = &priv->type;
+		header->data = priv->payload;
+		header->alloc_size = priv->payload_size;
+		mmal_buffer_header_reset(header);
+
+		pool->pool.header[i] = header;
+		mmal_queue_put(pool->pool.queue, header);
+	}
+
+	return &pool->pool;
+}
+
+void mmal_pool_destroy(MMAL_POOL_T *p)
+{
+	struct sw_pool *pool = (struct sw_pool *)p;
+
+	if (!pool)
+		return;
+
+	if (pool->pool.queue)
+		mmal_queue_destroy(pool->pool.queue);
+	free(pool->pool.header);
+	free(pool->headers);
+	free(pool->privs);
+	free(pool->payload);
+	free(pool);
+}
+
+void mmal_pool_callback_set(MMAL_POOL_T *p, MMAL_POOL_BH_CB_T cb, void *userdata)
+{
+	struct sw_pool *pool = (struct sw_pool *)p;
+
+	pool->cb = cb;
+	pool->userdata = userdata;
+}
+
+MMAL_POOL_T *mmal_port_pool_create(MMAL_PORT_T *port, unsigned int headers,
+				   uint32_t payload_size)
+{
+	(void)port;
+
+	return mmal_pool_create(headers, payload_size);
+}
+
+void mmal_port_pool_destroy(MMAL_PORT_T *port, MMAL_POOL_T *pool)
+{
+	(void)port;
+
+	mmal_pool_destroy(pool);
+}
+
+/* -----------------------------------------------------------------------------
+ * Queues
+ */
+
+struct MMAL_QUEUE_T {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	MMAL_BUFFER_HEADER_T *head;
+	MMAL_BUFFER_HEADER_T *tail;
+	unsigned int length;
+};
+
+MMAL_QUEUE_T *mmal_queue_create(void)
+{
+	pthread_condattr_t attr;
+	MMAL_QUEUE_T *queue;
+
+	queue = calloc(1, sizeof *queue);
+	if (!queue)
+		return NULL;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&queue->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return queue;
+}
+
+void mmal_queue_put(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer)
+{
+	pthread_mutex_lock(&queue->lock);
+	buffer->next = NULL;
+	if (queue->tail)
+		queue->tail->next = buffer;
+	else
+		queue->head = buffer;
+	queue->tail = buffer;
+	queue->length++;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void mmal_queue_put_back(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer)
+{
+	pthread_mutex_lock(&queue->lock);
+	buffer->next = queue->head;
+	queue->head = buffer;
+	if (!queue->tail)
+		queue->tail = buffer;
+	queue->length++;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static MMAL_BUFFER_HEADER_T *queue_pop(MMAL_QUEUE_T *queue)
+{
+	MMAL_BUFFER_HEADER_T *buffer = queue->head;
+
+	if (!buffer)
+		return NULL;
+
+	queue->head = buffer->next;
+	if (!queue->head)
+		queue->tail = NULL;
+	buffer->next = NULL;
+	queue->length--;
+
+	return buffer;
+}
+
+MMAL_BUFFER_HEADER_T *mmal_queue_get(MMAL_QUEUE_T *queue)
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	pthread_mutex_lock(&queue->lock);
+	buffer = queue_pop(queue);
+	pthread_mutex_unlock(&queue->lock);
+
+	return buffer;
+}
+
+MMAL_BUFFER_HEADER_T *mmal_queue_wait(MMAL_QUEUE_T *queue)
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->head)
+		pthread_cond_wait(&queue->cond, &queue->lock);
+	buffer = queue_pop(queue);
+	pthread_mutex_unlock(&queue->lock);
+
+	return buffer;
+}
+
+MMAL_BUFFER_HEADER_T *mmal_queue_timedwait(MMAL_QUEUE_T *queue, VCOS_UNSIGNED timeout)
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->head) {
+		if (pthread_cond_timedwait(&queue->cond, &queue->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	buffer = queue_pop(queue);
+	pthread_mutex_unlock(&queue->lock);
+
+	return buffer;
+}
+
+/* Unlocked like the VideoCore library's, so it is safe to poll for statistics */
+unsigned int mmal_queue_length(MMAL_QUEUE_T *queue)
+{
+	return __atomic_load_n(&queue->length, __ATOMIC_RELAXED);
+}
+
+void mmal_queue_destroy(MMAL_QUEUE_T *queue)
+{
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->cond);
+	free(queue);
+}
+
+/* -----------------------------------------------------------------------------
+ * Formats
+ */
+
+void mmal_format_copy(MMAL_ES_FORMAT_T *dest, MMAL_ES_FORMAT_T *src)
+{
+	dest->type = src->type;
+	dest->encoding = src->encoding;
+	dest->encoding_variant = src->encoding_variant;
+	*dest->es = *src->es;
+	dest->bitrate = src->bitrate;
+	dest->flags = src->flags;
+}
+
+MMAL_STATUS_T mmal_format_full_copy(MMAL_ES_FORMAT_T *dest, MMAL_ES_FORMAT_T *src)
+{
+	mmal_format_copy(dest, src);
+
+	if (src->extradata_size) {
+		if (!dest->extradata || src->extradata_size > SW_EXTRADATA_SIZE)
+			return MMAL_ENOSPC;
+		memcpy(dest->extradata, src->extradata, src->extradata_size);
+	}
+	dest->extradata_size = src->extradata_size;
+
+	return MMAL_SUCCESS;
+}
+
+uint32_t mmal_encoding_width_to_stride(uint32_t encoding, uint32_t width)
+{
+	switch (encoding) {
+	case MMAL_ENCODING_I420:
+	case MMAL_ENCODING_NV12:
+	case MMAL_ENCODING_NV21:
+	case MMAL_ENCODING_BAYER_SBGGR8:
+	case MMAL_ENCODING_BAYER_SGBRG8:
+	case MMAL_ENCODING_BAYER_SGRBG8:
+	case MMAL_ENCODING_BAYER_SRGGB8:
+		return width;
+	case MMAL_ENCODING_YUYV:
+	case MMAL_ENCODING_YVYU:
+	case MMAL_ENCODING_UYVY:
+	case MMAL_ENCODING_VYUY:
+	case MMAL_ENCODING_RGB16:
+		return width * 2;
+	case MMAL_ENCODING_RGB24:
+	case MMAL_ENCODING_BGR24:
+		return width * 3;
+	case MMAL_ENCODING_RGB32:
+	case MMAL_ENCODING_BGR32:
+	case MMAL_ENCODING_RGBA:
+	case MMAL_ENCODING_BGRA:
+	case MMAL_ENCODING_ARGB:
+		return width * 4;
+	case MMAL_ENCODING_BAYER_SBGGR10P:
+	case MMAL_ENCODING_BAYER_SGRBG10P:
+	case MMAL_ENCODING_BAYER_SGBRG10P:
+	case MMAL_ENCODING_BAYER_SRGGB10P:
+		return (width * 5 + 3) / 4;
+	default:
+		return 0;
+	}
+}
+
+uint32_t mmal_encoding_stride_to_width(uint32_t encoding, uint32_t stride)
+{
+	uint32_t one = mmal_encoding_width_to_stride(encoding, 4);
+
+	return one ? stride * 4 / one : 0;
+}
+
+/* Bytes in one frame of an uncompressed format, 0 if compressed */
+uint32_t sw_frame_size(const MMAL_ES_FORMAT_T *format)
+{
+	const MMAL_VIDEO_FORMAT_T *video = &format->es->video;
+	uint32_t stride = mmal_encoding_width_to_stride(format->encoding, video->width);
+
+	switch (format->encoding) {
+	case MMAL_ENCODING_I420:
+	case MMAL_ENCODING_NV12:
+	case MMAL_ENCODING_NV21:
+		return stride * video->height * 3 / 2;
+	default:
+		return stride * video->height;
+	}
+}
+
+const char *mmal_status_to_string(MMAL_STATUS_T status)
+{
+	static const char * const names[] = {
+		"SUCCESS", "ENOMEM", "ENOSPC", "EINVAL", "ENOSYS", "ENOENT",
+		"ENXIO", "EIO", "ESPIPE", "ECORRUPT", "ENOTREADY", "ECONFIG",
+		"EISCONN", "ENOTCONN", "EAGAIN", "EFAULT",
+	};
+
+	if ((unsigned int)status >= sizeof(names) / sizeof(names[0]))
+		return "UNKNOWN";
+	return names[status];
+}
+
+/* -----------------------------------------------------------------------------
+ * Ports
+ */
+
+static bool encoding_supported(const MMAL_FOURCC_T *list, MMAL_FOURCC_T encoding)
+{
+	if (!list)
+		return true;
+
+	for (; *list; list++) {
+		if (*list == encoding)
+			return true;
+	}
+
+	return false;
+}
+
+MMAL_STATUS_T mmal_port_format_commit(MMAL_PORT_T *port)
+{
+	struct sw_component *c = sw_component(port);
+	const MMAL_FOURCC_T *list = NULL;
+	MMAL_STATUS_T status;
+	unsigned int i;
+
+	if (port->type == MMAL_PORT_TYPE_INPUT)
+		list = c->type->input_encodings;
+	else if (port->type == MMAL_PORT_TYPE_OUTPUT)
+		list = c->type->output_encodings;
+	if (!encoding_supported(list, port->format->encoding))
+		return MMAL_EINVAL;
+
+	status = c->type->commit(c, port);
+	if (status != MMAL_SUCCESS)
+		return status;
+
+	if (port->buffer_num < port->buffer_num_min)
+		port->buffer_num = port->buffer_num_min;
+	if (port->buffer_size < port->buffer_size_min)
+		port->buffer_size = port->buffer_size_min;
+
+	/* Outputs follow the input picture size, as on the firmware */
+	if (port->type == MMAL_PORT_TYPE_INPUT && port->index == 0) {
+		for (i = 0; i < c->comp.output_num; i++) {
+			MMAL_PORT_T *out = c->output[i];
+
+			out->format->es->video = port->format->es->video;
+			if (c->type->commit(c, out) == MMAL_SUCCESS &&
+			    out->buffer_size < out->buffer_size_min)
+				out->buffer_size = out->buffer_size_min;
+		}
+	}
+
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb)
+{
+	struct sw_port *p = (struct sw_port *)port->priv;
+
+	if (port->is_enabled)
+		return MMAL_EISCONN;
+	if (!cb)
+		return MMAL_EINVAL;
+
+	p->cb = cb;
+	port->is_enabled = 1;
+	sw_component_kick(p->c);
+
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_flush(MMAL_PORT_T *port)
+{
+	struct sw_port *p = (struct sw_port *)port->priv;
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	pthread_mutex_lock(&p->c->process_lock);
+	while ((buffer = mmal_queue_get(p->queue)) != NULL) {
+		buffer->length = 0;
+		p->cb(port, buffer);
+	}
+	pthread_mutex_unlock(&p->c->process_lock);
+
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_disable(MMAL_PORT_T *port)
+{
+	if (!port->is_enabled)
+		return MMAL_EINVAL;
+
+	/* Buffers come back to a port that is already disabled, as with MMAL */
+	port->is_enabled = 0;
+	mmal_port_flush(port);
+
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct sw_port *p = (struct sw_port *)port->priv;
+
+	if (!buffer || !port->is_enabled || port->type == MMAL_PORT_TYPE_CONTROL)
+		return MMAL_EINVAL;
+
+	mmal_queue_put(p->queue, buffer);
+	sw_component_kick(p->c);
+
+	return MMAL_SUCCESS;
+}
+
+typedef struct {
+	MMAL_PARAMETER_HEADER_T header;
+	MMAL_FOURCC_T encodings[];
+} SW_PARAMETER_ENCODINGS_T;
+
+MMAL_STATUS_T mmal_port_parameter_set(MMAL_PORT_T *port,
+				      const MMAL_PARAMETER_HEADER_T *param)
+{
+	struct sw_port *p = (struct sw_port *)port->priv;
+	struct sw_component *c = p->c;
+
+	switch (param->id) {
+	case MMAL_PARAMETER_ZERO_COPY:
+		p->zero_copy = ((const MMAL_PARAMETER_BOOLEAN_T *)param)->enable;
+		return MMAL_SUCCESS;
+	default:
+		if (!c->type->parameter_set)
+			return MMAL_ENOSYS;
+		return c->type->parameter_set(c, port, param);
+	}
+}
+
+MMAL_STATUS_T mmal_port_parameter_get(MMAL_PORT_T *port, MMAL_PARAMETER_HEADER_T *param)
+{
+	struct sw_port *p = (struct sw_port *)port->priv;
+	struct sw_component *c = p->c;
+	SW_PARAMETER_ENCODINGS_T *encodings;
+	const MMAL_FOURCC_T *list;
+	unsigned int room, n;
+
+	switch (param->id) {
+	case MMAL_PARAMETER_ZERO_COPY:
+		((MMAL_PARAMETER_BOOLEAN_T *)param)->enable = p->zero_copy;
+		return MMAL_SUCCESS;
+
+	case MMAL_PARAMETER_SUPPORTED_ENCODINGS:
+		list = port->type == MMAL_PORT_TYPE_INPUT ? c->type->input_encodings
+							  : c->type->output_encodings;
+		encodings = (SW_PARAMETER_ENCODINGS_T *)param;
+		room = (param->size - sizeof(*param)) / sizeof(MMAL_FOURCC_T);
+		for (n = 0; list && list[n]; n++) {
+			if (n < room)
+				encodings->encodings[n] = list[n];
+		}
+		param->size = sizeof(*param) + (n < room ? n : room) * sizeof(MMAL_FOURCC_T);
+		return n > room ? MMAL_ENOSPC : MMAL_SUCCESS;
+
+	default:
+		return MMAL_ENOSYS;
+	}
+}
+
+MMAL_STATUS_T mmal_port_parameter_set_boolean(MMAL_PORT_T *port, uint32_t id,
+					      MMAL_BOOL_T value)
+{
+	MMAL_PARAMETER_BOOLEAN_T param = { { id, sizeof(param) }, value };
+
+	return mmal_port_parameter_set(port, &param.hdr);
+}
+
+MMAL_STATUS_T mmal_port_parameter_get_boolean(MMAL_PORT_T *port, uint32_t id,
+					      MMAL_BOOL_T *value)
+{
+	MMAL_PARAMETER_BOOLEAN_T param = { { id, sizeof(param) }, 0 };
+	MMAL_STATUS_T status;
+
+	status = mmal_port_parameter_get(port, &param.hdr);
+	if (status == MMAL_SUCCESS)
+		*value = param.enable;
+	return status;
+}
+
+MMAL_STATUS_T mmal_port_parameter_set_uint32(MMAL_PORT_T *port, uint32_t id,
+					     uint32_t value)
+{
+	MMAL_PARAMETER_UINT32_T param = { { id, sizeof(param) }, value };
+
+	return mmal_port_parameter_set(port, &param.hdr);
+}
+
+MMAL_STATUS_T mmal_port_parameter_get_uint32(MMAL_PORT_T *port, uint32_t id,
+					     uint32_t *value)
+{
+	MMAL_PARAMETER_UINT32_T param = { { id, sizeof(param) }, 0 };
+	MMAL_STATUS_T status;
+
+	status = mmal_port_parameter_get(port, &param.hdr);
+	if (status == MMAL_SUCCESS)
+		*value = param.value;
+	return status;
+}
+
+/* -----------------------------------------------------------------------------
+ * Helpers for the component implementations
+ */
+
+/* Next buffer the client sent to an enabled port */
+MMAL_BUFFER_HEADER_T *sw_port_get(MMAL_PORT_T *port)
+{
+	struct sw_port *p = (struct sw_port *)port->priv;
+
+	if (!port->is_enabled)
+		return NULL;
+
+	return mmal_queue_get(p->queue);
+}
+
+/* Put back a buffer that couldn't be processed yet, keeping the order */
+void sw_port_unget(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct sw_port *p = (struct sw_port *)port->priv;
+
+	mmal_queue_put_back(p->queue, buffer);
+}
+
+/* Hand a buffer back to the client */
+void sw_port_return(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct sw_port *p = (struct sw_port *)port->priv;
+
+	p->cb(port, buffer);
+}
+
+void sw_component_kick(struct sw_component *c)
+{
+	pthread_mutex_lock(&c->lock);
+	c->pending = true;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void sw_component_delay(struct sw_component *c)
+{
+	struct timespec ts;
+
+	if (!c->latency_us)
+		return;
+
+	ts.tv_sec = c->latency_us / 1000000;
+	ts.tv_nsec = (c->latency_us % 1000000) * 1000L;
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+		;
+}
+
+/* Report an error event on the control port, as the firmware would */
+void sw_component_error(struct sw_component *c, MMAL_STATUS_T status)
+{
+	MMAL_PORT_T *control = c->comp.control;
+	MMAL_BUFFER_HEADER_T *event;
+
+	fprintf(stderr, "%s: error %s\n", c->comp.name, mmal_status_to_string(status));
+
+	if (!control->is_enabled)
+		return;
+
+	event = mmal_queue_get(c->events->queue);
+	if (!event)
+		return;
+
+	event->cmd = MMAL_EVENT_ERROR;
+	memcpy(event->data, &status, sizeof status);
+	event->length = sizeof status;
+	sw_port_return(control, event);
+}
+
+/* -----------------------------------------------------------------------------
+ * Components
+ */
+
+static void *sw_component_thread(void *arg)
+{
+	struct sw_component *c = arg;
+
+	pthread_mutex_lock(&c->lock);
+	while (!c->quit) {
+		if (!c->pending) {
+			pthread_cond_wait(&c->cond, &c->lock);
+			continue;
+		}
+		c->pending = false;
+		pthread_mutex_unlock(&c->lock);
+
+		pthread_mutex_lock(&c->process_lock);
+		while (c->type->process(c))
+			;
+		pthread_mutex_unlock(&c->process_lock);
+
+		pthread_mutex_lock(&c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+static int sw_port_init(struct sw_component *c, struct sw_port *p,
+			MMAL_PORT_TYPE_T type, unsigned int index,
+			unsigned int index_all)
+{
+	static const char * const types[] = {
+		[MMAL_PORT_TYPE_CONTROL] = "ctr",
+		[MMAL_PORT_TYPE_INPUT] = "in",
+		[MMAL_PORT_TYPE_OUTPUT] = "out",
+	};
+	MMAL_PORT_T *port = &p->port;
+	const MMAL_FOURCC_T *list;
+
+	p->c = c;
+	p->queue = mmal_queue_create();
+	if (!p->queue)
+		return -ENOMEM;
+
+	snprintf(p->name, sizeof(p->name), "%s:%s:%u", c->type->name, types[type], index);
+	p->format.es = &p->es;
+	p->format.extradata = p->extradata;
+
+	port->priv = (struct MMAL_PORT_PRIVATE_T *)p;
+	port->name = p->name;
+	port->type = type;
+	port->index = index;
+	port->index_all = index_all;
+	port->format = &p->format;
+	port->component = &c->comp;
+	port->buffer_num_min = 1;
+	port->buffer_num_recommended = 3;
+	port->buffer_alignment_min = 16;
+
+	if (type == MMAL_PORT_TYPE_CONTROL)
+		return 0;
+
+	list = type == MMAL_PORT_TYPE_INPUT ? c->type->input_encodings
+					    : c->type->output_encodings;
+	p->format.type = MMAL_ES_TYPE_VIDEO;
+	p->format.encoding = list ? list[0] : MMAL_ENCODING_I420;
+	p->format.flags = MMAL_ES_FORMAT_FLAG_FRAMED;
+	p->es.video.frame_rate.den = 1;
+	p->es.video.par.num = 1;
+	p->es.video.par.den = 1;
+
+	return 0;
+}
+
+/* MMAL_SW_LATENCY_<name without the vc.ril. prefix, upper case> */
+static unsigned int sw_component_latency(const char *name)
+{
+	char var[64] = "MMAL_SW_LATENCY_";
+	const char *value;
+	size_t len = strlen(var);
+
+	if (!strncmp(name, SW_COMPONENT_PREFIX, strlen(SW_COMPONENT_PREFIX)))
+		name += strlen(SW_COMPONENT_PREFIX);
+	for (; *name && len < sizeof(var) - 1; name++)
+		var[len++] = toupper((unsigned char)*name);
+	var[len] = '\0';
+
+	value = getenv(var);
+	return value ? strtoul(value, NULL, 0) : 0;
+}
+
+MMAL_STATUS_T mmal_component_create(const char *name, MMAL_COMPONENT_T **component)
+{
+	static unsigned int next_id;
+	const struct sw_component_type *type = NULL;
+	struct sw_component *c;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < sizeof(sw_components) / sizeof(sw_components[0]); i++) {
+		if (!strcmp(name, sw_components[i]->name))
+			type = sw_components[i];
+	}
+	if (!type)
+		return MMAL_ENOSYS;
+
+	c = calloc(1, sizeof *c);
+	if (!c)
+		return MMAL_ENOMEM;
+
+	c->type = type;
+	c->comp.priv = (struct MMAL_COMPONENT_PRIVATE_T *)c;
+	c->comp.name = type->name;
+	c->comp.id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+	c->latency_us = sw_component_latency(type->name);
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	pthread_mutex_init(&c->process_lock, NULL);
+
+	if (type->priv_size) {
+		c->priv = calloc(1, type->priv_size);
+		if (!c->priv)
+			goto error;
+	}
+
+	c->events = mmal_pool_create(SW_EVENT_BUFFERS, sizeof(MMAL_STATUS_T));
+	if (!c->events || sw_port_init(c, &c->control, MMAL_PORT_TYPE_CONTROL, 0, 0))
+		goto error;
+	c->comp.control = &c->control.port;
+	c->all[n++] = &c->control.port;
+
+	for (i = 0; i < type->inputs; i++, n++) {
+		if (sw_port_init(c, &c->ports[n - 1], MMAL_PORT_TYPE_INPUT, i, n))
+			goto error;
+		c->input[i] = &c->ports[n - 1].port;
+		c->all[n] = c->input[i];
+	}
+	for (i = 0; i < type->outputs; i++, n++) {
+		if (sw_port_init(c, &c->ports[n - 1], MMAL_PORT_TYPE_OUTPUT, i, n))
+			goto error;
+		c->output[i] = &c->ports[n - 1].port;
+		c->all[n] = c->output[i];
+	}
+
+	c->comp.input_num = type->inputs;
+	c->comp.input = c->input;
+	c->comp.output_num = type->outputs;
+	c->comp.output = c->output;
+	c->comp.port_num = n;
+	c->comp.port = c->all;
+
+	/* Work out the default buffer requirements */
+	for (i = 1; i < n; i++) {
+		type->commit(c, c->all[i]);
+		c->all[i]->buffer_num = c->all[i]->buffer_num_recommended;
+		c->all[i]->buffer_size = c->all[i]->buffer_size_recommended;
+	}
+
+	if (pthread_create(&c->thread, NULL, sw_component_thread, c))
+		goto error;
+
+	*component = &c->comp;
+	return MMAL_SUCCESS;
+
+error:
+	for (i = 0; i < 2 * SW_MAX_PORTS; i++) {
+		if (c->ports[i].queue)
+			mmal_queue_destroy(c->ports[i].queue);
+	}
+	if (c->control.queue)
+		mmal_queue_destroy(c->control.queue);
+	mmal_pool_destroy(c->events);
+	free(c->priv);
+	free(c);
+	return MMAL_ENOMEM;
+}
+
+MMAL_STATUS_T mmal_component_destroy(MMAL_COMPONENT_T *component)
+{
+	struct sw_component *c = (struct sw_component *)component->priv;
+	unsigned int i;
+
+	for (i = 0; i < component->port_num; i++) {
+		if (component->port[i]->is_enabled)
+			mmal_port_disable(component->port[i]);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	c->quit = true;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+
+	if (c->type->cleanup)
+		c->type->cleanup(c);
+
+	for (i = 0; i < component->port_num; i++)
+		mmal_queue_destroy(((struct sw_port *)component->port[i]->priv)->queue);
+	mmal_pool_destroy(c->events);
+	free(c->priv);
+	free(c);
+
+	return MMAL_SUCCESS;
+}
+
+/*
+ * Like the firmware components, processing starts as soon as the ports
+ * are enabled, so enabling the component only records the state.
+ */
+MMAL_STATUS_T mmal_component_enable(MMAL_COMPONENT_T *component)
+{
+	component->is_enabled = 1;
+	sw_component_kick((struct sw_component *)component->priv);
+
+	return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_component_disable(MMAL_COMPONENT_T *component)
+{
+	component->is_enabled = 0;
+
+	return MMAL_SUCCESS;
+}
+
+/* -----------------------------------------------------------------------------
+ * VCOS, bcm_host and VCSM
+ */
+
+VCOS_STATUS_T vcos_thread_create(VCOS_THREAD_T *thread, const char *name,
+				 VCOS_THREAD_ATTR_T *attrs,
+				 void *(*entry)(void *), void *arg)
+{
+	char comm[16];
+
+	(void)attrs;
+
+	if (pthread_create(&thread->thread, NULL, entry, arg))
+		return VCOS_ENOMEM;
+
+	snprintf(comm, sizeof(comm), "%s", name);
+	pthread_setname_np(thread->thread, comm);
+
+	return VCOS_SUCCESS;
+}
+
+void vcos_thread_join(VCOS_THREAD_T *thread, void **pData)
+{
+	pthread_join(thread->thread, pData);
+}
+
+void bcm_host_init(void)
+{
+}
+
+void bcm_host_deinit(void)
+{
+}
+
+/* There's no VideoCore memory, so buffers are never imported */
+int vcsm_init(void)
+{
+	return 0;
+}
+
+void vcsm_exit(void)
+{
+}
+
+unsigned int vcsm_import_dmabuf(int dmabuf, char *name)
+{
+	(void)dmabuf;
+	(void)name;
+
+	return 0;
+}
+
+void vcsm_free(unsigned int handle)
+{
+	(void)handle;
+}
+
+unsigned int vcsm_vc_hdl_from_hdl(unsigned int handle)
+{
+	(void)handle;
+
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * v4l2_mmal - software MMAL stand-in, component framework.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Every component runs its own worker thread, which is kicked whenever a
+ * buffer is sent to one of its ports. Buffers go back to the client through
+ * the port callbacks from that thread, as they would from the VideoCore
+ * callback thread.
+ */
+
+#ifndef __MMAL_SW_H__
+#define __MMAL_SW_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "interface/mmal/mmal.h"
+
+#define SW_MAX_PORTS		4
+#define SW_EXTRADATA_SIZE	256
+
+struct sw_component;
+
+struct sw_port {
+	MMAL_PORT_T port;
+	struct sw_component *c;
+	char name[64];
+
+	MMAL_ES_FORMAT_T format;
+	MMAL_ES_SPECIFIC_FORMAT_T es;
+	uint8_t extradata[SW_EXTRADATA_SIZE];
+
+	/* Buffers sent by the client, waiting for the component */
+	MMAL_QUEUE_T *queue;
+	MMAL_PORT_BH_CB_T cb;
+	bool zero_copy;
+};
+
+struct sw_component_type {
+	const char *name;
+	unsigned int inputs;
+	unsigned int outputs;
+	/* Zero terminated, NULL accepts anything */
+	const MMAL_FOURCC_T *input_encodings;
+	const MMAL_FOURCC_T *output_encodings;
+	size_t priv_size;
+
+	/* Work out buffer requirements for a newly committed format */
+	MMAL_STATUS_T (*commit)(struct sw_component *c, MMAL_PORT_T *port);
+	/* Component specific parameters, MMAL_ENOSYS if not handled */
+	MMAL_STATUS_T (*parameter_set)(struct sw_component *c, MMAL_PORT_T *port,
+				       const MMAL_PARAMETER_HEADER_T *param);
+	/* Called from the worker until it returns false (no progress) */
+	bool (*process)(struct sw_component *c);
+	void (*cleanup)(struct sw_component *c);
+};
+
+struct sw_component {
+	MMAL_COMPONENT_T comp;
+	const struct sw_component_type *type;
+
+	struct sw_port control;
+	struct sw_port ports[2 * SW_MAX_PORTS];
+	MMAL_PORT_T *input[SW_MAX_PORTS];
+	MMAL_PORT_T *output[SW_MAX_PORTS];
+	MMAL_PORT_T *all[2 * SW_MAX_PORTS + 1];
+	MMAL_POOL_T *events;
+
+	/* Simulated processing time per buffer */
+	unsigned int latency_us;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool pending;
+	bool quit;
+	/* Held while processing, so ports can be flushed safely */
+	pthread_mutex_t process_lock;
+
+	void *priv;
+};
+
+static inline struct sw_component *sw_component(MMAL_PORT_T *port)
+{
+	return ((struct sw_port *)port->priv)->c;
+}
+
+MMAL_BUFFER_HEADER_T *sw_port_get(MMAL_PORT_T *port);
+void sw_port_unget(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+void sw_port_return(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+void sw_component_kick(struct sw_component *c);
+void sw_component_delay(struct sw_component *c);
+void sw_component_error(struct sw_component *c, MMAL_STATUS_T status);
+uint32_t sw_frame_size(const MMAL_ES_FORMAT_T *format);
+
+extern const struct sw_component_type sw_isp;
+extern const struct sw_component_type sw_video_splitter;
+extern const struct sw_component_type sw_video_render;
+extern const struct sw_component_type sw_video_encode;
+extern const struct sw_component_type sw_image_encode;
+
+#endif
@@ -0,0 +1,516 @@
+/*
+ * v4l2_mmal - software MMAL stand-in, encoder stubs.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The encoders don't compress anything. They produce a stream with the
+ * shape of the real thing - valid SPS/PPS in a CONFIG buffer, IDR and
+ * non-IDR slice NAL units sized from the bitrate, frames split over several
+ * output buffers when they don't fit - filled with pseudo random payload
+ * that can't contain a start code. The input buffer is held until its
+ * whole frame has gone out, as on the firmware.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmal_sw.h"
+
+#define ENCODE_INTRA_PERIOD	60
+#define ENCODE_BITRATE		10000000
+#define ENCODE_FRAME_RATE	30
+#define ENCODE_OUTPUT_SIZE	(64 << 10)
+/* An IDR costs this many P frames */
+#define ENCODE_IDR_WEIGHT	4
+
+struct encoder {
+	bool jpeg;
+	MMAL_VIDEO_PROFILE_T profile;
+	MMAL_VIDEO_LEVEL_T level;
+	bool inline_header;
+	int idr_requested;		/* set from parameter_set */
+	unsigned int intra_period;
+	unsigned int frame_num;
+	bool headers_sent;
+	uint32_t seed;
+
+	/* Frame being sent, the input is held until it has all gone */
+	MMAL_BUFFER_HEADER_T *input;
+	uint8_t config[64];
+	size_t config_len;
+	uint8_t *frame;
+	size_t frame_size;
+	size_t frame_len;
+	size_t frame_pos;
+	uint32_t frame_flags;
+};
+
+struct bitwriter {
+	uint8_t *data;
+	size_t size;
+	size_t bits;
+};
+
+static void bw_put(struct bitwriter *bw, uint32_t value, unsigned int bits)
+{
+	while (bits--) {
+		size_t byte = bw->bits / 8;
+
+		if (byte >= bw->size)
+			return;
+		if (!(bw->bits % 8))
+			bw->data[byte] = 0;
+		if (value >> bits & 1)
+			bw->data[byte] |= 0x80 >> (bw->bits % 8);
+		bw->bits++;
+	}
+}
+
+static void bw_ue(struct bitwriter *bw, uint32_t value)
+{
+	unsigned int len = 0;
+
+	while ((value + 1) >> (len + 1))
+		len++;
+	bw_put(bw, 0, len);
+	bw_put(bw, value + 1, len + 1);
+}
+
+static void bw_se(struct bitwriter *bw, int32_t value)
+{
+	bw_ue(bw, value > 0 ? 2 * value - 1 : -2 * value);
+}
+
+/* rbsp_trailing_bits, returns the length in bytes */
+static size_t bw_finish(struct bitwriter *bw)
+{
+	bw_put(bw, 1, 1);
+	while (bw->bits % 8)
+		bw_put(bw, 0, 1);
+
+	return bw->bits / 8;
+}
+
+/* Append a NAL unit with start code and emulation prevention */
+static size_t put_nal(uint8_t *out, uint8_t header, const uint8_t *rbsp, size_t len)
+{
+	unsigned int zeros = 0;
+	size_t pos = 0, i;
+
+	out[pos++] = 0;
+	out[pos++] = 0;
+	out[pos++] = 0;
+	out[pos++] = 1;
+	out[pos++] = header;
+
+	for (i = 0; i < len; i++) {
+		if (zeros == 2 && rbsp[i] <= 3) {
+			out[pos++] = 3;
+			zeros = 0;
+		}
+		out[pos++] = rbsp[i];
+		zeros = rbsp[i] ? 0 : zeros + 1;
+	}
+
+	return pos;
+}
+
+static unsigned int profile_idc(MMAL_VIDEO_PROFILE_T profile)
+{
+	switch (profile) {
+	case MMAL_VIDEO_PROFILE_H264_BASELINE:
+		return 66;
+	case MMAL_VIDEO_PROFILE_H264_MAIN:
+		return 77;
+	case MMAL_VIDEO_PROFILE_H264_EXTENDED:
+		return 88;
+	default:
+		return 100;
+	}
+}
+
+static unsigned int level_idc(MMAL_VIDEO_LEVEL_T level)
+{
+	static const uint8_t levels[] = {
+		10, 9, 11, 12, 13, 20, 21, 22, 30, 31, 32, 40, 41, 42,
+	};
+	unsigned int i = level - MMAL_VIDEO_LEVEL_H264_1;
+
+	return i < sizeof(levels) ? levels[i] : 40;
+}
+
+static void encoder_write_config(struct encoder *e, unsigned int width, unsigned int height)
+{
+	unsigned int profile = profile_idc(e->profile);
+	unsigned int mbw = (width + 15) / 16, mbh = (height + 15) / 16;
+	uint8_t rbsp[32];
+	struct bitwriter bw = { rbsp, sizeof(rbsp), 0 };
+	size_t len;
+
+	/* SPS */
+	bw_put(&bw, profile, 8);
+	bw_put(&bw, 0, 8);			/* constraint flags */
+	bw_put(&bw, level_idc(e->level), 8);
+	bw_ue(&bw, 0);				/* seq_parameter_set_id */
+	if (profile == 100) {
+		bw_ue(&bw, 1);			/* chroma_format_idc 4:2:0 */
+		bw_ue(&bw, 0);			/* bit depths */
+		bw_ue(&bw, 0);
+		bw_put(&bw, 0, 1);
+		bw_put(&bw, 0, 1);		/* no scaling matrices */
+	}
+	bw_ue(&bw, 0);				/* log2_max_frame_num - 4 */
+	bw_ue(&bw, 2);				/* pic_order_cnt_type */
+	bw_ue(&bw, 1);				/* max_num_ref_frames */
+	bw_put(&bw, 0, 1);
+	bw_ue(&bw, mbw - 1);
+	bw_ue(&bw, mbh - 1);
+	bw_put(&bw, 1, 1);			/* frame_mbs_only */
+	bw_put(&bw, 1, 1);			/* direct_8x8_inference */
+	if (mbw * 16 != width || mbh * 16 != height) {
+		bw_put(&bw, 1, 1);
+		bw_ue(&bw, 0);
+		bw_ue(&bw, (mbw * 16 - width) / 2);
+		bw_ue(&bw, 0);
+		bw_ue(&bw, (mbh * 16 - height) / 2);
+	} else {
+		bw_put(&bw, 0, 1);
+	}
+	bw_put(&bw, 0, 1);			/* no VUI */
+	len = bw_finish(&bw);
+	e->config_len = put_nal(e->config, 0x67, rbsp, len);
+
+	/* PPS */
+	bw.bits = 0;
+	bw_ue(&bw, 0);				/* pic_parameter_set_id */
+	bw_ue(&bw, 0);				/* seq_parameter_set_id */
+	bw_put(&bw, profile != 66, 1);		/* CABAC */
+	bw_put(&bw, 0, 1);
+	bw_ue(&bw, 0);				/* slice groups */
+	bw_ue(&bw, 0);				/* num_ref_idx_l0 - 1 */
+	bw_ue(&bw, 0);
+	bw_put(&bw, 0, 1);			/* weighted prediction */
+	bw_put(&bw, 0, 2);
+	bw_se(&bw, 0);				/* pic_init_qp - 26 */
+	bw_se(&bw, 0);
+	bw_se(&bw, 0);				/* chroma_qp_index_offset */
+	bw_put(&bw, 1, 1);			/* deblocking_filter_control_present */
+	bw_put(&bw, 0, 1);
+	bw_put(&bw, 0, 1);
+	len = bw_finish(&bw);
+	e->config_len += put_nal(e->config + e->config_len, 0x68, rbsp, len);
+}
+
+static uint32_t encoder_random(struct encoder *e)
+{
+	e->seed = e->seed * 1103515245 + 12345;
+	return e->seed >> 8;
+}
+
+/* Fill with pseudo random bytes that can't form a start code or marker */
+static void encoder_fill(struct encoder *e, uint8_t *data, size_t len, uint8_t mask)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		data[i] = (encoder_random(e) & mask) | 1;
+}
+
+static int encoder_reserve(struct encoder *e, size_t len)
+{
+	uint8_t *frame;
+
+	if (len <= e->frame_size)
+		return 0;
+
+	frame = realloc(e->frame, len);
+	if (!frame)
+		return -1;
+
+	e->frame = frame;
+	e->frame_size = len;
+	return 0;
+}
+
+/* Average bytes per frame for the configured bitrate and frame rate */
+static size_t encoder_frame_bytes(struct sw_component *c)
+{
+	const MMAL_VIDEO_FORMAT_T *video = &c->input[0]->format->es->video;
+	uint32_t bitrate = c->output[0]->format->bitrate;
+	uint64_t num = video->frame_rate.num, den = video->frame_rate.den;
+
+	if (!bitrate)
+		bitrate = ENCODE_BITRATE;
+	if (!num || !den) {
+		num = ENCODE_FRAME_RATE;
+		den = 1;
+	}
+
+	return bitrate / 8 * den / num;
+}
+
+static int encoder_encode(struct sw_component *c, struct encoder *e)
+{
+	const MMAL_VIDEO_FORMAT_T *video = &c->input[0]->format->es->video;
+	unsigned int width = video->crop.width ? (unsigned int)video->crop.width : video->width;
+	unsigned int height = video->crop.height ? (unsigned int)video->crop.height : video->height;
+	size_t avg = encoder_frame_bytes(c), len;
+	bool idr;
+
+	e->frame_pos = 0;
+	e->frame_flags = 0;
+
+	if (e->jpeg) {
+		len = (size_t)width * height / 8 + 4;
+		if (encoder_reserve(e, len))
+			return -1;
+
+		e->frame[0] = 0xff;
+		e->frame[1] = 0xd8;			/* SOI */
+		encoder_fill(e, e->frame + 2, len - 4, 0x7f);
+		e->frame[len - 2] = 0xff;
+		e->frame[len - 1] = 0xd9;		/* EOI */
+		e->frame_len = len;
+		return 0;
+	}
+
+	idr = !e->intra_period || !(e->frame_num % e->intra_period) ||
+	      __atomic_exchange_n(&e->idr_requested, 0, __ATOMIC_ACQ_REL);
+	if (idr)
+		e->frame_num = 0;
+	e->frame_num++;
+
+	if (!e->headers_sent || (idr && e->inline_header)) {
+		encoder_write_config(e, width, height);
+		e->headers_sent = true;
+	}
+
+	/* Keep the average on target, with +-12.5% variation per frame */
+	len = avg * e->intra_period / (e->intra_period + ENCODE_IDR_WEIGHT - 1);
+	if (idr)
+		len *= ENCODE_IDR_WEIGHT;
+	len = len - len / 8 + encoder_random(e) % (len / 4 + 1);
+	if (len < 8)
+		len = 8;
+	if (encoder_reserve(e, len))
+		return -1;
+
+	e->frame[0] = 0;
+	e->frame[1] = 0;
+	e->frame[2] = 0;
+	e->frame[3] = 1;
+	e->frame[4] = idr ? 0x65 : 0x41;
+	encoder_fill(e, e->frame + 5, len - 5, 0xff);
+	e->frame_len = len;
+	e->frame_flags = idr ? MMAL_BUFFER_HEADER_FLAG_KEYFRAME : 0;
+
+	return 0;
+}
+
+static MMAL_STATUS_T encoder_commit(struct sw_component *c, MMAL_PORT_T *port)
+{
+	(void)c;
+
+	if (port->type == MMAL_PORT_TYPE_INPUT) {
+		port->buffer_size_min = sw_frame_size(port->format);
+		port->buffer_num_min = 1;
+		port->buffer_num_recommended = 3;
+	} else {
+		port->buffer_size_min = ENCODE_OUTPUT_SIZE / 4;
+		port->buffer_num_min = 1;
+		port->buffer_num_recommended = 3;
+	}
+	port->buffer_size_recommended = port->buffer_size_min < ENCODE_OUTPUT_SIZE ?
+					ENCODE_OUTPUT_SIZE : port->buffer_size_min;
+
+	return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T encoder_parameter_set(struct sw_component *c, MMAL_PORT_T *port,
+					   const MMAL_PARAMETER_HEADER_T *param)
+{
+	struct encoder *e = c->priv;
+	const MMAL_PARAMETER_VIDEO_PROFILE_T *profile;
+
+	(void)port;
+
+	switch (param->id) {
+	case MMAL_PARAMETER_PROFILE:
+		profile = (const MMAL_PARAMETER_VIDEO_PROFILE_T *)param;
+		e->profile = profile->profile[0].profile;
+		e->level = profile->profile[0].level;
+		return MMAL_SUCCESS;
+	case MMAL_PARAMETER_INTRAPERIOD:
+		e->intra_period = ((const MMAL_PARAMETER_UINT32_T *)param)->value;
+		return MMAL_SUCCESS;
+	case MMAL_PARAMETER_VIDEO_BIT_RATE:
+		c->output[0]->format->bitrate = ((const MMAL_PARAMETER_UINT32_T *)param)->value;
+		return MMAL_SUCCESS;
+	case MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME:
+		if (((const MMAL_PARAMETER_BOOLEAN_T *)param)->enable)
+			__atomic_store_n(&e->idr_requested, 1, __ATOMIC_RELEASE);
+		return MMAL_SUCCESS;
+	case MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER:
+		e->inline_header = ((const MMAL_PARAMETER_BOOLEAN_T *)param)->enable;
+		return MMAL_SUCCESS;
+	case MMAL_PARAMETER_VIDEO_IMMUTABLE_INPUT:
+		return MMAL_SUCCESS;
+	default:
+		return MMAL_ENOSYS;
+	}
+}
+
+/* Copy out the next piece of the current frame, false if no buffer */
+static bool encoder_output(struct sw_component *c, struct encoder *e)
+{
+	MMAL_BUFFER_HEADER_T *out;
+	size_t len;
+
+	out = sw_port_get(c->output[0]);
+	if (!out)
+		return false;
+
+	out->offset = 0;
+	out->dts = e->input->dts;
+	if (e->config_len) {
+		len = e->config_len < out->alloc_size ? e->config_len : out->alloc_size;
+		memcpy(out->data, e->config, len);
+		out->flags = MMAL_BUFFER_HEADER_FLAG_CONFIG | MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+		out->pts = MMAL_TIME_UNKNOWN;
+		e->config_len = 0;
+	} else {
+		len = e->frame_len - e->frame_pos;
+		if (len > out->alloc_size)
+			len = out->alloc_size;
+		memcpy(out->data, e->frame + e->frame_pos, len);
+		e->frame_pos += len;
+		out->flags = e->frame_flags;
+		if (e->frame_pos == e->frame_len)
+			out->flags |= MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+		out->pts = e->input->pts;
+	}
+	out->length = len;
+
+	sw_port_return(c->output[0], out);
+	return true;
+}
+
+static bool encoder_process(struct sw_component *c)
+{
+	struct encoder *e = c->priv;
+	MMAL_BUFFER_HEADER_T *in;
+
+	if (!e->input) {
+		in = sw_port_get(c->input[0]);
+		if (!in)
+			return false;
+
+		if (!in->length) {
+			sw_port_return(c->input[0], in);
+			return true;
+		}
+
+		sw_component_delay(c);
+		if (encoder_encode(c, e) < 0) {
+			sw_component_error(c, MMAL_ENOMEM);
+			sw_port_return(c->input[0], in);
+			return true;
+		}
+		e->input = in;
+	}
+
+	while (e->config_len || e->frame_pos < e->frame_len) {
+		if (!encoder_output(c, e))
+			return false;
+	}
+
+	sw_port_return(c->input[0], e->input);
+	e->input = NULL;
+
+	return true;
+}
+
+static void encoder_cleanup(struct sw_component *c)
+{
+	struct encoder *e = c->priv;
+
+	free(e->frame);
+}
+
+static const MMAL_FOURCC_T encoder_input_encodings[] = {
+	MMAL_ENCODING_I420,
+	0
+};
+
+static const MMAL_FOURCC_T video_encoder_output_encodings[] = {
+	MMAL_ENCODING_H264,
+	0
+};
+
+static const MMAL_FOURCC_T image_encoder_output_encodings[] = {
+	MMAL_ENCODING_JPEG,
+	0
+};
+
+static MMAL_STATUS_T video_encoder_commit(struct sw_component *c, MMAL_PORT_T *port)
+{
+	struct encoder *e = c->priv;
+
+	if (!e->intra_period) {
+		e->intra_period = ENCODE_INTRA_PERIOD;
+		e->profile = MMAL_VIDEO_PROFILE_H264_HIGH;
+		e->level = MMAL_VIDEO_LEVEL_H264_4;
+		e->seed = c->comp.id;
+	}
+
+	/* A new input format starts a new stream, headers and IDR first */
+	if (port->type == MMAL_PORT_TYPE_INPUT) {
+		e->headers_sent = false;
+		e->frame_num = 0;
+	}
+
+	return encoder_commit(c, port);
+}
+
+static MMAL_STATUS_T image_encoder_commit(struct sw_component *c, MMAL_PORT_T *port)
+{
+	struct encoder *e = c->priv;
+
+	e->jpeg = true;
+	return encoder_commit(c, port);
+}
+
+const struct sw_component_type sw_video_encode = {
+	.name = "vc.ril.video_encode",
+	.inputs = 1,
+	.outputs = 1,
+	.input_encodings = encoder_input_encodings,
+	.output_encodings = video_encoder_output_encodings,
+	.priv_size = sizeof(struct encoder),
+	.commit = video_encoder_commit,
+	.parameter_set = encoder_parameter_set,
+	.process = encoder_process,
+	.cleanup = encoder_cleanup,
+};
+
+const struct sw_component_type sw_image_encode = {
+	.name = "vc.ril.image_encode",
+	.inputs = 1,
+	.outputs = 1,
+	.input_encodings = encoder_input_encodings,
+	.output_encodings = image_encoder_output_encodings,
+	.priv_size = sizeof(struct encoder),
+	.commit = image_encoder_commit,
+	.parameter_set = encoder_parameter_set,
+	.process = encoder_process,
+	.cleanup = encoder_cleanup,
+};
@@ -0,0 +1,503 @@
+/*
+ * v4l2_mmal - software MMAL stand-in, ISP, splitter and render.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The ISP converts any of the capture formats v4l2_mmal knows about to
+ * I420, scaling with nearest neighbour sampling. Bayer input is
+ * demosaiced by treating each 2x2 quad as one RGB sample.
+ */
+
+#include <string.h>
+
+#include "interface/mmal/util/mmal_util.h"
+
+#include "mmal_sw.h"
+
+/* Where to read pixels from in an input buffer */
+struct isp_src {
+	MMAL_FOURCC_T encoding;
+	const uint8_t *data;
+	const uint8_t *chroma;
+	unsigned int stride;
+	unsigned int chroma_stride;
+	const uint8_t *cr;
+};
+
+static const MMAL_FOURCC_T isp_input_encodings[] = {
+	MMAL_ENCODING_I420,
+	MMAL_ENCODING_NV12,
+	MMAL_ENCODING_NV21,
+	MMAL_ENCODING_YUYV,
+	MMAL_ENCODING_YVYU,
+	MMAL_ENCODING_UYVY,
+	MMAL_ENCODING_VYUY,
+	MMAL_ENCODING_RGB16,
+	MMAL_ENCODING_RGB24,
+	MMAL_ENCODING_BGR24,
+	MMAL_ENCODING_RGB32,
+	MMAL_ENCODING_BGR32,
+	MMAL_ENCODING_BGRA,
+	MMAL_ENCODING_ARGB,
+	MMAL_ENCODING_BAYER_SBGGR8,
+	MMAL_ENCODING_BAYER_SGBRG8,
+	MMAL_ENCODING_BAYER_SGRBG8,
+	MMAL_ENCODING_BAYER_SRGGB8,
+	MMAL_ENCODING_BAYER_SBGGR10P,
+	MMAL_ENCODING_BAYER_SGRBG10P,
+	MMAL_ENCODING_BAYER_SGBRG10P,
+	MMAL_ENCODING_BAYER_SRGGB10P,
+	0
+};
+
+static const MMAL_FOURCC_T isp_output_encodings[] = {
+	MMAL_ENCODING_I420,
+	0
+};
+
+static inline uint8_t clamp8(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline uint8_t bayer_pixel(const struct isp_src *s, unsigned int x, unsigned int y)
+{
+	const uint8_t *row = s->data + y * s->stride;
+
+	switch (s->encoding) {
+	case MMAL_ENCODING_BAYER_SBGGR10P:
+	case MMAL_ENCODING_BAYER_SGRBG10P:
+	case MMAL_ENCODING_BAYER_SGBRG10P:
+	case MMAL_ENCODING_BAYER_SRGGB10P:
+		/* Four pixels in five bytes, the first four hold the MSBs */
+		return row[x / 4 * 5 + x % 4];
+	default:
+		return row[x];
+	}
+}
+
+static void bayer_rgb(const struct isp_src *s, unsigned int x, unsigned int y,
+		      int *r, int *g, int *b)
+{
+	uint8_t p[2][2];
+	unsigned int rx, ry;
+
+	x &= ~1;
+	y &= ~1;
+	p[0][0] = bayer_pixel(s, x, y);
+	p[0][1] = bayer_pixel(s, x + 1, y);
+	p[1][0] = bayer_pixel(s, x, y + 1);
+	p[1][1] = bayer_pixel(s, x + 1, y + 1);
+
+	/* Position of red in the quad, blue is diagonally opposite */
+	switch (s->encoding) {
+	case MMAL_ENCODING_BAYER_SBGGR8:
+	case MMAL_ENCODING_BAYER_SBGGR10P:
+		rx = 1, ry = 1;
+		break;
+	case MMAL_ENCODING_BAYER_SGBRG8:
+	case MMAL_ENCODING_BAYER_SGBRG10P:
+		rx = 0, ry = 1;
+		break;
+	case MMAL_ENCODING_BAYER_SGRBG8:
+	case MMAL_ENCODING_BAYER_SGRBG10P:
+		rx = 1, ry = 0;
+		break;
+	default:
+		rx = 0, ry = 0;
+		break;
+	}
+
+	*r = p[ry][rx];
+	*b = p[!ry][!rx];
+	*g = (p[ry][!rx] + p[!ry][rx] + 1) / 2;
+}
+
+static void isp_rgb(const struct isp_src *s, unsigned int x, unsigned int y,
+		    int *r, int *g, int *b)
+{
+	const uint8_t *row = s->data + y * s->stride;
+	const uint8_t *p;
+	uint16_t v;
+
+	switch (s->encoding) {
+	case MMAL_ENCODING_RGB16:
+		v = row[x * 2] | row[x * 2 + 1] << 8;
+		*r = (v >> 8 & 0xf8) | v >> 13;
+		*g = (v >> 3 & 0xfc) | (v >> 9 & 0x03);
+		*b = (v << 3 & 0xf8) | (v >> 2 & 0x07);
+		break;
+	case MMAL_ENCODING_RGB24:
+		p = row + x * 3;
+		*r = p[0], *g = p[1], *b = p[2];
+		break;
+	case MMAL_ENCODING_BGR24:
+		p = row + x * 3;
+		*b = p[0], *g = p[1], *r = p[2];
+		break;
+	case MMAL_ENCODING_RGB32:
+		p = row + x * 4;
+		*r = p[0], *g = p[1], *b = p[2];
+		break;
+	case MMAL_ENCODING_BGR32:
+	case MMAL_ENCODING_BGRA:
+		p = row + x * 4;
+		*b = p[0], *g = p[1], *r = p[2];
+		break;
+	case MMAL_ENCODING_ARGB:
+		p = row + x * 4;
+		*r = p[1], *g = p[2], *b = p[3];
+		break;
+	default:
+		bayer_rgb(s, x, y, r, g, b);
+		break;
+	}
+}
+
+/* BT.601 limited range */
+static inline uint8_t rgb_y(int r, int g, int b)
+{
+	return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+static inline uint8_t rgb_u(int r, int g, int b)
+{
+	return clamp8(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+static inline uint8_t rgb_v(int r, int g, int b)
+{
+	return clamp8(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+/* Byte offsets of Y0, U and V within a packed 4:2:2 pixel pair */
+static void yuv422_layout(MMAL_FOURCC_T encoding, unsigned int *y, unsigned int *u,
+			  unsigned int *v)
+{
+	switch (encoding) {
+	case MMAL_ENCODING_YUYV:
+		*y = 0, *u = 1, *v = 3;
+		break;
+	case MMAL_ENCODING_YVYU:
+		*y = 0, *u = 3, *v = 1;
+		break;
+	case MMAL_ENCODING_UYVY:
+		*y = 1, *u = 0, *v = 2;
+		break;
+	default:	/* VYUY */
+		*y = 1, *u = 2, *v = 0;
+		break;
+	}
+}
+
+static uint8_t isp_luma(const struct isp_src *s, unsigned int x, unsigned int y)
+{
+	unsigned int yo, uo, vo;
+	int r, g, b;
+
+	switch (s->encoding) {
+	case MMAL_ENCODING_I420:
+	case MMAL_ENCODING_NV12:
+	case MMAL_ENCODING_NV21:
+		return s->data[y * s->stride + x];
+	case MMAL_ENCODING_YUYV:
+	case MMAL_ENCODING_YVYU:
+	case MMAL_ENCODING_UYVY:
+	case MMAL_ENCODING_VYUY:
+		yuv422_layout(s->encoding, &yo, &uo, &vo);
+		return s->data[y * s->stride + x * 2 + yo];
+	default:
+		isp_rgb(s, x, y, &r, &g, &b);
+		return rgb_y(r, g, b);
+	}
+}
+
+/* Chroma at (x, y) in full resolution input coordinates */
+static void isp_chroma(const struct isp_src *s, unsigned int x, unsigned int y,
+		       uint8_t *u, uint8_t *v)
+{
+	const uint8_t *p;
+	unsigned int yo, uo, vo;
+	int r, g, b;
+
+	switch (s->encoding) {
+	case MMAL_ENCODING_I420:
+		*u = s->chroma[y / 2 * s->chroma_stride + x / 2];
+		*v = s->cr[y / 2 * s->chroma_stride + x / 2];
+		break;
+	case MMAL_ENCODING_NV12:
+	case MMAL_ENCODING_NV21:
+		p = s->chroma + y / 2 * s->chroma_stride + (x & ~1);
+		*u = p[s->encoding == MMAL_ENCODING_NV21];
+		*v = p[s->encoding == MMAL_ENCODING_NV12];
+		break;
+	case MMAL_ENCODING_YUYV:
+	case MMAL_ENCODING_YVYU:
+	case MMAL_ENCODING_UYVY:
+	case MMAL_ENCODING_VYUY:
+		yuv422_layout(s->encoding, &yo, &uo, &vo);
+		p = s->data + y * s->stride + (x & ~1) * 2;
+		*u = p[uo];
+		*v = p[vo];
+		break;
+	default:
+		isp_rgb(s, x, y, &r, &g, &b);
+		*u = rgb_u(r, g, b);
+		*v = rgb_v(r, g, b);
+		break;
+	}
+}
+
+/*
+ * Input planes are where the buffer's video specific data says they are,
+ * or laid out contiguously for the port format when it gives no planes.
+ */
+static void isp_convert(const MMAL_ES_FORMAT_T *in_fmt, const uint8_t *in,
+			const MMAL_BUFFER_HEADER_VIDEO_SPECIFIC_T *planes,
+			const MMAL_ES_FORMAT_T *out_fmt, uint8_t *out)
+{
+	const MMAL_VIDEO_FORMAT_T *iv = &in_fmt->es->video;
+	const MMAL_VIDEO_FORMAT_T *ov = &out_fmt->es->video;
+	unsigned int iw = iv->crop.width ? (unsigned int)iv->crop.width : iv->width;
+	unsigned int ih = iv->crop.height ? (unsigned int)iv->crop.height : iv->height;
+	unsigned int ow = ov->crop.width ? (unsigned int)ov->crop.width : ov->width;
+	unsigned int oh = ov->crop.height ? (unsigned int)ov->crop.height : ov->height;
+	unsigned int ostride = ov->width;
+	uint8_t *oy = out, *ou = out + ostride * ov->height;
+	uint8_t *ovp = ou + ostride / 2 * (ov->height / 2);
+	uint32_t xstep = ((uint64_t)iw << 16) / ow;
+	uint32_t ystep = ((uint64_t)ih << 16) / oh;
+	struct isp_src s;
+	unsigned int x, y;
+
+	s.encoding = in_fmt->encoding;
+	s.data = in;
+	s.stride = mmal_encoding_width_to_stride(in_fmt->encoding, iv->width);
+	s.chroma = in + s.stride * iv->height;
+	s.chroma_stride = s.encoding == MMAL_ENCODING_I420 ? s.stride / 2 : s.stride;
+	s.cr = s.chroma + s.chroma_stride * (iv->height / 2);
+
+	if (planes->planes > 1) {
+		s.stride = planes->pitch[0];
+		s.chroma = in + planes->offset[1];
+		s.chroma_stride = planes->pitch[1];
+		if (planes->planes > 2)
+			s.cr = in + planes->offset[2];
+	}
+
+	/* Same layout in and out, nothing to convert */
+	if (s.encoding == MMAL_ENCODING_I420 && planes->planes <= 1 &&
+	    iw == ow && ih == oh && iv->width == ov->width && iv->height == ov->height) {
+		memcpy(out, in, sw_frame_size(out_fmt));
+		return;
+	}
+
+	for (y = 0; y < oh; y++) {
+		unsigned int sy = (uint64_t)y * ystep >> 16;
+
+		for (x = 0; x < ow; x++)
+			oy[y * ostride + x] = isp_luma(&s, (uint64_t)x * xstep >> 16, sy);
+	}
+
+	for (y = 0; y < oh / 2; y++) {
+		unsigned int sy = (uint64_t)y * 2 * ystep >> 16;
+
+		for (x = 0; x < ow / 2; x++)
+			isp_chroma(&s, (uint64_t)x * 2 * xstep >> 16, sy,
+				   &ou[y * ostride / 2 + x], &ovp[y * ostride / 2 + x]);
+	}
+}
+
+/*
+ * Smallest buffer the conversion can read from. Planes are laid out using
+ * the aligned height, but packed formats only need the visible lines.
+ */
+static uint32_t isp_input_size(const MMAL_ES_FORMAT_T *format,
+			       const MMAL_BUFFER_HEADER_VIDEO_SPECIFIC_T *planes)
+{
+	const MMAL_VIDEO_FORMAT_T *video = &format->es->video;
+	uint32_t lines = video->crop.height ? (uint32_t)video->crop.height : video->height;
+	unsigned int last = planes->planes - 1;
+
+	/* Separate planes end with the visible lines of the last chroma plane */
+	if (planes->planes > 1)
+		return planes->offset[last] + planes->pitch[last] * (lines / 2);
+
+	switch (format->encoding) {
+	case MMAL_ENCODING_I420:
+	case MMAL_ENCODING_NV12:
+	case MMAL_ENCODING_NV21:
+		return sw_frame_size(format);
+	default:
+		return mmal_encoding_width_to_stride(format->encoding, video->width) * lines;
+	}
+}
+
+static MMAL_STATUS_T isp_commit(struct sw_component *c, MMAL_PORT_T *port)
+{
+	(void)c;
+
+	port->buffer_size_min = sw_frame_size(port->format);
+	port->buffer_size_recommended = port->buffer_size_min;
+	port->buffer_num_min = 1;
+	port->buffer_num_recommended = 3;
+
+	return MMAL_SUCCESS;
+}
+
+static bool isp_process(struct sw_component *c)
+{
+	MMAL_PORT_T *input = c->input[0], *output = c->output[0];
+	MMAL_BUFFER_HEADER_T *in, *out;
+	uint32_t size;
+
+	in = sw_port_get(input);
+	if (!in)
+		return false;
+
+	out = sw_port_get(output);
+	if (!out) {
+		sw_port_unget(input, in);
+		return false;
+	}
+
+	sw_component_delay(c);
+
+	size = sw_frame_size(output->format);
+	if (in->length < isp_input_size(input->format, &in->type->video) ||
+	    out->alloc_size < size) {
+		sw_component_error(c, MMAL_EINVAL);
+		sw_port_unget(output, out);
+		sw_port_return(input, in);
+		return true;
+	}
+
+	isp_convert(input->format, in->data + in->offset, &in->type->video,
+		    output->format, out->data);
+
+	out->offset = 0;
+	out->length = size;
+	out->flags = in->flags;
+	out->pts = in->pts;
+	out->dts = in->dts;
+
+	sw_port_return(input, in);
+	sw_port_return(output, out);
+
+	return true;
+}
+
+const struct sw_component_type sw_isp = {
+	.name = "vc.ril.isp",
+	.inputs = 1,
+	.outputs = 1,
+	.input_encodings = isp_input_encodings,
+	.output_encodings = isp_output_encodings,
+	.commit = isp_commit,
+	.process = isp_process,
+};
+
+/* -----------------------------------------------------------------------------
+ * Splitter: copies every input buffer to each enabled output
+ */
+
+static bool splitter_process(struct sw_component *c)
+{
+	MMAL_BUFFER_HEADER_T *in, *out[SW_MAX_PORTS] = { NULL };
+	unsigned int i;
+
+	in = sw_port_get(c->input[0]);
+	if (!in)
+		return false;
+
+	/* Wait until every enabled output has somewhere to put the copy */
+	for (i = 0; i < c->comp.output_num; i++) {
+		if (!c->output[i]->is_enabled)
+			continue;
+
+		out[i] = sw_port_get(c->output[i]);
+		if (!out[i] || out[i]->alloc_size < in->length) {
+			if (out[i])
+				sw_port_unget(c->output[i], out[i]);
+			while (i--) {
+				if (out[i])
+					sw_port_unget(c->output[i], out[i]);
+			}
+			sw_port_unget(c->input[0], in);
+			return false;
+		}
+	}
+
+	sw_component_delay(c);
+
+	for (i = 0; i < c->comp.output_num; i++) {
+		if (!out[i])
+			continue;
+
+		memcpy(out[i]->data, in->data + in->offset, in->length);
+		out[i]->offset = 0;
+		out[i]->length = in->length;
+		out[i]->flags = in->flags;
+		out[i]->pts = in->pts;
+		out[i]->dts = in->dts;
+		*out[i]->type = *in->type;
+		sw_port_return(c->output[i], out[i]);
+	}
+	sw_port_return(c->input[0], in);
+
+	return true;
+}
+
+const struct sw_component_type sw_video_splitter = {
+	.name = "vc.ril.video_splitter",
+	.inputs = 1,
+	.outputs = 4,
+	.commit = isp_commit,
+	.process = splitter_process,
+};
+
+/* -----------------------------------------------------------------------------
+ * Render: a null sink that holds each buffer for its display time
+ */
+
+static MMAL_STATUS_T render_parameter_set(struct sw_component *c, MMAL_PORT_T *port,
+					  const MMAL_PARAMETER_HEADER_T *param)
+{
+	(void)c;
+	(void)port;
+
+	/* Accept display region changes, there is no display to apply them to */
+	return param->id == MMAL_PARAMETER_DISPLAYREGION ? MMAL_SUCCESS : MMAL_ENOSYS;
+}
+
+static bool render_process(struct sw_component *c)
+{
+	MMAL_BUFFER_HEADER_T *in;
+
+	in = sw_port_get(c->input[0]);
+	if (!in)
+		return false;
+
+	sw_component_delay(c);
+	sw_port_return(c->input[0], in);
+
+	return true;
+}
+
+const struct sw_component_type sw_video_render = {
+	.name = "vc.ril.video_render",
+	.inputs = 1,
+	.outputs = 0,
+	.commit = isp_commit,
+	.parameter_set = render_parameter_set,
+	.process = render_process,
+};
@@ -0,0 +1,365 @@
+/*
+ * v4l2_mmal - frame trace analysis.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Reads a trace written by v4l2_mmal --trace and reports frame interval
+ * jitter, gaps in the V4L2 sequence numbers, how those drops cluster, and
+ * the distribution of each pipeline stage's latency.
+ *
+ * The nominal frame interval is taken from the timestamps and sequence
+ * numbers over the whole run, so non-integer rates such as 59.94 fps are
+ * measured rather than assumed.
+ *
+ * Usage: trace_report [-w cluster_ms] [-n clusters] trace.bin
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#include "../latency.h"
+#include "../trace.h"
+
+#ifndef V4L2_BUF_FLAG_ERROR
+#define V4L2_BUF_FLAG_ERROR	0x0040
+#endif
+
+/* Drops closer together than this are reported as one cluster */
+#define CLUSTER_GAP_MS_DEFAULT	1000
+#define CLUSTERS_SHOWN_DEFAULT	10
+
+struct trace_file {
+	FILE *fp;
+	struct trace_file_header header;
+	long data_offset;
+	bool has_stages;
+};
+
+struct cluster {
+	uint64_t start_ns;
+	uint64_t end_ns;
+	unsigned int first_sequence;
+	unsigned int events;
+	uint64_t lost;
+};
+
+static const char *stage_names[] = { "isp_send", "isp_output" };
+static const char *sink_stage_names[] = { "sink_return", "encoded", "written" };
+
+static int trace_open(struct trace_file *tf, const char *path)
+{
+	size_t size;
+
+	memset(tf, 0, sizeof *tf);
+
+	tf->fp = fopen(path, "rb");
+	if (!tf->fp)
+		return -errno;
+
+	/* The version 1 header, then whatever this version adds */
+	size = offsetof(struct trace_file_header, header_size);
+	if (fread(&tf->header, size, 1, tf->fp) != 1 ||
+	    memcmp(tf->header.magic, TRACE_MAGIC, sizeof tf->header.magic))
+		return -EINVAL;
+
+	if (tf->header.version >= 2) {
+		if (fread(&tf->header.header_size, sizeof tf->header.header_size, 1, tf->fp) != 1 ||
+		    tf->header.header_size < size + sizeof tf->header.header_size)
+			return -EINVAL;
+
+		size += sizeof tf->header.header_size;
+		if (tf->header.header_size > size &&
+		    fread((char *)&tf->header + size,
+			  (tf->header.header_size < sizeof tf->header
+			   ? tf->header.header_size : sizeof tf->header) - size,
+			  1, tf->fp) != 1)
+			return -EINVAL;
+		size = tf->header.header_size;
+		tf->has_stages = true;
+	}
+
+	if (!tf->header.record_size)
+		return -EINVAL;
+	if (tf->header.num_sinks > LATENCY_MAX_SINKS)
+		tf->header.num_sinks = LATENCY_MAX_SINKS;
+
+	tf->data_offset = size;
+	return fseek(tf->fp, tf->data_offset, SEEK_SET) < 0 ? -errno : 0;
+}
+
+static bool trace_next(struct trace_file *tf, struct trace_record *rec)
+{
+	uint8_t buf[1024];
+	size_t size = tf->header.record_size;
+
+	if (size > sizeof buf) {
+		if (fread(buf, sizeof buf, 1, tf->fp) != 1 ||
+		    fseek(tf->fp, size - sizeof buf, SEEK_CUR) < 0)
+			return false;
+		size = sizeof buf;
+	} else if (fread(buf, size, 1, tf->fp) != 1) {
+		return false;
+	}
+
+	memset(rec, 0, sizeof *rec);
+	memcpy(rec, buf, size < sizeof *rec ? size : sizeof *rec);
+	if (!tf->has_stages)
+		rec->pts = INT64_MIN;
+
+	return true;
+}
+
+static void trace_rewind(struct trace_file *tf)
+{
+	fseek(tf->fp, tf->data_offset, SEEK_SET);
+}
+
+static void print_hist(const char *name, const struct latency_hist *h)
+{
+	if (!h->count) {
+		printf("  %-32s no samples\n", name);
+		return;
+	}
+
+	printf("  %-32s %8llu  avg %8llu  p50 %8llu  p99 %8llu  p99.9 %8llu  max %8llu us\n",
+	       name, (unsigned long long)h->count,
+	       (unsigned long long)(h->total_ns / h->count / 1000),
+	       (unsigned long long)latency_percentile(h, 50) / 1000,
+	       (unsigned long long)latency_percentile(h, 99) / 1000,
+	       (unsigned long long)latency_percentile(h, 99.9) / 1000,
+	       (unsigned long long)h->max_ns / 1000);
+}
+
+static int cluster_cmp(const void *a, const void *b)
+{
+	const struct cluster *ca = a, *cb = b;
+
+	if (ca->lost != cb->lost)
+		return ca->lost < cb->lost ? 1 : -1;
+	return ca->start_ns < cb->start_ns ? -1 : ca->start_ns > cb->start_ns;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [options] trace.bin\n", argv0);
+	printf("-w, --cluster-gap ms	Merge drops closer than this into one cluster (default %u)\n",
+	       CLUSTER_GAP_MS_DEFAULT);
+	printf("-n, --clusters n	Number of clusters listed, largest first (default %u)\n",
+	       CLUSTERS_SHOWN_DEFAULT);
+	printf("-h, --help		Show this help screen\n");
+}
+
+static struct option opts[] = {
+	{"cluster-gap", 1, 0, 'w'},
+	{"clusters", 1, 0, 'n'},
+	{"help", 0, 0, 'h'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char *argv[])
+{
+	static struct latency_hist interval, jitter, arrival, stages[LATENCY_STAGES];
+	unsigned int cluster_gap_ms = CLUSTER_GAP_MS_DEFAULT;
+	unsigned int clusters_shown = CLUSTERS_SHOWN_DEFAULT;
+	uint64_t not_reached[LATENCY_STAGES] = { 0 };
+	uint64_t records = 0, errors = 0, reordered = 0, trace_missing = 0;
+	uint64_t lost = 0, gap_events = 0, max_gap = 0, sent = 0;
+	uint64_t first_ts = 0, last_ts = 0, nominal_ns;
+	unsigned int first_seq = 0, last_seq = 0;
+	struct cluster *clusters = NULL, *cl = NULL;
+	unsigned int num_clusters = 0, i, j;
+	struct trace_record rec, prev;
+	struct trace_file tf;
+	char name[64];
+	int c, ret;
+
+	while ((c = getopt_long(argc, argv, "hn:w:", opts, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			clusters_shown = atoi(optarg);
+			break;
+		case 'w':
+			cluster_gap_ms = atoi(optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = trace_open(&tf, argv[optind]);
+	if (ret < 0) {
+		fprintf(stderr, "Can't read trace %s: %s\n", argv[optind],
+			ret == -EINVAL ? "not a v4l2_mmal trace" : strerror(-ret));
+		return 1;
+	}
+
+	/* First pass for the span of the run, and so the nominal interval */
+	while (trace_next(&tf, &rec)) {
+		if (!records) {
+			first_ts = rec.timestamp_ns;
+			first_seq = rec.sequence;
+		}
+		last_ts = rec.timestamp_ns;
+		last_seq = rec.sequence;
+		records++;
+	}
+
+	if (records < 2) {
+		printf("%llu frames, nothing to analyse\n", (unsigned long long)records);
+		return 0;
+	}
+
+	nominal_ns = last_seq != first_seq && last_ts > first_ts
+		   ? (last_ts - first_ts) / (last_seq - first_seq) : 0;
+
+	trace_rewind(&tf);
+	records = 0;
+
+	while (trace_next(&tf, &rec)) {
+		if (rec.flags & V4L2_BUF_FLAG_ERROR)
+			errors++;
+
+		/* Only meaningful when the timestamp is from the same clock */
+		if ((rec.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+		    rec.arrival_ns >= rec.timestamp_ns)
+			latency_record(&arrival, rec.arrival_ns - rec.timestamp_ns);
+
+		if (rec.pts != INT64_MIN) {
+			sent++;
+			for (i = 0; i < LATENCY_STAGES; i++) {
+				if (rec.stage_us[i])
+					latency_record(&stages[i], rec.stage_us[i] * 1000ULL);
+				else
+					not_reached[i]++;
+			}
+		}
+
+		if (records && rec.frame != prev.frame + 1)
+			trace_missing += rec.frame - prev.frame - 1;
+
+		if (records && (int32_t)(rec.sequence - prev.sequence) <= 0) {
+			reordered++;
+		} else if (records) {
+			uint64_t steps = rec.sequence - prev.sequence;
+			uint64_t delta = rec.timestamp_ns - prev.timestamp_ns;
+
+			/* Interval per sequence step, so a drop isn't also counted as jitter */
+			latency_record(&interval, delta / steps);
+			if (nominal_ns)
+				latency_record(&jitter, delta / steps > nominal_ns
+					       ? delta / steps - nominal_ns
+					       : nominal_ns - delta / steps);
+
+			if (steps > 1) {
+				gap_events++;
+				lost += steps - 1;
+				if (steps - 1 > max_gap)
+					max_gap = steps - 1;
+
+				if (!cl || prev.timestamp_ns - cl->end_ns > cluster_gap_ms * 1000000ULL) {
+					struct cluster *grown;
+
+					grown = realloc(clusters, (num_clusters + 1) * sizeof *clusters);
+					if (!grown) {
+						fprintf(stderr, "Out of memory\n");
+						return 1;
+					}
+					clusters = grown;
+					cl = &clusters[num_clusters++];
+					memset(cl, 0, sizeof *cl);
+					cl->start_ns = prev.timestamp_ns;
+					cl->first_sequence = prev.sequence + 1;
+				}
+				cl->end_ns = rec.timestamp_ns;
+				cl->events++;
+				cl->lost += steps - 1;
+			}
+		}
+
+		prev = rec;
+		records++;
+	}
+
+	printf("Trace %s: version %u, %llu frames over %.3f s\n", argv[optind],
+	       tf.header.version, (unsigned long long)records,
+	       (last_ts - first_ts) / 1000000000.0);
+	printf("Sequence %u to %u, nominal interval %.1f us (%.3f fps)\n",
+	       first_seq, last_seq, nominal_ns / 1000.0,
+	       nominal_ns ? 1000000000.0 / nominal_ns : 0.0);
+	printf("%llu frames flagged with errors, %llu missing from the trace\n",
+	       (unsigned long long)errors, (unsigned long long)trace_missing);
+
+	printf("\nDrops (V4L2 sequence gaps)\n");
+	printf("  %llu frames lost in %llu gaps, largest %llu, %llu out of order or repeated\n",
+	       (unsigned long long)lost, (unsigned long long)gap_events,
+	       (unsigned long long)max_gap, (unsigned long long)reordered);
+	printf("  %u clusters (drops within %u ms of each other)\n", num_clusters, cluster_gap_ms);
+
+	qsort(clusters, num_clusters, sizeof *clusters, cluster_cmp);
+	for (i = 0; i < num_clusters && i < clusters_shown; i++)
+		printf("    at %10.3f s, sequence %10u: %6llu frames lost in %4u gaps over %.3f s\n",
+		       (clusters[i].start_ns - first_ts) / 1000000000.0,
+		       clusters[i].first_sequence, (unsigned long long)clusters[i].lost,
+		       clusters[i].events,
+		       (clusters[i].end_ns - clusters[i].start_ns) / 1000000000.0);
+	if (num_clusters > clusters_shown)
+		printf("    ... %u more\n", num_clusters - clusters_shown);
+
+	printf("\nTiming                             frames       (all in us)\n");
+	print_hist("frame interval", &interval);
+	print_hist("jitter from nominal", &jitter);
+	print_hist("capture to DQBUF", &arrival);
+
+	if (tf.has_stages) {
+		printf("\nStage latency from DQBUF, %llu frames sent to the isp\n",
+		       (unsigned long long)sent);
+		for (i = 0; i < LATENCY_STAGES; i++) {
+			if (i < LATENCY_STAGE_SINK_RETURN(0)) {
+				snprintf(name, sizeof name, "%s", stage_names[i]);
+			} else {
+				j = (i - LATENCY_STAGE_SINK_RETURN(0)) / 3;
+				if (j >= tf.header.num_sinks)
+					break;
+				snprintf(name, sizeof name, "%.20s %s", tf.header.sink_names[j],
+					 sink_stage_names[(i - LATENCY_STAGE_SINK_RETURN(0)) % 3]);
+			}
+
+			/* Sinks that never produce output, eg. a renderer */
+			if (!stages[i].count)
+				continue;
+
+			print_hist(name, &stages[i]);
+			if (not_reached[i])
+				printf("  %-32s %8llu frames never got here\n", "",
+				       (unsigned long long)not_reached[i]);
+		}
+	}
+
+	free(clusters);
+	fclose(tf.fp);
+	return 0;
+}
@@ -0,0 +1,335 @@
+/*
+ * v4l2_mmal - per-frame trace ring.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The capture thread drops a fixed size record per frame into a ring and
+ * moves on. The ring overwrites its oldest records rather than waiting,
+ * and each slot carries its record number, so a reader that was lapped
+ * notices and skips instead of seeing a torn record. A consumer thread
+ * renders the text output and streams the binary file, and an on-demand
+ * dump reads the newest records the same way.
+ *
+ * Saving lags the capture by TRACE_SETTLE_MS, so that the stage times
+ * stamped by the MMAL callbacks and save threads can be picked up from the
+ * latency frame ring and saved with the record.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "formats.h"
+#include "trace.h"
+
+#ifndef V4L2_BUF_FLAG_ERROR
+#define V4L2_BUF_FLAG_ERROR	0x0040
+#endif
+
+/* How often the consumer looks for new records */
+#define TRACE_POLL_MS		100
+/* Records written to the binary file at once */
+#define TRACE_WRITE_BATCH	64
+
+static void *trace_thread(void *arg);
+
+static uint64_t trace_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int trace_init(struct trace *t, bool verbose, const char *path,
+	       struct latency_frames *frames, const char *const *sink_names,
+	       unsigned int num_sinks)
+{
+	struct trace_file_header header;
+	pthread_condattr_t attr;
+	unsigned int i;
+	int ret;
+
+	memset(t, 0, sizeof *t);
+	t->verbose = verbose;
+	t->fd = -1;
+	t->frames = frames;
+
+	t->slots = calloc(TRACE_RING_SIZE, sizeof *t->slots);
+	if (!t->slots)
+		return -ENOMEM;
+
+	if (path) {
+		t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (t->fd < 0) {
+			ret = -errno;
+			goto error;
+		}
+
+		memset(&header, 0, sizeof header);
+		memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+		header.version = TRACE_VERSION;
+		header.record_size = sizeof(struct trace_record);
+		header.header_size = sizeof header;
+		header.num_sinks = num_sinks < LATENCY_MAX_SINKS ? num_sinks : LATENCY_MAX_SINKS;
+		for (i = 0; i < header.num_sinks; i++)
+			strncpy(header.sink_names[i], sink_names[i],
+				TRACE_SINK_NAME_LEN - 1);
+		if (write(t->fd, &header, sizeof header) != sizeof header) {
+			ret = -EIO;
+			goto error;
+		}
+	}
+
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&t->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = pthread_create(&t->thread, NULL, trace_thread, t);
+	if (ret) {
+		ret = -ret;
+		goto error;
+	}
+	t->thread_running = true;
+
+	return 0;
+
+error:
+	trace_cleanup(t);
+	return ret;
+}
+
+void trace_frame(struct trace *t, const struct trace_record *rec)
+{
+	struct trace_slot *slot = &t->slots[t->head & (TRACE_RING_SIZE - 1)];
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->rec = *rec;
+	__atomic_store_n(&slot->seq, t->head + 1, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_request_dump(struct trace *t)
+{
+	__atomic_store_n(&t->dump_requested, 1, __ATOMIC_RELAXED);
+}
+
+/* Copy out a record, false if it has been overwritten */
+static bool trace_read(struct trace *t, uint64_t seq, struct trace_record *rec)
+{
+	struct trace_slot *slot = &t->slots[seq & (TRACE_RING_SIZE - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+		return false;
+
+	*rec = slot->rec;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq + 1;
+}
+
+/* The per-frame line v4l2_mmal has always printed */
+static void trace_print(const struct trace_record *rec, uint64_t prev_timestamp_ns)
+{
+	const char *ts_type, *ts_source;
+	uint64_t delta = rec->timestamp_ns - prev_timestamp_ns;
+	double fps = prev_timestamp_ns && delta ? 1000000000.0 / delta : 0.0;
+
+	v4l2_timestamp_names(rec->flags, &ts_type, &ts_source);
+
+	printf("%u (%u) [%c] %s %u %u B %llu.%06llu %llu.%06llu %.3f fps ts %s/%s\n",
+	       rec->frame, rec->index,
+	       (rec->flags & V4L2_BUF_FLAG_ERROR) ? 'E' : '-',
+	       v4l2_field_name(rec->field),
+	       rec->sequence, rec->bytesused,
+	       (unsigned long long)(rec->timestamp_ns / 1000000000ULL),
+	       (unsigned long long)(rec->timestamp_ns % 1000000000ULL / 1000),
+	       (unsigned long long)(rec->arrival_ns / 1000000000ULL),
+	       (unsigned long long)(rec->arrival_ns % 1000000000ULL / 1000),
+	       fps, ts_type, ts_source);
+}
+
+static void trace_write(struct trace *t, const struct trace_record *recs,
+			unsigned int count)
+{
+	const uint8_t *data = (const uint8_t *)recs;
+	size_t len = count * sizeof *recs;
+	ssize_t ret;
+
+	while (t->fd >= 0 && len) {
+		ret = write(t->fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "trace write failed: %s, stopping the trace file\n",
+				strerror(errno));
+			close(t->fd);
+			t->fd = -1;
+			return;
+		}
+		data += ret;
+		len -= ret;
+	}
+}
+
+static void trace_dump(struct trace *t)
+{
+	uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	uint64_t seq = head > TRACE_DUMP_RECORDS ? head - TRACE_DUMP_RECORDS : 0;
+	uint64_t prev = 0;
+	struct trace_record rec;
+
+	printf("Last %llu frames:\n", (unsigned long long)(head - seq));
+	for (; seq < head; seq++) {
+		if (!trace_read(t, seq, &rec))
+			continue;
+		trace_print(&rec, prev);
+		prev = rec.timestamp_ns;
+	}
+	fflush(stdout);
+}
+
+static void trace_consume(struct trace *t, bool final)
+{
+	struct trace_record batch[TRACE_WRITE_BATCH];
+	uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	uint64_t settled = trace_now_ns() - TRACE_SETTLE_MS * 1000000ULL;
+	struct trace_record *rec;
+	unsigned int count = 0;
+
+	if (t->verbose) {
+		if (head - t->print_tail > TRACE_RING_SIZE)
+			t->print_tail = head - TRACE_RING_SIZE;
+
+		for (; t->print_tail < head; t->print_tail++) {
+			if (!trace_read(t, t->print_tail, &batch[0]))
+				continue;
+			trace_print(&batch[0], t->last_timestamp_ns);
+			t->last_timestamp_ns = batch[0].timestamp_ns;
+		}
+		fflush(stdout);
+	}
+
+	if (t->fd < 0)
+		t->tail = head;
+
+	if (head - t->tail > TRACE_RING_SIZE) {
+		t->lost += head - t->tail - TRACE_RING_SIZE;
+		t->tail = head - TRACE_RING_SIZE;
+	}
+
+	for (; t->tail < head; t->tail++) {
+		rec = &batch[count];
+		if (!trace_read(t, t->tail, rec)) {
+			t->lost++;
+			continue;
+		}
+
+		/* Later stages may not have happened yet */
+		if (!final && rec->arrival_ns > settled)
+			break;
+
+		if (t->frames && rec->pts != INT64_MIN)
+			latency_frame_stages(t->frames, rec->pts, rec->stage_us);
+
+		if (++count == TRACE_WRITE_BATCH) {
+			trace_write(t, batch, count);
+			count = 0;
+		}
+	}
+
+	trace_write(t, batch, count);
+
+	if (__atomic_exchange_n(&t->dump_requested, 0, __ATOMIC_RELAXED))
+		trace_dump(t);
+}
+
+static void *trace_thread(void *arg)
+{
+	struct trace *t = arg;
+	struct timespec deadline;
+	bool flush;
+
+	pthread_mutex_lock(&t->lock);
+	while (!t->quit) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += TRACE_POLL_MS * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (!t->flush_requested)
+			pthread_cond_timedwait(&t->cond, &t->lock, &deadline);
+
+		/* Only a pass started after the request completes it */
+		flush = t->flush_requested;
+		pthread_mutex_unlock(&t->lock);
+		trace_consume(t, false);
+		pthread_mutex_lock(&t->lock);
+
+		if (flush) {
+			t->flush_requested = false;
+			pthread_cond_broadcast(&t->cond);
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	/* Whatever the capture thread produced before stopping */
+	trace_consume(t, true);
+	return NULL;
+}
+
+void trace_flush(struct trace *t)
+{
+	if (!t->thread_running)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	t->flush_requested = true;
+	pthread_cond_broadcast(&t->cond);
+	while (t->flush_requested)
+		pthread_cond_wait(&t->cond, &t->lock);
+	pthread_mutex_unlock(&t->lock);
+}
+
+void trace_cleanup(struct trace *t)
+{
+	if (t->thread_running) {
+		pthread_mutex_lock(&t->lock);
+		t->quit = true;
+		pthread_cond_broadcast(&t->cond);
+		pthread_mutex_unlock(&t->lock);
+		pthread_join(t->thread, NULL);
+		t->thread_running = false;
+
+		pthread_cond_destroy(&t->cond);
+		pthread_mutex_destroy(&t->lock);
+	}
+
+	if (t->lost)
+		printf("Trace lost %llu records\n", (unsigned long long)t->lost);
+
+	if (t->fd >= 0)
+		close(t->fd);
+	free(t->slots);
+
+	t->fd = -1;
+	t->slots = NULL;
+}
@@ -0,0 +1,118 @@
+/*
+ * v4l2_mmal - per-frame trace ring.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "latency.h"
+
+/* Records kept, a power of two. About 17 s at 60 fps. */
+#define TRACE_RING_SIZE		1024
+/*
+ * Records are saved once the frame is this old, so its stage times are in.
+ * Well inside the LATENCY_FRAMES the stage times are kept for.
+ */
+#define TRACE_SETTLE_MS		1000
+/* Records shown by an on-demand dump */
+#define TRACE_DUMP_RECORDS	64
+
+/*
+ * Binary trace file: a header, then records back to back. Fields are only
+ * ever added at the end of either, so a reader handles older files by
+ * zero filling to its own sizes.
+ */
+#define TRACE_MAGIC		"V4L2MMTR"
+#define TRACE_VERSION		2
+#define TRACE_SINK_NAME_LEN	32
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	/* Version 2 */
+	uint32_t header_size;
+	uint32_t num_sinks;
+	char sink_names[LATENCY_MAX_SINKS][TRACE_SINK_NAME_LEN];
+};
+
+/* One dequeued frame, in host byte order */
+struct trace_record {
+	/* CLOCK_MONOTONIC at DQBUF */
+	uint64_t arrival_ns;
+	/* V4L2 buffer timestamp */
+	uint64_t timestamp_ns;
+	/* Frames dequeued before this one */
+	uint32_t frame;
+	uint32_t sequence;
+	uint32_t bytesused;
+	uint32_t flags;
+	uint16_t index;
+	uint16_t field;
+	uint32_t reserved;
+	/* Version 2: pts given to MMAL, INT64_MIN if not sent */
+	int64_t pts;
+	/* us after arrival each LATENCY_STAGE_* was reached, 0 if not */
+	uint32_t stage_us[LATENCY_STAGES];
+};
+
+struct trace_slot {
+	/* Record number + 1, 0 while the record is being written */
+	uint64_t seq;
+	struct trace_record rec;
+};
+
+struct trace {
+	struct trace_slot *slots;
+	/* Records produced, only written by the capture thread */
+	uint64_t head;
+
+	/* Consumer thread, renders text and writes the binary file */
+	pthread_t thread;
+	bool thread_running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool quit;
+
+	/* Frame stage times, filled in just before a record is saved */
+	struct latency_frames *frames;
+
+	/* Next record to print, and to save */
+	uint64_t print_tail;
+	uint64_t tail;
+	uint64_t lost;
+	bool flush_requested;
+	bool verbose;
+	int fd;
+	int dump_requested;
+	/* Of the last record printed, for the frame rate */
+	uint64_t last_timestamp_ns;
+};
+
+int trace_init(struct trace *t, bool verbose, const char *path,
+	       struct latency_frames *frames, const char *const *sink_names,
+	       unsigned int num_sinks);
+/* Capture thread only, never blocks */
+void trace_frame(struct trace *t, const struct trace_record *rec);
+/* Print the most recent records, safe to call from a signal handler */
+void trace_request_dump(struct trace *t);
+/* Wait until every record so far has been printed */
+void trace_flush(struct trace *t);
+void trace_cleanup(struct trace *t);
+
+#endif
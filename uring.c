@@ -0,0 +1,427 @@
+/*
+ * v4l2_mmal - minimal io_uring wrapper for asynchronous output.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Talks to the kernel directly rather than through liburing so there is no
+ * extra build dependency. Each ring has a single submitting thread and a
+ * dedicated completion thread, which runs the request callbacks so that
+ * completions never land on the capture or save threads.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+/* Fixed file slot used when a ring has a registered output file */
+#define URING_FIXED_FD	0
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+				 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_link(struct uring *ring, struct uring_req *req)
+{
+	req->queued = true;
+	req->prev = NULL;
+	req->next = ring->pending;
+	if (ring->pending)
+		ring->pending->prev = req;
+	ring->pending = req;
+}
+
+static void uring_unlink(struct uring *ring, struct uring_req *req)
+{
+	if (req->prev)
+		req->prev->next = req->next;
+	else
+		ring->pending = req->next;
+	if (req->next)
+		req->next->prev = req->prev;
+	req->queued = false;
+	req->prev = NULL;
+	req->next = NULL;
+}
+
+/*
+ * The ring can't be waited on any more. Fail everything still in flight so
+ * nobody waits for completions that will never be reaped, and refuse new
+ * requests.
+ */
+static void uring_fail(struct uring *ring, int err)
+{
+	struct uring_req *req, *next;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->error = err;
+	req = ring->pending;
+	ring->pending = NULL;
+	for (next = req; next; next = next->next)
+		next->queued = false;
+	pthread_mutex_unlock(&ring->lock);
+
+	for (; req; req = next) {
+		next = req->next;
+		req->prev = NULL;
+		req->next = NULL;
+		req->complete(req, err);
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	ring->inflight = 0;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void *uring_thread(void *arg)
+{
+	struct uring *ring = arg;
+	struct io_uring_cqe *cqe;
+	struct uring_req *req;
+	unsigned int head, tail;
+	bool quit = false;
+	int ret;
+
+	while (!quit) {
+		ret = sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+		/* EBUSY is a full completion queue, reaping it is the cure */
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			uring_fail(ring, -errno);
+			break;
+		}
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		while (head != tail) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			req = (struct uring_req *)(uintptr_t)cqe->user_data;
+
+			/* A NULL request is the wakeup sent by uring_cleanup() */
+			if (req) {
+				pthread_mutex_lock(&ring->lock);
+				uring_unlink(ring, req);
+				pthread_mutex_unlock(&ring->lock);
+				req->complete(req, cqe->res);
+			} else {
+				quit = true;
+			}
+
+			head++;
+			__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+			pthread_mutex_lock(&ring->lock);
+			ring->inflight--;
+			pthread_cond_broadcast(&ring->cond);
+			pthread_mutex_unlock(&ring->lock);
+		}
+	}
+
+	return NULL;
+}
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	int ret;
+
+	memset(ring, 0, sizeof *ring);
+	memset(&p, 0, sizeof p);
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto error;
+	}
+
+	ring->sq_head = (unsigned int *)((uint8_t *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((uint8_t *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((uint8_t *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((uint8_t *)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned int *)((uint8_t *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((uint8_t *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((uint8_t *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_ring + p.cq_off.cqes);
+
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+
+	ret = pthread_create(&ring->thread, NULL, uring_thread, ring);
+	if (ret) {
+		ret = -ret;
+		goto error;
+	}
+	ring->thread_running = true;
+
+	return 0;
+
+error:
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+	return ret;
+}
+
+int uring_register_files(struct uring *ring, const int *fds, unsigned int num)
+{
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, num) < 0)
+		return -errno;
+
+	ring->fixed_files = true;
+	return 0;
+}
+
+/* Replace the registered files, e.g. when output moves to a new file */
+int uring_update_files(struct uring *ring, const int *fds, unsigned int num)
+{
+	struct io_uring_files_update up;
+
+	if (!ring->fixed_files)
+		return 0;
+
+	memset(&up, 0, sizeof up);
+	up.fds = (uintptr_t)fds;
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &up, num) < 0) {
+		/* Fall back to passing the fd with every request */
+		ring->fixed_files = false;
+		return -errno;
+	}
+
+	return 0;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov,
+			   unsigned int num)
+{
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, num) < 0)
+		return -errno;
+
+	ring->fixed_buffers = true;
+	return 0;
+}
+
+/*
+ * Grab the next free SQE for req, waiting for completions if the ring is
+ * full, or NULL if the ring has failed. Only one thread may submit to a
+ * ring.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring,
+					  struct uring_req *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	pthread_mutex_lock(&ring->lock);
+	while (!ring->error && ring->inflight >= ring->entries)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	if (ring->error) {
+		pthread_mutex_unlock(&ring->lock);
+		return NULL;
+	}
+	ring->inflight++;
+	if (req)
+		uring_link(ring, req);
+	pthread_mutex_unlock(&ring->lock);
+
+	tail = *ring->sq_tail;
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+
+	return sqe;
+}
+
+static int uring_submit(struct uring *ring, struct io_uring_sqe *sqe,
+			struct uring_req *req)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = sqe - ring->sqes;
+	int ret;
+
+	sqe->user_data = (uintptr_t)req;
+	if (req)
+		clock_gettime(CLOCK_MONOTONIC, &req->submitted);
+
+	ring->sq_array[tail & *ring->sq_mask] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = sys_io_uring_enter(ring->fd, 1, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	/*
+	 * The kernel only reads the SQ ring inside io_uring_enter(). If it
+	 * took the SQE anyway, the request is live and completes through its
+	 * CQE. Otherwise it is withdrawn, so a later enter can't submit it
+	 * for a request the caller has already failed.
+	 */
+	if (ret < 0 && __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail) {
+		ret = -errno;
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&ring->lock);
+		/* Unless the ring failed meanwhile, and completed it already */
+		if (req && !req->queued) {
+			pthread_mutex_unlock(&ring->lock);
+			return 0;
+		}
+		if (req)
+			uring_unlink(ring, req);
+		ring->inflight--;
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void uring_set_fd(struct uring *ring, struct io_uring_sqe *sqe, int fd)
+{
+	/* Registered rings only ever write to their one fixed file */
+	if (ring->fixed_files) {
+		sqe->fd = URING_FIXED_FD;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = fd;
+	}
+}
+
+/*
+ * Write a single buffer. A buf_index >= 0 selects a registered buffer, in
+ * which case buf must lie within it. fd < 0 selects the registered file.
+ */
+int uring_write(struct uring *ring, struct uring_req *req, int fd,
+		const void *buf, size_t len, off_t offset, int buf_index)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring, req);
+
+	if (!sqe)
+		return ring->error;
+
+	if (fd < 0)
+		uring_set_fd(ring, sqe, fd);
+	else
+		sqe->fd = fd;
+
+	sqe->opcode = buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	if (buf_index >= 0)
+		sqe->buf_index = buf_index;
+
+	return uring_submit(ring, sqe, req);
+}
+
+int uring_writev(struct uring *ring, struct uring_req *req, int fd,
+		 const struct iovec *iov, unsigned int cnt, off_t offset)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring, req);
+
+	if (!sqe)
+		return ring->error;
+
+	if (fd < 0)
+		uring_set_fd(ring, sqe, fd);
+	else
+		sqe->fd = fd;
+
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = cnt;
+	sqe->off = offset;
+
+	return uring_submit(ring, sqe, req);
+}
+
+/* Wait until every submitted request has completed */
+void uring_drain(struct uring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	while (ring->inflight)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+void uring_cleanup(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ring->fd < 0)
+		return;
+
+	if (ring->thread_running) {
+		uring_drain(ring);
+
+		/* Wake the completion thread with a NOP and let it exit */
+		sqe = uring_get_sqe(ring, NULL);
+		if (!sqe) {
+			/* It gave up on the ring and is already on its way out */
+			pthread_join(ring->thread, NULL);
+		} else {
+			sqe->opcode = IORING_OP_NOP;
+			if (uring_submit(ring, sqe, NULL) == 0)
+				pthread_join(ring->thread, NULL);
+			else
+				pthread_cancel(ring->thread);
+		}
+		ring->thread_running = false;
+	}
+
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+}
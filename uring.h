@@ -0,0 +1,94 @@
+/*
+ * v4l2_mmal - minimal io_uring wrapper for asynchronous output.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct uring_req;
+
+/*
+ * Called from the ring's completion thread with the result of the request
+ * (bytes transferred or -errno).
+ */
+typedef void (*uring_complete_t)(struct uring_req *req, int res);
+
+struct uring_req {
+	uring_complete_t complete;
+	struct timespec submitted;
+
+	/* In flight, so it can be failed if the completion thread dies */
+	bool queued;
+	struct uring_req *prev;
+	struct uring_req *next;
+};
+
+struct uring {
+	int fd;
+	unsigned int entries;
+
+	/* Submission queue, only touched by the submitting thread */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue, only touched by the completion thread */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	pthread_t thread;
+	bool thread_running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int inflight;
+	struct uring_req *pending;
+	/* Set once the completion thread has given up, nothing more is queued */
+	int error;
+	bool quit;
+
+	bool fixed_files;
+	bool fixed_buffers;
+};
+
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_cleanup(struct uring *ring);
+int uring_register_files(struct uring *ring, const int *fds, unsigned int num);
+int uring_update_files(struct uring *ring, const int *fds, unsigned int num);
+int uring_register_buffers(struct uring *ring, const struct iovec *iov,
+			   unsigned int num);
+int uring_write(struct uring *ring, struct uring_req *req, int fd,
+		const void *buf, size_t len, off_t offset, int buf_index);
+int uring_writev(struct uring *ring, struct uring_req *req, int fd,
+		 const struct iovec *iov, unsigned int cnt, off_t offset);
+void uring_drain(struct uring *ring);
+
+#endif
@@ -31,12 +31,16 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 
 #include <linux/videodev2.h>
 
@@ -48,23 +52,32 @@
 #include "bcm_host.h"
 #include "user-vcsm.h"
 
+#include "control.h"
+#include "dmabuf.h"
+#include "dvr.h"
+#include "formats.h"
+#include "hls.h"
+#include "latency.h"
+#include "metrics.h"
+#include "mux.h"
+#include "pipeline.h"
+#include "replay.h"
+#include "trace.h"
+#include "uring.h"
+#include "writer.h"
+
 #define MAX_COMPONENTS 4
 
-struct destinations {
-	char *component_name;
-	MMAL_FOURCC_T output_encoding;
-	MMAL_PORT_BH_CB_T cb;
-};
+/*
+ * Frames a blocking sink may hold beyond its input buffers. Each is an isp
+ * output buffer set aside for it, so a sink that stalls can't take the
+ * buffers the other sinks need.
+ */
+#define SINK_BLOCK_HELD		3
+/* Room for any sink's held frames */
+#define SINK_PENDING_MAX	4
 
 static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
-#define MMAL_ENCODING_UNUSED 0
-
-struct destinations dests[MAX_COMPONENTS] = {
-	{"vc.ril.video_encode", MMAL_ENCODING_H264, encoder_buffer_callback},
-	{"vc.ril.image_encode", MMAL_ENCODING_JPEG, encoder_buffer_callback},
-	{"vc.ril.video_render", MMAL_ENCODING_UNUSED, NULL},
-	{NULL, MMAL_ENCODING_UNUSED, NULL}
-};
 
 
 #ifndef V4L2_BUF_FLAG_ERROR
@@ -76,60 +89,306 @@ struct destinations dests[MAX_COMPONENTS] = {
 int debug = 1;
 #define print(...) do { if (debug) printf(__VA_ARGS__); }  while (0)
 
+struct device;
+struct buffer;
+
+/* Asynchronous write of one plane of a captured frame */
+struct raw_write {
+	struct uring_req req;
+	struct device *dev;
+	struct buffer *buffer;
+	unsigned int length;
+	int fd;
+};
+
 struct buffer
 {
 	unsigned int idx;
 	unsigned int padding[VIDEO_MAX_PLANES];
 	unsigned int size[VIDEO_MAX_PLANES];
 	void *mem[VIDEO_MAX_PLANES];
+	/* The range multi-planar buffers are mapped into, planes and gaps */
+	uint8_t *map_base;
+	size_t map_span;
+	/* The frame copied into the isp's layout, when it can't be mapped so */
+	uint8_t *repack;
 	MMAL_BUFFER_HEADER_T *mmal;
-	int dma_fd;
+	int dma_fd[VIDEO_MAX_PLANES];
 	unsigned int vcsm_handle;
+	/* Why the buffer couldn't be imported into the VPU, NULL if it was */
+	const char *copy_reason;
+
+	/*
+	 * Users of a dequeued buffer (capture loop, MMAL, raw writes). It is
+	 * given back to V4L2 when the last one is done, if requeue is set.
+	 */
+	int refs;
+	bool requeue;
+	struct raw_write raw_writes[VIDEO_MAX_PLANES];
+};
+
+struct event_source;
+
+typedef void (*event_handler_t)(struct device *dev, struct event_source *src,
+				uint32_t events);
+
+struct event_source {
+	int fd;
+	uint32_t events;
+	event_handler_t handler;
+	void *priv;
+};
+
+#define MAX_EVENT_SOURCES	8
+
+/* Reasons for waking the event loop through the notification eventfd */
+#define NOTIFY_STOP		(1 << 0)
+#define NOTIFY_MMAL_ERROR	(1 << 1)
+#define NOTIFY_DVR_TRIGGER	(1 << 2)
+
+struct event_loop {
+	int epoll_fd;
+	int timer_fd;
+	int notify_fd;
+
+	struct event_source sources[MAX_EVENT_SOURCES];
+	unsigned int num_sources;
+
+	unsigned int notify_flags;
+	bool done;
+};
+
+/* Frames lost before reaching the sinks, by where and why */
+enum drop_cause {
+	DROP_SEQUENCE_GAP,	/* missing from the V4L2 sequence while buffers were queued */
+	DROP_NO_BUFFER,		/* missing while every buffer was held downstream */
+	DROP_ISP_SEND,		/* the isp refused the buffer */
+	DROP_CAUSES,
+};
+
+static const struct {
+	const char *stage;
+	const char *cause;
+} drop_causes[DROP_CAUSES] = {
+	[DROP_SEQUENCE_GAP] = { "sensor", "sequence_gap" },
+	[DROP_NO_BUFFER] = { "capture", "no_buffer_queued" },
+	[DROP_ISP_SEND] = { "isp", "send_failed" },
+};
+
+/* Request an IDR this long before a time based segment boundary */
+#define SEGMENT_IDR_LEAD_USEC	200000
+
+struct segment {
+	/* Limits, 0 = unlimited */
+	unsigned int time;
+	uint64_t size;
+
+	unsigned int index;
+	int64_t start_pts;
+	uint64_t bytes;
+	bool idr_requested;
+	bool prev_config;
+
+	/* Next segment's files, opened before they are needed */
+	int next_fd;
+	int next_pts_fd;
+	bool next_tried;
+
+	/* Frame timing, for segment and partial segment durations */
+	int64_t last_pts;
+	unsigned int frame_usec;
+	bool frame_start;
+
+	/* HLS partial segment being built */
+	int64_t part_start_pts;
+	uint64_t part_offset;
+	bool part_independent;
+	/* HLS_MAX_PARTS reached, the rest of the segment is only listed whole */
+	bool parts_full;
 };
 
 struct component {
 	MMAL_COMPONENT_T *comp;
 	MMAL_POOL_T *ip_pool;
 	MMAL_POOL_T *op_pool;
-	FILE *stream_fd;
-	FILE *pts_fd;
+	int stream_fd;
+	int pts_fd;
+	char name[128];
+	char base_name[128];
+	struct writer writer;
+	struct mux mux;
+	struct segment seg;
+	struct hls hls;
+
+	/* Pre-event ring, output is only written after a trigger */
+	struct dvr dvr;
+	int64_t dvr_pre;
+	int64_t dvr_post;
+	int dvr_trigger;		/* set from the event loop */
+	bool dvr_recording;
+	bool dvr_frame_start;
+	int64_t dvr_until;
+	int64_t dvr_last_pts;
+	unsigned int dvr_events;
+	struct mux_buf dvr_scratch;
+
+	/* Time from DQBUF until the frame is back from this sink, encoded, and written */
+	struct latency_frames *lat_frames;
+	unsigned int index;
+	struct latency_hist lat_sink;
+	struct latency_hist lat_encoded;
+	struct latency_hist lat_written;
+
+	/* Encoder output, only updated from the component's output callback */
+	uint64_t encoded_frames;
+	uint64_t encoded_bytes;
+	/* What this sink was set up from */
+	const struct branch *branch;
+	/* Where isp frames go, the scaler's input if the branch has its own size */
+	MMAL_PORT_T *input;
+	MMAL_COMPONENT_T *scaler;
+	MMAL_POOL_T *scaler_pool;
+	/* isp frames seen, for decimation, only used by isp_output_callback */
+	unsigned int frames_seen;
+
+	/* isp frames waiting for a free input buffer, oldest first */
+	enum sink_policy policy;
+	unsigned int block_ms;
+	pthread_mutex_t pending_lock;
+	struct {
+		MMAL_BUFFER_HEADER_T *buffer;
+		uint64_t deadline_ns;
+	} pending[SINK_PENDING_MAX];
+	unsigned int pending_first;
+	unsigned int pending_count;
+	/* Held frames allowed, the isp buffers reserved for them */
+	unsigned int pending_max;
+	/* Frames this sink never got, counted under its policy's cause */
+	uint64_t drops;
+	/* Held frames dropped to stay within pending_max */
+	uint64_t overflows;
 
 	VCOS_THREAD_T save_thread;
 	MMAL_QUEUE_T *save_queue;
 	int thread_quit;
+	/* Set by the capture thread when the encoder restarts at a new size */
+	int new_stream;
+	unsigned int new_width;
+	unsigned int new_height;
+
+	/* Daemon mode, every capture session is written to a file of its own */
+	bool sessions;
+	unsigned int session_files;
+	/* Set by the event loop, the next buffer starts a session's file */
+	int new_session;
+	/* Set by the event loop once a session's frames are all here */
+	int end_session;
 };
 
 struct device
 {
 	int fd;
 	int opened;
+	/* Frames from a file or pattern instead of a V4L2 device */
+	bool use_replay;
+	struct replay replay;
 
 	unsigned int nbufs;
 	struct buffer *buffers;
 
 	MMAL_COMPONENT_T *isp;
 	MMAL_POOL_T *isp_output_pool;
+	/* isp output buffers the sinks need between them */
+	unsigned int isp_buffers;
+	/* Renegotiations after V4L2_EVENT_SOURCE_CHANGE */
+	unsigned int source_changes;
 
+	/* Sink branches, set up as components[] */
+	struct pipeline pipeline;
 	struct component components[MAX_COMPONENTS];
 
+	struct event_loop events;
+	MMAL_STATUS_T mmal_error;
+
+	/* Buffers queued to V4L2 and not yet dequeued */
+	int queued;
+	/* Only counted by the capture thread */
+	uint64_t drops[DROP_CAUSES];
+
+	/*
+	 * Per-stage latency: capture timestamp to DQBUF, then DQBUF to the
+	 * frame being sent to and coming out of the isp. Sinks have their own.
+	 */
+	struct latency_frames lat_frames;
+	struct latency_hist lat_dqbuf;
+	struct latency_hist lat_isp_send;
+	struct latency_hist lat_isp_output;
+
+	/* Scraped from the event loop */
+	struct metrics_server metrics;
+	/* Daemon mode, capture sessions are started and stopped from here */
+	bool daemon;
+	struct control_server control;
+	unsigned int sessions;
+	/* Per-frame records, printed and saved away from the capture thread */
+	struct trace trace;
+
 	/* V4L2 to MMAL interface */
 	MMAL_QUEUE_T *isp_queue;
 	MMAL_POOL_T *mmal_pool;
 	/* Encoded data */
 	MMAL_POOL_T *output_pool;
 
-	MMAL_BOOL_T can_zero_copy;
+	/*
+	 * The isp input is zero copy only if every buffer was imported, MMAL
+	 * can't take VC handles and ARM pointers on the same port. Set
+	 * require_zero_copy to fail rather than copy.
+	 */
+	MMAL_BOOL_T zero_copy;
+	unsigned int zero_copy_buffers;
+	bool require_zero_copy;
+
+	/* Batching of encoded output writes */
+	struct writer_config write_cfg;
+	/* Container for H.264 output, NULL for a raw elementary stream */
+	const struct mux_ops *container;
+	/* Segmented recording limits, 0 = one file */
+	unsigned int segment_time;
+	uint64_t segment_size;
+	/* HLS playlist, written alongside the segments */
+	const char *hls_path;
+	unsigned int hls_window;
+	unsigned int hls_part_ms;
+	/* Pre-event recording, 0 = off */
+	size_t dvr_size;
+	unsigned int dvr_pre;
+	unsigned int dvr_post;
+	const char *dvr_trigger_file;
+	struct timespec dvr_trigger_mtime;
+
+	/* Asynchronous raw frame output */
+	bool use_uring;
+	bool raw_uring;
+	struct uring raw_ring;
+	int raw_fd;
+	off_t raw_offset;
 
 	unsigned int width;
 	unsigned int height;
 	unsigned int fps;
-	unsigned int frame_time_usec;
 	uint32_t buffer_output_flags;
 	uint32_t timestamp_type;
 	struct timeval starttime;
-	int64_t lastpts;
 
+	/* V4L2_BUF_TYPE_VIDEO_CAPTURE or _MPLANE, the device's API */
+	enum v4l2_buf_type type;
 	unsigned char num_planes;
+	unsigned int bytesperline[VIDEO_MAX_PLANES];
+	unsigned int sizeimage[VIDEO_MAX_PLANES];
+
+	/* V4L2_MEMORY_DMABUF buffers are allocated from dmabuf */
+	enum v4l2_memory memtype;
+	struct dmabuf_provider dmabuf;
 
 	void *pattern[VIDEO_MAX_PLANES];
 
@@ -142,196 +401,54 @@ static void errno_exit(const char *s)
         exit(EXIT_FAILURE);
 }
 
-static struct v4l2_format_info {
-	const char *name;
-	unsigned int fourcc;
-	unsigned char n_planes;
-	MMAL_FOURCC_T mmal_encoding;
-} pixel_formats[] = {
-	{ "RGB332", V4L2_PIX_FMT_RGB332, 1, 	MMAL_ENCODING_UNUSED },
-	{ "RGB444", V4L2_PIX_FMT_RGB444, 1,	MMAL_ENCODING_UNUSED },
-	{ "ARGB444", V4L2_PIX_FMT_ARGB444, 1,	MMAL_ENCODING_UNUSED },
-	{ "XRGB444", V4L2_PIX_FMT_XRGB444, 1,	MMAL_ENCODING_UNUSED },
-	{ "RGB555", V4L2_PIX_FMT_RGB555, 1,	MMAL_ENCODING_UNUSED },
-	{ "ARGB555", V4L2_PIX_FMT_ARGB555, 1,	MMAL_ENCODING_UNUSED },
-	{ "XRGB555", V4L2_PIX_FMT_XRGB555, 1,	MMAL_ENCODING_UNUSED },
-	{ "RGB565", V4L2_PIX_FMT_RGB565, 1,	MMAL_ENCODING_UNUSED },
-	{ "RGB555X", V4L2_PIX_FMT_RGB555X, 1,	MMAL_ENCODING_UNUSED },
-	{ "RGB565X", V4L2_PIX_FMT_RGB565X, 1,	MMAL_ENCODING_RGB16 },
-	{ "BGR666", V4L2_PIX_FMT_BGR666, 1,	MMAL_ENCODING_UNUSED },
-	{ "BGR24", V4L2_PIX_FMT_BGR24, 1,	MMAL_ENCODING_RGB24 },
-	{ "RGB24", V4L2_PIX_FMT_RGB24, 1,	MMAL_ENCODING_BGR24 },
-	{ "BGR32", V4L2_PIX_FMT_BGR32, 1,	MMAL_ENCODING_BGR32 },
-	{ "ABGR32", V4L2_PIX_FMT_ABGR32, 1,	MMAL_ENCODING_BGRA },
-	{ "XBGR32", V4L2_PIX_FMT_XBGR32, 1,	MMAL_ENCODING_BGR32 },
-	{ "RGB32", V4L2_PIX_FMT_RGB32, 1,	MMAL_ENCODING_RGB32 },
-	{ "ARGB32", V4L2_PIX_FMT_ARGB32, 1,	MMAL_ENCODING_ARGB },
-	{ "XRGB32", V4L2_PIX_FMT_XRGB32, 1,	MMAL_ENCODING_UNUSED },
-	{ "HSV24", V4L2_PIX_FMT_HSV24, 1,	MMAL_ENCODING_UNUSED },
-	{ "HSV32", V4L2_PIX_FMT_HSV32, 1,	MMAL_ENCODING_UNUSED },
-	{ "Y8", V4L2_PIX_FMT_GREY, 1,		MMAL_ENCODING_UNUSED },
-	{ "Y10", V4L2_PIX_FMT_Y10, 1,		MMAL_ENCODING_UNUSED },
-	{ "Y12", V4L2_PIX_FMT_Y12, 1,		MMAL_ENCODING_UNUSED },
-	{ "Y16", V4L2_PIX_FMT_Y16, 1,		MMAL_ENCODING_UNUSED },
-	{ "UYVY", V4L2_PIX_FMT_UYVY, 1,		MMAL_ENCODING_UYVY },
-	{ "VYUY", V4L2_PIX_FMT_VYUY, 1,		MMAL_ENCODING_VYUY },
-	{ "YUYV", V4L2_PIX_FMT_YUYV, 1,		MMAL_ENCODING_YUYV },
-	{ "YVYU", V4L2_PIX_FMT_YVYU, 1,		MMAL_ENCODING_YVYU },
-	{ "NV12", V4L2_PIX_FMT_NV12, 1,		MMAL_ENCODING_NV12 },
-	{ "NV12M", V4L2_PIX_FMT_NV12M, 2,	MMAL_ENCODING_UNUSED },
-	{ "NV21", V4L2_PIX_FMT_NV21, 1,		MMAL_ENCODING_NV21 },
-	{ "NV21M", V4L2_PIX_FMT_NV21M, 2,	MMAL_ENCODING_UNUSED },
-	{ "NV16", V4L2_PIX_FMT_NV16, 1,		MMAL_ENCODING_UNUSED },
-	{ "NV16M", V4L2_PIX_FMT_NV16M, 2,	MMAL_ENCODING_UNUSED },
-	{ "NV61", V4L2_PIX_FMT_NV61, 1,		MMAL_ENCODING_UNUSED },
-	{ "NV61M", V4L2_PIX_FMT_NV61M, 2,	MMAL_ENCODING_UNUSED },
-	{ "NV24", V4L2_PIX_FMT_NV24, 1,		MMAL_ENCODING_UNUSED },
-	{ "NV42", V4L2_PIX_FMT_NV42, 1,		MMAL_ENCODING_UNUSED },
-	{ "YUV420M", V4L2_PIX_FMT_YUV420M, 3,	MMAL_ENCODING_UNUSED },
-	{ "YUV422M", V4L2_PIX_FMT_YUV422M, 3,	MMAL_ENCODING_UNUSED },
-	{ "YUV444M", V4L2_PIX_FMT_YUV444M, 3,	MMAL_ENCODING_UNUSED },
-	{ "YVU420M", V4L2_PIX_FMT_YVU420M, 3,	MMAL_ENCODING_UNUSED },
-	{ "YVU422M", V4L2_PIX_FMT_YVU422M, 3,	MMAL_ENCODING_UNUSED },
-	{ "YVU444M", V4L2_PIX_FMT_YVU444M, 3,	MMAL_ENCODING_UNUSED },
-	{ "SBGGR8", V4L2_PIX_FMT_SBGGR8, 1,	MMAL_ENCODING_BAYER_SBGGR8 },
-	{ "SGBRG8", V4L2_PIX_FMT_SGBRG8, 1,	MMAL_ENCODING_BAYER_SGBRG8 },
-	{ "SGRBG8", V4L2_PIX_FMT_SGRBG8, 1,	MMAL_ENCODING_BAYER_SGRBG8 },
-	{ "SRGGB8", V4L2_PIX_FMT_SRGGB8, 1,	MMAL_ENCODING_BAYER_SRGGB8 },
-	{ "SBGGR10_DPCM8", V4L2_PIX_FMT_SBGGR10DPCM8, 1,	MMAL_ENCODING_UNUSED },
-	{ "SGBRG10_DPCM8", V4L2_PIX_FMT_SGBRG10DPCM8, 1,	MMAL_ENCODING_UNUSED },
-	{ "SGRBG10_DPCM8", V4L2_PIX_FMT_SGRBG10DPCM8, 1,	MMAL_ENCODING_UNUSED },
-	{ "SRGGB10_DPCM8", V4L2_PIX_FMT_SRGGB10DPCM8, 1,	MMAL_ENCODING_UNUSED },
-	{ "SBGGR10", V4L2_PIX_FMT_SBGGR10, 1,	MMAL_ENCODING_UNUSED },
-	{ "SGBRG10", V4L2_PIX_FMT_SGBRG10, 1,	MMAL_ENCODING_UNUSED },
-	{ "SGRBG10", V4L2_PIX_FMT_SGRBG10, 1,	MMAL_ENCODING_UNUSED },
-	{ "SRGGB10", V4L2_PIX_FMT_SRGGB10, 1,	MMAL_ENCODING_UNUSED },
-	{ "SBGGR10P", V4L2_PIX_FMT_SBGGR10P, 1,	MMAL_ENCODING_BAYER_SBGGR10P },
-	{ "SGBRG10P", V4L2_PIX_FMT_SGBRG10P, 1,	MMAL_ENCODING_BAYER_SGBRG10P },
-	{ "SGRBG10P", V4L2_PIX_FMT_SGRBG10P, 1,	MMAL_ENCODING_BAYER_SGRBG10P },
-	{ "SRGGB10P", V4L2_PIX_FMT_SRGGB10P, 1,	MMAL_ENCODING_BAYER_SRGGB10P },
-	{ "SBGGR12", V4L2_PIX_FMT_SBGGR12, 1,	MMAL_ENCODING_UNUSED },
-	{ "SGBRG12", V4L2_PIX_FMT_SGBRG12, 1,	MMAL_ENCODING_UNUSED },
-	{ "SGRBG12", V4L2_PIX_FMT_SGRBG12, 1,	MMAL_ENCODING_UNUSED },
-	{ "SRGGB12", V4L2_PIX_FMT_SRGGB12, 1,	MMAL_ENCODING_UNUSED },
-	{ "DV", V4L2_PIX_FMT_DV, 1,		MMAL_ENCODING_UNUSED },
-	{ "MJPEG", V4L2_PIX_FMT_MJPEG, 1,	MMAL_ENCODING_UNUSED },
-	{ "MPEG", V4L2_PIX_FMT_MPEG, 1,		MMAL_ENCODING_UNUSED },
-};
-
 static void list_formats(void)
-{
-	unsigned int i;
-
-	for (i = 0; i < ARRAY_SIZE(pixel_formats); i++)
-		print("%s (\"%c%c%c%c\", %u planes)\n",
-		       pixel_formats[i].name,
-		       pixel_formats[i].fourcc & 0xff,
-		       (pixel_formats[i].fourcc >> 8) & 0xff,
-		       (pixel_formats[i].fourcc >> 16) & 0xff,
-		       (pixel_formats[i].fourcc >> 24) & 0xff,
-		       pixel_formats[i].n_planes);
-}
-
-static const struct v4l2_format_info *v4l2_format_by_fourcc(unsigned int fourcc)
-{
-	unsigned int i;
-
-	for (i = 0; i < ARRAY_SIZE(pixel_formats); ++i) {
-		if (pixel_formats[i].fourcc == fourcc)
-			return &pixel_formats[i];
-	}
-
-	return NULL;
-}
-
-static const struct v4l2_format_info *v4l2_format_by_name(const char *name)
-{
-	unsigned int i;
-
-	for (i = 0; i < ARRAY_SIZE(pixel_formats); ++i) {
-		if (strcasecmp(pixel_formats[i].name, name) == 0)
-			return &pixel_formats[i];
-	}
-
-	return NULL;
-}
-
-static const struct v4l2_format_info *v4l2_format_by_mmal_encoding(MMAL_FOURCC_T encoding)
-{
-	unsigned int i;
-
-	for (i = 0; i < ARRAY_SIZE(pixel_formats); ++i) {
-		if (pixel_formats[i].mmal_encoding == encoding)
-			return &pixel_formats[i];
-	}
-
-	return NULL;
-}
-
-static const char *v4l2_format_name(unsigned int fourcc)
 {
 	const struct v4l2_format_info *info;
-	static char name[5];
 	unsigned int i;
 
-	info = v4l2_format_by_fourcc(fourcc);
-	if (info)
-		return info->name;
-
-	for (i = 0; i < 4; ++i) {
-		name[i] = fourcc & 0xff;
-		fourcc >>= 8;
-	}
-
-	name[4] = '\0';
-	return name;
+	for (i = 0; (info = v4l2_format_by_index(i)); i++)
+		print("%s (\"%c%c%c%c\", %u planes)\n",
+		       info->name,
+		       info->fourcc & 0xff,
+		       (info->fourcc >> 8) & 0xff,
+		       (info->fourcc >> 16) & 0xff,
+		       (info->fourcc >> 24) & 0xff,
+		       info->n_planes);
 }
 
-static const struct {
-	const char *name;
-	enum v4l2_field field;
-} fields[] = {
-	{ "any", V4L2_FIELD_ANY },
-	{ "none", V4L2_FIELD_NONE },
-	{ "top", V4L2_FIELD_TOP },
-	{ "bottom", V4L2_FIELD_BOTTOM },
-	{ "interlaced", V4L2_FIELD_INTERLACED },
-	{ "seq-tb", V4L2_FIELD_SEQ_TB },
-	{ "seq-bt", V4L2_FIELD_SEQ_BT },
-	{ "alternate", V4L2_FIELD_ALTERNATE },
-	{ "interlaced-tb", V4L2_FIELD_INTERLACED_TB },
-	{ "interlaced-bt", V4L2_FIELD_INTERLACED_BT },
-};
-
-static enum v4l2_field v4l2_field_from_string(const char *name)
+static void video_init(struct device *dev)
 {
-	unsigned int i;
-
-	for (i = 0; i < ARRAY_SIZE(fields); ++i) {
-		if (strcasecmp(fields[i].name, name) == 0)
-			return fields[i].field;
-	}
-
-	return -1;
+	memset(dev, 0, sizeof *dev);
+	dev->fd = -1;
+	dev->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	dev->memtype = V4L2_MEMORY_MMAP;
+	dev->dmabuf.fd = -1;
+	dev->buffers = NULL;
+	dev->events.epoll_fd = -1;
+	dev->events.timer_fd = -1;
+	dev->events.notify_fd = -1;
+	dev->raw_fd = -1;
+	dev->metrics.server.fd = -1;
+	dev->metrics.server.listen_fd = -1;
+	dev->control.server.fd = -1;
+	dev->control.server.listen_fd = -1;
+	dev->trace.fd = -1;
+	pipeline_init(&dev->pipeline);
+	latency_frames_init(&dev->lat_frames);
 }
 
-static const char *v4l2_field_name(enum v4l2_field field)
+/* All device access goes through here, so a replay source can stand in */
+static int video_ioctl(struct device *dev, unsigned long request, void *arg)
 {
-	unsigned int i;
-
-	for (i = 0; i < ARRAY_SIZE(fields); ++i) {
-		if (fields[i].field == field)
-			return fields[i].name;
-	}
+	if (dev->use_replay)
+		return replay_ioctl(&dev->replay, request, arg);
 
-	return "unknown";
+	return ioctl(dev->fd, request, arg);
 }
 
-static void video_init(struct device *dev)
+static bool video_is_mplane(struct device *dev)
 {
-	memset(dev, 0, sizeof *dev);
-	dev->fd = -1;
-	dev->buffers = NULL;
+	return dev->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 }
 
 static bool video_has_fd(struct device *dev)
@@ -372,6 +489,33 @@ static int video_open(struct device *dev, const char *devname)
 	return 0;
 }
 
+static int video_open_replay(struct device *dev, const char *source,
+			     unsigned int fps, bool unthrottled, bool mplane)
+{
+	int ret;
+
+	if (video_has_fd(dev)) {
+		print("Can't open replay source (already open).\n");
+		return -1;
+	}
+
+	ret = replay_open(&dev->replay, source, fps, unthrottled, mplane);
+	if (ret < 0) {
+		print("Error opening replay source %s: %s (%d).\n", source,
+		       strerror(-ret), -ret);
+		return ret;
+	}
+
+	print("Replaying %s at %u fps%s%s.\n", source, dev->replay.fps,
+	      unthrottled ? " (unthrottled)" : "",
+	      mplane ? " with the multi-planar API" : "");
+
+	dev->fd = dev->replay.fd;
+	dev->use_replay = true;
+
+	return 0;
+}
+
 static int video_querycap(struct device *dev, unsigned int *capabilities)
 {
 	struct v4l2_capability cap;
@@ -379,7 +523,7 @@ static int video_querycap(struct device *dev, unsigned int *capabilities)
 	int ret;
 
 	memset(&cap, 0, sizeof cap);
-	ret = ioctl(dev->fd, VIDIOC_QUERYCAP, &cap);
+	ret = video_ioctl(dev, VIDIOC_QUERYCAP, &cap);
 	if (ret < 0)
 		return 0;
 
@@ -396,51 +540,108 @@ static int video_querycap(struct device *dev, unsigned int *capabilities)
 	return 0;
 }
 
+static void events_cleanup(struct event_loop *loop);
+
 static void video_close(struct device *dev)
 {
 	unsigned int i;
 
+	events_cleanup(&dev->events);
+	if (dev->metrics.server.fd >= 0)
+		metrics_close(&dev->metrics);
+	if (dev->control.server.fd >= 0)
+		control_close(&dev->control);
+	trace_cleanup(&dev->trace);
+
 	for (i = 0; i < dev->num_planes; i++)
 		free(dev->pattern[i]);
 
 	free(dev->buffers);
-	if (dev->opened)
+	dmabuf_close(&dev->dmabuf);
+	if (dev->use_replay)
+		replay_close(&dev->replay);
+	else if (dev->opened)
 		close(dev->fd);
 }
 
 static void video_log_status(struct device *dev)
 {
-	ioctl(dev->fd, VIDIOC_LOG_STATUS);
+	video_ioctl(dev, VIDIOC_LOG_STATUS, NULL);
 }
 
 static int video_get_format(struct device *dev)
 {
 	struct v4l2_format fmt;
+	unsigned int i;
 	int ret;
 
 	memset(&fmt, 0, sizeof fmt);
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.type = dev->type;
 
-	ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
+	ret = video_ioctl(dev, VIDIOC_G_FMT, &fmt);
 	if (ret < 0) {
 		print("Unable to get format: %s (%d).\n", strerror(errno),
 			errno);
 		return ret;
 	}
 
-	dev->width = fmt.fmt.pix.width;
-	dev->height = fmt.fmt.pix.height;
-	dev->num_planes = 1;
-
-	print("Video format: %s (%08x) %ux%u (stride %u) field %s buffer size %u\n",
-		v4l2_format_name(fmt.fmt.pix.pixelformat), fmt.fmt.pix.pixelformat,
-		fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.bytesperline,
-		v4l2_field_name(fmt.fmt.pix_mp.field),
-		fmt.fmt.pix.sizeimage);
+	if (video_is_mplane(dev)) {
+		dev->width = fmt.fmt.pix_mp.width;
+		dev->height = fmt.fmt.pix_mp.height;
+		dev->num_planes = fmt.fmt.pix_mp.num_planes;
+
+		print("Video format: %s (%08x) %ux%u field %s, %u planes:\n",
+			v4l2_format_name(fmt.fmt.pix_mp.pixelformat),
+			fmt.fmt.pix_mp.pixelformat, fmt.fmt.pix_mp.width,
+			fmt.fmt.pix_mp.height, v4l2_field_name(fmt.fmt.pix_mp.field),
+			fmt.fmt.pix_mp.num_planes);
+
+		for (i = 0; i < fmt.fmt.pix_mp.num_planes; i++) {
+			dev->bytesperline[i] = fmt.fmt.pix_mp.plane_fmt[i].bytesperline;
+			dev->sizeimage[i] = fmt.fmt.pix_mp.plane_fmt[i].sizeimage;
+			print(" * Stride %u, buffer size %u\n",
+				fmt.fmt.pix_mp.plane_fmt[i].bytesperline,
+				fmt.fmt.pix_mp.plane_fmt[i].sizeimage);
+		}
+	} else {
+		dev->width = fmt.fmt.pix.width;
+		dev->height = fmt.fmt.pix.height;
+		dev->num_planes = 1;
+		dev->bytesperline[0] = fmt.fmt.pix.bytesperline;
+		dev->sizeimage[0] = fmt.fmt.pix.sizeimage;
+
+		print("Video format: %s (%08x) %ux%u (stride %u) field %s buffer size %u\n",
+			v4l2_format_name(fmt.fmt.pix.pixelformat), fmt.fmt.pix.pixelformat,
+			fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.bytesperline,
+			v4l2_field_name(fmt.fmt.pix.field),
+			fmt.fmt.pix.sizeimage);
+	}
 
 	return 0;
 }
 
+/* The single planar view of a format, with the sizes of plane 0 */
+static void video_format_pix(struct device *dev, const struct v4l2_format *fmt,
+			     struct v4l2_pix_format *pix)
+{
+	const struct v4l2_pix_format_mplane *mp = &fmt->fmt.pix_mp;
+
+	if (!video_is_mplane(dev)) {
+		*pix = fmt->fmt.pix;
+		return;
+	}
+
+	memset(pix, 0, sizeof *pix);
+	pix->width = mp->width;
+	pix->height = mp->height;
+	pix->pixelformat = mp->pixelformat;
+	pix->field = mp->field;
+	pix->bytesperline = mp->plane_fmt[0].bytesperline;
+	pix->sizeimage = mp->plane_fmt[0].sizeimage;
+	pix->colorspace = mp->colorspace;
+	pix->flags = mp->flags;
+}
+
 static int format_bpp(__u32 pixfmt)
 {
 	switch(pixfmt)
@@ -469,60 +670,216 @@ static int video_set_format(struct device *dev, unsigned int w, unsigned int h,
 			    unsigned int flags)
 {
 	struct v4l2_format fmt;
+	unsigned int i;
 	int ret;
 
 	memset(&fmt, 0, sizeof fmt);
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.type = dev->type;
 
-	fmt.fmt.pix.width = w;
-	fmt.fmt.pix.height = h;
-	fmt.fmt.pix.pixelformat = format;
-	fmt.fmt.pix.field = field;
 	print("stride is %d\n",stride);
 	if (!stride)
 		stride = ((w+31) &~31)*format_bpp(format);
 	print("stride is now %d\n",stride);
-	fmt.fmt.pix.bytesperline = stride;
-	fmt.fmt.pix.sizeimage = buffer_size;
-	fmt.fmt.pix.priv = V4L2_PIX_FMT_PRIV_MAGIC;
-	fmt.fmt.pix.flags = flags;
 
-	ret = ioctl(dev->fd, VIDIOC_S_FMT, &fmt);
+	if (video_is_mplane(dev)) {
+		const struct v4l2_format_info *info = v4l2_format_by_fourcc(format);
+
+		fmt.fmt.pix_mp.width = w;
+		fmt.fmt.pix_mp.height = h;
+		fmt.fmt.pix_mp.pixelformat = format;
+		fmt.fmt.pix_mp.field = field;
+		fmt.fmt.pix_mp.num_planes = info ? info->n_planes : 1;
+		fmt.fmt.pix_mp.flags = flags;
+		/* The driver derives the other planes from the luma stride */
+		fmt.fmt.pix_mp.plane_fmt[0].bytesperline = stride;
+		fmt.fmt.pix_mp.plane_fmt[0].sizeimage = buffer_size;
+	} else {
+		fmt.fmt.pix.width = w;
+		fmt.fmt.pix.height = h;
+		fmt.fmt.pix.pixelformat = format;
+		fmt.fmt.pix.field = field;
+		fmt.fmt.pix.bytesperline = stride;
+		fmt.fmt.pix.sizeimage = buffer_size;
+		fmt.fmt.pix.priv = V4L2_PIX_FMT_PRIV_MAGIC;
+		fmt.fmt.pix.flags = flags;
+	}
+
+	ret = video_ioctl(dev, VIDIOC_S_FMT, &fmt);
 	if (ret < 0) {
 		print("Unable to set format: %s (%d).\n", strerror(errno),
 			errno);
 		return ret;
 	}
 
-	print("Video format set: %s (%08x) %ux%u (stride %u) field %s buffer size %u\n",
-		v4l2_format_name(fmt.fmt.pix.pixelformat), fmt.fmt.pix.pixelformat,
-		fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.bytesperline,
-		v4l2_field_name(fmt.fmt.pix.field),
-		fmt.fmt.pix.sizeimage);
+	if (video_is_mplane(dev)) {
+		print("Video format set: %s (%08x) %ux%u field %s, %u planes:\n",
+			v4l2_format_name(fmt.fmt.pix_mp.pixelformat),
+			fmt.fmt.pix_mp.pixelformat, fmt.fmt.pix_mp.width,
+			fmt.fmt.pix_mp.height, v4l2_field_name(fmt.fmt.pix_mp.field),
+			fmt.fmt.pix_mp.num_planes);
+
+		for (i = 0; i < fmt.fmt.pix_mp.num_planes; i++)
+			print(" * Stride %u, buffer size %u\n",
+				fmt.fmt.pix_mp.plane_fmt[i].bytesperline,
+				fmt.fmt.pix_mp.plane_fmt[i].sizeimage);
+	} else {
+		print("Video format set: %s (%08x) %ux%u (stride %u) field %s buffer size %u\n",
+			v4l2_format_name(fmt.fmt.pix.pixelformat), fmt.fmt.pix.pixelformat,
+			fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.bytesperline,
+			v4l2_field_name(fmt.fmt.pix.field),
+			fmt.fmt.pix.sizeimage);
+	}
+
+	return 0;
+}
+
+/* Size of a plane, as the driver has it or as we allocated it */
+static unsigned int video_plane_length(struct device *dev, struct buffer *buffer,
+				       struct v4l2_buffer *v4l2buf, unsigned int plane)
+{
+	if (dev->memtype == V4L2_MEMORY_DMABUF)
+		return buffer->size[plane];
+	if (video_is_mplane(dev))
+		return v4l2buf->m.planes[plane].length;
+	return v4l2buf->length;
+}
+
+/* A dmabuf per plane, big enough for what the driver and format need */
+static int video_buffer_alloc_dmabuf(struct device *dev, struct buffer *buffer,
+				     struct v4l2_buffer *v4l2buf)
+{
+	unsigned int length;
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		length = video_is_mplane(dev) ? v4l2buf->m.planes[i].length
+					      : v4l2buf->length;
+		if (length < dev->sizeimage[i])
+			length = dev->sizeimage[i];
+
+		fd = dmabuf_alloc(&dev->dmabuf, length);
+		if (fd < 0) {
+			print("Unable to allocate %u bytes from %s for buffer %u/%u: %s (%d)\n",
+			       length, dev->dmabuf.ops->name, buffer->idx, i,
+			       strerror(-fd), -fd);
+			return fd;
+		}
+
+		buffer->dma_fd[i] = fd;
+		buffer->size[i] = length;
+	}
 
 	return 0;
 }
 
+/*
+ * Where the isp reads the planes of a multi-planar frame. The firmware
+ * doesn't look at the plane offsets in a buffer header, it lays the planes
+ * out back to back from the committed input format: every line is
+ * bytesperline long and there are video.height lines (aligned up to 16),
+ * half as many for the 4:2:0 chroma planes. Returns the frame size.
+ */
+static size_t isp_plane_offsets(struct device *dev, size_t *offsets)
+{
+	unsigned int height = dev->isp->input[0]->format->es->video.height;
+	size_t size = 0;
+	unsigned int i;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		offsets[i] = size;
+		size += (size_t)dev->bytesperline[i] * (i ? height / 2 : height);
+	}
+
+	return size;
+}
+
+/*
+ * Planes are mapped into one reserved range, so MMAL can be handed the
+ * whole frame as one buffer. For the isp they go where it will read them,
+ * if those offsets are page aligned and leave room for each plane. Lines
+ * the isp reads beyond a plane, up to its aligned height, are the
+ * reservation's zero pages. Otherwise the planes are mapped back to back,
+ * and each frame is repacked into the isp's layout as it is captured.
+ */
 static int video_buffer_mmap(struct device *dev, struct buffer *buffer,
 			     struct v4l2_buffer *v4l2buf)
 {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t offsets[VIDEO_MAX_PLANES];
+	size_t frame_size = 0;
+	bool in_place = false;
+	uint8_t *base = NULL;
+	size_t span = 0;
 	unsigned int length;
 	unsigned int offset;
 	unsigned int i;
+	int fd;
+
+	if (dev->num_planes > 1) {
+		for (i = 0; i < dev->num_planes; i++)
+			span += (video_plane_length(dev, buffer, v4l2buf, i) + page - 1) &
+				~(page - 1);
+
+		if (dev->mmal_pool) {
+			frame_size = isp_plane_offsets(dev, offsets);
+			in_place = true;
+			for (i = 0; i < dev->num_planes; i++) {
+				length = video_plane_length(dev, buffer, v4l2buf, i);
+				if (offsets[i] % page ||
+				    (i + 1 < dev->num_planes && offsets[i] + length > offsets[i + 1]))
+					in_place = false;
+			}
+			if (in_place) {
+				i = dev->num_planes - 1;
+				span = offsets[i] + video_plane_length(dev, buffer, v4l2buf, i);
+				if (span < frame_size)
+					span = frame_size;
+				span = (span + page - 1) & ~(page - 1);
+			} else {
+				buffer->repack = malloc(frame_size);
+				if (!buffer->repack)
+					return -ENOMEM;
+			}
+		}
+
+		base = mmap(NULL, span, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			print("Unable to reserve %zu bytes for buffer %u: %s (%d)\n",
+			       span, buffer->idx, strerror(errno), errno);
+			return -1;
+		}
+		buffer->map_base = base;
+		buffer->map_span = span;
+		span = 0;
+	}
 
 	for (i = 0; i < dev->num_planes; i++) {
-		length = v4l2buf->length;
-		offset = v4l2buf->m.offset;
+		length = video_plane_length(dev, buffer, v4l2buf, i);
+		if (dev->memtype == V4L2_MEMORY_DMABUF) {
+			fd = buffer->dma_fd[i];
+			offset = 0;
+		} else {
+			fd = dev->use_replay ? dev->replay.mem_fd : dev->fd;
+			offset = video_is_mplane(dev) ? v4l2buf->m.planes[i].m.mem_offset
+						      : v4l2buf->m.offset;
+		}
 
-		buffer->mem[i] = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED,
-				      dev->fd, offset);
+		if (in_place)
+			span = offsets[i];
+		buffer->mem[i] = mmap(base ? base + span : NULL, length,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | (base ? MAP_FIXED : 0),
+				      fd, offset);
 		if (buffer->mem[i] == MAP_FAILED) {
 			print("Unable to map buffer %u/%u: %s (%d)\n",
 			       buffer->idx, i, strerror(errno), errno);
+			buffer->mem[i] = NULL;
 			return -1;
 		}
 
 		buffer->size[i] = length;
+		span += (length + page - 1) & ~(page - 1);
 
 		print("Buffer %u/%u mapped at address %p.\n",
 		       buffer->idx, i, buffer->mem[i]);
@@ -531,12 +888,59 @@ static int video_buffer_mmap(struct device *dev, struct buffer *buffer,
 	return 0;
 }
 
+/*
+ * Copy a multi-planar frame into the isp's layout if it isn't there
+ * already: the planes couldn't be mapped in place, or the payload starts
+ * part way into a plane.
+ */
+static int video_buffer_repack(struct device *dev, struct buffer *buffer,
+			       const struct v4l2_plane *planes)
+{
+	size_t offsets[VIDEO_MAX_PLANES];
+	size_t frame_size, length;
+	unsigned int i;
+	bool shifted = false;
+
+	for (i = 0; i < dev->num_planes; i++)
+		shifted |= planes[i].data_offset != 0;
+	if (!buffer->repack && !shifted)
+		return 0;
+
+	frame_size = isp_plane_offsets(dev, offsets);
+	if (!buffer->repack) {
+		buffer->repack = malloc(frame_size);
+		if (!buffer->repack)
+			return -ENOMEM;
+		buffer->mmal->data = buffer->repack;
+	}
+
+	for (i = 0; i < dev->num_planes; i++) {
+		length = (i + 1 < dev->num_planes ? offsets[i + 1] : frame_size) - offsets[i];
+		if (planes[i].bytesused < planes[i].data_offset)
+			continue;
+		if (length > planes[i].bytesused - planes[i].data_offset)
+			length = planes[i].bytesused - planes[i].data_offset;
+		memcpy(buffer->repack + offsets[i],
+		       (uint8_t *)buffer->mem[i] + planes[i].data_offset, length);
+	}
+
+	return 0;
+}
+
 static int video_buffer_munmap(struct device *dev, struct buffer *buffer)
 {
 	unsigned int i;
 	int ret;
 
-	for (i = 0; i < dev->num_planes; i++) {
+	/* The planes go with the range they were mapped into */
+	if (buffer->map_base) {
+		if (munmap(buffer->map_base, buffer->map_span) < 0)
+			print("Unable to unmap buffer %u: %s (%d)\n",
+			       buffer->idx, strerror(errno), errno);
+		memset(buffer->mem, 0, sizeof buffer->mem);
+	}
+
+	for (i = 0; i < dev->num_planes && buffer->mem[i]; i++) {
 		ret = munmap(buffer->mem[i], buffer->size[i]);
 		if (ret < 0) {
 			print("Unable to unmap buffer %u/%u: %s (%d)\n",
@@ -546,34 +950,92 @@ static int video_buffer_munmap(struct device *dev, struct buffer *buffer)
 		buffer->mem[i] = NULL;
 	}
 
+	buffer->map_base = NULL;
+	free(buffer->repack);
+	buffer->repack = NULL;
+
 	return 0;
 }
 
-static void get_ts_flags(uint32_t flags, const char **ts_type, const char **ts_source)
+/*
+ * Import a buffer into VideoCore memory. Returns NULL if it was, or why it
+ * will have to be copied.
+ */
+static const char *video_buffer_import(struct device *dev, struct buffer *buffer)
 {
-	switch (flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) {
-	case V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN:
-		*ts_type = "unk";
-		break;
-	case V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC:
-		*ts_type = "mono";
-		break;
-	case V4L2_BUF_FLAG_TIMESTAMP_COPY:
-		*ts_type = "copy";
-		break;
-	default:
-		*ts_type = "inv";
-	}
-	switch (flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) {
-	case V4L2_BUF_FLAG_TSTAMP_SRC_EOF:
-		*ts_source = "EoF";
-		break;
-	case V4L2_BUF_FLAG_TSTAMP_SRC_SOE:
-		*ts_source = "SoE";
-		break;
-	default:
-		*ts_source = "inv";
+	buffer->vcsm_handle = 0;
+
+	/* The VPU takes one handle per buffer */
+	if (dev->num_planes > 1)
+		return "planes in separate dmabufs";
+	if (buffer->dma_fd[0] < 0)
+		return "no dmabuf";
+
+	buffer->vcsm_handle = vcsm_import_dmabuf(buffer->dma_fd[0], "V4L2 buf");
+	if (!buffer->vcsm_handle)
+		return "vcsm import failed";
+
+	print("Imported buffer %u dmabuf %d, vcsm handle %u\n", buffer->idx,
+	      buffer->dma_fd[0], buffer->vcsm_handle);
+	return NULL;
+}
+
+/*
+ * Point the MMAL headers at the buffers, as VC handles when every buffer
+ * was imported and ARM pointers otherwise. A partial import is undone, the
+ * isp input port is either zero copy or not for all of its buffers.
+ */
+static int video_link_mmal(struct device *dev)
+{
+	struct buffer *buffer;
+	unsigned int i;
+
+	dev->zero_copy_buffers = 0;
+	for (i = 0; i < dev->nbufs; i++) {
+		if (!dev->buffers[i].copy_reason)
+			dev->zero_copy_buffers++;
+	}
+	dev->zero_copy = dev->zero_copy_buffers == dev->nbufs;
+
+	if (!dev->zero_copy) {
+		for (i = 0; i < dev->nbufs; i++) {
+			buffer = &dev->buffers[i];
+			if (buffer->copy_reason) {
+				fprintf(stderr, "Buffer %u is not zero copy: %s\n", i,
+					buffer->copy_reason);
+			} else {
+				vcsm_free(buffer->vcsm_handle);
+				buffer->vcsm_handle = 0;
+				buffer->copy_reason = "other buffers not imported";
+			}
+		}
+
+		fprintf(stderr, "Zero copy: %u of %u buffers imported, copying all of them\n",
+			dev->zero_copy_buffers, dev->nbufs);
+		if (dev->require_zero_copy)
+			return -1;
+	} else {
+		print("Zero copy: all %u buffers imported\n", dev->nbufs);
 	}
+
+	for (i = 0; i < dev->nbufs; i++) {
+		buffer = &dev->buffers[i];
+		if (buffer->vcsm_handle)
+			buffer->mmal->data = (uint8_t *)vcsm_vc_hdl_from_hdl(buffer->vcsm_handle);
+		else if (buffer->repack)
+			buffer->mmal->data = buffer->repack;
+		else
+			buffer->mmal->data = buffer->mem[0];
+
+		print("Linking V4L2 buffer index %d ptr %p to MMAL header %p. mmal->data 0x%X\n",
+			i, buffer, buffer->mmal, (uint32_t)buffer->mmal->data);
+	}
+
+	/* Only what is still zero copy counts */
+	if (!dev->zero_copy)
+		dev->zero_copy_buffers = 0;
+
+	return 0;
 }
 
 static int video_alloc_buffers(struct device *dev, int nbufs)
@@ -582,15 +1044,15 @@ static int video_alloc_buffers(struct device *dev, int nbufs)
 	struct v4l2_requestbuffers rb;
 	struct v4l2_buffer buf;
 	struct buffer *buffers;
-	unsigned int i;
+	unsigned int i, j;
 	int ret;
 
 	memset(&rb, 0, sizeof rb);
 	rb.count = nbufs;
-	rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	rb.memory = V4L2_MEMORY_MMAP;
+	rb.type = dev->type;
+	rb.memory = dev->memtype;
 
-	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &rb);
+	ret = video_ioctl(dev, VIDIOC_REQBUFS, &rb);
 	if (ret < 0) {
 		print("Unable to request buffers: %s (%d).\n", strerror(errno),
 			errno);
@@ -599,10 +1061,15 @@ static int video_alloc_buffers(struct device *dev, int nbufs)
 
 	print("%u buffers requested.\n", rb.count);
 
-	buffers = malloc(rb.count * sizeof buffers[0]);
+	buffers = calloc(rb.count, sizeof buffers[0]);
 	if (buffers == NULL)
 		return -ENOMEM;
 
+	for (i = 0; i < rb.count; ++i) {
+		for (j = 0; j < VIDEO_MAX_PLANES; j++)
+			buffers[i].dma_fd[j] = -1;
+	}
+
 	/* Map the buffers. */
 	for (i = 0; i < rb.count; ++i) {
 		const char *ts_type, *ts_source;
@@ -611,23 +1078,36 @@ static int video_alloc_buffers(struct device *dev, int nbufs)
 		memset(planes, 0, sizeof planes);
 
 		buf.index = i;
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
+		buf.type = dev->type;
+		buf.memory = dev->memtype;
 		buf.length = VIDEO_MAX_PLANES;
 		buf.m.planes = planes;
 
-		ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &buf);
+		ret = video_ioctl(dev, VIDIOC_QUERYBUF, &buf);
 		if (ret < 0) {
 			print("Unable to query buffer %u: %s (%d).\n", i,
 				strerror(errno), errno);
 			return ret;
 		}
-		get_ts_flags(buf.flags, &ts_type, &ts_source);
-		print("length: %u offset: %u timestamp type/source: %s/%s\n",
-		       buf.length, buf.m.offset, ts_type, ts_source);
+		v4l2_timestamp_names(buf.flags, &ts_type, &ts_source);
+		if (video_is_mplane(dev)) {
+			print("timestamp type/source: %s/%s\n", ts_type, ts_source);
+			for (j = 0; j < dev->num_planes; j++)
+				print("plane %u length: %u offset: %u\n", j,
+				       planes[j].length, planes[j].m.mem_offset);
+		} else {
+			print("length: %u offset: %u timestamp type/source: %s/%s\n",
+			       buf.length, buf.m.offset, ts_type, ts_source);
+		}
 
 		buffers[i].idx = i;
 
+		if (dev->memtype == V4L2_MEMORY_DMABUF) {
+			ret = video_buffer_alloc_dmabuf(dev, &buffers[i], &buf);
+			if (ret < 0)
+				return ret;
+		}
+
 		ret = video_buffer_mmap(dev, &buffers[i], &buf);
 		if (ret < 0)
 			return ret;
@@ -636,6 +1116,12 @@ static int video_alloc_buffers(struct device *dev, int nbufs)
 			struct v4l2_exportbuffer expbuf;
 			MMAL_BUFFER_HEADER_T *mmal_buf;
 
+			/*
+			 * Each V4L2 buffer owns one header from here until
+			 * video_free_buffers, with user_data pointing back at
+			 * it, so the capture path and isp_ip_cb can map between
+			 * the two without searching.
+			 */
 			mmal_buf = mmal_queue_get(dev->mmal_pool->queue);
 			if (!mmal_buf) {
 				print("Failed to get a buffer from the pool. Queue length %d\n", mmal_queue_length(dev->mmal_pool->queue));
@@ -643,66 +1129,79 @@ static int video_alloc_buffers(struct device *dev, int nbufs)
 			}
 			mmal_buf->user_data = &buffers[i];
 
-			memset(&expbuf, 0, sizeof(expbuf));
-			expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			expbuf.index = i;
-			if (!ioctl(dev->fd, VIDIOC_EXPBUF, &expbuf)) {
-				buffers[i].dma_fd = expbuf.fd;
-
-				buffers[i].vcsm_handle = vcsm_import_dmabuf(expbuf.fd, "V4L2 buf");
-			}
-			else
-			{
-				buffers[i].dma_fd = -1;
-				buffers[i].vcsm_handle = 0;
+			/* Our own dmabufs need no exporting */
+			for (j = 0; j < dev->num_planes && dev->memtype == V4L2_MEMORY_MMAP; j++) {
+				memset(&expbuf, 0, sizeof(expbuf));
+				expbuf.type = dev->type;
+				expbuf.index = i;
+				expbuf.plane = j;
+				if (!video_ioctl(dev, VIDIOC_EXPBUF, &expbuf))
+					buffers[i].dma_fd[j] = expbuf.fd;
 			}
 
-			if (buffers[i].vcsm_handle)
-			{
-				dev->can_zero_copy = MMAL_TRUE;
-				print("Exported buffer %d to dmabuf %d, vcsm handle %u\n", i, buffers[i].dma_fd, buffers[i].vcsm_handle);
-				mmal_buf->data = (uint8_t*)vcsm_vc_hdl_from_hdl(buffers[i].vcsm_handle);
-			}
-			else
-			{
-				dev->can_zero_copy = MMAL_FALSE;
-				mmal_buf->data = buffers[i].mem[0];	//Only deal with the single planar API
+			buffers[i].copy_reason = video_buffer_import(dev, &buffers[i]);
+
+			/* The planes as MMAL sees them, relative to data */
+			mmal_buf->type->video.planes = dev->num_planes;
+			for (j = 0; j < dev->num_planes; j++) {
+				mmal_buf->type->video.offset[j] =
+					(uint8_t *)buffers[i].mem[j] - (uint8_t *)buffers[i].mem[0];
+				mmal_buf->type->video.pitch[j] = dev->bytesperline[j];
 			}
 
-			mmal_buf->alloc_size = buf.length;
+			/* Up to the end of the last plane, padding included */
+			mmal_buf->alloc_size = mmal_buf->type->video.offset[dev->num_planes - 1] +
+					       buffers[i].size[dev->num_planes - 1];
+
+			/* Multi-planar frames are where the isp reads them, or repacked there */
+			if (dev->num_planes > 1) {
+				size_t offsets[VIDEO_MAX_PLANES];
+
+				mmal_buf->alloc_size = isp_plane_offsets(dev, offsets);
+				for (j = 0; j < dev->num_planes; j++)
+					mmal_buf->type->video.offset[j] = offsets[j];
+			}
 			buffers[i].mmal = mmal_buf;
-			print("Linking V4L2 buffer index %d ptr %p to MMAL header %p. mmal->data 0x%X\n",
-				i, &buffers[i], mmal_buf, (uint32_t)mmal_buf->data);
-			/* Put buffer back in the pool */
-			mmal_buffer_header_release(mmal_buf);
 		}
 	}
 
 	dev->timestamp_type = buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK;
 	dev->buffers = buffers;
 	dev->nbufs = rb.count;
+
+	if (dev->mmal_pool)
+		return video_link_mmal(dev);
 	return 0;
 }
 
 static int video_free_buffers(struct device *dev)
 {
 	struct v4l2_requestbuffers rb;
-	unsigned int i;
+	unsigned int i, j;
 	int ret;
 
 	if (dev->nbufs == 0)
 		return 0;
 
 	for (i = 0; i < dev->nbufs; ++i) {
+		if (dev->buffers[i].mmal)
+		{
+			/* Return the bound header to the pool */
+			dev->buffers[i].mmal->user_data = NULL;
+			mmal_buffer_header_release(dev->buffers[i].mmal);
+			dev->buffers[i].mmal = NULL;
+		}
 		if (dev->buffers[i].vcsm_handle)
 		{
 			print("Releasing vcsm handle %u\n", dev->buffers[i].vcsm_handle);
 			vcsm_free(dev->buffers[i].vcsm_handle);
 		}
-		if (dev->buffers[i].dma_fd >= 0)
+		for (j = 0; j < dev->num_planes; j++)
 		{
-			print("Closing dma_buf %d\n", dev->buffers[i].dma_fd);
-			close(dev->buffers[i].dma_fd);
+			if (dev->buffers[i].dma_fd[j] < 0)
+				continue;
+			print("Closing dma_buf %d\n", dev->buffers[i].dma_fd[j]);
+			close(dev->buffers[i].dma_fd[j]);
 		}
 		ret = video_buffer_munmap(dev, &dev->buffers[i]);
 		if (ret < 0)
@@ -711,10 +1210,10 @@ static int video_free_buffers(struct device *dev)
 
 	memset(&rb, 0, sizeof rb);
 	rb.count = 0;
-	rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	rb.memory = V4L2_MEMORY_MMAP;
+	rb.type = dev->type;
+	rb.memory = dev->memtype;
 
-	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &rb);
+	ret = video_ioctl(dev, VIDIOC_REQBUFS, &rb);
 	if (ret < 0) {
 		print("Unable to release buffers: %s (%d).\n",
 			strerror(errno), errno);
@@ -740,23 +1239,58 @@ static int video_queue_buffer(struct device *dev, int index)
 	memset(&planes, 0, sizeof planes);
 
 	buf.index = index;
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
+	buf.type = dev->type;
+	buf.memory = dev->memtype;
+	buf.length = dev->num_planes;
+	buf.m.planes = planes;
+
+	if (dev->memtype == V4L2_MEMORY_DMABUF) {
+		struct buffer *buffer = &dev->buffers[index];
+		unsigned int i;
+
+		if (video_is_mplane(dev)) {
+			for (i = 0; i < dev->num_planes; i++) {
+				planes[i].m.fd = buffer->dma_fd[i];
+				planes[i].length = buffer->size[i];
+			}
+		} else {
+			buf.m.fd = buffer->dma_fd[0];
+			buf.length = buffer->size[0];
+		}
+	}
 
-	ret = ioctl(dev->fd, VIDIOC_QBUF, &buf);
+	ret = video_ioctl(dev, VIDIOC_QBUF, &buf);
 	if (ret < 0)
 		print("Unable to queue buffer: %s (%d).\n",
 			strerror(errno), errno);
+	else
+		__atomic_add_fetch(&dev->queued, 1, __ATOMIC_RELAXED);
 
 	return ret;
 }
 
+static void buffer_get(struct buffer *buffer)
+{
+	__atomic_add_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Drop a reference, requeuing the buffer to V4L2 if it was the last one */
+static int buffer_put(struct device *dev, struct buffer *buffer)
+{
+	if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	if (!buffer->requeue)
+		return 0;
+
+	return video_queue_buffer(dev, buffer->idx);
+}
+
 static int video_enable(struct device *dev, int enable)
 {
-	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int type = dev->type;
 	int ret;
 
-	ret = ioctl(dev->fd, enable ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &type);
+	ret = video_ioctl(dev, enable ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &type);
 	if (ret < 0) {
 		print("Unable to %s streaming: %s (%d).\n",
 			enable ? "start" : "stop", strerror(errno), errno);
@@ -792,866 +1326,3616 @@ static int video_queue_all_buffers(struct device *dev)
 	return 0;
 }
 
-static void isp_ip_cb(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+static int events_init(struct event_loop *loop)
 {
-	struct device *dev = (struct device *)port->userdata;
 	unsigned int i;
-//	print("Buffer %p (->data %p) returned\n", buffer, buffer->data);
-	for (i = 0; i < dev->nbufs; i++) {
-		if (dev->buffers[i].mmal == buffer) {
-//			print("Matches V4L2 buffer index %d / %d\n", i, dev->buffers[i].idx);
-			video_queue_buffer(dev, dev->buffers[i].idx);
-			mmal_buffer_header_release(buffer);
-			buffer = NULL;
-			break;
-		}
+
+	memset(loop, 0, sizeof *loop);
+	for (i = 0; i < MAX_EVENT_SOURCES; i++)
+		loop->sources[i].fd = -1;
+
+	loop->timer_fd = -1;
+	loop->notify_fd = -1;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		print("Unable to create epoll instance: %s (%d).\n",
+			strerror(errno), errno);
+		return -errno;
 	}
-	if (buffer) {
-		print("Failed to find matching V4L2 buffer for mmal buffer %p\n", buffer);
-		mmal_buffer_header_release(buffer);
+
+	loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (loop->timer_fd < 0) {
+		print("Unable to create timerfd: %s (%d).\n",
+			strerror(errno), errno);
+		return -errno;
 	}
+
+	loop->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (loop->notify_fd < 0) {
+		print("Unable to create eventfd: %s (%d).\n",
+			strerror(errno), errno);
+		return -errno;
+	}
+
+	return 0;
 }
 
-static void * save_thread(void *arg)
+static void events_cleanup(struct event_loop *loop)
 {
-	struct component *comp = (struct component *)arg;
-	MMAL_BUFFER_HEADER_T *buffer;
-	MMAL_STATUS_T status;
-	unsigned int bytes_written;
-
-	while (!comp->thread_quit)
-	{
-		//Being lazy and using a timed wait instead of setting up a
-		//mechanism for skipping this when destroying the thread
-		buffer = mmal_queue_timedwait(comp->save_queue, 100);
-		if (!buffer)
-			continue;
+	if (loop->notify_fd >= 0)
+		close(loop->notify_fd);
+	if (loop->timer_fd >= 0)
+		close(loop->timer_fd);
+	if (loop->epoll_fd >= 0)
+		close(loop->epoll_fd);
+
+	loop->notify_fd = -1;
+	loop->timer_fd = -1;
+	loop->epoll_fd = -1;
+	loop->num_sources = 0;
+}
 
-		//print("Buffer %p saving, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
-		if (comp->stream_fd)
-		{
-			bytes_written = fwrite(buffer->data, 1, buffer->length, comp->stream_fd);
-			fflush(comp->stream_fd);
+static int events_add(struct event_loop *loop, int fd, uint32_t events,
+		      event_handler_t handler, void *priv)
+{
+	struct event_source *src = NULL;
+	struct epoll_event ev;
+	unsigned int i;
 
-			if (bytes_written != buffer->length)
-			{
-				print("Failed to write buffer data (%d from %d)- aborting", bytes_written, buffer->length);
-			}
+	for (i = 0; i < MAX_EVENT_SOURCES; i++) {
+		if (loop->sources[i].fd == -1) {
+			src = &loop->sources[i];
+			break;
 		}
+	}
+	if (!src) {
+		print("No free event source slots for fd %d\n", fd);
+		return -ENOSPC;
+	}
 
-		if (comp->pts_fd &&
-		    !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) &&
-		    buffer->pts != MMAL_TIME_UNKNOWN)
-			fprintf(comp->pts_fd, "%lld.%03lld\n", buffer->pts/1000, buffer->pts%1000);
+	src->fd = fd;
+	src->events = events;
+	src->handler = handler;
+	src->priv = priv;
 
-		buffer->length = 0;
-		status = mmal_port_send_buffer(comp->comp->output[0], buffer);
-		if(status != MMAL_SUCCESS)
-		{
-			print("mmal_port_send_buffer failed on buffer %p, status %d", buffer, status);
+	memset(&ev, 0, sizeof ev);
+	ev.events = events;
+	ev.data.ptr = src;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		print("Unable to add fd %d to epoll: %s (%d).\n", fd,
+			strerror(errno), errno);
+		src->fd = -1;
+		return -errno;
+	}
+
+	loop->num_sources++;
+	return 0;
+}
+
+static void events_del(struct event_loop *loop, int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_EVENT_SOURCES; i++) {
+		if (loop->sources[i].fd == fd) {
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			loop->sources[i].fd = -1;
+			loop->num_sources--;
+			break;
 		}
 	}
-	return NULL;
 }
 
-static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+static int events_set_timer(struct event_loop *loop, unsigned int interval_ms)
 {
-	struct component *comp = (struct component *)port->userdata;
+	struct itimerspec its;
 
-	//print("Buffer %p returned, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
-	//vcos_log_error("File handle: %p", port->userdata);
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = interval_ms / 1000;
+	its.it_value.tv_nsec = (interval_ms % 1000) * 1000000;
+	its.it_interval = its.it_value;
 
-	if (port->is_enabled)
-		mmal_queue_put(comp->save_queue, buffer);
-	else
-		mmal_buffer_header_release(buffer);
+	return timerfd_settime(loop->timer_fd, 0, &its, NULL);
 }
 
-/*static void dummy_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+/*
+ * Wake up the event loop from another thread (MMAL callbacks, save threads)
+ * or from a signal handler. Only uses async-signal-safe operations.
+ */
+static void events_notify(struct event_loop *loop, unsigned int flags)
 {
-	print("Buffer %p returned, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
+	uint64_t one = 1;
 
-	if (port->is_enabled)
-		mmal_port_send_buffer(port, buffer);
-	else
-		mmal_buffer_header_release(buffer);
-}*/
+	__atomic_fetch_or(&loop->notify_flags, flags, __ATOMIC_SEQ_CST);
+	if (write(loop->notify_fd, &one, sizeof one) < 0) {
+		/* Counter overflow is the only failure, and then a wakeup is already pending */
+	}
+}
 
-static void buffers_to_isp(struct device *dev)
+static unsigned int events_take_notifications(struct event_loop *loop)
 {
-	MMAL_BUFFER_HEADER_T *buffer;
+	uint64_t count;
 
-	while ((buffer = mmal_queue_get(dev->isp_output_pool->queue)) != NULL)
-	{
-		mmal_port_send_buffer(dev->isp->output[0], buffer);
+	if (read(loop->notify_fd, &count, sizeof count) < 0) {
+		/* EAGAIN - nothing pending */
 	}
 
+	return __atomic_exchange_n(&loop->notify_flags, 0, __ATOMIC_SEQ_CST);
 }
-static void isp_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+
+static int events_dispatch(struct device *dev, struct event_loop *loop, int timeout_ms)
 {
-	//print("Buffer %p from isp, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
-	//vcos_log_error("File handle: %p", port->userdata);
-	struct device *dev = (struct device*)port->userdata;
-	int i;
+	struct epoll_event evs[MAX_EVENT_SOURCES];
+	int n, i;
 
-	for (i=0; i<MAX_COMPONENTS && dev->components[i].comp; i++)
-	{
-		MMAL_BUFFER_HEADER_T *out = mmal_queue_get(dev->components[i].ip_pool->queue);
-		if (out)
-		{
-			mmal_buffer_header_replicate(out, buffer);
-			mmal_port_send_buffer(dev->components[i].comp->input[0], out);
-		}
+	n = epoll_wait(loop->epoll_fd, evs, MAX_EVENT_SOURCES, timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		errno_exit("epoll_wait");
 	}
-	mmal_buffer_header_release(buffer);
 
-	buffers_to_isp(dev);
+	for (i = 0; i < n; i++) {
+		struct event_source *src = evs[i].data.ptr;
+
+		/* A previous handler in this batch may have removed the source */
+		if (src->fd < 0)
+			continue;
+
+		src->handler(dev, src, evs[i].events);
+	}
+
+	return n;
 }
 
-static void sink_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+static void control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
-	//print("Buffer %p returned from %s, filled %d, timestamp %llu, flags %04X\n", buffer, port->name, buffer->length, buffer->pts, buffer->flags);
-	//vcos_log_error("File handle: %p", port->userdata);
-	struct device *dev = (struct device*)port->userdata;
+	struct device *dev = (struct device *)port->userdata;
+
+	if (buffer->cmd == MMAL_EVENT_ERROR) {
+		dev->mmal_error = *(MMAL_STATUS_T *)buffer->data;
+		print("%s reported error %d\n", port->component->name, dev->mmal_error);
+		events_notify(&dev->events, NOTIFY_MMAL_ERROR);
+	}
 
 	mmal_buffer_header_release(buffer);
+}
 
-	buffers_to_isp(dev);
+static int enable_control_port(struct device *dev, MMAL_COMPONENT_T *comp)
+{
+	MMAL_STATUS_T status;
+
+	comp->control->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+	status = mmal_port_enable(comp->control, control_callback);
+	if (status != MMAL_SUCCESS) {
+		print("Failed to enable control port on %s\n", comp->name);
+		return -1;
+	}
+
+	return 0;
 }
 
-#define LOG_DEBUG print
+static void isp_ip_cb(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct device *dev = (struct device *)port->userdata;
+	struct buffer *buf = (struct buffer *)buffer->user_data;
+
+	/*
+	 * The header stays bound to its V4L2 buffer for the lifetime of the
+	 * allocation, so don't release it back to the pool - it is picked up
+	 * again by index when V4L2 next returns this buffer.
+	 */
+	buffer_put(dev, buf);
+}
 
-static void dump_port_format(MMAL_ES_FORMAT_T *format)
+/* Last piece of an encoded frame, as opposed to headers or a partial frame */
+static bool buffer_frame_end(MMAL_BUFFER_HEADER_T *buffer)
 {
-   const char *name_type;
+	return (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) &&
+	       !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) &&
+	       buffer->pts != MMAL_TIME_UNKNOWN;
+}
 
-   if (!format)
-      return;
+/*
+ * Called once the data has been written, or copied into a batch when the
+ * writer can't hold on to any more buffers.
+ */
+static void save_buffer_release(void *priv)
+{
+	MMAL_BUFFER_HEADER_T *buffer = (MMAL_BUFFER_HEADER_T *)priv;
+	struct component *comp = (struct component *)buffer->user_data;
+	MMAL_STATUS_T status;
 
-   switch(format->type)
-   {
-   case MMAL_ES_TYPE_AUDIO: name_type = "audio"; break;
-   case MMAL_ES_TYPE_VIDEO: name_type = "video"; break;
-   case MMAL_ES_TYPE_SUBPICTURE: name_type = "subpicture"; break;
-   default: name_type = "unknown"; break;
-   }
+	if (buffer_frame_end(buffer))
+		latency_stamp(&comp->lat_written, comp->lat_frames, buffer->pts,
+			      LATENCY_STAGE_WRITTEN(comp->index));
 
-   LOG_DEBUG("type: %s, fourcc: %4.4s", name_type, (char *)&format->encoding);
-   LOG_DEBUG(" bitrate: %i, framed: %i", format->bitrate,
-            !!(format->flags & MMAL_ES_FORMAT_FLAG_FRAMED));
-   LOG_DEBUG(" extra data: %i, %p", format->extradata_size, format->extradata);
-   switch(format->type)
-   {
-   case MMAL_ES_TYPE_AUDIO:
-      LOG_DEBUG(" samplerate: %i, channels: %i, bps: %i, block align: %i",
-               format->es->audio.sample_rate, format->es->audio.channels,
-               format->es->audio.bits_per_sample, format->es->audio.block_align);
-      break;
+	buffer->length = 0;
+	status = mmal_port_send_buffer(comp->comp->output[0], buffer);
+	if(status != MMAL_SUCCESS)
+	{
+		/* Back to the pool, sent again when the port is re-enabled */
+		if (comp->comp->output[0]->is_enabled)
+			print("mmal_port_send_buffer failed on buffer %p, status %d", buffer, status);
+		mmal_buffer_header_release(buffer);
+	}
+}
 
-   case MMAL_ES_TYPE_VIDEO:
-      LOG_DEBUG(" width: %i, height: %i, (%i,%i,%i,%i)",
-               format->es->video.width, format->es->video.height,
-               format->es->video.crop.x, format->es->video.crop.y,
-               format->es->video.crop.width, format->es->video.crop.height);
-      LOG_DEBUG(" pixel aspect ratio: %i/%i, frame rate: %i/%i",
-               format->es->video.par.num, format->es->video.par.den,
-               format->es->video.frame_rate.num, format->es->video.frame_rate.den);
-      break;
+/*
+ * Name of a segment file. A '#' in the output name is replaced by the
+ * segment number, otherwise the number goes before the extension.
+ */
+/* Fails with -ENAMETOOLONG if the numbered name doesn't fit in size */
+static int segment_name(struct component *comp, unsigned int index,
+			char *name, size_t size)
+{
+	const char *base = comp->base_name;
+	const char *p;
+	int len;
 
-   case MMAL_ES_TYPE_SUBPICTURE:
-      break;
+	p = strchr(base, '#');
+	if (p)
+		len = snprintf(name, size, "%.*s%06u%s", (int)(p - base), base, index, p + 1);
+	else if ((p = strrchr(base, '.')))
+		len = snprintf(name, size, "%.*s-%06u%s", (int)(p - base), base, index, p);
+	else
+		len = snprintf(name, size, "%s-%06u", base, index);
 
-   default: break;
-   }
+	return len < 0 || (size_t)len >= size ? -ENAMETOOLONG : 0;
 }
 
-void mmal_log_dump_port(MMAL_PORT_T *port)
+static int segment_open(struct component *comp, unsigned int index,
+			int *fd, int *pts_fd)
 {
-   if (!port)
-      return;
+	char name[sizeof(comp->name)];
+	char pts_name[sizeof(comp->name) + 4];
 
-   LOG_DEBUG("%s(%p)", port->name, port);
+	if (segment_name(comp, index, name, sizeof(name)) < 0)
+	{
+		print("Output name %s is too long for segment %u\n", comp->base_name, index);
+		return -ENAMETOOLONG;
+	}
+	*fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (*fd < 0)
+	{
+		print("Failed to open %s: %s (%d)\n", name, strerror(errno), errno);
+		return -errno;
+	}
 
-   dump_port_format(port->format);
+	*pts_fd = -1;
+	if (!comp->mux.ops)
+	{
+		snprintf(pts_name, sizeof(pts_name), "%s.pts", name);
+		*pts_fd = open(pts_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (*pts_fd >= 0) /* save header for mkvmerge */
+			dprintf(*pts_fd, "# timecode format v2\n");
+	}
 
-   LOG_DEBUG(" buffers num: %i(opt %i, min %i), size: %i(opt %i, min: %i), align: %i",
-            port->buffer_num, port->buffer_num_recommended, port->buffer_num_min,
-            port->buffer_size, port->buffer_size_recommended, port->buffer_size_min,
-            port->buffer_alignment_min);
+	return 0;
 }
 
-int video_set_dv_timings(struct device *dev);
-
-static void handle_event(struct device *dev)
+/*
+ * List the data written since the last partial segment as a new part.
+ * It must already be on disk.
+ */
+static void segment_part_close(struct component *comp, uint64_t end)
 {
-        struct v4l2_event ev;
-
-        while (!ioctl(dev->fd, VIDIOC_DQEVENT, &ev)) {
-            switch (ev.type) {
-            case V4L2_EVENT_SOURCE_CHANGE:
-                fprintf(stderr, "Source changed\n");
+	struct segment *seg = &comp->seg;
+	int64_t duration = 0;
+	int ret = 0;
 
-		video_set_dv_timings(dev);
-//                stop_capture(V4L2_BUF_TYPE_VIDEO_CAPTURE);
-//                unmap_buffers(buffers, n_buffers);
+	/* The init section of an fMP4 file isn't part of any part */
+	if (seg->part_offset < comp->mux.header_len)
+		seg->part_offset = comp->mux.header_len;
 
-                fprintf(stderr, "Unmapped all buffers\n");
-//                free_buffers_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+	if (seg->part_start_pts != MMAL_TIME_UNKNOWN && seg->last_pts != MMAL_TIME_UNKNOWN)
+		duration = seg->last_pts + seg->frame_usec - seg->part_start_pts;
 
-//                init_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE, &buffers, &n_buffers);
+	if (end > seg->part_offset)
+		ret = hls_part_add(&comp->hls, seg->part_offset, end - seg->part_offset,
+				   duration, seg->part_independent);
+	if (ret == -ENOSPC)
+	{
+		if (!seg->parts_full)
+			print("%s: more than %u partial segments, listing the rest of it whole\n",
+			      comp->name, HLS_MAX_PARTS);
+		seg->parts_full = true;
+	}
+	else if (ret < 0)
+	{
+		print("%s: failed to update playlist %s\n", comp->name, comp->hls.path);
+	}
 
-//                start_capturing_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE, buffers, n_buffers);
-                break;
-            case V4L2_EVENT_EOS:
-                fprintf(stderr, "EOS\n");
-                break;
-            }
-        }
+	seg->part_offset = end;
+	seg->part_start_pts = MMAL_TIME_UNKNOWN;
 }
 
-#define MAX_ENCODINGS_NUM 25
-typedef struct {
-   MMAL_PARAMETER_HEADER_T header;
-   MMAL_FOURCC_T encodings[MAX_ENCODINGS_NUM];
-} MMAL_SUPPORTED_ENCODINGS_T;
+/* Add the segment just finished to the playlist, once it is on disk */
+static void segment_hls_end(struct component *comp, uint64_t length)
+{
+	struct segment *seg = &comp->seg;
+	int64_t duration = 0;
 
+	if (!comp->hls.path)
+		return;
 
-int mmal_dump_supported_formats(MMAL_PORT_T *port)
-{
-   int new_fw = 0;
-   MMAL_STATUS_T ret;
+	hls_set_init(&comp->hls, comp->mux.header_len);
+	if (comp->hls.part_target)
+		segment_part_close(comp, length);
 
-   MMAL_SUPPORTED_ENCODINGS_T sup_encodings = {{MMAL_PARAMETER_SUPPORTED_ENCODINGS, sizeof(sup_encodings)}, {0}};
-   ret = mmal_port_parameter_get(port, &sup_encodings.header);
-   if (ret == MMAL_SUCCESS || ret == MMAL_ENOSPC)
-   {
-      //Allow ENOSPC error and hope that the desired formats are in the first
-      //MAX_ENCODINGS_NUM entries.
-      int i;
-      int num_encodings = (sup_encodings.header.size - sizeof(sup_encodings.header)) /
-          sizeof(sup_encodings.encodings[0]);
-      if(num_encodings > MAX_ENCODINGS_NUM)
-         num_encodings = MAX_ENCODINGS_NUM;
-      for (i=0; i<num_encodings; i++)
-      {
-         printf("Format %4.4s\n", (char *)&sup_encodings.encodings[i]);
-      }
-   }
-   return new_fw;
+	if (seg->start_pts != MMAL_TIME_UNKNOWN && seg->last_pts != MMAL_TIME_UNKNOWN)
+		duration = seg->last_pts + seg->frame_usec - seg->start_pts;
+
+	if (hls_segment_end(&comp->hls, length, duration) < 0)
+		print("%s: failed to update playlist %s\n", comp->name, comp->hls.path);
 }
 
-static int setup_mmal(struct device *dev, int nbufs, const char *filename)
+/* Move output to the next segment, which starts with this buffer */
+static void segment_switch(struct component *comp, int64_t pts)
 {
-	MMAL_STATUS_T status;
-	VCOS_STATUS_T vcos_status;
-	MMAL_PORT_T *port;
-	const struct v4l2_format_info *info;
-	struct v4l2_format fmt;
-	int ret, i;
-	MMAL_PORT_T *isp_output;
-
-	//FIXME: Clean up after errors
+	struct segment *seg = &comp->seg;
+	uint64_t length;
+	int ret;
 
-	status = mmal_component_create("vc.ril.isp", &dev->isp);
-	if(status != MMAL_SUCCESS)
+	if (seg->next_fd < 0 &&
+	    segment_open(comp, seg->index + 1, &seg->next_fd, &seg->next_pts_fd) < 0)
 	{
-		print("Failed to create isp\n");
-		return -1;
+		/* Carry on with the current file */
+		seg->bytes = 0;
+		seg->idr_requested = false;
+		return;
 	}
 
-	port = dev->isp->input[0];
+	/* Finish the old file's container, then point the writer at the new one */
+	if (comp->mux.ops)
+		mux_reset(&comp->mux);
 
-	memset(&fmt, 0, sizeof fmt);
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	length = writer_position(&comp->writer);
+	ret = writer_set_fd(&comp->writer, seg->next_fd);
+	if (ret < 0)
+		print("%s: write error at end of segment: %s (%d)\n",
+			comp->name, strerror(-ret), -ret);
+	if (seg->next_pts_fd >= 0)
+		writer_set_sidecar(&comp->writer, seg->next_pts_fd);
+
+	segment_hls_end(comp, length);
+
+	seg->start_pts = pts;
+	seg->bytes = 0;
+	seg->idr_requested = false;
+	seg->next_tried = false;
+	seg->part_offset = 0;
+	seg->part_start_pts = MMAL_TIME_UNKNOWN;
+	seg->parts_full = false;
+
+	close(comp->stream_fd);
+	if (comp->pts_fd >= 0)
+		close(comp->pts_fd);
+	comp->stream_fd = seg->next_fd;
+	comp->pts_fd = seg->next_pts_fd;
+	seg->next_fd = -1;
+	seg->next_pts_fd = -1;
+
+	seg->index++;
+	segment_name(comp, seg->index, comp->name, sizeof(comp->name));
+	print("Writing data to %s\n", comp->name);
+	if (comp->hls.path)
+		hls_segment_start(&comp->hls, comp->name);
+}
 
-	ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
-	if (ret < 0) {
-		print("Unable to get format: %s (%d).\n", strerror(errno),
-			errno);
-		return ret;
+/*
+ * Called for every encoded buffer before it is written. Once a segment is
+ * nearly complete an IDR is requested, and the switch happens on the next
+ * random access point: the CONFIG buffer carrying the SPS/PPS (inline
+ * headers are enabled when segmenting), or the first piece of a keyframe
+ * not preceded by one.
+ * With LL-HLS, partial segments are cut at the first frame boundary after
+ * each part target.
+ */
+static void segment_check(struct component *comp, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct segment *seg = &comp->seg;
+	bool config = !!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG);
+	bool rap, ahead = false;
+	int64_t elapsed = 0;
+	int64_t pts;
+
+	if (!seg->time && !seg->size)
+		return;
+
+	rap = config ||
+	      ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) &&
+	       seg->frame_start && !seg->prev_config);
+	seg->prev_config = config;
+
+	if (comp->hls.part_target && seg->frame_start &&
+	    seg->part_start_pts != MMAL_TIME_UNKNOWN && seg->last_pts != MMAL_TIME_UNKNOWN &&
+	    seg->last_pts + seg->frame_usec - seg->part_start_pts >= comp->hls.part_target * 1000LL)
+	{
+		/* The part has to be complete on disk before it is listed */
+		mux_flush(&comp->mux);
+		writer_sync(&comp->writer);
+		segment_part_close(comp, writer_position(&comp->writer));
 	}
 
-	info = v4l2_format_by_fourcc(fmt.fmt.pix.pixelformat);
-	if (!info || info->mmal_encoding == MMAL_ENCODING_UNUSED)
+	/* The SPS/PPS carry no timestamp, they go with the frame before */
+	pts = buffer->pts != MMAL_TIME_UNKNOWN ? buffer->pts : seg->last_pts;
+	if (pts != MMAL_TIME_UNKNOWN && seg->start_pts != MMAL_TIME_UNKNOWN)
+		elapsed = pts - seg->start_pts;
+
+	/* Open the next file half way through, well away from the switch */
+	if (!seg->next_tried &&
+	    ((seg->time && elapsed >= seg->time * 500000LL) ||
+	     (seg->size && seg->bytes >= seg->size / 2)))
 	{
-		print("Unsupported encoding\n");
-		return -1;
+		segment_open(comp, seg->index + 1, &seg->next_fd, &seg->next_pts_fd);
+		seg->next_tried = true;
 	}
 
-	port->format->encoding = info->mmal_encoding;
-	port->format->es->video.crop.width = fmt.fmt.pix.width;
-	port->format->es->video.crop.height = fmt.fmt.pix.height;
-	port->format->es->video.width = (port->format->es->video.crop.width+31) & ~31;
-	//mmal_encoding_stride_to_width(port->format->encoding, fmt.fmt.pix.bytesperline);
-	/* FIXME - buffer may not be aligned vertically */
-	port->format->es->video.height = (fmt.fmt.pix.height+15) & ~15;	
-	//Ignore for now, but will be wanted for video encode.
-	//port->format->es->video.frame_rate.num = 10000;
-	//port->format->es->video.frame_rate.den = frame_interval ? frame_interval : 10000;
-	port->buffer_num = nbufs;
-	if (dev->fps) {
-		dev->frame_time_usec = 1000000/dev->fps;
-	}
+	if (seg->time && elapsed >= seg->time * 1000000LL - SEGMENT_IDR_LEAD_USEC)
+		ahead = true;
+	if (seg->size && seg->bytes >= seg->size - seg->size / 16)
+		ahead = true;
 
-	status = mmal_port_format_commit(port);
-	if (status != MMAL_SUCCESS)
+	if (ahead && rap)
 	{
-		print("Commit failed\n");
-		return -1;
+		segment_switch(comp, buffer->pts);
 	}
-	mmal_log_dump_port(port);
-
-	unsigned int mmal_stride = mmal_encoding_width_to_stride(info->mmal_encoding, port->format->es->video.width);
-	if (mmal_stride != fmt.fmt.pix.bytesperline) {
-		if (video_set_format(dev, fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.pixelformat, mmal_stride,
-				     fmt.fmt.pix.sizeimage, fmt.fmt.pix.field, fmt.fmt.pix.flags) < 0) 
-			print("Failed to adjust stride\n");
-		else
-			// Retrieve settings again so local state is correct
-			video_get_format(dev);
+	else if (ahead && !seg->idr_requested)
+	{
+		if (mmal_port_parameter_set_boolean(comp->comp->output[0],
+				MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, MMAL_TRUE) != MMAL_SUCCESS)
+			print("%s: failed to request an I frame\n", comp->name);
+		seg->idr_requested = true;
 	}
 
+	seg->bytes += buffer->length;
 
-	dev->mmal_pool = mmal_pool_create(nbufs, 0);
-	if (!dev->mmal_pool) {
-		print("Failed to create pool\n");
-		return -1;
+	if (buffer->pts != MMAL_TIME_UNKNOWN && !config)
+	{
+		if (seg->start_pts == MMAL_TIME_UNKNOWN)
+			seg->start_pts = buffer->pts;
+		if (seg->part_start_pts == MMAL_TIME_UNKNOWN)
+		{
+			seg->part_start_pts = buffer->pts;
+			seg->part_independent = !!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME);
+		}
+		seg->last_pts = buffer->pts;
 	}
-	print("Created pool of length %d, size %d\n", nbufs, 0);
+	seg->frame_start = config || (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END);
+}
 
-	port->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+static void segment_cleanup(struct component *comp)
+{
+	struct segment *seg = &comp->seg;
+	char name[sizeof(comp->name) + 4];
 
-	/* Setup ISP output */
-	isp_output = dev->isp->output[0];
-	mmal_format_copy(isp_output->format, port->format);
-	isp_output = dev->isp->output[0];
-	isp_output->format->encoding = MMAL_ENCODING_I420;
-	isp_output->buffer_num = 3;
+	if (seg->next_fd < 0)
+		return;
 
-	status = mmal_port_format_commit(isp_output);
-	if (status != MMAL_SUCCESS)
+	/* Remove the unused, pre-opened next segment */
+	close(seg->next_fd);
+	segment_name(comp, seg->index + 1, name, sizeof(comp->name));
+	unlink(name);
+	if (seg->next_pts_fd >= 0)
 	{
-		print("ISP o/p commit failed\n");
-		return -1;
+		close(seg->next_pts_fd);
+		strcat(name, ".pts");
+		unlink(name);
 	}
-	print("format->video.size now %dx%d\n", isp_output->format->es->video.width, isp_output->format->es->video.height);
+	seg->next_fd = -1;
+	seg->next_pts_fd = -1;
+}
 
-	isp_output->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+static unsigned int buffer_mux_flags(MMAL_BUFFER_HEADER_T *buffer)
+{
+	unsigned int flags = 0;
 
-	/* Set up all the sink components */
-	for(i=0; i<MAX_COMPONENTS && dests[i].component_name; i++)
-	{
-		MMAL_COMPONENT_T *comp;
-		MMAL_PORT_T *ip, *op = NULL;
-		status = mmal_component_create(dests[i].component_name, &comp);
-		if(status != MMAL_SUCCESS)
-		{
-			print("Failed to create %s", dests[i].component_name);
-			return -1;
-		}
-		dev->components[i].comp = comp;
-		ip = comp->input[0];
+	if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
+		flags |= MUX_FLAG_CONFIG;
+	if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
+		flags |= MUX_FLAG_KEYFRAME;
+	if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+		flags |= MUX_FLAG_FRAME_END;
 
-		status = mmal_format_full_copy(ip->format, isp_output->format);
-		ip->buffer_num = 3;
-		if (status == MMAL_SUCCESS)
-			status = mmal_port_format_commit(ip);
+	return flags;
+}
 
-		status += mmal_port_parameter_set_boolean(ip, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
-		if (status != MMAL_SUCCESS)
-			return -1;
+static int64_t buffer_mux_pts(MMAL_BUFFER_HEADER_T *buffer)
+{
+	return buffer->pts == MMAL_TIME_UNKNOWN ? MUX_TIME_UNKNOWN : buffer->pts;
+}
 
-		ip->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+/* Write out one encoded buffer, which goes back to the encoder once written */
+static void save_buffer(struct component *comp, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct writer *w = &comp->writer;
+	int ret;
 
-		//Set up the output of the sink component
-		if (dests[i].output_encoding != MMAL_ENCODING_UNUSED && comp->output_num)
-		{
-			print("Setup output port\n");
-			op = comp->output[0];
-			op->format->encoding = dests[i].output_encoding;
+	if (w->sidecar &&
+	    !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) &&
+	    buffer->pts != MMAL_TIME_UNKNOWN)
+		writer_sidecar_printf(w, "%lld.%03lld\n", buffer->pts/1000, buffer->pts%1000);
 
-			//This may not be relevant, but I'm not making it configurable
-			op->format->bitrate = 10000000;
-			op->buffer_size = 256<<10;
+	buffer->user_data = comp;
+	if (comp->mux.ops && comp->stream_fd >= 0)
+	{
+		ret = mux_buffer(&comp->mux, buffer->data + buffer->offset, buffer->length,
+				 buffer_mux_pts(buffer), buffer_mux_flags(buffer),
+				 save_buffer_release, buffer);
+		if (ret < 0 && ret != -EAGAIN)
+			print("Failed to mux buffer data: %s (%d)\n", strerror(-ret), -ret);
+	}
+	else if (comp->stream_fd >= 0 && buffer->length)
+	{
+		ret = writer_add(w, buffer->data + buffer->offset, buffer->length,
+				 save_buffer_release, buffer);
+		if (ret < 0)
+			print("Failed to write buffer data: %s (%d)\n", strerror(-ret), -ret);
+	}
+	else
+	{
+		save_buffer_release(buffer);
+	}
+}
 
-			if (op->buffer_size < op->buffer_size_min)
-				op->buffer_size = op->buffer_size_min;
+/* Write out a copy of a buffer held in the pre-event ring */
+static void dvr_write(struct component *comp, const uint8_t *data, size_t len,
+		      int64_t pts, unsigned int flags)
+{
+	struct writer *w = &comp->writer;
+	int ret;
 
-			op->buffer_num = 8;
+	if (comp->mux.ops)
+	{
+		/* The muxer may rewrite the data in place, so give it a copy */
+		mbuf_reset(&comp->dvr_scratch);
+		mbuf_put(&comp->dvr_scratch, data, len);
+		if (comp->dvr_scratch.error)
+			return;
+		ret = mux_buffer(&comp->mux, comp->dvr_scratch.data, len, pts, flags,
+				 NULL, NULL);
+		if (ret < 0 && ret != -EAGAIN)
+			print("Failed to mux buffer data: %s (%d)\n", strerror(-ret), -ret);
+		return;
+	}
 
-			if (op->buffer_num < op->buffer_num_min)
-				op->buffer_num = op->buffer_num_min;
+	if (w->sidecar && !(flags & MUX_FLAG_CONFIG) && pts != MUX_TIME_UNKNOWN)
+		writer_sidecar_printf(w, "%lld.%03lld\n", (long long)pts/1000, (long long)pts%1000);
+	ret = writer_copy(w, data, len);
+	if (ret < 0)
+		print("Failed to write buffer data: %s (%d)\n", strerror(-ret), -ret);
+}
 
-			// We need to set the frame rate on output to 0, to ensure it gets
-			// updated correctly from the input framerate when port connected
-			op->format->es->video.frame_rate.num = 0;
-			op->format->es->video.frame_rate.den = 1;
+/*
+ * Start writing an event file with the last dvr_pre microseconds from the
+ * ring, starting at a keyframe.
+ */
+static void dvr_start(struct component *comp)
+{
+	struct dvr *d = &comp->dvr;
+	const struct dvr_entry *e;
+	int fd, pts_fd;
+	unsigned int i;
+	int start;
 
-			// Commit the port changes to the output port
-			status = mmal_port_format_commit(op);
-			if (status != MMAL_SUCCESS)
-			{
-				print("Unable to set format on encoder output port\n");
-			}
+	if (segment_open(comp, comp->dvr_events, &fd, &pts_fd) < 0)
+		return;
 
+	writer_set_fd(&comp->writer, fd);
+	writer_set_sidecar(&comp->writer, pts_fd);
+	comp->stream_fd = fd;
+	comp->pts_fd = pts_fd;
+	segment_name(comp, comp->dvr_events, comp->name, sizeof(comp->name));
+	comp->dvr_events++;
+	comp->dvr_recording = true;
+	print("Event triggered, writing to %s\n", comp->name);
+
+	start = dvr_find_start(d, comp->dvr_pre);
+	if (start < 0)
+	{
+		/* Nothing decodable held yet, so get a keyframe as soon as possible */
+		mmal_port_parameter_set_boolean(comp->comp->output[0],
+				MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, MMAL_TRUE);
+		if (d->config_len)
+			dvr_write(comp, d->config, d->config_len, MUX_TIME_UNKNOWN, MUX_FLAG_CONFIG);
+		return;
+	}
 
-			status = mmal_port_parameter_set_boolean(op, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
-			if (status != MMAL_SUCCESS)
-			{
-				print("Could not enable zero copy on %s output port\n", dests[i].component_name);
-			}
+	if (d->config_len)
+		dvr_write(comp, d->config, d->config_len, MUX_TIME_UNKNOWN, MUX_FLAG_CONFIG);
+	for (i = start; i < d->count; i++)
+	{
+		e = dvr_entry(d, i);
+		dvr_write(comp, dvr_data(d, e), e->len, e->pts, e->flags);
+	}
+}
 
-			if (op->format->encoding == MMAL_ENCODING_H264)
-			{
-				MMAL_PARAMETER_VIDEO_PROFILE_T  param;
-				param.hdr.id = MMAL_PARAMETER_PROFILE;
-				param.hdr.size = sizeof(param);
+static void dvr_stop(struct component *comp)
+{
+	int ret;
 
-				param.profile[0].profile = MMAL_VIDEO_PROFILE_H264_HIGH;//state->profile;
-				param.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+	if (comp->mux.ops)
+		mux_reset(&comp->mux);
 
-				status = mmal_port_parameter_set(op, &param.hdr);
-				if (status != MMAL_SUCCESS)
-				{
-					print("Unable to set H264 profile\n");
-				}
+	ret = writer_set_fd(&comp->writer, -1);
+	if (ret < 0)
+		print("%s: write error: %s (%d)\n", comp->name, strerror(-ret), -ret);
+	writer_set_sidecar(&comp->writer, -1);
+
+	close(comp->stream_fd);
+	if (comp->pts_fd >= 0)
+		close(comp->pts_fd);
+	comp->stream_fd = -1;
+	comp->pts_fd = -1;
+	comp->dvr_recording = false;
+	print("Event finished, %s complete\n", comp->name);
+}
 
-				if (mmal_port_parameter_set_boolean(ip, MMAL_PARAMETER_VIDEO_IMMUTABLE_INPUT, 1) != MMAL_SUCCESS)
-				{
-					print("Unable to set immutable input flag\n");
-					// Continue rather than abort..
-				}
+/*
+ * Pre-event mode: every buffer goes into the ring. Until a trigger it is
+ * handed straight back to the encoder; while an event is being recorded
+ * it is also written out as usual.
+ */
+static void dvr_buffer(struct component *comp, MMAL_BUFFER_HEADER_T *buffer)
+{
+	unsigned int flags = buffer_mux_flags(buffer);
+	int64_t pts = buffer_mux_pts(buffer);
+	bool frame_start = comp->dvr_frame_start;
 
-				//set INLINE HEADER flag to generate SPS and PPS for every IDR if requested
-				if (mmal_port_parameter_set_boolean(op, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, 0) != MMAL_SUCCESS)
-				{
-					print("failed to set INLINE HEADER FLAG parameters\n");
-					// Continue rather than abort..
-				}
-			}
+	comp->dvr_frame_start = !!(flags & (MUX_FLAG_CONFIG | MUX_FLAG_FRAME_END));
 
-			status = mmal_port_parameter_set_boolean(op, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
-			if(status != MMAL_SUCCESS)
-			{
-				print("Failed to set zero copy\n");
-				return -1;
-			}
-			op->userdata = (struct MMAL_PORT_USERDATA_T *)&dev->components[i];
+	/* Stop once the post-event time is up, on a frame boundary */
+	if (comp->dvr_recording && frame_start && pts != MUX_TIME_UNKNOWN &&
+	    pts >= comp->dvr_until)
+		dvr_stop(comp);
 
-			/* Setup the output files */
-			if (filename[0] == '-' && filename[1] == '\0')
-			{
-				dev->components[i].stream_fd = stdout;
-				debug = 0;
-			}
-			else
-			{
-				char tmp_filename[128];
-				sprintf(tmp_filename, "%u_%s", i, filename);
+	dvr_append(&comp->dvr, buffer->data + buffer->offset, buffer->length, pts, flags);
+	if (pts != MUX_TIME_UNKNOWN && !(flags & MUX_FLAG_CONFIG))
+		comp->dvr_last_pts = pts;
 
-				printf("Writing data to %s\n", tmp_filename);
-				dev->components[i].stream_fd = fopen(tmp_filename, "wb");
-			}
+	if (__atomic_exchange_n(&comp->dvr_trigger, 0, __ATOMIC_ACQ_REL))
+	{
+		/* A trigger during an event just extends it */
+		comp->dvr_until = comp->dvr_last_pts + comp->dvr_post;
+		if (!comp->dvr_recording)
+		{
+			/* The replay includes this buffer, so it's done with */
+			dvr_start(comp);
+			buffer->user_data = comp;
+			save_buffer_release(buffer);
+			return;
+		}
+	}
 
-			{
-				char tmp_filename[128];
-				sprintf(tmp_filename, "%u_%s.pts", i, filename);
+	if (comp->dvr_recording)
+	{
+		save_buffer(comp, buffer);
+	}
+	else
+	{
+		buffer->user_data = comp;
+		save_buffer_release(buffer);
+	}
+}
 
-				dev->components[i].pts_fd = (void*)fopen(tmp_filename, "wb");
-				if (dev->components[i].pts_fd) /* save header for mkvmerge */
-					fprintf(dev->components[i].pts_fd, "# timecode format v2\n");
-			}
+/*
+ * First buffer from an encoder restarted at a new size. Raw streams and TS
+ * carry on in the same file, the new parameter sets come with the stream.
+ * MP4 and MKV describe a single size in their header, so they and segmented
+ * output move on to the next file.
+ */
+static void stream_restart(struct component *comp, MMAL_BUFFER_HEADER_T *buffer)
+{
+	comp->mux.params.width = comp->new_width;
+	comp->mux.params.height = comp->new_height;
 
-			dev->components[i].save_queue = mmal_queue_create();
-			if(!dev->components[i].save_queue)
-			{
-				print("Failed to create queue\n");
-				return -1;
-			}
+	if (comp->stream_fd < 0 || comp->stream_fd == STDOUT_FILENO)
+		return;
 
-			vcos_status = vcos_thread_create(&dev->components[i].save_thread, "save-thread",
-						NULL, save_thread, &dev->components[i]);
-			if(vcos_status != VCOS_SUCCESS)
-			{
-				print("Failed to create save thread\n");
-				return -1;
-			}
+	if (comp->seg.time || comp->seg.size ||
+	    (comp->mux.ops && comp->mux.ops != &mux_ts_ops))
+		segment_switch(comp, buffer->pts);
+}
 
-		}
+/*
+ * Daemon mode: a session's file is opened when its first buffer arrives.
+ * Sessions, and size changes within one, go to the next numbered file.
+ */
+static void session_open(struct component *comp)
+{
+	int fd, pts_fd;
 
-		status = mmal_port_enable(ip, sink_input_callback);
-		if (status != MMAL_SUCCESS)
-			return -1;
+	comp->seg.index = comp->session_files ? comp->seg.index + 1 : 0;
+	if (segment_open(comp, comp->seg.index, &fd, &pts_fd) < 0)
+		return;
 
-		print("Create pool of %d buffers for %s\n",
-						ip->buffer_num,
-						dests[i].component_name);
-		dev->components[i].ip_pool = mmal_port_pool_create(ip, ip->buffer_num, 0);
-		if(!dev->components[i].ip_pool)
-		{
-			print("Failed to create %s ip pool\n", dests[i].component_name);
-			return -1;
-		}
+	writer_set_fd(&comp->writer, fd);
+	writer_set_sidecar(&comp->writer, pts_fd);
+	comp->stream_fd = fd;
+	comp->pts_fd = pts_fd;
+	comp->session_files++;
+	segment_name(comp, comp->seg.index, comp->name, sizeof(comp->name));
+	print("Session started, writing to %s\n", comp->name);
+}
 
-		if (op)
-		{
-			print("Create pool of %d buffers for %s\n",
-							op->buffer_num,
-							dests[i].component_name);
-			dev->components[i].op_pool = mmal_port_pool_create(op, op->buffer_num, op->buffer_size);
-			if(!dev->components[i].op_pool)
-			{
-				print("Failed to create %s op pool\n", dests[i].component_name);
-				return -1;
-			}
+static void session_close(struct component *comp)
+{
+	int ret;
 
-			status = mmal_port_enable(op, dests[i].cb);
-			if (status != MMAL_SUCCESS)
-				return -1;
+	if (comp->stream_fd < 0)
+		return;
 
-			unsigned int j;
-			for(j=0; j<op->buffer_num; j++)
-			{
-				MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(dev->components[i].op_pool->queue);
+	if (comp->mux.ops)
+		mux_reset(&comp->mux);
 
-				if (!buffer)
-				{
-					print("Where'd my buffer go?!\n");
-					return -1;
-				}
-				status = mmal_port_send_buffer(op, buffer);
-				if(status != MMAL_SUCCESS)
-				{
-					print("mmal_port_send_buffer failed on buffer %p, status %d\n", buffer, status);
-					return -1;
-				}
-				print("Sent buffer %p", buffer);
+	ret = writer_set_fd(&comp->writer, -1);
+	if (ret < 0)
+		print("%s: write error: %s (%d)\n", comp->name, strerror(-ret), -ret);
+	writer_set_sidecar(&comp->writer, -1);
+
+	close(comp->stream_fd);
+	if (comp->pts_fd >= 0)
+		close(comp->pts_fd);
+	comp->stream_fd = -1;
+	comp->pts_fd = -1;
+	print("Session finished, %s complete\n", comp->name);
+}
+
+static void * save_thread(void *arg)
+{
+	struct component *comp = (struct component *)arg;
+	struct writer *w = &comp->writer;
+	MMAL_BUFFER_HEADER_T *buffer;
+	int timeout;
+
+	while (!comp->thread_quit)
+	{
+		//Being lazy and using a timed wait instead of setting up a
+		//mechanism for skipping this when destroying the thread.
+		//Wake up early if batched data is due to be written out.
+		timeout = writer_timeout_ms(w);
+		if (timeout < 0 || timeout > 100)
+			timeout = 100;
+
+		buffer = timeout ? mmal_queue_timedwait(comp->save_queue, timeout) : NULL;
+		if (!buffer)
+		{
+			if (writer_timeout_ms(w) == 0)
+				writer_flush(w);
+			/* Only once the queue is empty, so the whole session is in */
+			if (__atomic_load_n(&comp->end_session, __ATOMIC_ACQUIRE))
+			{
+				session_close(comp);
+				__atomic_store_n(&comp->end_session, 0, __ATOMIC_RELEASE);
 			}
+			continue;
 		}
 
-		print("Enable %s....\n", dests[i].component_name);
-		status = mmal_component_enable(comp);
-		if(status != MMAL_SUCCESS)
+		//print("Buffer %p saving, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
+		if (comp->dvr.data)
 		{
-			print("Failed to enable\n");
-			return -1;
+			dvr_buffer(comp, buffer);
+			continue;
 		}
+
+		if (__atomic_exchange_n(&comp->new_stream, 0, __ATOMIC_ACQ_REL))
+			stream_restart(comp, buffer);
+		if (__atomic_exchange_n(&comp->new_session, 0, __ATOMIC_ACQ_REL))
+			session_open(comp);
+		if (comp->stream_fd >= 0)
+			segment_check(comp, buffer);
+		save_buffer(comp, buffer);
 	}
 
-	status = mmal_port_parameter_set_boolean(isp_output, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+	writer_flush(w);
+	return NULL;
+}
+
+static void writer_report(struct component *comp)
+{
+	const struct writer_stats *stats = &comp->writer.stats;
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - stats->start.tv_sec) +
+	       (now.tv_nsec - stats->start.tv_nsec) / 1000000000.0;
+
+	print("%s: %llu bytes in %llu writes (%llu flushes, %llu buffers, %llu bytes copied), %.0f B/s\n",
+		comp->name, (unsigned long long)stats->bytes,
+		(unsigned long long)stats->writes, (unsigned long long)stats->flushes,
+		(unsigned long long)stats->chunks, (unsigned long long)stats->copied,
+		secs > 0 ? stats->bytes / secs : 0.0);
+	print("%s: %s write latency avg %llu us, max %llu us, %llu errors\n",
+		comp->name, writer_backend_name(comp->writer.backend),
+		stats->flushes ? (unsigned long long)(stats->latency_total_ns / stats->flushes / 1000) : 0ULL,
+		(unsigned long long)(stats->latency_max_ns / 1000),
+		(unsigned long long)stats->errors);
+}
+
+static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct component *comp = (struct component *)port->userdata;
+
+	//print("Buffer %p returned, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
+	//vcos_log_error("File handle: %p", port->userdata);
+
+	if (buffer_frame_end(buffer)) {
+		latency_stamp(&comp->lat_encoded, comp->lat_frames, buffer->pts,
+			      LATENCY_STAGE_ENCODED(comp->index));
+		__atomic_add_fetch(&comp->encoded_frames, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&comp->encoded_bytes, buffer->length, __ATOMIC_RELAXED);
+
+	if (port->is_enabled)
+		mmal_queue_put(comp->save_queue, buffer);
+	else
+		mmal_buffer_header_release(buffer);
+}
+
+/*static void dummy_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	print("Buffer %p returned, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
+
+	if (port->is_enabled)
+		mmal_port_send_buffer(port, buffer);
+	else
+		mmal_buffer_header_release(buffer);
+}*/
+
+static void buffers_to_isp(struct device *dev)
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	while ((buffer = mmal_queue_get(dev->isp_output_pool->queue)) != NULL)
+	{
+		/* Not while the isp output is being reconfigured */
+		if (mmal_port_send_buffer(dev->isp->output[0], buffer) != MMAL_SUCCESS)
+		{
+			mmal_queue_put_back(dev->isp_output_pool->queue, buffer);
+			break;
+		}
+	}
+
+}
+static uint64_t sink_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The sink's pending_lock is held by the callers of the sink_pending_* helpers */
+static MMAL_BUFFER_HEADER_T *sink_pending_pop(struct component *comp)
+{
+	MMAL_BUFFER_HEADER_T *buffer = comp->pending[comp->pending_first].buffer;
+
+	comp->pending_first = (comp->pending_first + 1) % SINK_PENDING_MAX;
+	comp->pending_count--;
+
+	return buffer;
+}
+
+static void sink_pending_drop(struct component *comp)
+{
+	mmal_buffer_header_release(sink_pending_pop(comp));
+	__atomic_add_fetch(&comp->drops, 1, __ATOMIC_RELAXED);
+}
+
+static void sink_pending_add(struct component *comp, MMAL_BUFFER_HEADER_T *buffer,
+			     uint64_t deadline_ns)
+{
+	unsigned int slot;
+
+	if (comp->pending_count == comp->pending_max)
+	{
+		mmal_buffer_header_release(sink_pending_pop(comp));
+		__atomic_add_fetch(&comp->overflows, 1, __ATOMIC_RELAXED);
+	}
+
+	slot = (comp->pending_first + comp->pending_count) % SINK_PENDING_MAX;
+	mmal_buffer_header_acquire(buffer);
+	comp->pending[slot].buffer = buffer;
+	comp->pending[slot].deadline_ns = deadline_ns;
+	comp->pending_count++;
+}
+
+static void sink_send(struct component *comp, MMAL_BUFFER_HEADER_T *out,
+		      MMAL_BUFFER_HEADER_T *buffer)
+{
+	mmal_buffer_header_replicate(out, buffer);
+	if (mmal_port_send_buffer(comp->input, out) != MMAL_SUCCESS)
+	{
+		mmal_buffer_header_release(out);
+		__atomic_add_fetch(&comp->drops, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Frames a sink may hold while it is busy */
+static unsigned int sink_pending_max(enum sink_policy policy)
+{
+	switch (policy)
+	{
+	case SINK_DROP_OLDEST:
+		return 1;
+	case SINK_BLOCK:
+		return SINK_BLOCK_HELD;
+	default:
+		return 0;
+	}
+}
+
+/* Hand held frames to the sink, in order, while it has free input buffers */
+static void sink_pending_send(struct component *comp)
+{
+	MMAL_BUFFER_HEADER_T *buffer, *out;
+
+	while (comp->pending_count &&
+	       (out = mmal_queue_get(comp->ip_pool->queue)) != NULL)
+	{
+		buffer = sink_pending_pop(comp);
+		sink_send(comp, out, buffer);
+		mmal_buffer_header_release(buffer);
+	}
+}
+
+static void sink_deliver(struct component *comp, MMAL_BUFFER_HEADER_T *buffer,
+			 uint64_t now_ns)
+{
+	MMAL_BUFFER_HEADER_T *out = NULL;
+
+	pthread_mutex_lock(&comp->pending_lock);
+
+	sink_pending_send(comp);
+	if (!comp->pending_count)
+		out = mmal_queue_get(comp->ip_pool->queue);
+
+	if (out)
+	{
+		sink_send(comp, out, buffer);
+	}
+	else
+	{
+		/* Still busy with earlier frames */
+		switch (comp->policy)
+		{
+		case SINK_DROP_NEWEST:
+			__atomic_add_fetch(&comp->drops, 1, __ATOMIC_RELAXED);
+			break;
+		case SINK_DROP_OLDEST:
+			while (comp->pending_count)
+				sink_pending_drop(comp);
+			sink_pending_add(comp, buffer, UINT64_MAX);
+			break;
+		case SINK_BLOCK:
+			sink_pending_add(comp, buffer, now_ns + comp->block_ms * 1000000ULL);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&comp->pending_lock);
+}
+
+/*
+ * Drop held frames that have waited too long. The sink callbacks only run
+ * while it makes progress, so this is also called from the capture thread.
+ */
+static void sinks_expire(struct device *dev)
+{
+	uint64_t now = sink_now_ns();
+	struct component *comp;
+	int i;
+
+	for (i=0; i<MAX_COMPONENTS && dev->components[i].comp; i++)
+	{
+		comp = &dev->components[i];
+
+		pthread_mutex_lock(&comp->pending_lock);
+		sink_pending_send(comp);
+		while (comp->pending_count &&
+		       comp->pending[comp->pending_first].deadline_ns <= now)
+			sink_pending_drop(comp);
+		pthread_mutex_unlock(&comp->pending_lock);
+	}
+
+	buffers_to_isp(dev);
+}
+
+static void isp_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	//print("Buffer %p from isp, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
+	//vcos_log_error("File handle: %p", port->userdata);
+	struct device *dev = (struct device*)port->userdata;
+	uint64_t now = sink_now_ns();
+	int i;
+
+	/* Flushed out by disabling the port, there is no frame in it */
+	if (!port->is_enabled)
+	{
+		mmal_buffer_header_release(buffer);
+		return;
+	}
+
+	latency_stamp(&dev->lat_isp_output, &dev->lat_frames, buffer->pts,
+		      LATENCY_STAGE_ISP_OUTPUT);
+
+	for (i=0; i<MAX_COMPONENTS && dev->components[i].comp; i++)
+	{
+		struct component *comp = &dev->components[i];
+
+		/* Frames a decimated branch doesn't want aren't drops */
+		if (comp->frames_seen++ % comp->branch->decimate)
+			continue;
+		sink_deliver(comp, buffer, now);
+	}
+	mmal_buffer_header_release(buffer);
+
+	buffers_to_isp(dev);
+}
+
+static void sink_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	//print("Buffer %p returned from %s, filled %d, timestamp %llu, flags %04X\n", buffer, port->name, buffer->length, buffer->pts, buffer->flags);
+	//vcos_log_error("File handle: %p", port->userdata);
+	struct device *dev = (struct device*)port->userdata;
+	struct component *comp = NULL;
+	int i;
+
+	for (i=0; i<MAX_COMPONENTS && dev->components[i].comp; i++)
+	{
+		if (dev->components[i].input == port)
+		{
+			comp = &dev->components[i];
+			/* A scaled frame is back from the sink in scaled_input_callback */
+			if (!comp->scaler)
+				latency_stamp(&comp->lat_sink, &dev->lat_frames,
+					      buffer->pts, LATENCY_STAGE_SINK_RETURN(i));
+		}
+	}
+
+	mmal_buffer_header_release(buffer);
+
+	/* The input buffer is free again, for a held frame if there is one */
+	if (comp)
+	{
+		pthread_mutex_lock(&comp->pending_lock);
+		sink_pending_send(comp);
+		pthread_mutex_unlock(&comp->pending_lock);
+	}
+
+	buffers_to_isp(dev);
+}
+
+/* Keep the scaler supplied with the buffers the sink has finished with */
+static void scaler_refill(struct component *comp)
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	while ((buffer = mmal_queue_get(comp->scaler_pool->queue)) != NULL)
+	{
+		if (mmal_port_send_buffer(comp->scaler->output[0], buffer) != MMAL_SUCCESS)
+		{
+			mmal_buffer_header_release(buffer);
+			break;
+		}
+	}
+}
+
+static void scaler_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct component *comp = (struct component *)port->userdata;
+
+	/* The sink has as many input buffers as the scaler has output buffers */
+	if (!port->is_enabled || !buffer->length ||
+	    mmal_port_send_buffer(comp->comp->input[0], buffer) != MMAL_SUCCESS)
+	{
+		if (port->is_enabled && buffer->length)
+			__atomic_add_fetch(&comp->drops, 1, __ATOMIC_RELAXED);
+		mmal_buffer_header_release(buffer);
+		if (port->is_enabled)
+			scaler_refill(comp);
+	}
+}
+
+static void scaled_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct component *comp = (struct component *)port->userdata;
+
+	latency_stamp(&comp->lat_sink, comp->lat_frames, buffer->pts,
+		      LATENCY_STAGE_SINK_RETURN(comp->index));
+
+	mmal_buffer_header_release(buffer);
+	if (comp->scaler->output[0]->is_enabled)
+		scaler_refill(comp);
+}
+
+#define LOG_DEBUG print
+
+static void dump_port_format(MMAL_ES_FORMAT_T *format)
+{
+   const char *name_type;
+
+   if (!format)
+      return;
+
+   switch(format->type)
+   {
+   case MMAL_ES_TYPE_AUDIO: name_type = "audio"; break;
+   case MMAL_ES_TYPE_VIDEO: name_type = "video"; break;
+   case MMAL_ES_TYPE_SUBPICTURE: name_type = "subpicture"; break;
+   default: name_type = "unknown"; break;
+   }
+
+   LOG_DEBUG("type: %s, fourcc: %4.4s", name_type, (char *)&format->encoding);
+   LOG_DEBUG(" bitrate: %i, framed: %i", format->bitrate,
+            !!(format->flags & MMAL_ES_FORMAT_FLAG_FRAMED));
+   LOG_DEBUG(" extra data: %i, %p", format->extradata_size, format->extradata);
+   switch(format->type)
+   {
+   case MMAL_ES_TYPE_AUDIO:
+      LOG_DEBUG(" samplerate: %i, channels: %i, bps: %i, block align: %i",
+               format->es->audio.sample_rate, format->es->audio.channels,
+               format->es->audio.bits_per_sample, format->es->audio.block_align);
+      break;
+
+   case MMAL_ES_TYPE_VIDEO:
+      LOG_DEBUG(" width: %i, height: %i, (%i,%i,%i,%i)",
+               format->es->video.width, format->es->video.height,
+               format->es->video.crop.x, format->es->video.crop.y,
+               format->es->video.crop.width, format->es->video.crop.height);
+      LOG_DEBUG(" pixel aspect ratio: %i/%i, frame rate: %i/%i",
+               format->es->video.par.num, format->es->video.par.den,
+               format->es->video.frame_rate.num, format->es->video.frame_rate.den);
+      break;
+
+   case MMAL_ES_TYPE_SUBPICTURE:
+      break;
+
+   default: break;
+   }
+}
+
+void mmal_log_dump_port(MMAL_PORT_T *port)
+{
+   if (!port)
+      return;
+
+   LOG_DEBUG("%s(%p)", port->name, port);
+
+   dump_port_format(port->format);
+
+   LOG_DEBUG(" buffers num: %i(opt %i, min %i), size: %i(opt %i, min: %i), align: %i",
+            port->buffer_num, port->buffer_num_recommended, port->buffer_num_min,
+            port->buffer_size, port->buffer_size_recommended, port->buffer_size_min,
+            port->buffer_alignment_min);
+}
+
+int video_set_dv_timings(struct device *dev);
+
+/* Dequeue the pending events, true if the source changed resolution */
+static bool handle_event(struct device *dev)
+{
+	struct v4l2_event ev;
+	bool changed = false;
+
+	while (!video_ioctl(dev, VIDIOC_DQEVENT, &ev)) {
+		switch (ev.type) {
+		case V4L2_EVENT_SOURCE_CHANGE:
+			fprintf(stderr, "Source changed\n");
+			if (ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION)
+				changed = true;
+			break;
+		case V4L2_EVENT_EOS:
+			fprintf(stderr, "EOS\n");
+			break;
+		}
+	}
+
+	return changed;
+}
+
+#define MAX_ENCODINGS_NUM 25
+typedef struct {
+   MMAL_PARAMETER_HEADER_T header;
+   MMAL_FOURCC_T encodings[MAX_ENCODINGS_NUM];
+} MMAL_SUPPORTED_ENCODINGS_T;
+
+
+int mmal_dump_supported_formats(MMAL_PORT_T *port)
+{
+   int new_fw = 0;
+   MMAL_STATUS_T ret;
+
+   MMAL_SUPPORTED_ENCODINGS_T sup_encodings = {{MMAL_PARAMETER_SUPPORTED_ENCODINGS, sizeof(sup_encodings)}, {0}};
+   ret = mmal_port_parameter_get(port, &sup_encodings.header);
+   if (ret == MMAL_SUCCESS || ret == MMAL_ENOSPC)
+   {
+      //Allow ENOSPC error and hope that the desired formats are in the first
+      //MAX_ENCODINGS_NUM entries.
+      int i;
+      int num_encodings = (sup_encodings.header.size - sizeof(sup_encodings.header)) /
+          sizeof(sup_encodings.encodings[0]);
+      if(num_encodings > MAX_ENCODINGS_NUM)
+         num_encodings = MAX_ENCODINGS_NUM;
+      for (i=0; i<num_encodings; i++)
+      {
+         printf("Format %4.4s\n", (char *)&sup_encodings.encodings[i]);
+      }
+   }
+   return new_fw;
+}
+
+/*
+ * A branch with its own size gets an isp of its own, scaling the main isp
+ * output. Its output buffers go straight to the sink and back.
+ */
+/* The branch's size, whatever the isp output */
+static MMAL_STATUS_T scaler_set_output_format(struct component *comp,
+					      MMAL_PORT_T *isp_output)
+{
+	const struct branch *branch = comp->branch;
+	MMAL_PORT_T *op = comp->scaler->output[0];
+
+	mmal_format_copy(op->format, isp_output->format);
+	op->format->es->video.crop.x = 0;
+	op->format->es->video.crop.y = 0;
+	op->format->es->video.crop.width = branch->width;
+	op->format->es->video.crop.height = branch->height;
+	op->format->es->video.width = (branch->width+31) & ~31;
+	op->format->es->video.height = (branch->height+15) & ~15;
+	/* One for each of the sink's input buffers */
+	op->buffer_num = 3;
+
+	return mmal_port_format_commit(op);
+}
+
+static int setup_scaler(struct device *dev, struct component *comp,
+			MMAL_PORT_T *isp_output)
+{
+	const struct branch *branch = comp->branch;
+	MMAL_STATUS_T status;
+	MMAL_PORT_T *ip, *op;
+
+	status = mmal_component_create("vc.ril.isp", &comp->scaler);
+	if (status != MMAL_SUCCESS)
+	{
+		print("Failed to create scaler for %s\n", branch->component);
+		return -1;
+	}
+	if (enable_control_port(dev, comp->scaler))
+		return -1;
+
+	ip = comp->scaler->input[0];
+	status = mmal_format_full_copy(ip->format, isp_output->format);
+	ip->buffer_num = 3;
+	if (status == MMAL_SUCCESS)
+		status = mmal_port_format_commit(ip);
+	status += mmal_port_parameter_set_boolean(ip, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+	if (status != MMAL_SUCCESS)
+	{
+		print("Failed to set up scaler input for %s\n", branch->component);
+		return -1;
+	}
+	ip->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+
+	op = comp->scaler->output[0];
+	status = scaler_set_output_format(comp, isp_output);
+	status += mmal_port_parameter_set_boolean(op, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+	if (status != MMAL_SUCCESS)
+	{
+		print("Scaler can't output %ux%u for %s\n", branch->width, branch->height,
+		      branch->component);
+		return -1;
+	}
+	op->userdata = (struct MMAL_PORT_USERDATA_T *)comp;
+
+	comp->input = ip;
+	return 0;
+}
+
+/* Once the sink is enabled, so the scaler output has somewhere to go */
+static int enable_scaler(struct component *comp)
+{
+	MMAL_PORT_T *op = comp->scaler->output[0];
+	MMAL_STATUS_T status;
+
+	status = mmal_port_enable(op, scaler_output_callback);
+	if (status != MMAL_SUCCESS)
+		return -1;
+
+	comp->scaler_pool = mmal_port_pool_create(op, op->buffer_num, op->buffer_size);
+	if (!comp->scaler_pool)
+	{
+		print("Failed to create scaler pool for %s\n", comp->branch->component);
+		return -1;
+	}
+
+	status = mmal_port_enable(comp->input, sink_input_callback);
+	if (status == MMAL_SUCCESS)
+		status = mmal_component_enable(comp->scaler);
+	if (status != MMAL_SUCCESS)
+		return -1;
+
+	scaler_refill(comp);
+	return 0;
+}
+
+/* The isp input in the current V4L2 format, with the stride it wants */
+static int isp_set_input_format(struct device *dev, int nbufs)
+{
+	MMAL_STATUS_T status;
+	MMAL_PORT_T *port = dev->isp->input[0];
+	const struct v4l2_format_info *info;
+	struct v4l2_format fmt;
+	struct v4l2_pix_format pix;
+	int ret;
+
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = dev->type;
+
+	ret = video_ioctl(dev, VIDIOC_G_FMT, &fmt);
+	if (ret < 0) {
+		print("Unable to get format: %s (%d).\n", strerror(errno),
+			errno);
+		return ret;
+	}
+	video_format_pix(dev, &fmt, &pix);
+
+	info = v4l2_format_by_fourcc(pix.pixelformat);
+	if (!info || info->mmal_encoding == MMAL_ENCODING_UNUSED)
+	{
+		print("Unsupported encoding\n");
+		return -1;
+	}
+
+	port->format->encoding = info->mmal_encoding;
+	port->format->es->video.crop.width = pix.width;
+	port->format->es->video.crop.height = pix.height;
+	port->format->es->video.width = (port->format->es->video.crop.width+31) & ~31;
+	//mmal_encoding_stride_to_width(port->format->encoding, pix.bytesperline);
+	/* FIXME - buffer may not be aligned vertically */
+	port->format->es->video.height = (pix.height+15) & ~15;	
+	//Ignore for now, but will be wanted for video encode.
+	//port->format->es->video.frame_rate.num = 10000;
+	//port->format->es->video.frame_rate.den = frame_interval ? frame_interval : 10000;
+	port->buffer_num = nbufs;
+
+	status = mmal_port_format_commit(port);
+	if (status != MMAL_SUCCESS)
+	{
+		print("Commit failed\n");
+		return -1;
+	}
+	mmal_log_dump_port(port);
+
+	unsigned int mmal_stride = mmal_encoding_width_to_stride(info->mmal_encoding, port->format->es->video.width);
+	if (mmal_stride != pix.bytesperline) {
+		if (video_set_format(dev, pix.width, pix.height, pix.pixelformat, mmal_stride,
+				     pix.sizeimage, pix.field, pix.flags) < 0) 
+			print("Failed to adjust stride\n");
+		else
+			// Retrieve settings again so local state is correct
+			video_get_format(dev);
+	}
+
+	return 0;
+}
+
+/* I420 at the input size, for the sinks */
+static int isp_set_output_format(struct device *dev)
+{
+	MMAL_STATUS_T status;
+	MMAL_PORT_T *isp_output = dev->isp->output[0];
+
+	mmal_format_copy(isp_output->format, dev->isp->input[0]->format);
+	isp_output->format->encoding = MMAL_ENCODING_I420;
+	isp_output->buffer_num = 3;
+
+	status = mmal_port_format_commit(isp_output);
+	if (status != MMAL_SUCCESS)
+	{
+		print("ISP o/p commit failed\n");
+		return -1;
+	}
+	print("format->video.size now %dx%d\n", isp_output->format->es->video.width, isp_output->format->es->video.height);
+
+	return 0;
+}
+
+/* A sink input taking format, at the branch's share of the frame rate */
+static MMAL_STATUS_T sink_set_input_format(struct device *dev, struct component *comp,
+					   MMAL_ES_FORMAT_T *format)
+{
+	MMAL_PORT_T *ip = comp->comp->input[0];
+	MMAL_STATUS_T status;
+
+	status = mmal_format_full_copy(ip->format, format);
+	ip->buffer_num = 3;
+	if (dev->fps)
+	{
+		ip->format->es->video.frame_rate.num = dev->fps;
+		ip->format->es->video.frame_rate.den = comp->branch->decimate;
+	}
+	if (status == MMAL_SUCCESS)
+		status = mmal_port_format_commit(ip);
+
+	return status;
+}
+
+/* Enough isp output buffers for every sink, all of them sent to the isp */
+static int enable_isp_output(struct device *dev)
+{
+	MMAL_PORT_T *isp_output = dev->isp->output[0];
+	MMAL_STATUS_T status;
+
+	/*
+	 * Enough isp buffers that one sink falling behind hits its own policy
+	 * rather than starving the isp, and so every other sink, of buffers.
+	 */
+	if (isp_output->buffer_num < dev->isp_buffers)
+		isp_output->buffer_num = dev->isp_buffers;
 
 	/* All setup, so enable the ISP output and feed it the buffers */
 	status = mmal_port_enable(isp_output, isp_output_callback);
 	if (status != MMAL_SUCCESS)
 		return -1;
 
-	print("Create pool of %d buffers of size %d for encode/render\n", isp_output->buffer_num, isp_output->buffer_size);
-	dev->isp_output_pool = mmal_port_pool_create(isp_output, isp_output->buffer_num, isp_output->buffer_size);
-	if(!dev->isp_output_pool)
+	print("Create pool of %d buffers of size %d for encode/render\n", isp_output->buffer_num, isp_output->buffer_size);
+	dev->isp_output_pool = mmal_port_pool_create(isp_output, isp_output->buffer_num, isp_output->buffer_size);
+	if(!dev->isp_output_pool)
+	{
+		print("Failed to create pool\n");
+		return -1;
+	}
+
+	buffers_to_isp(dev);
+
+	return 0;
+}
+
+static int setup_mmal(struct device *dev, int nbufs, const char *filename)
+{
+	MMAL_STATUS_T status;
+	VCOS_STATUS_T vcos_status;
+	MMAL_PORT_T *port;
+	int i;
+	MMAL_PORT_T *isp_output;
+	const char *output;
+	bool hls_used = false;
+
+	//FIXME: Clean up after errors
+
+	status = mmal_component_create("vc.ril.isp", &dev->isp);
+	if(status != MMAL_SUCCESS)
+	{
+		print("Failed to create isp\n");
+		return -1;
+	}
+	if (enable_control_port(dev, dev->isp))
+		return -1;
+
+	if (isp_set_input_format(dev, nbufs) < 0)
+		return -1;
+	port = dev->isp->input[0];
+
+
+	dev->mmal_pool = mmal_pool_create(nbufs, 0);
+	if (!dev->mmal_pool) {
+		print("Failed to create pool\n");
+		return -1;
+	}
+	print("Created pool of length %d, size %d\n", nbufs, 0);
+
+	port->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+
+	/* Setup ISP output */
+	if (isp_set_output_format(dev) < 0)
+		return -1;
+	isp_output = dev->isp->output[0];
+	dev->isp_buffers = 1;
+
+	isp_output->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+
+	/* Set up a sink component for every branch of the pipeline */
+	for(i=0; i<MAX_COMPONENTS && i<(int)dev->pipeline.num_branches; i++)
+	{
+		const struct branch *branch = &dev->pipeline.branches[i];
+		MMAL_COMPONENT_T *comp;
+		MMAL_PORT_T *ip, *op = NULL;
+		MMAL_ES_FORMAT_T *sink_format = isp_output->format;
+
+		status = mmal_component_create(branch->component, &comp);
+		if(status != MMAL_SUCCESS)
+		{
+			print("Failed to create %s", branch->component);
+			return -1;
+		}
+		dev->components[i].comp = comp;
+		dev->components[i].branch = branch;
+		dev->components[i].stream_fd = -1;
+		dev->components[i].pts_fd = -1;
+		dev->components[i].seg.start_pts = MMAL_TIME_UNKNOWN;
+		dev->components[i].seg.last_pts = MMAL_TIME_UNKNOWN;
+		dev->components[i].seg.part_start_pts = MMAL_TIME_UNKNOWN;
+		dev->components[i].seg.next_fd = -1;
+		dev->components[i].seg.next_pts_fd = -1;
+		dev->components[i].seg.frame_start = true;
+		dev->components[i].dvr_last_pts = MMAL_TIME_UNKNOWN;
+		dev->components[i].dvr_frame_start = true;
+		dev->components[i].lat_frames = &dev->lat_frames;
+		dev->components[i].index = i;
+		dev->components[i].policy = branch->policy;
+		dev->components[i].block_ms = branch->block_ms;
+		dev->components[i].pending_max = sink_pending_max(branch->policy);
+		pthread_mutex_init(&dev->components[i].pending_lock, NULL);
+		if (enable_control_port(dev, comp))
+			return -1;
+		ip = comp->input[0];
+		dev->components[i].input = ip;
+
+		if (branch->width)
+		{
+			if (setup_scaler(dev, &dev->components[i], isp_output) < 0)
+				return -1;
+			sink_format = dev->components[i].scaler->output[0]->format;
+		}
+
+		status = sink_set_input_format(dev, &dev->components[i], sink_format);
+		status += mmal_port_parameter_set_boolean(ip, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+		if (status != MMAL_SUCCESS)
+			return -1;
+
+		if (dev->components[i].scaler)
+		{
+			/* Scaled frames come straight from the scaler's output pool */
+			ip->userdata = (struct MMAL_PORT_USERDATA_T *)&dev->components[i];
+			dev->isp_buffers += dev->components[i].input->buffer_num;
+		}
+		else
+		{
+			ip->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+			dev->isp_buffers += ip->buffer_num;
+		}
+
+		/* Every frame a sink holds or has held for it is an isp buffer */
+		dev->isp_buffers += dev->components[i].pending_max;
+
+		//Set up the output of the sink component
+		if (branch->encoding != MMAL_ENCODING_UNUSED && comp->output_num)
+		{
+			print("Setup output port\n");
+			op = comp->output[0];
+			op->format->encoding = branch->encoding;
+
+			op->format->bitrate = branch->bitrate ? branch->bitrate : 10000000;
+			op->buffer_size = 256<<10;
+
+			if (op->buffer_size < op->buffer_size_min)
+				op->buffer_size = op->buffer_size_min;
+
+			op->buffer_num = 8;
+
+			if (op->buffer_num < op->buffer_num_min)
+				op->buffer_num = op->buffer_num_min;
+
+
+			// We need to set the frame rate on output to 0, to ensure it gets
+			// updated correctly from the input framerate when port connected
+			op->format->es->video.frame_rate.num = 0;
+			op->format->es->video.frame_rate.den = 1;
+
+			// Commit the port changes to the output port
+			status = mmal_port_format_commit(op);
+			if (status != MMAL_SUCCESS)
+			{
+				print("Unable to set format on encoder output port\n");
+			}
+
+
+			status = mmal_port_parameter_set_boolean(op, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+			if (status != MMAL_SUCCESS)
+			{
+				print("Could not enable zero copy on %s output port\n", branch->component);
+			}
+
+			if (op->format->encoding == MMAL_ENCODING_H264)
+			{
+				MMAL_PARAMETER_VIDEO_PROFILE_T  param;
+				param.hdr.id = MMAL_PARAMETER_PROFILE;
+				param.hdr.size = sizeof(param);
+
+				param.profile[0].profile = MMAL_VIDEO_PROFILE_H264_HIGH;//state->profile;
+				param.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+
+				status = mmal_port_parameter_set(op, &param.hdr);
+				if (status != MMAL_SUCCESS)
+				{
+					print("Unable to set H264 profile\n");
+				}
+
+				if (mmal_port_parameter_set_boolean(ip, MMAL_PARAMETER_VIDEO_IMMUTABLE_INPUT, 1) != MMAL_SUCCESS)
+				{
+					print("Unable to set immutable input flag\n");
+					// Continue rather than abort..
+				}
+
+				//set INLINE HEADER flag to generate SPS and PPS for every IDR if requested
+				//Segments and sessions need them so every file can be decoded on its own
+				if (mmal_port_parameter_set_boolean(op, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER,
+								    dev->segment_time || dev->segment_size ||
+								    dev->daemon) != MMAL_SUCCESS)
+				{
+					print("failed to set INLINE HEADER FLAG parameters\n");
+					// Continue rather than abort..
+				}
+			}
+
+			status = mmal_port_parameter_set_boolean(op, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+			if(status != MMAL_SUCCESS)
+			{
+				print("Failed to set zero copy\n");
+				return -1;
+			}
+			op->userdata = (struct MMAL_PORT_USERDATA_T *)&dev->components[i];
+
+			/* Setup the output files */
+			output = branch->output[0] ? branch->output : filename;
+			if (output[0] == '-' && output[1] == '\0')
+			{
+				dev->components[i].stream_fd = STDOUT_FILENO;
+				snprintf(dev->components[i].name, sizeof(dev->components[i].name), "stdout");
+				debug = 0;
+			}
+			else
+			{
+				if (branch->output[0])
+					snprintf(dev->components[i].base_name,
+						 sizeof(dev->components[i].base_name), "%s", output);
+				else
+					snprintf(dev->components[i].base_name,
+						 sizeof(dev->components[i].base_name), "%u_%s", i, output);
+
+				/* Segments, events and sessions each get a numbered file */
+				bool numbered = true;
+
+				if (op->format->encoding == MMAL_ENCODING_H264 &&
+				    (dev->segment_time || dev->segment_size))
+				{
+					dev->components[i].seg.time = dev->segment_time;
+					dev->components[i].seg.size = dev->segment_size;
+					dev->components[i].seg.frame_usec = branch->decimate *
+						(dev->fps ? 1000000 / dev->fps : 33333);
+				}
+				else if (op->format->encoding == MMAL_ENCODING_H264 && dev->dvr_size)
+				{
+					/* Each event gets its own file, opened on the trigger */
+					if (dvr_init(&dev->components[i].dvr, dev->dvr_size) < 0)
+					{
+						print("Failed to allocate DVR buffer\n");
+						return -1;
+					}
+					dev->components[i].dvr_pre = dev->dvr_pre * 1000000LL;
+					dev->components[i].dvr_post = dev->dvr_post * 1000000LL;
+				}
+				else if (dev->daemon)
+				{
+					/* Each session gets its own file, opened when it starts */
+					dev->components[i].sessions = true;
+				}
+				else
+				{
+					numbered = false;
+					strcpy(dev->components[i].name, dev->components[i].base_name);
+				}
+
+				if (numbered &&
+				    segment_name(&dev->components[i], 0, dev->components[i].name,
+						 sizeof(dev->components[i].name)) < 0)
+				{
+					print("Output name %s is too long to number\n",
+					      dev->components[i].base_name);
+					return -1;
+				}
+
+				if (dev->components[i].dvr.data)
+				{
+					printf("Holding %us of data in %zu bytes, events go to %s\n",
+					       dev->dvr_pre, dev->dvr_size, dev->components[i].name);
+				}
+				else if (dev->components[i].sessions)
+				{
+					printf("Capture sessions write to %s onwards\n",
+					       dev->components[i].name);
+				}
+				else
+				{
+					printf("Writing data to %s\n", dev->components[i].name);
+					dev->components[i].stream_fd = open(dev->components[i].name,
+									    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+					if (dev->components[i].stream_fd < 0)
+						print("Failed to open %s: %s (%d)\n", dev->components[i].name,
+							strerror(errno), errno);
+				}
+			}
+
+			// Never let the writer hold more than half the encoder's
+			// buffers, so encoding can continue while a batch builds up
+			struct writer_config write_cfg = dev->write_cfg;
+			write_cfg.max_held = op->buffer_num / 2;
+
+			if (writer_init(&dev->components[i].writer, dev->components[i].stream_fd,
+					&write_cfg) < 0)
+			{
+				print("Failed to create writer\n");
+				return -1;
+			}
+
+			if (dev->container && op->format->encoding == MMAL_ENCODING_H264)
+			{
+				struct mux_params params = {
+					.width = ip->format->es->video.crop.width,
+					.height = ip->format->es->video.crop.height,
+					.fps_num = dev->fps,
+					.fps_den = branch->decimate,
+				};
+
+				/* Timestamps go into the container instead of a .pts file */
+				mux_init(&dev->components[i].mux, dev->container,
+					 &dev->components[i].writer, &params);
+
+				/* One playlist, for the first segmented branch */
+				if (dev->hls_path && dev->components[i].seg.time && !hls_used)
+				{
+					hls_used = true;
+					if (hls_init(&dev->components[i].hls, dev->hls_path,
+						     dev->container == &mux_mp4_ops, dev->hls_window,
+						     dev->segment_time, dev->hls_part_ms) < 0)
+					{
+						print("Failed to set up HLS playlist\n");
+						return -1;
+					}
+					hls_segment_start(&dev->components[i].hls, dev->components[i].name);
+				}
+			}
+			else if (!dev->components[i].dvr.data && !dev->components[i].sessions)
+			{
+				char tmp_filename[sizeof(dev->components[i].name) + 4];
+				sprintf(tmp_filename, "%s.pts", dev->components[i].name);
+
+				dev->components[i].pts_fd = open(tmp_filename,
+								 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+				if (dev->components[i].pts_fd >= 0) /* save header for mkvmerge */
+				{
+					writer_set_sidecar(&dev->components[i].writer, dev->components[i].pts_fd);
+					writer_sidecar_printf(&dev->components[i].writer, "# timecode format v2\n");
+				}
+			}
+
+			dev->components[i].save_queue = mmal_queue_create();
+			if(!dev->components[i].save_queue)
+			{
+				print("Failed to create queue\n");
+				return -1;
+			}
+
+			vcos_status = vcos_thread_create(&dev->components[i].save_thread, "save-thread",
+						NULL, save_thread, &dev->components[i]);
+			if(vcos_status != VCOS_SUCCESS)
+			{
+				print("Failed to create save thread\n");
+				return -1;
+			}
+
+		}
+
+		status = mmal_port_enable(ip, dev->components[i].scaler ? scaled_input_callback
+								    : sink_input_callback);
+		if (status != MMAL_SUCCESS)
+			return -1;
+
+		/* Headers for the isp frames, replicated into the sink or its scaler */
+		print("Create pool of %d buffers for %s\n",
+						dev->components[i].input->buffer_num,
+						branch->component);
+		dev->components[i].ip_pool = mmal_port_pool_create(dev->components[i].input,
+								   dev->components[i].input->buffer_num, 0);
+		if(!dev->components[i].ip_pool)
+		{
+			print("Failed to create %s ip pool\n", branch->component);
+			return -1;
+		}
+
+		if (op)
+		{
+			print("Create pool of %d buffers for %s\n",
+							op->buffer_num,
+							branch->component);
+			dev->components[i].op_pool = mmal_port_pool_create(op, op->buffer_num, op->buffer_size);
+			if(!dev->components[i].op_pool)
+			{
+				print("Failed to create %s op pool\n", branch->component);
+				return -1;
+			}
+
+			status = mmal_port_enable(op, encoder_buffer_callback);
+			if (status != MMAL_SUCCESS)
+				return -1;
+
+			unsigned int j;
+			for(j=0; j<op->buffer_num; j++)
+			{
+				MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(dev->components[i].op_pool->queue);
+
+				if (!buffer)
+				{
+					print("Where'd my buffer go?!\n");
+					return -1;
+				}
+				status = mmal_port_send_buffer(op, buffer);
+				if(status != MMAL_SUCCESS)
+				{
+					print("mmal_port_send_buffer failed on buffer %p, status %d\n", buffer, status);
+					return -1;
+				}
+				print("Sent buffer %p", buffer);
+			}
+		}
+
+		print("Enable %s....\n", branch->component);
+		status = mmal_component_enable(comp);
+		if(status != MMAL_SUCCESS)
+		{
+			print("Failed to enable\n");
+			return -1;
+		}
+
+		if (dev->components[i].scaler && enable_scaler(&dev->components[i]) < 0)
+		{
+			print("Failed to enable scaler for %s\n", branch->component);
+			return -1;
+		}
+	}
+
+	status = mmal_port_parameter_set_boolean(isp_output, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+
+	return enable_isp_output(dev);
+}
+
+static int enable_isp_input(struct device *dev)
+{
+	MMAL_STATUS_T status;
+
+	if (mmal_port_parameter_set_boolean(dev->isp->input[0], MMAL_PARAMETER_ZERO_COPY, dev->zero_copy) != MMAL_SUCCESS)
+	{
+		print("Failed to set zero copy\n");
+		return -1;
+	}
+	status = mmal_port_enable(dev->isp->input[0], isp_ip_cb);
+	if (status != MMAL_SUCCESS)
+	{
+		print("ISP input enable failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void destroy_mmal(struct device *dev)
+{
+	uint64_t length;
+	int i;
+	//FIXME: Clean up everything properly
+	for (i=0; i<MAX_COMPONENTS; i++)
+	{
+		if (dev->components[i].comp)
+		{
+			/* Frames still held for a sink when the capture stopped */
+			pthread_mutex_lock(&dev->components[i].pending_lock);
+			while (dev->components[i].pending_count)
+				mmal_buffer_header_release(sink_pending_pop(&dev->components[i]));
+			pthread_mutex_unlock(&dev->components[i].pending_lock);
+		}
+
+		if (!dev->components[i].save_queue)
+			continue;
+
+		dev->components[i].thread_quit = 1;
+		vcos_thread_join(&dev->components[i].save_thread, NULL);
+
+		if (dev->components[i].mux.ops)
+			mux_cleanup(&dev->components[i].mux);
+		length = writer_position(&dev->components[i].writer);
+		writer_cleanup(&dev->components[i].writer);
+		segment_cleanup(&dev->components[i]);
+		dvr_cleanup(&dev->components[i].dvr);
+		mbuf_free(&dev->components[i].dvr_scratch);
+
+		if (dev->components[i].hls.path)
+		{
+			segment_hls_end(&dev->components[i], length);
+			hls_finish(&dev->components[i].hls);
+			hls_cleanup(&dev->components[i].hls);
+		}
+		writer_report(&dev->components[i]);
+
+		if (dev->components[i].stream_fd >= 0 &&
+		    dev->components[i].stream_fd != STDOUT_FILENO)
+			close(dev->components[i].stream_fd);
+		if (dev->components[i].pts_fd >= 0)
+			close(dev->components[i].pts_fd);
+	}
+}
+
+/* Runs on the raw ring's completion thread */
+static void raw_write_complete(struct uring_req *req, int res)
+{
+	struct raw_write *rw = (struct raw_write *)req;
+
+	if (res < 0)
+		print("write error: %s (%d)\n", strerror(-res), -res);
+	else if ((unsigned int)res != rw->length)
+		print("write error: only %d bytes written instead of %u\n",
+		       res, rw->length);
+
+	if (rw->fd >= 0)
+		close(rw->fd);
+
+	buffer_put(rw->dev, rw->buffer);
+}
+
+static int video_raw_uring_init(struct device *dev, const char *pattern)
+{
+	struct iovec *iov;
+	unsigned int i, j, n = 0;
+	struct stat st;
+	int ret;
+
+	ret = uring_init(&dev->raw_ring, dev->nbufs * dev->num_planes);
+	if (ret < 0) {
+		print("io_uring unavailable for raw frames: %s (%d), using write()\n",
+			strerror(-ret), -ret);
+		return ret;
+	}
+
+	/* A pattern without '#' appends every frame to one file, so keep it open */
+	if (!strchr(pattern, '#')) {
+		dev->raw_fd = open(pattern, O_CREAT | O_WRONLY | O_CLOEXEC,
+				   S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (dev->raw_fd < 0 || fstat(dev->raw_fd, &st) < 0) {
+			print("Unable to open %s: %s (%d)\n", pattern,
+				strerror(errno), errno);
+			uring_cleanup(&dev->raw_ring);
+			return -errno;
+		}
+		dev->raw_offset = st.st_size;
+
+		if (uring_register_files(&dev->raw_ring, &dev->raw_fd, 1) < 0)
+			print("Unable to register raw output file, using plain fd\n");
+	}
+
+	/*
+	 * Registering the V4L2 buffers lets writes skip the per-I/O page
+	 * pinning. Not all buffer types can be pinned (eg PFN mapped dma-contig
+	 * memory), in which case plain writes are used.
+	 */
+	iov = calloc(dev->nbufs * dev->num_planes, sizeof *iov);
+	if (iov) {
+		for (i = 0; i < dev->nbufs; i++) {
+			for (j = 0; j < dev->num_planes; j++) {
+				iov[n].iov_base = dev->buffers[i].mem[j];
+				iov[n].iov_len = dev->buffers[i].size[j];
+				n++;
+			}
+		}
+		if (uring_register_buffers(&dev->raw_ring, iov, n) < 0)
+			print("Unable to register V4L2 buffers with io_uring, using unregistered writes\n");
+		free(iov);
+	}
+
+	print("Raw frames written with io_uring (%s file, %s buffers)\n",
+		dev->raw_ring.fixed_files ? "fixed" : "plain",
+		dev->raw_ring.fixed_buffers ? "registered" : "unregistered");
+
+	dev->raw_uring = true;
+	return 0;
+}
+
+static void video_raw_uring_cleanup(struct device *dev)
+{
+	if (!dev->raw_uring)
+		return;
+
+	uring_cleanup(&dev->raw_ring);
+	if (dev->raw_fd >= 0)
+		close(dev->raw_fd);
+	dev->raw_fd = -1;
+	dev->raw_uring = false;
+}
+
+/* Where the payload of a plane of a dequeued buffer is, and its size */
+static uint8_t *video_plane_payload(struct device *dev, const struct v4l2_buffer *buf,
+				    unsigned int plane, unsigned int *length)
+{
+	uint8_t *mem = dev->buffers[buf->index].mem[plane];
+
+	if (!video_is_mplane(dev)) {
+		*length = buf->bytesused;
+		return mem;
+	}
+
+	*length = buf->m.planes[plane].bytesused - buf->m.planes[plane].data_offset;
+	return mem + buf->m.planes[plane].data_offset;
+}
+
+/*
+ * Queue the planes of a frame for writing. The V4L2 buffer is held until
+ * every write has completed.
+ */
+static void video_save_image_async(struct device *dev, struct v4l2_buffer *buf,
+				   const char *pattern, unsigned int sequence)
+{
+	struct buffer *buffer = &dev->buffers[buf->index];
+	char *filename = NULL;
+	off_t file_offset = 0;
+	const char *p;
+	unsigned int i;
+	int fd = -1;
+	int ret;
+
+	p = strchr(pattern, '#');
+	if (p != NULL) {
+		filename = malloc(strlen(pattern) + 12);
+		if (filename == NULL)
+			return;
+		sprintf(filename, "%.*s%06u%s", (int)(p - pattern), pattern,
+			sequence, p + 1);
+
+		fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+			  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		free(filename);
+		if (fd == -1)
+			return;
+	}
+
+	for (i = 0; i < dev->num_planes; i++) {
+		struct raw_write *rw = &buffer->raw_writes[i];
+		int buf_index = -1;
+		uint8_t *data;
+
+		rw->dev = dev;
+		rw->buffer = buffer;
+		rw->req.complete = raw_write_complete;
+		data = video_plane_payload(dev, buf, i, &rw->length);
+		/* Only the last plane closes a per-frame file */
+		rw->fd = i + 1 == dev->num_planes ? fd : -1;
+
+		if (dev->raw_ring.fixed_buffers)
+			buf_index = buf->index * dev->num_planes + i;
+
+		buffer_get(buffer);
+		if (fd >= 0) {
+			/* Planes follow each other in the frame's file */
+			ret = uring_write(&dev->raw_ring, &rw->req, fd,
+					  data, rw->length, file_offset, buf_index);
+			file_offset += rw->length;
+		} else {
+			ret = uring_write(&dev->raw_ring, &rw->req,
+					  dev->raw_ring.fixed_files ? -1 : dev->raw_fd,
+					  data, rw->length, dev->raw_offset,
+					  buf_index);
+			dev->raw_offset += rw->length;
+		}
+
+		if (ret < 0) {
+			print("Unable to queue write: %s (%d)\n", strerror(-ret), -ret);
+			if (rw->fd >= 0)
+				close(rw->fd);
+			buffer_put(dev, buffer);
+		}
+	}
+}
+
+static void video_save_image(struct device *dev, struct v4l2_buffer *buf,
+			     const char *pattern, unsigned int sequence)
+{
+	unsigned int size;
+	unsigned int i;
+	char *filename;
+	const char *p;
+	bool append;
+	int ret = 0;
+	int fd;
+
+	size = strlen(pattern);
+	filename = malloc(size + 12);
+	if (filename == NULL)
+		return;
+
+	p = strchr(pattern, '#');
+	if (p != NULL) {
+		sprintf(filename, "%.*s%06u%s", (int)(p - pattern), pattern,
+			sequence, p + 1);
+		append = false;
+	} else {
+		strcpy(filename, pattern);
+		append = true;
+	}
+
+	fd = open(filename, O_CREAT | O_WRONLY | (append ? O_APPEND : O_TRUNC),
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	free(filename);
+	if (fd == -1)
+		return;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		unsigned int length;
+		void *data = video_plane_payload(dev, buf, i, &length);
+
+		ret = write(fd, data, length);
+		if (ret < 0) {
+			print("write error: %s (%d)\n", strerror(errno), errno);
+			break;
+		} else if (ret != (int)length)
+			print("write error: only %d bytes written instead of %u\n",
+			       ret, length);
+	}
+	close(fd);
+}
+
+/* Seconds without a frame before the capture is abandoned */
+#define CAPTURE_TIMEOUT_SEC	60
+/* Seconds between periodic statistics reports */
+#define STATS_INTERVAL_SEC	10
+
+struct capture {
+	unsigned int nframes;
+	unsigned int skip;
+	const char *pattern;
+	int do_requeue_last;
+
+	unsigned int frames;
+	unsigned int size;
+	struct timespec ts;
+
+	/* For spotting frames missing from the V4L2 sequence */
+	bool have_sequence;
+	uint32_t last_sequence;
+	int queued_after_last;
+
+	unsigned int idle_ticks;
+	unsigned int stats_ticks;
+	unsigned int stats_frames;
+	unsigned int watchdog_frames;
+	int error;
+};
+
+static void drop_count(struct device *dev, enum drop_cause cause, uint64_t n)
+{
+	__atomic_add_fetch(&dev->drops[cause], n, __ATOMIC_RELAXED);
+}
+
+static uint64_t drops_total(struct device *dev)
+{
+	uint64_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < DROP_CAUSES; i++)
+		total += __atomic_load_n(&dev->drops[i], __ATOMIC_RELAXED);
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		total += __atomic_load_n(&dev->components[i].drops, __ATOMIC_RELAXED);
+		total += __atomic_load_n(&dev->components[i].overflows, __ATOMIC_RELAXED);
+	}
+
+	return total;
+}
+
+static void drops_report(struct device *dev)
+{
+	uint64_t n;
+	unsigned int i;
+
+	for (i = 0; i < DROP_CAUSES; i++) {
+		n = __atomic_load_n(&dev->drops[i], __ATOMIC_RELAXED);
+		if (n)
+			print("Dropped %llu frames at %s: %s\n", (unsigned long long)n,
+				drop_causes[i].stage, drop_causes[i].cause);
+	}
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		n = __atomic_load_n(&dev->components[i].drops, __ATOMIC_RELAXED);
+		if (n)
+			print("Dropped %llu frames at %s: %s\n", (unsigned long long)n,
+				dev->components[i].branch->label,
+				sink_policy_cause(dev->components[i].policy));
+		n = __atomic_load_n(&dev->components[i].overflows, __ATOMIC_RELAXED);
+		if (n)
+			print("Dropped %llu frames at %s: %s\n", (unsigned long long)n,
+				dev->components[i].branch->label, SINK_OVERFLOW_CAUSE);
+	}
+}
+
+static int video_capture_frame(struct device *dev, struct capture *cap)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buf;
+	struct trace_record rec;
+	struct buffer *buffer;
+	int ret;
+
+	/* Dequeue a buffer. */
+	memset(&buf, 0, sizeof buf);
+	memset(planes, 0, sizeof planes);
+
+	buf.type = dev->type;
+	buf.memory = dev->memtype;
+	buf.length = VIDEO_MAX_PLANES;
+	buf.m.planes = planes;
+
+	ret = video_ioctl(dev, VIDIOC_DQBUF, &buf);
+	if (ret < 0) {
+		/* Woken without a frame, eg a replay tick with no buffer queued */
+		if (errno == EAGAIN)
+			return 0;
+		if (errno != EIO) {
+			print("Unable to dequeue buffer: %s (%d).\n",
+				strerror(errno), errno);
+			return ret;
+		}
+		buf.type = dev->type;
+		buf.memory = dev->memtype;
+	}
+
+	/*
+	 * The driver numbers every frame, whether it had a buffer for it or
+	 * not. A gap is put down to the pipeline if the last dequeue left the
+	 * driver without a buffer, and to the sensor otherwise.
+	 */
+	if (cap->have_sequence && (int32_t)(buf.sequence - cap->last_sequence) > 1)
+		drop_count(dev, cap->queued_after_last ? DROP_SEQUENCE_GAP : DROP_NO_BUFFER,
+			   buf.sequence - cap->last_sequence - 1);
+	cap->have_sequence = true;
+	cap->last_sequence = buf.sequence;
+	cap->queued_after_last = __atomic_sub_fetch(&dev->queued, 1, __ATOMIC_RELAXED);
+
+	if (video_is_mplane(dev)) {
+		unsigned int i;
+
+		buf.bytesused = 0;
+		for (i = 0; i < dev->num_planes; i++)
+			buf.bytesused += planes[i].bytesused - planes[i].data_offset;
+	}
+
+	//print("bytesused in buffer is %d\n", buf.bytesused);
+	cap->size += buf.bytesused;
+
+	clock_gettime(CLOCK_MONOTONIC, &cap->ts);
+
+	/* Only meaningful when the timestamp is from the same clock and real time */
+	if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+	    !(dev->use_replay && dev->replay.unthrottled)) {
+		int64_t ns = (cap->ts.tv_sec - buf.timestamp.tv_sec) * 1000000000LL +
+			     cap->ts.tv_nsec - buf.timestamp.tv_usec * 1000LL;
+
+		if (ns >= 0)
+			latency_record(&dev->lat_dqbuf, ns);
+	}
+
+	/* Rendered and saved, if at all, by the trace thread */
+	memset(&rec, 0, sizeof rec);
+	rec.arrival_ns = cap->ts.tv_sec * 1000000000ULL + cap->ts.tv_nsec;
+	rec.timestamp_ns = buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL;
+	rec.frame = cap->frames;
+	rec.sequence = buf.sequence;
+	rec.bytesused = buf.bytesused;
+	rec.flags = buf.flags;
+	rec.index = buf.index;
+	rec.field = buf.field;
+	rec.pts = INT64_MIN;
+
+	if (buf.index >= dev->nbufs) {
+		print("Invalid buffer index %u\n", buf.index);
+		return -EINVAL;
+	}
+
+	/* The capture loop holds a reference until it is done with the frame */
+	buffer = &dev->buffers[buf.index];
+	buffer->refs = 1;
+	buffer->requeue = !(cap->frames + 1 >= cap->nframes - dev->nbufs &&
+			    !cap->do_requeue_last);
+
+	/* Save the raw image. */
+	if (cap->pattern && !cap->skip) {
+		if (dev->raw_uring)
+			video_save_image_async(dev, &buf, cap->pattern, cap->frames);
+		else
+			video_save_image(dev, &buf, cap->pattern, cap->frames);
+	}
+
+	if (dev->mmal_pool) {
+		MMAL_BUFFER_HEADER_T *mmal = buffer->mmal;
+		MMAL_STATUS_T status;
+		if (!mmal) {
+			print("No MMAL buffer bound to V4L2 buffer %u\n", buf.index);
+		} else {
+			/*
+			 * Need to wait for MMAL to be finished with the buffer
+			 * before returning to V4L2, which always happens.
+			 */
+			buffer_get(buffer);
+			buffer->requeue = true;
+			mmal->length = mmal->alloc_size;	//Deliberately use length as MMAL wants the padding
+
+
+			if (!dev->starttime.tv_sec)
+				dev->starttime = buf.timestamp;
+
+			struct timeval pts;
+			timersub(&buf.timestamp, &dev->starttime, &pts);
+			//MMAL PTS is in usecs, so convert from struct timeval
+			mmal->pts = (pts.tv_sec * 1000000) + pts.tv_usec;
+
+			latency_frame_start(&dev->lat_frames, mmal->pts,
+					    cap->ts.tv_sec * 1000000000ULL + cap->ts.tv_nsec);
+
+			mmal->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+			//mmal->pts = buf.timestamp;
+			if (dev->num_planes > 1 && video_buffer_repack(dev, buffer, planes) < 0)
+				status = MMAL_ENOMEM;
+			else
+				status = mmal_port_send_buffer(dev->isp->input[0], mmal);
+			if (status != MMAL_SUCCESS) {
+				print("mmal_port_send_buffer failed %d\n", status);
+				drop_count(dev, DROP_ISP_SEND, 1);
+				buffer_put(dev, buffer);
+			} else {
+				latency_stamp(&dev->lat_isp_send, &dev->lat_frames, mmal->pts,
+					      LATENCY_STAGE_ISP_SEND);
+				rec.pts = mmal->pts;
+			}
+		}
+	}
+
+	trace_frame(&dev->trace, &rec);
+
+	if (dev->isp_output_pool)
+		sinks_expire(dev);
+
+	if (cap->skip)
+		--cap->skip;
+
+	cap->frames++;
+
+	ret = buffer_put(dev, buffer);
+	if (ret < 0) {
+		print("Unable to requeue buffer: %s (%d).\n",
+			strerror(errno), errno);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void latency_report_hist(const char *stage, const char *from,
+				const struct latency_hist *h)
+{
+	if (!h->count)
+		return;
+
+	print("Latency %-32s from %-6s %8llu frames, p50 %llu us, p99 %llu us, p99.9 %llu us, max %llu us\n",
+		stage, from, (unsigned long long)h->count,
+		(unsigned long long)latency_percentile(h, 50) / 1000,
+		(unsigned long long)latency_percentile(h, 99) / 1000,
+		(unsigned long long)latency_percentile(h, 99.9) / 1000,
+		(unsigned long long)h->max_ns / 1000);
+}
+
+/* Cumulative since the start, so each stage includes the ones before it */
+static void latency_report(struct device *dev)
+{
+	char stage[64];
+	unsigned int i;
+
+	latency_report_hist("dqbuf", "sensor", &dev->lat_dqbuf);
+	latency_report_hist("isp_send", "dqbuf", &dev->lat_isp_send);
+	latency_report_hist("isp_output", "dqbuf", &dev->lat_isp_output);
+
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		struct component *comp = &dev->components[i];
+
+		snprintf(stage, sizeof stage, "%s sink_return", comp->branch->label);
+		latency_report_hist(stage, "dqbuf", &comp->lat_sink);
+		snprintf(stage, sizeof stage, "%s encoded", comp->branch->label);
+		latency_report_hist(stage, "dqbuf", &comp->lat_encoded);
+		snprintf(stage, sizeof stage, "%s written", comp->branch->label);
+		latency_report_hist(stage, "dqbuf", &comp->lat_written);
+	}
+}
+
+struct metrics_scrape {
+	struct device *dev;
+	struct capture *cap;
+};
+
+static void metrics_latency(struct metrics_buf *b, const char *labels,
+			    const struct latency_hist *h)
+{
+	static const char * const quantiles[] = { "0.5", "0.99", "0.999" };
+	static const double percentiles[] = { 50, 99, 99.9 };
+	char sample[192];
+	unsigned int i;
+
+	if (!__atomic_load_n(&h->count, __ATOMIC_RELAXED))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(quantiles); i++) {
+		snprintf(sample, sizeof sample, "%s,quantile=\"%s\"", labels, quantiles[i]);
+		metrics_seconds(b, "v4l2_mmal_latency_seconds", sample,
+				latency_percentile(h, percentiles[i]));
+	}
+	metrics_seconds(b, "v4l2_mmal_latency_seconds_sum", labels,
+			__atomic_load_n(&h->total_ns, __ATOMIC_RELAXED));
+	metrics_value(b, "v4l2_mmal_latency_seconds_count", labels,
+		      __atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+/*
+ * Everything is read as it stands. Counters only have one writer each, the
+ * event loop itself or a single MMAL or writer thread, so the frame path
+ * never waits for a scrape.
+ */
+static void metrics_render(struct metrics_buf *b, void *priv)
+{
+	struct metrics_scrape *scrape = priv;
+	struct device *dev = scrape->dev;
+	struct capture *cap = scrape->cap;
+	struct writer_stats stats[MAX_COMPONENTS];
+	unsigned int held = 0;
+	char labels[160];
+	unsigned int i;
+
+	metrics_family(b, "v4l2_mmal_frames_captured_total", "counter",
+		       "Frames dequeued from V4L2.");
+	metrics_value(b, "v4l2_mmal_frames_captured_total", NULL, cap->frames);
+	metrics_family(b, "v4l2_mmal_source_changes_total", "counter",
+		       "Renegotiations after the source changed mode.");
+	metrics_value(b, "v4l2_mmal_source_changes_total", NULL, dev->source_changes);
+	metrics_family(b, "v4l2_mmal_frames_dropped_total", "counter",
+		       "Frames lost, by pipeline stage and cause.");
+	for (i = 0; i < DROP_CAUSES; i++) {
+		snprintf(labels, sizeof labels, "stage=\"%s\",cause=\"%s\"",
+			 drop_causes[i].stage, drop_causes[i].cause);
+		metrics_value(b, "v4l2_mmal_frames_dropped_total", labels,
+			      __atomic_load_n(&dev->drops[i], __ATOMIC_RELAXED));
+	}
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		snprintf(labels, sizeof labels, "stage=\"%s\",cause=\"%s\"",
+			 dev->components[i].branch->label,
+			 sink_policy_cause(dev->components[i].policy));
+		metrics_value(b, "v4l2_mmal_frames_dropped_total", labels,
+			      __atomic_load_n(&dev->components[i].drops, __ATOMIC_RELAXED));
+		if (dev->components[i].policy != SINK_BLOCK)
+			continue;
+		snprintf(labels, sizeof labels, "stage=\"%s\",cause=\"%s\"",
+			 dev->components[i].branch->label, SINK_OVERFLOW_CAUSE);
+		metrics_value(b, "v4l2_mmal_frames_dropped_total", labels,
+			      __atomic_load_n(&dev->components[i].overflows, __ATOMIC_RELAXED));
+	}
+	metrics_family(b, "v4l2_mmal_captured_bytes_total", "counter",
+		       "Bytes dequeued from V4L2.");
+	metrics_value(b, "v4l2_mmal_captured_bytes_total", NULL, cap->size);
+
+	for (i = 0; i < dev->nbufs; i++) {
+		if (__atomic_load_n(&dev->buffers[i].refs, __ATOMIC_RELAXED))
+			held++;
+	}
+	metrics_family(b, "v4l2_mmal_v4l2_buffers", "gauge",
+		       "V4L2 buffers queued to the driver, or held by MMAL and raw writes.");
+	metrics_value(b, "v4l2_mmal_v4l2_buffers", "state=\"driver\"", dev->nbufs - held);
+	metrics_value(b, "v4l2_mmal_v4l2_buffers", "state=\"held\"", held);
+	metrics_family(b, "v4l2_mmal_zero_copy_buffers", "gauge",
+		       "V4L2 buffers the isp reads in place, the rest are copied.");
+	metrics_value(b, "v4l2_mmal_zero_copy_buffers", NULL, dev->zero_copy_buffers);
+
+	if (dev->isp_output_pool) {
+		metrics_family(b, "v4l2_mmal_isp_output_pool_free", "gauge",
+			       "isp output buffers not sent to the isp.");
+		metrics_value(b, "v4l2_mmal_isp_output_pool_free", NULL,
+			      mmal_queue_length(dev->isp_output_pool->queue));
+	}
+
+	metrics_family(b, "v4l2_mmal_input_pool_free", "gauge",
+		       "Input buffers of a component not holding a frame.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_value(b, "v4l2_mmal_input_pool_free", labels,
+			      mmal_queue_length(dev->components[i].ip_pool->queue));
+	}
+
+	metrics_family(b, "v4l2_mmal_output_pool_free", "gauge",
+		       "Encoded output buffers waiting to be sent to the encoder.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (!dev->components[i].op_pool)
+			continue;
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_value(b, "v4l2_mmal_output_pool_free", labels,
+			      mmal_queue_length(dev->components[i].op_pool->queue));
+	}
+
+	metrics_family(b, "v4l2_mmal_save_queue_length", "gauge",
+		       "Encoded buffers waiting for the save thread.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (!dev->components[i].save_queue)
+			continue;
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_value(b, "v4l2_mmal_save_queue_length", labels,
+			      mmal_queue_length(dev->components[i].save_queue));
+	}
+
+	metrics_family(b, "v4l2_mmal_encoded_frames_total", "counter",
+		       "Frames out of an encoder.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (!dev->components[i].save_queue)
+			continue;
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_value(b, "v4l2_mmal_encoded_frames_total", labels,
+			      __atomic_load_n(&dev->components[i].encoded_frames, __ATOMIC_RELAXED));
+	}
+
+	metrics_family(b, "v4l2_mmal_encoded_bytes_total", "counter",
+		       "Bytes out of an encoder, headers included.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (!dev->components[i].save_queue)
+			continue;
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_value(b, "v4l2_mmal_encoded_bytes_total", labels,
+			      __atomic_load_n(&dev->components[i].encoded_bytes, __ATOMIC_RELAXED));
+	}
+
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (dev->components[i].save_queue)
+			writer_peek_stats(&dev->components[i].writer, &stats[i]);
+	}
+
+	metrics_family(b, "v4l2_mmal_written_bytes_total", "counter",
+		       "Bytes written to the output files.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (!dev->components[i].save_queue)
+			continue;
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_value(b, "v4l2_mmal_written_bytes_total", labels, stats[i].bytes);
+	}
+
+	metrics_family(b, "v4l2_mmal_writes_total", "counter",
+		       "Write system calls or io_uring writes.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (!dev->components[i].save_queue)
+			continue;
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_value(b, "v4l2_mmal_writes_total", labels, stats[i].writes);
+	}
+
+	metrics_family(b, "v4l2_mmal_write_errors_total", "counter",
+		       "Failed writes.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (!dev->components[i].save_queue)
+			continue;
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_value(b, "v4l2_mmal_write_errors_total", labels, stats[i].errors);
+	}
+
+	metrics_family(b, "v4l2_mmal_write_latency_seconds", "summary",
+		       "Time to write out a batch.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (!dev->components[i].save_queue)
+			continue;
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_seconds(b, "v4l2_mmal_write_latency_seconds_sum", labels,
+				stats[i].latency_total_ns);
+		metrics_value(b, "v4l2_mmal_write_latency_seconds_count", labels,
+			      stats[i].flushes);
+	}
+
+	metrics_family(b, "v4l2_mmal_write_latency_max_seconds", "gauge",
+		       "Longest time to write out a batch.");
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		if (!dev->components[i].save_queue)
+			continue;
+		snprintf(labels, sizeof labels, "branch=\"%s\",component=\"%s\"",
+			 dev->components[i].branch->label, dev->components[i].comp->name);
+		metrics_seconds(b, "v4l2_mmal_write_latency_max_seconds", labels,
+				stats[i].latency_max_ns);
+	}
+
+	metrics_family(b, "v4l2_mmal_latency_seconds", "summary",
+		       "Time from DQBUF (from the capture timestamp for dqbuf) to each stage.");
+	metrics_latency(b, "stage=\"dqbuf\"", &dev->lat_dqbuf);
+	metrics_latency(b, "stage=\"isp_send\"", &dev->lat_isp_send);
+	metrics_latency(b, "stage=\"isp_output\"", &dev->lat_isp_output);
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++) {
+		struct component *comp = &dev->components[i];
+
+		snprintf(labels, sizeof labels, "stage=\"sink_return\",branch=\"%s\",component=\"%s\"",
+			 comp->branch->label, comp->comp->name);
+		metrics_latency(b, labels, &comp->lat_sink);
+		snprintf(labels, sizeof labels, "stage=\"encoded\",branch=\"%s\",component=\"%s\"",
+			 comp->branch->label, comp->comp->name);
+		metrics_latency(b, labels, &comp->lat_encoded);
+		snprintf(labels, sizeof labels, "stage=\"written\",branch=\"%s\",component=\"%s\"",
+			 comp->branch->label, comp->comp->name);
+		metrics_latency(b, labels, &comp->lat_written);
+	}
+}
+
+static void metrics_handler(struct device *dev, struct event_source *src,
+			    uint32_t events)
+{
+	struct metrics_scrape scrape = { dev, src->priv };
+
+	(void)events;
+
+	metrics_dispatch(&dev->metrics, metrics_render, &scrape);
+}
+
+#define SINK_DRAIN_MS	2000
+
+/* Wait for the sinks to be done with every frame they were given or held */
+static void sinks_drain(struct device *dev)
+{
+	struct component *comp;
+	unsigned int ms, i;
+	bool busy = true;
+
+	for (ms = 0; busy && ms < SINK_DRAIN_MS; ms++)
+	{
+		sinks_expire(dev);
+
+		busy = false;
+		for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++)
+		{
+			comp = &dev->components[i];
+
+			pthread_mutex_lock(&comp->pending_lock);
+			if (comp->pending_count ||
+			    mmal_queue_length(comp->ip_pool->queue) < comp->ip_pool->headers_num)
+				busy = true;
+			pthread_mutex_unlock(&comp->pending_lock);
+		}
+
+		if (busy)
+			usleep(1000);
+	}
+
+	if (busy)
+		print("Sinks still busy after %u ms, dropping their frames\n", SINK_DRAIN_MS);
+}
+
+/*
+ * Take the isp, and everything fed from it, to the new V4L2 format. The
+ * isp input is disabled, so no new frames arrive. Scaled branches keep
+ * their size and only the scaler input changes, other sinks are cycled
+ * through the new size, encoders starting a new stream.
+ */
+static int isp_reconfigure(struct device *dev, int nbufs)
+{
+	MMAL_PORT_T *isp_output = dev->isp->output[0];
+	struct component *comp;
+	MMAL_STATUS_T status;
+	MMAL_PORT_T *ip, *op;
+	unsigned int i, ms;
+
+	sinks_drain(dev);
+
+	/* Downstream first, so nothing is sent on while the isp output goes */
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++)
+	{
+		comp = &dev->components[i];
+
+		mmal_port_disable(comp->input);
+		if (comp->scaler)
+			mmal_port_disable(comp->scaler->output[0]);
+		else if (comp->op_pool)
+			mmal_port_disable(comp->comp->output[0]);
+
+		pthread_mutex_lock(&comp->pending_lock);
+		while (comp->pending_count)
+			sink_pending_drop(comp);
+		pthread_mutex_unlock(&comp->pending_lock);
+
+		/* The old stream is written out before the new one starts */
+		for (ms = 0; comp->save_queue && mmal_queue_length(comp->save_queue) &&
+			     ms < SINK_DRAIN_MS; ms++)
+			usleep(1000);
+	}
+	mmal_port_disable(isp_output);
+
+	/* The buffers are the old frame size, and must all be back */
+	if (mmal_queue_length(dev->isp_output_pool->queue) != dev->isp_output_pool->headers_num)
+	{
+		print("isp output buffers still in use\n");
+		return -1;
+	}
+	mmal_port_pool_destroy(isp_output, dev->isp_output_pool);
+	dev->isp_output_pool = NULL;
+
+	if (isp_set_input_format(dev, nbufs) < 0 || isp_set_output_format(dev) < 0)
+		return -1;
+
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++)
+	{
+		comp = &dev->components[i];
+		ip = comp->input;
+
+		if (comp->scaler)
+		{
+			op = comp->scaler->output[0];
+			status = mmal_format_full_copy(ip->format, isp_output->format);
+			if (status == MMAL_SUCCESS)
+				status = mmal_port_format_commit(ip);
+			if (status == MMAL_SUCCESS)
+				status = scaler_set_output_format(comp, isp_output);
+			if (status == MMAL_SUCCESS)
+				status = mmal_port_enable(op, scaler_output_callback);
+			if (status == MMAL_SUCCESS)
+				status = mmal_port_enable(ip, sink_input_callback);
+			if (status != MMAL_SUCCESS)
+			{
+				print("Failed to reconfigure the scaler for %s\n", comp->branch->component);
+				return -1;
+			}
+			scaler_refill(comp);
+			continue;
+		}
+
+		status = sink_set_input_format(dev, comp, isp_output->format);
+		if (status == MMAL_SUCCESS)
+			status = mmal_port_enable(ip, sink_input_callback);
+		if (status == MMAL_SUCCESS && comp->op_pool)
+		{
+			MMAL_BUFFER_HEADER_T *buffer;
+
+			comp->new_width = ip->format->es->video.crop.width;
+			comp->new_height = ip->format->es->video.crop.height;
+			__atomic_store_n(&comp->new_stream, 1, __ATOMIC_RELEASE);
+
+			op = comp->comp->output[0];
+			status = mmal_port_enable(op, encoder_buffer_callback);
+			/* The rest come back from the save thread */
+			while (status == MMAL_SUCCESS &&
+			       (buffer = mmal_queue_get(comp->op_pool->queue)) != NULL)
+				status = mmal_port_send_buffer(op, buffer);
+		}
+		if (status != MMAL_SUCCESS)
+		{
+			print("Failed to reconfigure %s\n", comp->branch->component);
+			return -1;
+		}
+	}
+
+	return enable_isp_output(dev);
+}
+
+/*
+ * The source changed mode, eg an HDMI source rebooting. Stop streaming,
+ * take the buffers back from MMAL, then reallocate them for the new format
+ * and carry on. The isp and sinks are only reconfigured if the size
+ * changed, and the outputs stay open wherever the new stream can follow.
+ */
+static int video_source_change(struct device *dev, struct capture *cap)
+{
+	MMAL_VIDEO_FORMAT_T *video = &dev->isp->input[0]->format->es->video;
+	int nbufs = dev->nbufs;
+	int ret;
+
+	dev->source_changes++;
+
+	ret = video_enable(dev, 0);
+	if (ret < 0)
+		return ret;
+
+	/* Have MMAL hand back the frames it still holds before they are unmapped */
+	if (dev->isp->input[0]->is_enabled)
+		mmal_port_disable(dev->isp->input[0]);
+	if (dev->raw_uring)
+		uring_drain(&dev->raw_ring);
+
+	ret = video_free_buffers(dev);
+	if (ret < 0)
+		return ret;
+	__atomic_store_n(&dev->queued, 0, __ATOMIC_RELAXED);
+
+	/* New timings can only be set without buffers */
+	video_set_dv_timings(dev);
+	ret = video_get_format(dev);
+	if (ret < 0)
+		return ret;
+
+	if (dev->width != (unsigned int)video->crop.width ||
+	    dev->height != (unsigned int)video->crop.height)
+	{
+		print("Source now %ux%u, was %ux%u, reconfiguring\n", dev->width,
+		      dev->height, video->crop.width, video->crop.height);
+		ret = isp_reconfigure(dev, nbufs);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = video_alloc_buffers(dev, nbufs);
+	if (ret < 0)
+		return ret;
+	ret = enable_isp_input(dev);
+	if (ret < 0)
+		return ret;
+	ret = video_queue_all_buffers(dev);
+	if (ret < 0)
+		return ret;
+
+	/* The sequence starts again, and frames take a while to come */
+	cap->have_sequence = false;
+	cap->idle_ticks = 0;
+
+	return video_enable(dev, 1);
+}
+
+static void capture_handler(struct device *dev, struct event_source *src,
+			    uint32_t events)
+{
+	struct capture *cap = src->priv;
+
+	/*
+	 * V4L2 signals pending events (source change, EOS) through POLLPRI.
+	 * The replay fd is an epoll fd, which can't, so it is always asked.
+	 */
+	if (events & EPOLLPRI)
+		fprintf(stderr, "Exception\n");
+	if (((events & EPOLLPRI) || dev->use_replay) && handle_event(dev)) {
+		if (video_source_change(dev, cap) < 0) {
+			cap->error = -1;
+			dev->events.done = true;
+		}
+		return;
+	}
+
+	/*
+	 * Treat EPOLLERR like select() did and attempt the dequeue, which
+	 * blocks or fails with a meaningful error.
+	 */
+	if (events & (EPOLLIN | EPOLLERR)) {
+		if (video_capture_frame(dev, cap) < 0) {
+			cap->error = -1;
+			dev->events.done = true;
+		} else if (cap->frames >= cap->nframes) {
+			dev->events.done = true;
+		}
+	}
+}
+
+/* Ask every pre-event recorder to write out an event, picked up by the save threads */
+static void dvr_trigger_all(struct device *dev, const char *reason)
+{
+	unsigned int i;
+
+	print("DVR trigger (%s)\n", reason);
+	for (i = 0; i < MAX_COMPONENTS; i++)
 	{
-		print("Failed to create pool\n");
-		return -1;
+		if (dev->components[i].dvr.data)
+			__atomic_store_n(&dev->components[i].dvr_trigger, 1, __ATOMIC_RELEASE);
 	}
+}
 
-	buffers_to_isp(dev);
+/* A touch of the trigger file counts as a trigger */
+static void dvr_check_trigger_file(struct device *dev)
+{
+	struct stat st;
+
+	if (!dev->dvr_trigger_file || stat(dev->dvr_trigger_file, &st) < 0)
+		return;
+
+	if (st.st_mtim.tv_sec == dev->dvr_trigger_mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == dev->dvr_trigger_mtime.tv_nsec)
+		return;
+
+	dev->dvr_trigger_mtime = st.st_mtim;
+	dvr_trigger_all(dev, dev->dvr_trigger_file);
+}
+
+static void capture_timer_handler(struct device *dev, struct event_source *src,
+				  uint32_t events)
+{
+	struct capture *cap = src->priv;
+	uint64_t expirations;
+
+	(void)events;
+
+	if (read(src->fd, &expirations, sizeof expirations) != sizeof expirations)
+		return;
+
+	/* Watchdog */
+	if (cap->frames == cap->watchdog_frames) {
+		cap->idle_ticks += expirations;
+		if (cap->idle_ticks >= CAPTURE_TIMEOUT_SEC) {
+			fprintf(stderr, "capture timeout\n");
+			cap->error = -1;
+			dev->events.done = true;
+			return;
+		}
+	} else {
+		cap->idle_ticks = 0;
+		cap->watchdog_frames = cap->frames;
+	}
+
+	/* Periodic statistics */
+	cap->stats_ticks += expirations;
+	if (cap->stats_ticks >= STATS_INTERVAL_SEC) {
+		print("Stats: %u frames, %.3f fps over last %u s, %llu dropped\n",
+			cap->frames,
+			(double)(cap->frames - cap->stats_frames) / cap->stats_ticks,
+			cap->stats_ticks, (unsigned long long)drops_total(dev));
+		cap->stats_frames = cap->frames;
+		cap->stats_ticks = 0;
+		drops_report(dev);
+		latency_report(dev);
+	}
+
+	dvr_check_trigger_file(dev);
+
+	/* Frames are also held while nothing is being captured */
+	if (dev->isp_output_pool)
+		sinks_expire(dev);
+
+	if (dev->metrics.server.fd >= 0)
+		metrics_expire(&dev->metrics);
+	if (dev->control.server.fd >= 0 && !dev->daemon)
+		control_expire(&dev->control);
+}
+
+struct capture_control {
+	struct device *dev;
+	struct capture *cap;
+};
+
+/* Commands for the control socket of a DVR capture, which has no sessions */
+static void capture_command(char *command, char *reply, size_t size, void *priv)
+{
+	struct capture_control *c = priv;
+	struct device *dev = c->dev;
+	char *verb, *save;
+
+	verb = strtok_r(command, " \t", &save);
+	if (!verb)
+	{
+		snprintf(reply, size, "error no command");
+		return;
+	}
+
+	if (!strcmp(verb, "trigger"))
+	{
+		dvr_trigger_all(dev, "control");
+		snprintf(reply, size, "ok");
+	}
+	else if (!strcmp(verb, "status"))
+	{
+		snprintf(reply, size, "ok capturing frames %u size %ux%u",
+			 c->cap->frames, dev->width, dev->height);
+	}
+	else if (!strcmp(verb, "quit"))
+	{
+		dev->events.done = true;
+		snprintf(reply, size, "ok");
+	}
+	else
+	{
+		snprintf(reply, size, "error unknown command '%s'", verb);
+	}
+}
+
+static void capture_control_handler(struct device *dev, struct event_source *src,
+				    uint32_t events)
+{
+	struct capture_control c = { dev, src->priv };
+
+	(void)events;
+
+	control_dispatch(&dev->control, capture_command, &c);
+}
+
+static void capture_notify_handler(struct device *dev, struct event_source *src,
+				   uint32_t events)
+{
+	struct capture *cap = src->priv;
+	unsigned int flags;
+
+	(void)events;
+
+	flags = events_take_notifications(&dev->events);
+
+	if (flags & NOTIFY_MMAL_ERROR) {
+		print("MMAL error %d reported, stopping capture\n", dev->mmal_error);
+		cap->error = -1;
+		dev->events.done = true;
+	}
+	if (flags & NOTIFY_STOP) {
+		print("Stop requested, stopping capture\n");
+		dev->events.done = true;
+	}
+	if (flags & NOTIFY_DVR_TRIGGER)
+		dvr_trigger_all(dev, "signal");
+}
+
+static int video_do_capture(struct device *dev, unsigned int nframes,
+	unsigned int skip, const char *pattern,
+	int do_requeue_last, int do_queue_late)
+{
+	struct event_loop *loop = &dev->events;
+	struct capture cap;
+	struct timespec start;
+	double bps;
+	double fps;
+	int ret;
+
+	memset(&cap, 0, sizeof cap);
+	cap.nframes = nframes;
+	cap.skip = skip;
+	cap.pattern = pattern;
+	cap.do_requeue_last = do_requeue_last;
+
+	ret = events_add(loop, dev->fd, EPOLLIN | EPOLLPRI, capture_handler, &cap);
+	if (ret < 0)
+		goto done;
+	ret = events_add(loop, loop->timer_fd, EPOLLIN, capture_timer_handler, &cap);
+	if (ret < 0)
+		goto done;
+	ret = events_add(loop, loop->notify_fd, EPOLLIN, capture_notify_handler, &cap);
+	if (ret < 0)
+		goto done;
+	if (dev->metrics.server.fd >= 0) {
+		ret = events_add(loop, dev->metrics.server.fd, EPOLLIN, metrics_handler, &cap);
+		if (ret < 0)
+			goto done;
+	}
+	if (dev->control.server.fd >= 0) {
+		ret = events_add(loop, dev->control.server.fd, EPOLLIN,
+				 capture_control_handler, &cap);
+		if (ret < 0)
+			goto done;
+	}
+
+	if (dev->use_uring && pattern)
+		video_raw_uring_init(dev, pattern);
+
+	/* Start streaming. */
+	ret = video_enable(dev, 1);
+	if (ret < 0)
+		goto done;
+
+	if (do_queue_late)
+		video_queue_all_buffers(dev);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cap.ts = start;
+
+	events_set_timer(loop, 1000);
+
+	loop->done = nframes == 0;
+	while (!loop->done)
+		events_dispatch(dev, loop, -1);
+
+	events_set_timer(loop, 0);
+
+	/* Let the trace thread catch up before the summary */
+	trace_flush(&dev->trace);
+
+	/* Outstanding raw writes still reference the V4L2 buffers */
+	if (dev->raw_uring)
+		uring_drain(&dev->raw_ring);
+
+	if (cap.error) {
+		ret = cap.error;
+		goto done;
+	}
+
+	/* Stop streaming. */
+	ret = video_enable(dev, 0);
+	if (ret < 0)
+		goto done;
+
+	if (nframes == 0) {
+		print("No frames captured.\n");
+		goto done;
+	}
+
+	if (cap.ts.tv_sec == start.tv_sec && cap.ts.tv_nsec == start.tv_nsec) {
+		print("Captured %u frames (%u bytes) 0 seconds\n", cap.frames, cap.size);
+		goto done;
+	}
+
+	cap.ts.tv_sec -= start.tv_sec;
+	cap.ts.tv_nsec -= start.tv_nsec;
+	if (cap.ts.tv_nsec < 0) {
+		cap.ts.tv_sec--;
+		cap.ts.tv_nsec += 1000000000;
+	}
+
+	bps = cap.size/(cap.ts.tv_nsec/1000.0+1000000.0*cap.ts.tv_sec)*1000000.0;
+	fps = cap.frames/(cap.ts.tv_nsec/1000.0+1000000.0*cap.ts.tv_sec)*1000000.0;
+
+	print("Captured %u frames in %lu.%06lu seconds (%f fps, %f B/s).\n",
+		cap.frames, cap.ts.tv_sec, cap.ts.tv_nsec/1000, fps, bps);
+	print("Total number of frames dropped %llu\n", (unsigned long long)drops_total(dev));
+	drops_report(dev);
+	if (dev->lat_isp_send.count)
+		print("DQBUF to isp send latency avg %llu ns, max %llu ns\n",
+			(unsigned long long)(dev->lat_isp_send.total_ns / dev->lat_isp_send.count),
+			(unsigned long long)dev->lat_isp_send.max_ns);
+done:
+	if (dev->control.server.fd >= 0)
+		events_del(loop, dev->control.server.fd);
+	if (dev->metrics.server.fd >= 0)
+		events_del(loop, dev->metrics.server.fd);
+	events_del(loop, loop->notify_fd);
+	events_del(loop, loop->timer_fd);
+	events_del(loop, dev->fd);
+
+	video_raw_uring_cleanup(dev);
+
+	/* Have MMAL hand back the frames it still holds before they are unmapped */
+	if (dev->isp && dev->isp->input[0]->is_enabled)
+		mmal_port_disable(dev->isp->input[0]);
+
+	if (video_free_buffers(dev) < 0 && ret >= 0)
+		ret = -1;
+
+	return ret;
+}
+
+/* Daemon mode: the graph, its pools and the V4L2 buffers stay up between sessions */
+struct daemon {
+	struct device *dev;
+	struct capture cap;
+
+	/* What every session's capture starts with */
+	unsigned int skip;
+	const char *pattern;
+	int do_requeue_last;
+
+	bool capturing;
+	bool quit;
+	int error;
+	struct timespec start;
+};
+
+/* For the save threads to write out and close a session's files */
+#define SESSION_CLOSE_MS	2000
+
+static double timespec_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000.0 +
+	       (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Nothing is set up here, the buffers only need queueing and the encoders
+ * an IDR to start the session's files with.
+ */
+static int session_start(struct device *dev, struct daemon *d, unsigned int nframes)
+{
+	struct component *comp;
+	struct timespec now;
+	unsigned int i;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	memset(&d->cap, 0, sizeof d->cap);
+	d->cap.nframes = nframes;
+	d->cap.skip = d->skip;
+	d->cap.pattern = d->pattern;
+	d->cap.do_requeue_last = d->do_requeue_last;
+
+	ret = enable_isp_input(dev);
+	if (ret < 0)
+		return ret;
+
+	ret = video_queue_all_buffers(dev);
+	if (ret < 0)
+		goto error;
+
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++)
+	{
+		comp = &dev->components[i];
+		if (!comp->sessions)
+			continue;
+
+		if (comp->comp->output[0]->format->encoding == MMAL_ENCODING_H264)
+			mmal_port_parameter_set_boolean(comp->comp->output[0],
+					MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, MMAL_TRUE);
+		__atomic_store_n(&comp->new_session, 1, __ATOMIC_RELEASE);
+	}
+
+	ret = events_add(&dev->events, dev->fd, EPOLLIN | EPOLLPRI, capture_handler, &d->cap);
+	if (ret < 0)
+		goto error;
+
+	ret = video_enable(dev, 1);
+	if (ret < 0)
+	{
+		events_del(&dev->events, dev->fd);
+		goto error;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &d->start);
+	d->cap.ts = d->start;
+	d->capturing = true;
+	print("Session %u started in %.3f ms\n", dev->sessions, timespec_ms(&now, &d->start));
 
 	return 0;
+
+error:
+	/* Back to stopped, so another start can be tried */
+	mmal_port_disable(dev->isp->input[0]);
+	video_enable(dev, 0);
+	__atomic_store_n(&dev->queued, 0, __ATOMIC_RELAXED);
+	return ret;
 }
 
-static int enable_isp_input(struct device *dev)
+/*
+ * Stop capturing and wait until the session's files are complete. The
+ * components keep running and the buffers stay allocated.
+ */
+static void session_stop(struct device *dev, struct daemon *d)
 {
-	MMAL_STATUS_T status;
+	struct component *comp;
+	struct timespec now;
+	unsigned int i, ms;
+	bool busy = true;
+
+	events_del(&dev->events, dev->fd);
+
+	/*
+	 * MMAL hands back the frames it holds first, so they are queued again
+	 * and STREAMOFF takes every buffer back, ready for the next session.
+	 */
+	if (dev->isp->input[0]->is_enabled)
+		mmal_port_disable(dev->isp->input[0]);
+	if (dev->raw_uring)
+		uring_drain(&dev->raw_ring);
+	video_enable(dev, 0);
+	__atomic_store_n(&dev->queued, 0, __ATOMIC_RELAXED);
+
+	sinks_drain(dev);
+
+	for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++)
+	{
+		comp = &dev->components[i];
+		if (!comp->sessions)
+			continue;
+
+		for (ms = 0; mmal_queue_length(comp->save_queue) && ms < SINK_DRAIN_MS; ms++)
+			usleep(1000);
+		__atomic_store_n(&comp->end_session, 1, __ATOMIC_RELEASE);
+	}
+
+	for (ms = 0; busy && ms < SESSION_CLOSE_MS; ms++)
+	{
+		busy = false;
+		for (i = 0; i < MAX_COMPONENTS && dev->components[i].comp; i++)
+		{
+			if (__atomic_load_n(&dev->components[i].end_session, __ATOMIC_ACQUIRE))
+				busy = true;
+		}
+
+		if (busy)
+			usleep(1000);
+	}
+
+	if (busy)
+		print("Session files still being written after %u ms\n", SESSION_CLOSE_MS);
+
+	trace_flush(&dev->trace);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	print("Session %u: captured %u frames (%u bytes) in %.3f seconds\n",
+	      dev->sessions, d->cap.frames, d->cap.size,
+	      timespec_ms(&d->start, &now) / 1000.0);
+
+	d->capturing = false;
+	dev->sessions++;
+}
+
+/*
+ * Only while stopped. The pools are kept if the size is unchanged, and the
+ * isp and sinks are only reconfigured if the driver's size did change.
+ * Returns 1 if the driver refused the format, the old one is kept then.
+ */
+static int session_reconfigure(struct device *dev, unsigned int width,
+			       unsigned int height)
+{
+	MMAL_VIDEO_FORMAT_T *video = &dev->isp->input[0]->format->es->video;
+	struct v4l2_format fmt;
+	int nbufs = dev->nbufs;
+	int ret, set;
+
+	if (width == dev->width && height == dev->height)
+		return 0;
+
+	/* Same pixel format, only the size changes */
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = dev->type;
+	ret = video_ioctl(dev, VIDIOC_G_FMT, &fmt);
+	if (ret < 0)
+		return 1;
+
+	ret = video_free_buffers(dev);
+	if (ret < 0)
+		return ret;
+
+	set = video_set_format(dev, width, height,
+			       video_is_mplane(dev) ? fmt.fmt.pix_mp.pixelformat
+						    : fmt.fmt.pix.pixelformat,
+			       0, 0, V4L2_FIELD_ANY, 0);
+	ret = video_get_format(dev);
+	if (ret < 0)
+		return ret;
+
+	if (dev->width != (unsigned int)video->crop.width ||
+	    dev->height != (unsigned int)video->crop.height)
+	{
+		print("Reconfiguring for %ux%u, was %ux%u\n", dev->width,
+		      dev->height, video->crop.width, video->crop.height);
+		ret = isp_reconfigure(dev, nbufs);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = video_alloc_buffers(dev, nbufs);
+	if (ret < 0)
+		return ret;
+
+	return set < 0 ? 1 : 0;
+}
+
+static void daemon_command(char *command, char *reply, size_t size, void *priv)
+{
+	struct daemon *d = priv;
+	struct device *dev = d->dev;
+	unsigned int nframes, width, height, session;
+	char *verb, *arg, *end, *save;
+	int ret;
+
+	verb = strtok_r(command, " \t", &save);
+	arg = strtok_r(NULL, " \t", &save);
+	if (!verb)
+	{
+		snprintf(reply, size, "error no command");
+		return;
+	}
+
+	if (!strcmp(verb, "start"))
+	{
+		nframes = (unsigned int)-1;
+		if (arg)
+		{
+			nframes = strtoul(arg, &end, 10);
+			if (*end || !nframes)
+			{
+				snprintf(reply, size, "error invalid frame count '%s'", arg);
+				return;
+			}
+		}
+
+		if (d->capturing)
+			snprintf(reply, size, "error session %u already running", dev->sessions);
+		else if (session_start(dev, d, nframes) < 0)
+			snprintf(reply, size, "error failed to start");
+		else
+			snprintf(reply, size, "ok session %u", dev->sessions);
+	}
+	else if (!strcmp(verb, "stop"))
+	{
+		if (!d->capturing)
+		{
+			snprintf(reply, size, "error not capturing");
+			return;
+		}
+
+		session = dev->sessions;
+		session_stop(dev, d);
+		snprintf(reply, size, "ok session %u %u frames", session, d->cap.frames);
+	}
+	else if (!strcmp(verb, "reconfigure"))
+	{
+		width = arg ? strtoul(arg, &end, 10) : 0;
+		if (!arg || *end != 'x' || end == arg)
+		{
+			snprintf(reply, size, "error invalid size '%s'", arg ? arg : "");
+			return;
+		}
+		height = strtoul(end + 1, &end, 10);
+		if (*end || !width || !height)
+		{
+			snprintf(reply, size, "error invalid size '%s'", arg);
+			return;
+		}
+
+		if (d->capturing)
+		{
+			snprintf(reply, size, "error stop session %u first", dev->sessions);
+			return;
+		}
 
-	if (mmal_port_parameter_set_boolean(dev->isp->input[0], MMAL_PARAMETER_ZERO_COPY, dev->can_zero_copy) != MMAL_SUCCESS)
+		ret = session_reconfigure(dev, width, height);
+		if (ret < 0)
+		{
+			/* Nothing left to capture with */
+			snprintf(reply, size, "error failed to reconfigure, exiting");
+			d->error = ret;
+			d->quit = true;
+		}
+		else if (ret)
+		{
+			snprintf(reply, size, "error %ux%u not supported, still %ux%u",
+				 width, height, dev->width, dev->height);
+		}
+		else
+		{
+			snprintf(reply, size, "ok %ux%u", dev->width, dev->height);
+		}
+	}
+	else if (!strcmp(verb, "status"))
+	{
+		if (d->capturing)
+			snprintf(reply, size, "ok capturing session %u frames %u size %ux%u",
+				 dev->sessions, d->cap.frames, dev->width, dev->height);
+		else
+			snprintf(reply, size, "ok idle sessions %u size %ux%u",
+				 dev->sessions, dev->width, dev->height);
+	}
+	else if (!strcmp(verb, "quit"))
 	{
-		print("Failed to set zero copy\n");
-		return -1;
+		d->quit = true;
+		snprintf(reply, size, "ok");
 	}
-	status = mmal_port_enable(dev->isp->input[0], isp_ip_cb);
-	if (status != MMAL_SUCCESS)
+	else
 	{
-		print("ISP input enable failed\n");
-		return -1;
+		snprintf(reply, size, "error unknown command '%s'", verb);
 	}
-
-	return 0;
 }
 
-static void destroy_mmal(struct device *dev)
+static void daemon_control_handler(struct device *dev, struct event_source *src,
+				   uint32_t events)
 {
-	int i;
-	//FIXME: Clean up everything properly
-	for (i=0; i<MAX_COMPONENTS; i++)
-	{
-		dev->components[i].thread_quit = 1;
-		vcos_thread_join(&dev->components[i].save_thread, NULL);
+	(void)events;
 
-		if (dev->components[i].stream_fd)
-			fclose(dev->components[i].stream_fd);
-		if (dev->components[i].pts_fd)
-			fclose(dev->components[i].pts_fd);
-	}
+	control_dispatch(&dev->control, daemon_command, src->priv);
 }
 
-static void video_save_image(struct device *dev, struct v4l2_buffer *buf,
-			     const char *pattern, unsigned int sequence)
+static void daemon_timer_handler(struct device *dev, struct event_source *src,
+				 uint32_t events)
 {
-	unsigned int size;
-	unsigned int i;
-	char *filename;
-	const char *p;
-	bool append;
-	int ret = 0;
-	int fd;
+	struct daemon *d = src->priv;
+	struct event_source capture_src = *src;
+	uint64_t expirations;
 
-	size = strlen(pattern);
-	filename = malloc(size + 12);
-	if (filename == NULL)
-		return;
+	/* Idle clients would lock everyone else out, session or not */
+	control_expire(&dev->control);
 
-	p = strchr(pattern, '#');
-	if (p != NULL) {
-		sprintf(filename, "%.*s%06u%s", (int)(p - pattern), pattern,
-			sequence, p + 1);
-		append = false;
-	} else {
-		strcpy(filename, pattern);
-		append = true;
+	/* The watchdog and statistics are only for sessions */
+	if (d->capturing)
+	{
+		capture_src.priv = &d->cap;
+		capture_timer_handler(dev, &capture_src, events);
+		return;
 	}
 
-	fd = open(filename, O_CREAT | O_WRONLY | (append ? O_APPEND : O_TRUNC),
-		  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-	free(filename);
-	if (fd == -1)
+	if (read(src->fd, &expirations, sizeof expirations) != sizeof expirations)
 		return;
 
-	for (i = 0; i < dev->num_planes; i++) {
-		void *data = dev->buffers[buf->index].mem[i];
-		unsigned int length;
+	if (dev->metrics.server.fd >= 0)
+		metrics_expire(&dev->metrics);
+}
 
-		length = buf->bytesused;
+static void daemon_notify_handler(struct device *dev, struct event_source *src,
+				  uint32_t events)
+{
+	struct daemon *d = src->priv;
+	unsigned int flags;
 
-		ret = write(fd, data, length);
-		if (ret < 0) {
-			print("write error: %s (%d)\n", strerror(errno), errno);
-			break;
-		} else if (ret != (int)length)
-			print("write error: only %d bytes written instead of %u\n",
-			       ret, length);
+	(void)events;
+
+	flags = events_take_notifications(&dev->events);
+
+	if (flags & NOTIFY_MMAL_ERROR)
+	{
+		print("MMAL error %d reported, exiting\n", dev->mmal_error);
+		d->error = -1;
+		d->quit = true;
+	}
+	if (flags & NOTIFY_STOP)
+	{
+		print("Stop requested, exiting\n");
+		d->quit = true;
 	}
-	close(fd);
 }
 
-static int video_do_capture(struct device *dev, unsigned int nframes,
-	unsigned int skip, const char *pattern,
-	int do_requeue_last, int do_queue_late)
+/*
+ * Run capture sessions as the control socket asks until told to quit. A
+ * session ends on "stop", after the frames "start" asked for, or on error,
+ * which also ends the daemon.
+ */
+static int video_daemon(struct device *dev, struct daemon *d)
 {
-	struct v4l2_plane planes[VIDEO_MAX_PLANES];
-	struct v4l2_buffer buf;
-	struct timespec start;
-	struct timeval last;
-	struct timespec ts;
-	unsigned int size;
-	unsigned int i = 0;
-	double bps;
-	double fps;
+	struct event_loop *loop = &dev->events;
 	int ret;
-	int dropped_frames = 0;
 
-	/* Start streaming. */
-	ret = video_enable(dev, 1);
+	d->dev = dev;
+
+	ret = events_add(loop, dev->control.server.fd, EPOLLIN, daemon_control_handler, d);
 	if (ret < 0)
 		goto done;
+	ret = events_add(loop, loop->timer_fd, EPOLLIN, daemon_timer_handler, d);
+	if (ret < 0)
+		goto done;
+	ret = events_add(loop, loop->notify_fd, EPOLLIN, daemon_notify_handler, d);
+	if (ret < 0)
+		goto done;
+	if (dev->metrics.server.fd >= 0) {
+		ret = events_add(loop, dev->metrics.server.fd, EPOLLIN, metrics_handler, &d->cap);
+		if (ret < 0)
+			goto done;
+	}
 
-	if (do_queue_late)
-		video_queue_all_buffers(dev);
-
-	size = 0;
-	clock_gettime(CLOCK_MONOTONIC, &start);
-	last.tv_sec = start.tv_sec;
-	last.tv_usec = start.tv_nsec / 1000;
-
-        while (i < nframes) {
-                fd_set fds[3];
-                fd_set *rd_fds = &fds[0]; /* for capture */
-                fd_set *ex_fds = &fds[1]; /* for capture */
-                fd_set *wr_fds = &fds[2]; /* for output */
-                struct timeval tv;
-                int r;
-
-                if (rd_fds) {
-                    FD_ZERO(rd_fds);
-                    FD_SET(dev->fd, rd_fds);
-                }
-
-                if (ex_fds) {
-                    FD_ZERO(ex_fds);
-                    FD_SET(dev->fd, ex_fds);
-                }
-
-                if (wr_fds) {
-                    FD_ZERO(wr_fds);
-                    FD_SET(dev->fd, wr_fds);
-                }
-
-                /* Timeout. */
-                tv.tv_sec = 60;
-                tv.tv_usec = 0;
-
-                r = select(dev->fd + 1, rd_fds, wr_fds, ex_fds, &tv);
-
-                if (-1 == r) {
-                        if (EINTR == errno)
-                                continue;
-                        errno_exit("select");
-                }
-
-                if (0 == r) {
-                        fprintf(stderr, "select timeout\n");
-                        exit(EXIT_FAILURE);
-                }
-
-                if (rd_fds && FD_ISSET(dev->fd, rd_fds)) {
-			const char *ts_type, *ts_source;
-			int queue_buffer = 1;
-			/* Dequeue a buffer. */
-			memset(&buf, 0, sizeof buf);
-			memset(planes, 0, sizeof planes);
-
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			buf.memory = V4L2_MEMORY_MMAP;
-			buf.length = VIDEO_MAX_PLANES;
-			buf.m.planes = planes;
-
-			ret = ioctl(dev->fd, VIDIOC_DQBUF, &buf);
-			if (ret < 0) {
-				if (errno != EIO) {
-					print("Unable to dequeue buffer: %s (%d).\n",
-						strerror(errno), errno);
-					goto done;
-				}
-				buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-				buf.memory = V4L2_MEMORY_MMAP;
-			}
-
-			//print("bytesused in buffer is %d\n", buf.bytesused);
-			size += buf.bytesused;
-
-			fps = (buf.timestamp.tv_sec - last.tv_sec) * 1000000
-			    + buf.timestamp.tv_usec - last.tv_usec;
-			fps = fps ? 1000000.0 / fps : 0.0;
-
-			clock_gettime(CLOCK_MONOTONIC, &ts);
-			get_ts_flags(buf.flags, &ts_type, &ts_source);
-			print("%u (%u) [%c] %s %u %u B %ld.%06ld %ld.%06ld %.3f fps ts %s/%s\n", i, buf.index,
-				(buf.flags & V4L2_BUF_FLAG_ERROR) ? 'E' : '-',
-				v4l2_field_name(buf.field),
-				buf.sequence, buf.bytesused,
-				buf.timestamp.tv_sec, buf.timestamp.tv_usec,
-				ts.tv_sec, ts.tv_nsec/1000, fps,
-				ts_type, ts_source);
-
-			last = buf.timestamp;
-
-			/* Save the raw image. */
-			if (pattern && !skip)
-				video_save_image(dev, &buf, pattern, i);
-
-			if (dev->mmal_pool) {
-				MMAL_BUFFER_HEADER_T *mmal = mmal_queue_get(dev->mmal_pool->queue);
-				MMAL_STATUS_T status;
-				if (!mmal) {
-					print("Failed to get MMAL buffer\n");
-				} else {
-					/* Need to wait for MMAL to be finished with the buffer before returning to V4L2 */
-					queue_buffer = 0;
-					if (((struct buffer*)mmal->user_data)->idx != buf.index) {
-						print("Mismatch in expected buffers. V4L2 gave idx %d, MMAL expecting %d\n",
-							buf.index, ((struct buffer*)mmal->user_data)->idx);
-					}
-					mmal->length = buf.length;	//Deliberately use length as MMAL wants the padding
-
-					if (!dev->starttime.tv_sec)
-						dev->starttime = buf.timestamp;
-
-					struct timeval pts;
-					timersub(&buf.timestamp, &dev->starttime, &pts);
-					//MMAL PTS is in usecs, so convert from struct timeval
-					mmal->pts = (pts.tv_sec * 1000000) + pts.tv_usec;
-					if (mmal->pts > (dev->lastpts+dev->frame_time_usec+2500)) {
-						print("DROPPED FRAME - %lld and %lld, delta %lld\n", dev->lastpts, mmal->pts, mmal->pts-dev->lastpts);
-						dropped_frames++;
-					}
-					dev->lastpts = mmal->pts;
-
-					mmal->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
-					//mmal->pts = buf.timestamp;
-					status = mmal_port_send_buffer(dev->isp->input[0], mmal);
-					if (status != MMAL_SUCCESS)
-						print("mmal_port_send_buffer failed %d\n", status);
-				}
-			}
-
-			if (skip)
-				--skip;
-
-			fflush(stdout);
-
-			i++;
+	if (dev->use_uring && d->pattern)
+		video_raw_uring_init(dev, d->pattern);
 
-			if (i >= nframes - dev->nbufs && !do_requeue_last)
-				continue;
-			if (!queue_buffer)
-				continue;
+	events_set_timer(loop, 1000);
+	printf("Waiting for commands on %s\n", dev->control.server.path);
 
-			ret = video_queue_buffer(dev, buf.index);
-			if (ret < 0) {
-				print("Unable to requeue buffer: %s (%d).\n",
-					strerror(errno), errno);
-				goto done;
-			}
-                }
-                if (wr_fds && FD_ISSET(dev->fd, wr_fds)) {
-                    fprintf(stderr, "Writing?!?!?\n");
-                }
-                if (ex_fds && FD_ISSET(dev->fd, ex_fds)) {
-                    fprintf(stderr, "Exception\n");
-                    handle_event(dev);
-                }
-                /* EAGAIN - continue select loop. */
-        }
+	loop->done = false;
+	while (!d->quit) {
+		events_dispatch(dev, loop, -1);
+		if (!loop->done)
+			continue;
 
+		/* The session has all its frames, or capturing failed */
+		loop->done = false;
+		if (d->capturing)
+			session_stop(dev, d);
+		if (d->cap.error) {
+			d->error = d->cap.error;
+			d->quit = true;
+		}
+	}
 
-	/* Stop streaming. */
-	ret = video_enable(dev, 0);
-	if (ret < 0)
-		return ret;
+	if (d->capturing)
+		session_stop(dev, d);
 
-	if (nframes == 0) {
-		print("No frames captured.\n");
-		goto done;
-	}
+	events_set_timer(loop, 0);
+	ret = d->error;
 
-	if (ts.tv_sec == start.tv_sec && ts.tv_nsec == start.tv_nsec) {
-		print("Captured %u frames (%u bytes) 0 seconds\n", i, size);
-		goto done;
-	}
+done:
+	if (dev->metrics.server.fd >= 0)
+		events_del(loop, dev->metrics.server.fd);
+	events_del(loop, loop->notify_fd);
+	events_del(loop, loop->timer_fd);
+	events_del(loop, dev->control.server.fd);
 
-	ts.tv_sec -= start.tv_sec;
-	ts.tv_nsec -= start.tv_nsec;
-	if (ts.tv_nsec < 0) {
-		ts.tv_sec--;
-		ts.tv_nsec += 1000000000;
-	}
+	video_raw_uring_cleanup(dev);
 
-	bps = size/(ts.tv_nsec/1000.0+1000000.0*ts.tv_sec)*1000000.0;
-	fps = i/(ts.tv_nsec/1000.0+1000000.0*ts.tv_sec)*1000000.0;
+	if (video_free_buffers(dev) < 0 && ret >= 0)
+		ret = -1;
 
-	print("Captured %u frames in %lu.%06lu seconds (%f fps, %f B/s).\n",
-		i, ts.tv_sec, ts.tv_nsec/1000, fps, bps);
-	print("Total number of frames dropped %d\n", dropped_frames);
-done:
-	return video_free_buffers(dev);
+	return ret;
 }
 
 int video_set_dv_timings(struct device *dev)
@@ -1661,11 +4945,11 @@ int video_set_dv_timings(struct device *dev)
 	int ret;
 
 	memset(&timings, 0, sizeof timings);
-	ret = ioctl(dev->fd, VIDIOC_QUERY_DV_TIMINGS, &timings);
+	ret = video_ioctl(dev, VIDIOC_QUERY_DV_TIMINGS, &timings);
 	if (ret >= 0) {
 		print("QUERY_DV_TIMINGS returned %ux%u pixclk %llu\n", timings.bt.width, timings.bt.height, timings.bt.pixelclock);
 		//Can read DV timings, so set them.
-		ret = ioctl(dev->fd, VIDIOC_S_DV_TIMINGS, &timings);
+		ret = video_ioctl(dev, VIDIOC_S_DV_TIMINGS, &timings);
 		if (ret < 0) {
 			print("Failed to set DV timings\n");
 			return -1;
@@ -1684,10 +4968,10 @@ int video_set_dv_timings(struct device *dev)
 		}
 	} else {
 		memset(&std, 0, sizeof std);
-		ret = ioctl(dev->fd, VIDIOC_QUERYSTD, &std);
+		ret = video_ioctl(dev, VIDIOC_QUERYSTD, &std);
 		if (ret >= 0) {
 			//Can read standard, so set it.
-			ret = ioctl(dev->fd, VIDIOC_S_STD, &std);
+			ret = video_ioctl(dev, VIDIOC_S_STD, &std);
 			if (ret < 0) {
 				print("Failed to set standard\n");
 				return -1;
@@ -1706,9 +4990,9 @@ int video_get_fps(struct device *dev)
 	int ret;
 
 	memset(&parm, 0, sizeof parm);
-	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	parm.type = dev->type;
 
-	ret = ioctl(dev->fd, VIDIOC_G_PARM, &parm);
+	ret = video_ioctl(dev, VIDIOC_G_PARM, &parm);
 	if (ret < 0) {
 		print("Unable to get frame rate: %s (%d).\n",
 			strerror(errno), errno);
@@ -1730,6 +5014,9 @@ int video_get_fps(struct device *dev)
 #define V4L_BUFFERS_DEFAULT	8
 #define V4L_BUFFERS_MAX		32
 
+#define WRITE_BATCH_DEFAULT	(512 << 10)
+#define WRITE_WINDOW_DEFAULT	200
+
 static void usage(const char *argv0)
 {
 	print("Usage: %s [options] device\n", argv0);
@@ -1749,6 +5036,7 @@ static void usage(const char *argv0)
 	print("-s, --size WxH			Set the frame size\n");
 	print("-t, --time-per-frame num/denom	Set the time per frame (eg. 1/25 = 25 fps)\n");
 	print("-T, --dv-timings		Query and set the DV timings\n");
+	print("-v, --verbose			Print a line for every captured frame\n");
 	print("    --buffer-prefix		Write portions of buffer before data_offset\n");
 	print("    --buffer-size		Buffer size in bytes\n");
 	print("    --fd                        Use a numeric file descriptor insted of a device\n");
@@ -1760,6 +5048,50 @@ static void usage(const char *argv0)
 	print("    --queue-late		Queue buffers after streamon, not before\n");
 	print("    --requeue-last		Requeue the last buffers before streamoff\n");
 	print("    --timestamp-source		Set timestamp source on output buffers [eof, soe]\n");
+	print("    --write-batch bytes		Batch encoded output into writes of this size (0 = write every buffer)\n");
+	print("    --write-window ms		Maximum time encoded output is held before being written\n");
+	print("    --io-uring			Write encoded and raw output asynchronously with io_uring\n");
+	print("    --container type		Wrap the H.264 output in a container [raw, mp4, mkv, ts]\n");
+	print("    --segment-time secs		Start a new output file every secs seconds, at an IDR frame\n");
+	print("    --segment-size bytes	Start a new output file after this many bytes, at an IDR frame\n");
+	print("    --hls playlist		Write an HLS playlist for the segments (ts or mp4 container)\n");
+	print("    --hls-window n		Number of segments listed in the playlist (default 6),\n");
+	print("				older ones are deleted\n");
+	print("    --hls-part ms		Also list LL-HLS partial segments of this duration\n");
+	print("    --dvr pre[:post]		Only keep the last pre secs in memory, write them and post\n");
+	print("				secs more to a new file on SIGUSR1 or a trigger (default post 10)\n");
+	print("				With --control, the socket takes trigger, status and quit\n");
+	print("    --dvr-size bytes		Memory for the pre-event buffer (default 32MiB)\n");
+	print("    --dvr-trigger file		Also trigger an event whenever file is touched\n");
+	print("    --dmabuf[=provider]		Allocate the buffers here and give them to V4L2 as dmabufs\n");
+	print("				[auto, cma, system, udmabuf, memfd] (default auto)\n");
+	print("    --require-zero-copy		Fail if any buffer can't be imported into the VPU\n");
+	print("    --replay source		Capture from a raw frame file (as written by --file) or\n");
+	print("				'pattern' instead of a device, set -f and -s to match the file\n");
+	print("    --replay-fps fps		Frame rate of the replay source (default 30)\n");
+	print("    --replay-mplane		Emulate a multi-planar device, eg for -f NV12M\n");
+	print("    --replay-source-change n:WxH	Have the replay source change mode to WxH after n\n");
+	print("				frames, as an HDMI source would\n");
+	print("    --unthrottled		Replay frames as fast as buffers are returned\n");
+	print("    --metrics path		Serve Prometheus metrics on a Unix domain socket\n");
+	print("    --control path		Stay up between captures, run as commands on this Unix\n");
+	print("				domain socket ask: start [nframes], stop, reconfigure WxH,\n");
+	print("				status and quit. Each capture writes its own files\n");
+	print("    --trace file		Save a binary record of every captured frame\n");
+	print("				SIGUSR2 prints the most recent frames\n");
+	print("    --branch desc		Add a sink branch, replacing the default H.264, JPEG and\n");
+	print("				render ones: component[,key=value...] with component one of\n");
+	print("				video_encode, image_encode or video_render and keys\n");
+	print("				encoding (h264, jpeg), size WxH, decimate n (every nth\n");
+	print("				frame), bitrate b/s, output file and policy (see below)\n");
+	print("    --pipeline file		Read the branches from file, one description per line\n");
+	print("    --sink-policy sink=policy	What a busy sink does with a new frame, sink is a\n");
+	print("				component, eg. video_encode, or one branch, eg.\n");
+	print("				video_encode#1, policy one of newest (drop it), oldest (hold\n");
+	print("				it, dropping any held one) or block[:ms] (hold every frame\n");
+	print("				for up to ms, default %u, a few at a time). H.264 blocks,\n",
+	      SINK_BLOCK_MS_DEFAULT);
+	print("				JPEG drops newest and render drops oldest\n");
 	print("    --skip n			Skip the first n frames\n");
 	print("    --stride value		Line stride in bytes\n");
 	print("-m  --mmal			Enable MMAL rendering of images\n");
@@ -1778,11 +5110,43 @@ static void usage(const char *argv0)
 #define OPT_PREMULTIPLIED	269
 #define OPT_QUEUE_LATE		270
 #define OPT_DATA_PREFIX		271
+#define OPT_WRITE_BATCH		272
+#define OPT_WRITE_WINDOW	273
+#define OPT_IO_URING		274
+#define OPT_CONTAINER		275
+#define OPT_SEGMENT_TIME	276
+#define OPT_SEGMENT_SIZE	277
+#define OPT_HLS			278
+#define OPT_HLS_WINDOW		279
+#define OPT_HLS_PART		280
+#define OPT_DVR			281
+#define OPT_DVR_SIZE		282
+#define OPT_DVR_TRIGGER		283
+#define OPT_REPLAY		284
+#define OPT_REPLAY_FPS		285
+#define OPT_UNTHROTTLED		286
+#define OPT_METRICS		287
+#define OPT_TRACE		288
+#define OPT_SINK_POLICY		289
+#define OPT_BRANCH		290
+#define OPT_PIPELINE		291
+#define OPT_REPLAY_MPLANE	292
+#define OPT_DMABUF		293
+#define OPT_REQUIRE_ZERO_COPY	294
+#define OPT_REPLAY_CHANGE	295
+#define OPT_CONTROL		296
 
 static struct option opts[] = {
+	{"branch", 1, 0, OPT_BRANCH},
 	{"buffer-size", 1, 0, OPT_BUFFER_SIZE},
 	{"capture", 2, 0, 'c'},
+	{"container", 1, 0, OPT_CONTAINER},
+	{"control", 1, 0, OPT_CONTROL},
 	{"data-prefix", 0, 0, OPT_DATA_PREFIX},
+	{"dmabuf", 2, 0, OPT_DMABUF},
+	{"dvr", 1, 0, OPT_DVR},
+	{"dvr-size", 1, 0, OPT_DVR_SIZE},
+	{"dvr-trigger", 1, 0, OPT_DVR_TRIGGER},
 	{"encode-to", 1, 0, 'E'},
 	{"fd", 1, 0, OPT_FD},
 	{"field", 1, 0, OPT_FIELD},
@@ -1790,23 +5154,70 @@ static struct option opts[] = {
 	{"fill-frames", 0, 0, 'I'},
 	{"format", 1, 0, 'f'},
 	{"help", 0, 0, 'h'},
+	{"hls", 1, 0, OPT_HLS},
+	{"hls-part", 1, 0, OPT_HLS_PART},
+	{"hls-window", 1, 0, OPT_HLS_WINDOW},
 	{"log-status", 0, 0, OPT_LOG_STATUS},
+	{"metrics", 1, 0, OPT_METRICS},
 	{"mmal", 0, 0, 'm'},
 	{"nbufs", 1, 0, 'n'},
 	{"no-query", 0, 0, OPT_NO_QUERY},
 	{"pause", 0, 0, 'p'},
+	{"pipeline", 1, 0, OPT_PIPELINE},
 	{"premultiplied", 0, 0, OPT_PREMULTIPLIED},
 	{"queue-late", 0, 0, OPT_QUEUE_LATE},
+	{"replay", 1, 0, OPT_REPLAY},
+	{"replay-fps", 1, 0, OPT_REPLAY_FPS},
+	{"replay-mplane", 0, 0, OPT_REPLAY_MPLANE},
+	{"replay-source-change", 1, 0, OPT_REPLAY_CHANGE},
 	{"requeue-last", 0, 0, OPT_REQUEUE_LAST},
+	{"require-zero-copy", 0, 0, OPT_REQUIRE_ZERO_COPY},
 	{"size", 1, 0, 's'},
+	{"segment-size", 1, 0, OPT_SEGMENT_SIZE},
+	{"segment-time", 1, 0, OPT_SEGMENT_TIME},
+	{"sink-policy", 1, 0, OPT_SINK_POLICY},
 	{"skip", 1, 0, OPT_SKIP_FRAMES},
 	{"stride", 1, 0, OPT_STRIDE},
 	{"time-per-frame", 1, 0, 't'},
 	{"timestamp-source", 1, 0, OPT_TSTAMP_SRC},
+	{"trace", 1, 0, OPT_TRACE},
+	{"unthrottled", 0, 0, OPT_UNTHROTTLED},
+	{"verbose", 0, 0, 'v'},
 	{"dv-timings", 0, 0, 'T'},
+	{"write-batch", 1, 0, OPT_WRITE_BATCH},
+	{"write-window", 1, 0, OPT_WRITE_WINDOW},
+	{"io-uring", 0, 0, OPT_IO_URING},
 	{0, 0, 0, 0}
 };
 
+static struct event_loop *signal_loop;
+
+static void stop_signal_handler(int signum)
+{
+	(void)signum;
+
+	if (signal_loop)
+		events_notify(signal_loop, NOTIFY_STOP);
+}
+
+static void dvr_signal_handler(int signum)
+{
+	(void)signum;
+
+	if (signal_loop)
+		events_notify(signal_loop, NOTIFY_DVR_TRIGGER);
+}
+
+static struct trace *signal_trace;
+
+static void trace_signal_handler(int signum)
+{
+	(void)signum;
+
+	if (signal_trace)
+		trace_request_dump(signal_trace);
+}
+
 int main(int argc, char *argv[])
 {
 	struct device dev;
@@ -1841,11 +5252,37 @@ int main(int argc, char *argv[])
 	const char *filename = "frame-#.bin";
 	const char *encode_filename = "file.h264";
 
+	/* Replay source */
+	const char *replay_source = NULL;
+	unsigned int replay_fps = 0;
+	bool replay_mplane = false;
+	const char *replay_change = NULL;
+	const char *dmabuf_provider = NULL;
+	bool unthrottled = false;
+
+	const char *metrics_path = NULL;
+	const char *control_path = NULL;
+
+	/* Pipeline */
+	const char *sink_policies[PIPELINE_MAX_BRANCHES];
+	unsigned int num_sink_policies = 0;
+	unsigned int i;
+
+	/* Frame trace */
+	const char *trace_path = NULL;
+	bool verbose = false;
+
 	video_init(&dev);
 	bcm_host_init();
 
+	if (events_init(&dev.events) < 0)
+		return 1;
+
+	dev.write_cfg.flush_bytes = WRITE_BATCH_DEFAULT;
+	dev.write_cfg.flush_ms = WRITE_WINDOW_DEFAULT;
+
 	opterr = 0;
-	while ((c = getopt_long(argc, argv, "c::E:f:F::hn:pr:s:t:T", opts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "c::E:f:F::hn:pr:s:t:Tv", opts, NULL)) != -1) {
 
 		switch (c) {
 		case 'c':
@@ -1903,6 +5340,9 @@ int main(int argc, char *argv[])
 		case 'T':
 			do_set_dv_timings = 1;
 			break;
+		case 'v':
+			verbose = true;
+			break;
 		case OPT_BUFFER_SIZE:
 			buffer_size = atoi(optarg);
 			break;
@@ -1956,6 +5396,110 @@ int main(int argc, char *argv[])
 		case OPT_DATA_PREFIX:
 			dev.write_data_prefix = true;
 			break;
+		case OPT_WRITE_BATCH:
+			dev.write_cfg.flush_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_WRITE_WINDOW:
+			dev.write_cfg.flush_ms = atoi(optarg);
+			break;
+		case OPT_IO_URING:
+			dev.use_uring = true;
+			dev.write_cfg.backend = WRITER_BACKEND_URING;
+			break;
+		case OPT_CONTAINER:
+			if (!strcmp(optarg, "raw")) {
+				dev.container = NULL;
+				break;
+			}
+			dev.container = mux_find(optarg);
+			if (!dev.container) {
+				print("Unsupported container '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_SEGMENT_TIME:
+			dev.segment_time = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_SEGMENT_SIZE:
+			dev.segment_size = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_HLS:
+			dev.hls_path = optarg;
+			break;
+		case OPT_HLS_WINDOW:
+			dev.hls_window = strtoul(optarg, &endptr, 10);
+			if (*endptr || endptr == optarg || optarg[0] == '-' ||
+			    !dev.hls_window) {
+				print("Invalid HLS window '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_HLS_PART:
+			dev.hls_part_ms = atoi(optarg);
+			break;
+		case OPT_DVR:
+			dev.dvr_post = DVR_DEFAULT_POST;
+			if (sscanf(optarg, "%u:%u", &dev.dvr_pre, &dev.dvr_post) < 1) {
+				print("Invalid DVR time '%s'\n", optarg);
+				return 1;
+			}
+			if (!dev.dvr_size)
+				dev.dvr_size = DVR_DEFAULT_SIZE;
+			break;
+		case OPT_DVR_SIZE:
+			dev.dvr_size = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_DVR_TRIGGER:
+			dev.dvr_trigger_file = optarg;
+			break;
+		case OPT_REPLAY:
+			replay_source = optarg;
+			break;
+		case OPT_REPLAY_FPS:
+			replay_fps = atoi(optarg);
+			break;
+		case OPT_REPLAY_MPLANE:
+			replay_mplane = true;
+			break;
+		case OPT_REPLAY_CHANGE:
+			replay_change = optarg;
+			break;
+		case OPT_DMABUF:
+			dev.memtype = V4L2_MEMORY_DMABUF;
+			dmabuf_provider = optarg;
+			break;
+		case OPT_REQUIRE_ZERO_COPY:
+			dev.require_zero_copy = true;
+			break;
+		case OPT_UNTHROTTLED:
+			unthrottled = true;
+			break;
+		case OPT_METRICS:
+			metrics_path = optarg;
+			break;
+		case OPT_CONTROL:
+			control_path = optarg;
+			dev.daemon = true;
+			break;
+		case OPT_TRACE:
+			trace_path = optarg;
+			break;
+		case OPT_BRANCH:
+			if (pipeline_add_branch(&dev.pipeline, optarg) < 0)
+				return 1;
+			break;
+		case OPT_PIPELINE:
+			if (pipeline_load(&dev.pipeline, optarg) < 0)
+				return 1;
+			break;
+		case OPT_SINK_POLICY:
+			/* Applied once all the branches are known */
+			if (num_sink_policies == ARRAY_SIZE(sink_policies)) {
+				print("Too many sink policies\n");
+				return 1;
+			}
+			sink_policies[num_sink_policies++] = optarg;
+			break;
 		default:
 			print("Invalid option -%c\n", c);
 			print("Run %s -h for help.\n", argv[0]);
@@ -1966,6 +5510,82 @@ int main(int argc, char *argv[])
 	if (!do_file)
 		filename = NULL;
 
+	for (i = 0; i < num_sink_policies; i++) {
+		if (pipeline_set_policy(&dev.pipeline, sink_policies[i]) < 0) {
+			print("Invalid sink policy '%s'\n", sink_policies[i]);
+			return 1;
+		}
+	}
+
+	if (dev.hls_path) {
+		/* HLS players want time based segments in TS or fMP4 */
+		if (!dev.container)
+			dev.container = &mux_ts_ops;
+		if (dev.container != &mux_ts_ops && dev.container != &mux_mp4_ops) {
+			print("HLS needs the ts or mp4 container\n");
+			return 1;
+		}
+		if (!dev.segment_time)
+			dev.segment_time = HLS_DEFAULT_SEGMENT_TIME;
+		if (!dev.hls_window)
+			dev.hls_window = HLS_DEFAULT_WINDOW;
+		if (dev.hls_part_ms &&
+		    dev.segment_time * 1000 / dev.hls_part_ms > HLS_MAX_PARTS) {
+			print("At most %u partial segments per segment\n", HLS_MAX_PARTS);
+			return 1;
+		}
+	}
+
+	if (dev.dvr_size) {
+		if (dev.segment_time || dev.segment_size || dev.hls_path) {
+			print("DVR mode can't be combined with segments or HLS\n");
+			return 1;
+		}
+		if (dev.dvr_trigger_file) {
+			struct stat st;
+
+			/* Only changes after startup count */
+			if (!stat(dev.dvr_trigger_file, &st))
+				dev.dvr_trigger_mtime = st.st_mtim;
+		}
+		/* The control socket triggers events rather than starting sessions */
+		dev.daemon = false;
+	}
+
+	if (dev.daemon) {
+		/* Sessions decide the files, and nothing is held between them */
+		if (dev.segment_time || dev.segment_size || dev.hls_path) {
+			print("Control mode can't be combined with segments or HLS\n");
+			return 1;
+		}
+		for (i = 0; i < dev.pipeline.num_branches; i++) {
+			const char *output = dev.pipeline.branches[i].output[0] ?
+					     dev.pipeline.branches[i].output : encode_filename;
+
+			if (dev.pipeline.branches[i].encoding != MMAL_ENCODING_UNUSED &&
+			    !strcmp(output, "-")) {
+				print("Control mode can't write to stdout\n");
+				return 1;
+			}
+		}
+	}
+
+	if (replay_source) {
+		if (video_open_replay(&dev, replay_source, replay_fps, unthrottled,
+				      replay_mplane) < 0)
+			return 1;
+
+		if (replay_change) {
+			unsigned int frames = 0, w = 0, h = 0;
+
+			if (sscanf(replay_change, "%u:%ux%u", &frames, &w, &h) != 3 ||
+			    replay_source_change(&dev.replay, frames, w, h) < 0) {
+				print("Invalid source change %s\n", replay_change);
+				return 1;
+			}
+		}
+	}
+
 	if (!video_has_fd(&dev)) {
 		if (optind >= argc) {
 			usage(argv[0]);
@@ -1982,6 +5602,18 @@ int main(int argc, char *argv[])
 			return 1;
 	}
 
+	/*
+	 * The multi-planar API when it's all the device has, or a format
+	 * with separate planes was asked for. Single planar otherwise.
+	 */
+	if (capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+		const struct v4l2_format_info *info = v4l2_format_by_fourcc(pixelformat);
+
+		if (!(capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
+		    (do_set_format && info && info->n_planes > 1))
+			dev.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	}
+
 	if (do_log_status)
 		video_log_status(&dev);
 
@@ -2006,47 +5638,140 @@ int main(int argc, char *argv[])
 		memset(&sub, 0, sizeof(sub));
 
 		sub.type = V4L2_EVENT_SOURCE_CHANGE;
-		ioctl(dev.fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
+		video_ioctl(&dev, VIDIOC_SUBSCRIBE_EVENT, &sub);
 	}
 
 	if (!dev.fps)
 		video_get_fps(&dev);
 
-	setup_mmal(&dev, nbufs, encode_filename);
+	{
+		struct sigaction sa;
+
+		/* First signal stops the capture cleanly, a second one kills us */
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = stop_signal_handler;
+		sa.sa_flags = SA_RESETHAND;
+		signal_loop = &dev.events;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+
+		if (dev.dvr_size) {
+			sa.sa_handler = dvr_signal_handler;
+			sa.sa_flags = SA_RESTART;
+			sigaction(SIGUSR1, &sa, NULL);
+		}
+
+		sa.sa_handler = trace_signal_handler;
+		sa.sa_flags = SA_RESTART;
+		signal_trace = &dev.trace;
+		sigaction(SIGUSR2, &sa, NULL);
+	}
+
+	pipeline_print(&dev.pipeline);
+	if (setup_mmal(&dev, nbufs, encode_filename) < 0) {
+		video_close(&dev);
+		return 1;
+	}
 
-	if (!do_capture) {
+	if (!do_capture && !dev.daemon) {
 		video_close(&dev);
 		return 0;
 	}
 
+	if (dev.memtype == V4L2_MEMORY_DMABUF) {
+		ret = dmabuf_open(&dev.dmabuf, dmabuf_provider, dev.use_replay);
+		if (ret < 0) {
+			print("No dmabuf provider %s: %s (%d).\n",
+			      dmabuf_provider ? dmabuf_provider : "available",
+			      strerror(-ret), -ret);
+			video_close(&dev);
+			return 1;
+		}
+		print("Allocating buffers from %s.\n", dev.dmabuf.ops->name);
+	}
+
 	if (video_prepare_capture(&dev, nbufs)) {
 		video_close(&dev);
 		return 1;
 	}
 
-	if (enable_isp_input(&dev)) {
+	/* In daemon mode that is left to each session */
+	if (!dev.daemon && enable_isp_input(&dev)) {
 		print("Failed to enable isp input\n");
 		video_close(&dev);
 		return 1;
 	}
 
-	if (!do_queue_late && video_queue_all_buffers(&dev)) {
+	if (!dev.daemon && !do_queue_late && video_queue_all_buffers(&dev)) {
 		video_close(&dev);
 		return 1;
 	}
 
-	if (do_pause) {
-		print("Press enter to start capture\n");
-		getchar();
+	if (metrics_path) {
+		ret = metrics_open(&dev.metrics, metrics_path);
+		if (ret < 0) {
+			print("Unable to serve metrics on %s: %s (%d).\n",
+			      metrics_path, strerror(-ret), -ret);
+			video_close(&dev);
+			return 1;
+		}
+	}
+
+	if (control_path) {
+		ret = control_open(&dev.control, control_path);
+		if (ret < 0) {
+			print("Unable to listen for commands on %s: %s (%d).\n",
+			      control_path, strerror(-ret), -ret);
+			video_close(&dev);
+			return 1;
+		}
+	}
+
+	{
+		const char *sinks[MAX_COMPONENTS];
+		unsigned int i;
+
+		for (i = 0; i < MAX_COMPONENTS && dev.components[i].comp; i++)
+			sinks[i] = dev.components[i].branch->label;
+
+		ret = trace_init(&dev.trace, verbose, trace_path, &dev.lat_frames,
+				 sinks, i);
+	}
+	if (ret < 0) {
+		print("Unable to start the frame trace%s%s: %s (%d).\n",
+		      trace_path ? " to " : "", trace_path ? trace_path : "",
+		      strerror(-ret), -ret);
+		video_close(&dev);
+		return 1;
 	}
 
-	if (video_do_capture(&dev, nframes, skip, filename,
-			     do_requeue_last, do_queue_late) < 0) {
+	if (dev.daemon) {
+		struct daemon d;
+
+		memset(&d, 0, sizeof d);
+		d.skip = skip;
+		d.pattern = filename;
+		d.do_requeue_last = do_requeue_last;
+
+		ret = video_daemon(&dev, &d);
+	} else {
+		if (do_pause) {
+			print("Press enter to start capture\n");
+			getchar();
+		}
+
+		ret = video_do_capture(&dev, nframes, skip, filename,
+				       do_requeue_last, do_queue_late);
+	}
+	if (ret < 0) {
 		video_close(&dev);
 		return 1;
 	}
 
 	destroy_mmal(&dev);
+	/* After the encoders have drained, so the last frames' stage times are in */
+	trace_cleanup(&dev.trace);
+	latency_report(&dev);
 
 	video_close(&dev);
 	return 0;
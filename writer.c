@@ -0,0 +1,624 @@
+/*
+ * v4l2_mmal - batched, vectored output writer.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Coalesces output data into iovec batches so that a stream of small
+ * encoded buffers costs one writev() per flush window rather than a
+ * write (and fflush) per buffer. With the io_uring backend, batches are
+ * submitted asynchronously and completed on the ring's own thread, with
+ * up to WRITER_BATCHES in flight.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "writer.h"
+
+#define SIDECAR_SIZE	(16 << 10)
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+const char *writer_backend_name(enum writer_backend backend)
+{
+	switch (backend) {
+	case WRITER_BACKEND_URING:
+		return "io_uring";
+	case WRITER_BACKEND_SYNC:
+	default:
+		return "writev";
+	}
+}
+
+static void batch_complete(struct uring_req *req, int res);
+
+static int writer_init_uring(struct writer *w)
+{
+	struct iovec iov[WRITER_BATCHES];
+	struct stat st;
+	unsigned int i;
+	int ret;
+
+	/* Explicit offsets only make sense for regular files */
+	if (fstat(w->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return -ENOTSUP;
+
+	w->offset = lseek(w->fd, 0, SEEK_CUR);
+	if (w->offset < 0)
+		return -errno;
+
+	ret = uring_init(&w->ring, WRITER_BATCHES * 2);
+	if (ret < 0)
+		return ret;
+
+	/* Both of these are optimisations, so failure is not fatal */
+	uring_register_files(&w->ring, &w->fd, 1);
+
+	for (i = 0; i < WRITER_BATCHES; i++) {
+		iov[i].iov_base = w->batches[i].staging;
+		iov[i].iov_len = w->staging_size;
+	}
+	uring_register_buffers(&w->ring, iov, WRITER_BATCHES);
+
+	for (i = 0; i < WRITER_BATCHES; i++)
+		w->batches[i].req.complete = batch_complete;
+
+	return 0;
+}
+
+int writer_init(struct writer *w, int fd, const struct writer_config *cfg)
+{
+	unsigned int i;
+
+	memset(w, 0, sizeof *w);
+	w->fd = fd;
+	w->sidecar_fd = -1;
+	w->ring.fd = -1;
+	w->cfg = *cfg;
+	w->backend = WRITER_BACKEND_SYNC;
+
+	if (w->cfg.max_held > WRITER_MAX_CHUNKS)
+		w->cfg.max_held = WRITER_MAX_CHUNKS;
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	/* Room for a full window of copied data plus some slack */
+	w->staging_size = w->cfg.flush_bytes + (256 << 10);
+	w->num_batches = cfg->backend == WRITER_BACKEND_URING ? WRITER_BATCHES : 1;
+
+	for (i = 0; i < w->num_batches; i++) {
+		w->batches[i].w = w;
+		w->batches[i].staging = malloc(w->staging_size);
+		if (!w->batches[i].staging)
+			return -ENOMEM;
+	}
+	w->cur = &w->batches[0];
+
+	if (cfg->backend == WRITER_BACKEND_URING) {
+		if (fd >= 0 && writer_init_uring(w) == 0) {
+			w->backend = WRITER_BACKEND_URING;
+		} else {
+			/* Fall back to synchronous writes from a single batch */
+			for (i = 1; i < w->num_batches; i++) {
+				free(w->batches[i].staging);
+				w->batches[i].staging = NULL;
+			}
+			w->num_batches = 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &w->stats.start);
+	return 0;
+}
+
+void writer_set_sidecar(struct writer *w, int fd)
+{
+	w->sidecar_fd = fd;
+	if (!w->sidecar) {
+		w->sidecar = malloc(SIDECAR_SIZE);
+		w->sidecar_size = w->sidecar ? SIDECAR_SIZE : 0;
+	}
+}
+
+static void batch_release(struct writer_batch *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < b->num_chunks; i++) {
+		if (b->chunks[i].release)
+			b->chunks[i].release(b->chunks[i].priv);
+	}
+
+	__atomic_sub_fetch(&b->w->held, b->held, __ATOMIC_RELEASE);
+	b->num_chunks = 0;
+	b->held = 0;
+	b->pending = 0;
+	b->staging_used = 0;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Skip over the first 'done' bytes of an iov array, fixing up a partial entry */
+static unsigned int iov_advance(struct iovec **iovp, unsigned int cnt, size_t done)
+{
+	struct iovec *iov = *iovp;
+
+	while (cnt && done >= iov->iov_len) {
+		done -= iov->iov_len;
+		iov++;
+		cnt--;
+	}
+	if (cnt) {
+		iov->iov_base = (uint8_t *)iov->iov_base + done;
+		iov->iov_len -= done;
+	}
+
+	*iovp = iov;
+	return cnt;
+}
+
+static int iov_write_sync(int fd, struct iovec *iov, unsigned int cnt,
+			  off_t offset, uint64_t *writes)
+{
+	ssize_t ret;
+
+	while (cnt) {
+		if (offset >= 0)
+			ret = pwritev(fd, iov, cnt, offset);
+		else
+			ret = writev(fd, iov, cnt);
+		(*writes)++;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (offset >= 0)
+			offset += ret;
+		cnt = iov_advance(&iov, cnt, ret);
+	}
+
+	return 0;
+}
+
+/*
+ * Counters are bumped from the writing thread and, with io_uring, from the
+ * completion thread, not always under the lock, so every update is atomic.
+ * writer_peek_stats() can then read them from any thread without it.
+ */
+static void stat_add(uint64_t *stat, uint64_t n)
+{
+	__atomic_add_fetch(stat, n, __ATOMIC_RELAXED);
+}
+
+static void writer_account(struct writer *w, size_t bytes, uint64_t ns,
+			   uint64_t writes, int ret)
+{
+	pthread_mutex_lock(&w->lock);
+	stat_add(&w->stats.latency_total_ns, ns);
+	if (ns > w->stats.latency_max_ns)
+		__atomic_store_n(&w->stats.latency_max_ns, ns, __ATOMIC_RELAXED);
+	stat_add(&w->stats.flushes, 1);
+	stat_add(&w->stats.writes, writes);
+
+	if (ret < 0) {
+		stat_add(&w->stats.errors, 1);
+		w->error = ret;
+	} else {
+		stat_add(&w->stats.bytes, bytes);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Runs on the ring's completion thread */
+static void batch_complete(struct uring_req *req, int res)
+{
+	struct writer_batch *b = (struct writer_batch *)req;
+	struct writer *w = b->w;
+	struct timespec now;
+	uint64_t writes = 1;
+	struct iovec *iov = b->iov;
+	unsigned int cnt;
+
+	if (res >= 0 && (size_t)res < b->pending) {
+		/* Short write, finish it off synchronously */
+		cnt = iov_advance(&iov, b->num_chunks, res);
+		res = iov_write_sync(w->fd, iov, cnt, b->offset + res, &writes);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	writer_account(w, b->pending,
+		       timespec_ns(&now) - timespec_ns(&req->submitted),
+		       writes, res < 0 ? res : 0);
+
+	batch_release(b);
+
+	pthread_mutex_lock(&w->lock);
+	b->busy = false;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int writer_submit(struct writer *w, struct writer_batch *b)
+{
+	int fd = w->ring.fixed_files ? -1 : w->fd;
+	int buf_index = -1;
+	int ret;
+
+	b->offset = w->offset;
+	w->offset += b->pending;
+
+	pthread_mutex_lock(&w->lock);
+	b->busy = true;
+	pthread_mutex_unlock(&w->lock);
+
+	/* A batch that is entirely copied data can use its registered buffer */
+	if (b->num_chunks == 1 && !b->chunks[0].release && w->ring.fixed_buffers)
+		buf_index = b - w->batches;
+
+	if (buf_index >= 0)
+		ret = uring_write(&w->ring, &b->req, fd, b->iov[0].iov_base,
+				  b->iov[0].iov_len, b->offset, buf_index);
+	else
+		ret = uring_writev(&w->ring, &b->req, fd, b->iov,
+				   b->num_chunks, b->offset);
+
+	if (ret < 0) {
+		/* Couldn't queue it, so do it the slow way */
+		uint64_t writes = 0;
+
+		batch_complete(&b->req, iov_write_sync(w->fd, b->iov, b->num_chunks,
+						       b->offset, &writes));
+	}
+
+	/* Move on to the next batch, waiting for it to be written if need be */
+	w->cur = &w->batches[(b - w->batches + 1) % w->num_batches];
+
+	pthread_mutex_lock(&w->lock);
+	while (w->cur->busy)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	return w->error;
+}
+
+int writer_flush(struct writer *w)
+{
+	struct writer_batch *b = w->cur;
+	struct timespec start, end;
+	uint64_t writes = 0;
+	int ret = 0;
+
+	if (b->num_chunks) {
+		if (w->backend == WRITER_BACKEND_URING) {
+			ret = writer_submit(w, b);
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ret = iov_write_sync(w->fd, b->iov, b->num_chunks, -1, &writes);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			writer_account(w, b->pending,
+				       timespec_ns(&end) - timespec_ns(&start),
+				       writes, ret);
+			batch_release(b);
+		}
+	}
+
+	if (w->sidecar_used) {
+		if (w->sidecar_fd >= 0 &&
+		    write_all(w->sidecar_fd, w->sidecar, w->sidecar_used) < 0)
+			stat_add(&w->stats.errors, 1);
+		w->sidecar_used = 0;
+	}
+
+	return ret;
+}
+
+/*
+ * Flush and wait until everything handed to the writer so far has reached
+ * the file, so that it can safely be modified with pwrite().
+ */
+int writer_sync(struct writer *w)
+{
+	int ret;
+
+	ret = writer_flush(w);
+	if (w->backend == WRITER_BACKEND_URING)
+		uring_drain(&w->ring);
+
+	return ret < 0 ? ret : w->error;
+}
+
+/*
+ * Move output to a new file. Pending data still goes to the old one, and
+ * with the io_uring backend in-flight writes are waited for, so the caller
+ * may close the old fd as soon as this returns.
+ */
+int writer_set_fd(struct writer *w, int fd)
+{
+	int ret;
+
+	ret = writer_sync(w);
+
+	w->fd = fd;
+	w->position = 0;
+	if (w->backend == WRITER_BACKEND_URING) {
+		w->offset = lseek(fd, 0, SEEK_CUR);
+		if (w->offset < 0)
+			w->offset = 0;
+		uring_update_files(&w->ring, &w->fd, 1);
+	}
+
+	return ret;
+}
+
+static int writer_check_flush(struct writer *w)
+{
+	if (w->cur->pending >= w->cfg.flush_bytes)
+		return writer_flush(w);
+
+	return 0;
+}
+
+static void writer_mark_pending(struct writer *w, size_t len)
+{
+	if (!w->cur->pending)
+		clock_gettime(CLOCK_MONOTONIC, &w->first_pending);
+	w->cur->pending += len;
+}
+
+int writer_copy(struct writer *w, const void *data, size_t len)
+{
+	struct writer_batch *b;
+	struct iovec *last;
+	int ret;
+
+	if (!len)
+		return 0;
+
+	w->position += len;
+
+	if (len > w->staging_size) {
+		/* Too big to stage, write it out synchronously */
+		ret = writer_flush(w);
+		if (ret < 0)
+			return ret;
+		if (w->backend == WRITER_BACKEND_URING) {
+			/* Keep the async offsets in step */
+			uring_drain(&w->ring);
+			ret = pwrite(w->fd, data, len, w->offset) == (ssize_t)len ? 0 : -EIO;
+			w->offset += len;
+		} else {
+			ret = write_all(w->fd, data, len);
+		}
+		pthread_mutex_lock(&w->lock);
+		stat_add(&w->stats.writes, 1);
+		if (ret < 0)
+			stat_add(&w->stats.errors, 1);
+		else
+			stat_add(&w->stats.bytes, len);
+		pthread_mutex_unlock(&w->lock);
+		return ret;
+	}
+
+	b = w->cur;
+	if (b->staging_used + len > w->staging_size ||
+	    b->num_chunks == WRITER_MAX_CHUNKS) {
+		ret = writer_flush(w);
+		if (ret < 0)
+			return ret;
+		b = w->cur;
+	}
+
+	memcpy(b->staging + b->staging_used, data, len);
+	stat_add(&w->stats.copied, len);
+
+	/* Extend the previous iov if it ends where this copy starts */
+	last = b->num_chunks ? &b->iov[b->num_chunks - 1] : NULL;
+	if (last && !b->chunks[b->num_chunks - 1].release &&
+	    (uint8_t *)last->iov_base + last->iov_len == b->staging + b->staging_used) {
+		last->iov_len += len;
+	} else {
+		b->iov[b->num_chunks].iov_base = b->staging + b->staging_used;
+		b->iov[b->num_chunks].iov_len = len;
+		b->chunks[b->num_chunks].release = NULL;
+		b->chunks[b->num_chunks].priv = NULL;
+		b->num_chunks++;
+	}
+
+	b->staging_used += len;
+	writer_mark_pending(w, len);
+
+	return writer_check_flush(w);
+}
+
+int writer_add(struct writer *w, const void *data, size_t len,
+	       writer_release_t release, void *priv)
+{
+	struct writer_batch *b = w->cur;
+	int ret;
+
+	if (__atomic_load_n(&w->held, __ATOMIC_ACQUIRE) >= w->cfg.max_held ||
+	    b->num_chunks == WRITER_MAX_CHUNKS) {
+		/*
+		 * Can't hang on to any more of the producer's buffers. Copy the
+		 * data if it fits, otherwise push out what we have first.
+		 */
+		if (b->num_chunks < WRITER_MAX_CHUNKS &&
+		    b->staging_used + len <= w->staging_size) {
+			ret = writer_copy(w, data, len);
+			if (release)
+				release(priv);
+			return ret;
+		}
+
+		ret = writer_flush(w);
+		if (ret < 0 && release) {
+			release(priv);
+			return ret;
+		}
+		b = w->cur;
+
+		/* Batches still in flight may hold all the buffers we're allowed */
+		if (__atomic_load_n(&w->held, __ATOMIC_ACQUIRE) >= w->cfg.max_held) {
+			ret = writer_copy(w, data, len);
+			if (release)
+				release(priv);
+			return ret;
+		}
+	}
+
+	w->position += len;
+
+	b->iov[b->num_chunks].iov_base = (void *)data;
+	b->iov[b->num_chunks].iov_len = len;
+	b->chunks[b->num_chunks].release = release;
+	b->chunks[b->num_chunks].priv = priv;
+	b->num_chunks++;
+	b->held++;
+	__atomic_add_fetch(&w->held, 1, __ATOMIC_RELEASE);
+	stat_add(&w->stats.chunks, 1);
+	writer_mark_pending(w, len);
+
+	return writer_check_flush(w);
+}
+
+int writer_sidecar_printf(struct writer *w, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if (!w->sidecar)
+		return -EINVAL;
+
+	va_start(ap, fmt);
+	len = vsnprintf(w->sidecar + w->sidecar_used,
+			w->sidecar_size - w->sidecar_used, fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return -EINVAL;
+
+	if ((size_t)len >= w->sidecar_size - w->sidecar_used) {
+		/* Out of room - write out what we have and try again */
+		if (w->sidecar_fd >= 0)
+			write_all(w->sidecar_fd, w->sidecar, w->sidecar_used);
+		w->sidecar_used = 0;
+
+		va_start(ap, fmt);
+		len = vsnprintf(w->sidecar, w->sidecar_size, fmt, ap);
+		va_end(ap);
+		if (len < 0 || (size_t)len >= w->sidecar_size)
+			return -ENOSPC;
+	}
+
+	w->sidecar_used += len;
+	return 0;
+}
+
+/*
+ * How long the caller may sleep before the pending data has to be written
+ * out, or -1 if there is nothing pending.
+ */
+int writer_timeout_ms(struct writer *w)
+{
+	struct timespec now;
+	int64_t elapsed;
+
+	if (!w->cur->pending)
+		return -1;
+	if (!w->cfg.flush_ms)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (timespec_ns(&now) - timespec_ns(&w->first_pending)) / 1000000;
+	if (elapsed >= w->cfg.flush_ms)
+		return 0;
+
+	return w->cfg.flush_ms - elapsed;
+}
+
+/* Bytes handed to the writer since it was created or last moved file */
+uint64_t writer_position(struct writer *w)
+{
+	return w->position;
+}
+
+void writer_get_stats(struct writer *w, struct writer_stats *stats)
+{
+	pthread_mutex_lock(&w->lock);
+	*stats = w->stats;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Without the lock, so individual counters are current but not consistent */
+void writer_peek_stats(struct writer *w, struct writer_stats *stats)
+{
+	stats->bytes = __atomic_load_n(&w->stats.bytes, __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&w->stats.writes, __ATOMIC_RELAXED);
+	stats->flushes = __atomic_load_n(&w->stats.flushes, __ATOMIC_RELAXED);
+	stats->chunks = __atomic_load_n(&w->stats.chunks, __ATOMIC_RELAXED);
+	stats->copied = __atomic_load_n(&w->stats.copied, __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&w->stats.errors, __ATOMIC_RELAXED);
+	stats->latency_total_ns = __atomic_load_n(&w->stats.latency_total_ns, __ATOMIC_RELAXED);
+	stats->latency_max_ns = __atomic_load_n(&w->stats.latency_max_ns, __ATOMIC_RELAXED);
+	stats->start = w->stats.start;
+}
+
+void writer_cleanup(struct writer *w)
+{
+	unsigned int i;
+
+	writer_flush(w);
+
+	if (w->backend == WRITER_BACKEND_URING) {
+		uring_drain(&w->ring);
+		uring_cleanup(&w->ring);
+	}
+
+	for (i = 0; i < w->num_batches; i++) {
+		free(w->batches[i].staging);
+		w->batches[i].staging = NULL;
+	}
+	free(w->sidecar);
+	w->sidecar = NULL;
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+}
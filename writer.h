@@ -0,0 +1,143 @@
+/*
+ * v4l2_mmal - batched, vectored output writer.
+ * Copyright (C) 2018 Raspberry Pi (Trading) Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __WRITER_H__
+#define __WRITER_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+#define WRITER_MAX_CHUNKS	64
+/* Batches that can be in flight at once with the io_uring backend */
+#define WRITER_BATCHES		4
+
+enum writer_backend {
+	WRITER_BACKEND_SYNC,
+	WRITER_BACKEND_URING,
+};
+
+/* Called once the data passed to writer_add() has been written out */
+typedef void (*writer_release_t)(void *priv);
+
+struct writer_config {
+	/* Flush once this many bytes are pending (0 = flush every chunk) */
+	size_t flush_bytes;
+	/* Flush pending data at least this often (0 = no time limit) */
+	unsigned int flush_ms;
+	/*
+	 * Maximum number of chunks held by reference, across every batch in
+	 * flight. Beyond this, data is
+	 * copied into the staging buffer and released straight away so the
+	 * producer's pool is never starved.
+	 */
+	unsigned int max_held;
+	/* Requested backend, falls back to synchronous writes if unavailable */
+	enum writer_backend backend;
+};
+
+struct writer_chunk {
+	writer_release_t release;
+	void *priv;
+};
+
+struct writer_stats {
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t flushes;
+	uint64_t chunks;
+	uint64_t copied;
+	uint64_t errors;
+	uint64_t latency_total_ns;
+	uint64_t latency_max_ns;
+	struct timespec start;
+};
+
+struct writer;
+
+struct writer_batch {
+	struct uring_req req;
+	struct writer *w;
+
+	struct iovec iov[WRITER_MAX_CHUNKS];
+	struct writer_chunk chunks[WRITER_MAX_CHUNKS];
+	unsigned int num_chunks;
+	unsigned int held;
+	size_t pending;
+	off_t offset;
+	bool busy;
+
+	/* Copied data, referenced by iov entries until the batch completes */
+	uint8_t *staging;
+	size_t staging_used;
+};
+
+struct writer {
+	int fd;
+	struct writer_config cfg;
+	enum writer_backend backend;
+
+	struct writer_batch batches[WRITER_BATCHES];
+	unsigned int num_batches;
+	struct writer_batch *cur;
+	size_t staging_size;
+	struct timespec first_pending;
+
+	/* Asynchronous backend */
+	struct uring ring;
+	off_t offset;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* Small text sidecar, written out alongside every flush */
+	int sidecar_fd;
+	char *sidecar;
+	size_t sidecar_size;
+	size_t sidecar_used;
+
+	/* Chunks held by reference across all batches, at most cfg.max_held */
+	unsigned int held;
+
+	/* Bytes accepted for the current file, whether written yet or not */
+	uint64_t position;
+
+	struct writer_stats stats;
+	int error;
+};
+
+int writer_init(struct writer *w, int fd, const struct writer_config *cfg);
+void writer_set_sidecar(struct writer *w, int fd);
+int writer_add(struct writer *w, const void *data, size_t len,
+	       writer_release_t release, void *priv);
+int writer_copy(struct writer *w, const void *data, size_t len);
+int writer_sidecar_printf(struct writer *w, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+int writer_flush(struct writer *w);
+int writer_sync(struct writer *w);
+int writer_set_fd(struct writer *w, int fd);
+int writer_timeout_ms(struct writer *w);
+uint64_t writer_position(struct writer *w);
+void writer_get_stats(struct writer *w, struct writer_stats *stats);
+void writer_peek_stats(struct writer *w, struct writer_stats *stats);
+const char *writer_backend_name(enum writer_backend backend);
+void writer_cleanup(struct writer *w);
+
+#endif